@@ -5,12 +5,15 @@ skybox basic.vs skybox.fs
 depth quad.vs depth.fs
 multi basic.vs multi.fs
 singlepass basic.vs singlepass.fs
-normalmap basic.vs normalmap.fs
+normalmap basic.vs normalmap.fs HAS_ALBEDO,HAS_NORMALMAP,ALPHA_MASK,LIGHTS_MANY,HAS_IRRADIANCE,HAS_PROBE
 multipass basic.vs multipass.fs
 debug basic.vs debug.fs
 plain basic.vs plain.fs
 compute test.cs
 
+//permutations, the macros must follow SCN::eMaterialMacro
+@material basic.vs normalmap.fs HAS_ALBEDO,HAS_NORMALMAP,HAS_EMISSIVE,ALPHA_MASK,LIGHTS_FEW,LIGHTS_MANY,HAS_IRRADIANCE,HAS_PROBE
+
 \test.cs
 #version 430 core
 
@@ -20,19 +23,61 @@ void main()
 	vec4 i = vec4(0.0);
 }
 
+\blocks
+//shared by the shaders of the atlas, std140 so they match GFX::sCameraBlock, sFrameBlock and sMaterialBlock,
+//each one is bound to its eUniformBlock binding point. Include it after #version in both stages
+layout(std140) uniform u_camera_block {
+	mat4 u_viewprojection;
+	vec3 u_camera_pos;
+};
+
+layout(std140) uniform u_frame_block {
+	vec3 u_light_ambient;
+	float u_time;
+	int u_light_count;
+	int u_irr_enabled;
+	vec3 u_irr_start;
+	vec3 u_irr_inv_delta;
+	vec3 u_irr_dims;
+	vec3 u_light_pos[10];
+	vec3 u_light_color[10];
+	vec3 u_light_dir[10];
+	float u_light_int[10];
+	int u_light_type[10];
+	float u_light_min[10];
+	float u_light_max[10];
+	float u_light_cone_max[10];	//FOR SPOT LIGHTS
+	float u_light_cone_min[10];	//FOR SPOT LIGHTS
+};
+
+struct sMaterial {
+	vec4 color;
+	vec3 emissive_factor;
+	float alpha_cutoff;
+	float shininess;
+	float roughness;
+	float metalness;
+};
+
+layout(std140) uniform u_material_block {
+	sMaterial u_materials[256];
+};
+uniform int u_material_index;
+#define u_material u_materials[u_material_index]
+
 \basic.vs
 
 #version 330 core
 
-in vec3 a_vertex;
-in vec3 a_normal;
-in vec2 a_coord;
-in vec4 a_color;
+//attribute locations must match GFX::eAttribLocation (meshes build their VAO with them)
+layout(location = 0) in vec3 a_vertex;
+layout(location = 1) in vec3 a_normal;
+layout(location = 2) in vec2 a_coord;
+layout(location = 4) in vec4 a_color;
 
-uniform vec3 u_camera_pos;
+#include "blocks"
 
 uniform mat4 u_model;
-uniform mat4 u_viewprojection;
 
 //this will store the color for the pixel shader
 out vec3 v_position;
@@ -41,8 +86,6 @@ out vec3 v_normal;
 out vec2 v_uv;
 out vec4 v_color;
 
-uniform float u_time;
-
 void main()
 {	
 	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
@@ -66,8 +109,8 @@ void main()
 
 #version 330 core
 
-in vec3 a_vertex;
-in vec2 a_coord;
+layout(location = 0) in vec3 a_vertex;
+layout(location = 2) in vec2 a_coord;
 out vec2 v_uv;
 
 void main()
@@ -103,7 +146,6 @@ in vec4 v_color;
 
 uniform vec4 u_color;
 uniform sampler2D u_texture;
-uniform float u_time;
 uniform float u_alpha_cutoff;
 
 out vec4 FragColor;
@@ -128,13 +170,14 @@ void main()
 in vec3 v_position;
 in vec3 v_world_position;
 
+#include "blocks"
+
 uniform samplerCube u_texture;
-uniform vec3 u_camera_position;
 out vec4 FragColor;
 
 void main()
 {
-	vec3 E = v_world_position - u_camera_position;
+	vec3 E = v_world_position - u_camera_pos;
 	vec4 color = texture( u_texture, E );
 	FragColor = color;
 }
@@ -151,7 +194,6 @@ in vec2 v_uv;
 
 uniform vec4 u_color;
 uniform sampler2D u_texture;
-uniform float u_time;
 uniform float u_alpha_cutoff;
 
 layout(location = 0) out vec4 FragColor;
@@ -198,15 +240,13 @@ void main()
 
 #version 330 core
 
-in vec3 a_vertex;
-in vec3 a_normal;
-in vec2 a_coord;
+layout(location = 0) in vec3 a_vertex;
+layout(location = 1) in vec3 a_normal;
+layout(location = 2) in vec2 a_coord;
 
 in mat4 u_model;
 
-uniform vec3 u_camera_pos;
-
-uniform mat4 u_viewprojection;
+#include "blocks"
 
 //this will store the color for the pixel shader
 out vec3 v_position;
@@ -234,6 +274,8 @@ void main()
 
 #version 330 core
 
+#include "blocks"
+
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
@@ -243,25 +285,9 @@ in vec4 v_color;
 uniform vec4 u_color;
 uniform sampler2D u_texture;
 uniform sampler2D u_normal_texture;
-uniform float u_time;
 uniform float u_alpha_cutoff;
 
-uniform vec3 u_light_ambient;
-
-uniform vec3 u_light_pos[10];
-uniform vec3 u_light_color[10];
-uniform float u_light_int[10];
-uniform vec3 u_light_dir[10];
-uniform int u_light_count;
-uniform int u_light_type[10];
-uniform float u_light_min[10];
-uniform float u_light_max[10];
-
-uniform float u_light_cone_max[10];	//FOR SPOT LIGHTS
-uniform float u_light_cone_min[10];		//FOR SPOT LIGHTS
-
 uniform float u_material_shine;
-uniform vec3 u_camera_pos;
 
 out vec4 FragColor;
 
@@ -349,34 +375,56 @@ void main()
 
 #version 330 core
 
+#include "blocks"
+
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
 in vec2 v_uv;
 in vec4 v_color;
 
-uniform vec4 u_color;
 uniform sampler2D u_texture;
 uniform sampler2D u_normal_texture;
-uniform float u_time;
-uniform float u_alpha_cutoff;
+uniform sampler2D u_emissive_texture;
 
-uniform vec3 u_light_ambient;
+//the features are macros so each material compiles only what it uses (@material), normalmap has the generic ones
+//lights bucket: the loop has a constant bound so it can be unrolled
+#if defined(LIGHTS_MANY)
+	#define MAX_LIGHTS 10
+#elif defined(LIGHTS_FEW)
+	#define MAX_LIGHTS 4
+#endif
 
-uniform vec3 u_light_pos[10];
-uniform vec3 u_light_color[10];
-uniform float u_light_int[10];
-uniform vec3 u_light_dir[10];
-uniform int u_light_count;
-uniform int u_light_type[10];
-uniform float u_light_min[10];
-uniform float u_light_max[10];
+uniform sampler3D u_irr_texture; //the grid is in u_frame_block
 
-uniform float u_light_cone_max[10];	//FOR SPOT LIGHTS
-uniform float u_light_cone_min[10];		//FOR SPOT LIGHTS
+//irradiance from the volume, the 9 SH coefficients are stacked along z
+vec3 computeIrradiance(vec3 pos, vec3 N)
+{
+	vec3 local = clamp((pos - u_irr_start) * u_irr_inv_delta, 0.0, 1.0);
+	vec3 uvw = (local * (u_irr_dims - 1.0) + 0.5) / u_irr_dims;
+	uvw.z /= 9.0;
+	vec3 c[9];
+	for(int i = 0; i < 9; i++)
+		c[i] = texture(u_irr_texture, vec3(uvw.xy, uvw.z + float(i) / 9.0)).rgb;
+	vec3 irradiance = c[0] + c[1] * N.y + c[2] * N.z + c[3] * N.x + c[4] * N.x * N.y + c[5] * N.y * N.z + c[6] * (3.0 * N.z * N.z - 1.0) + c[7] * N.x * N.z + c[8] * (N.x * N.x - N.y * N.y);
+	return max(irradiance, vec3(0.0));
+}
 
-uniform float u_material_shine;
-uniform vec3 u_camera_pos;
+uniform int u_probe_enabled;
+uniform samplerCube u_probe_texture;
+uniform float u_probe_levels;
+
+//specular from the probe, its mips are prefiltered with GGX from roughness 0 to 1
+vec3 computeReflection(vec3 pos, vec3 N, vec3 albedo)
+{
+	vec3 V = normalize(u_camera_pos - pos);
+	vec3 R = reflect(-V, N);
+	vec3 radiance = textureLod(u_probe_texture, R, u_material.roughness * (u_probe_levels - 1.0)).rgb;
+	vec3 F0 = mix(vec3(0.04), albedo, u_material.metalness);
+	float n_dot_v = max(dot(N, V), 0.0);
+	vec3 F = F0 + (max(vec3(1.0 - u_material.roughness), F0) - F0) * pow(1.0 - n_dot_v, 5.0);
+	return radiance * F;
+}
 
 out vec4 FragColor;
 
@@ -415,19 +463,33 @@ void main()
 {
 
 	vec2 uv = v_uv;
-	vec4 color = u_color;
+	vec4 color = u_material.color;
+#ifdef HAS_ALBEDO
 	color *= texture( u_texture, v_uv );
+#endif
 
-	vec3 texture_normal = texture( u_normal_texture, v_uv ).xyz;
-	texture_normal = (texture_normal * 2.0) - 1.0;
-	texture_normal = normalize(texture_normal);
+#ifdef HAS_NORMALMAP
+	//z is rebuilt from xy, compressed normal maps are BC5 and only have two channels
+	vec2 texture_xy = texture( u_normal_texture, v_uv ).xy * 2.0 - 1.0;
+	vec3 texture_normal = vec3(texture_xy, sqrt(max(1.0 - dot(texture_xy, texture_xy), 0.0)));
 	vec3 normal = perturbNormal(normalize(v_normal), v_world_position, v_uv, texture_normal);
+#else
+	vec3 normal = normalize(v_normal);
+#endif
 
 	vec3 light_component = vec3(0.0, 0.0, 0.0);
 
-	light_component += u_light_ambient * color.rgb;
+#ifdef HAS_IRRADIANCE
+	vec3 ambient = u_irr_enabled == 1 ? computeIrradiance(v_world_position, normal) : u_light_ambient;
+#else
+	vec3 ambient = u_light_ambient;
+#endif
+	light_component += ambient * color.rgb;
 
-	for(int i = 0; i < u_light_count; i++){
+#ifdef MAX_LIGHTS
+	for(int i = 0; i < MAX_LIGHTS; i++){
+		if(i >= u_light_count)
+			break;
 
 		if(u_light_type[i] == 1) {										//POINT
 			float dist = distance(u_light_pos[i], v_world_position);
@@ -442,7 +504,7 @@ void main()
 			vec3 R = normalize(reflect(-L, normalize(normal)));
 			vec3 V = normalize(u_camera_pos - v_world_position);
 			float r_dot_v = clamp(dot(R, V), 0.0, 1.0);
-			float specular = pow(r_dot_v, u_material_shine);
+			float specular = pow(r_dot_v, u_material.shininess);
 			light_component += specular * u_light_int[i] * attenuation * u_light_color[i];
 
 
@@ -467,7 +529,7 @@ void main()
 			vec3 R = normalize(reflect(-L, normalize(normal)));
 			vec3 V = normalize(u_camera_pos - v_world_position);
 			float r_dot_v = clamp(dot(R, V), 0.0, 1.0);
-			float specular = pow(r_dot_v, u_material_shine);
+			float specular = pow(r_dot_v, u_material.shininess);
 			light_component += specular * u_light_int[i] * attenuation * u_light_color[i];
 
 
@@ -480,19 +542,29 @@ void main()
 			vec3 R = normalize(reflect(-L, normalize(normal)));
 			vec3 V = normalize(u_camera_pos - v_world_position);
 			float r_dot_v = clamp(dot(R, V), 0.0, 1.0);
-			float specular = pow(r_dot_v, u_material_shine);
+			float specular = pow(r_dot_v, u_material.shininess);
 			light_component += specular * u_light_int[i] * u_light_color[i];
 		}
 
 
 		
 	}
+#endif
 
-	if(color.a < u_alpha_cutoff) {
+#ifdef ALPHA_MASK
+	if(color.a < u_material.alpha_cutoff) {
 		discard;
 	}
+#endif
 
 	vec3 lit_color = color.rgb * light_component;
+#ifdef HAS_PROBE
+	if(u_probe_enabled == 1)
+		lit_color += computeReflection(v_world_position, normal, color.rgb);
+#endif
+#ifdef HAS_EMISSIVE
+	lit_color += u_material.emissive_factor * texture( u_emissive_texture, v_uv ).rgb;
+#endif
 	FragColor = vec4(lit_color, color.a);
 }
 
@@ -502,33 +574,49 @@ void main()
 
 #version 330 core
 
+#include "blocks"
+
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
 in vec2 v_uv;
 in vec4 v_color;
 
-uniform vec4 u_color;
 uniform sampler2D u_texture;
 uniform sampler2D u_normal_texture;
-uniform float u_time;
-uniform float u_alpha_cutoff;
 
-uniform vec3 u_light_ambient;
+uniform int u_light_index; //the light of this pass in u_frame_block, the first one adds the ambient
 
-uniform vec3 u_light_pos;
-uniform vec3 u_light_color;
-uniform float u_light_int;
-uniform vec3 u_light_dir;
-uniform int u_light_type;
-uniform float u_light_min;
-uniform float u_light_max;
+uniform sampler3D u_irr_texture; //the grid is in u_frame_block
 
-uniform float u_light_cone_max;	//FOR SPOT LIGHTS
-uniform float u_light_cone_min;		//FOR SPOT LIGHTS
+//irradiance from the volume, the 9 SH coefficients are stacked along z
+vec3 computeIrradiance(vec3 pos, vec3 N)
+{
+	vec3 local = clamp((pos - u_irr_start) * u_irr_inv_delta, 0.0, 1.0);
+	vec3 uvw = (local * (u_irr_dims - 1.0) + 0.5) / u_irr_dims;
+	uvw.z /= 9.0;
+	vec3 c[9];
+	for(int i = 0; i < 9; i++)
+		c[i] = texture(u_irr_texture, vec3(uvw.xy, uvw.z + float(i) / 9.0)).rgb;
+	vec3 irradiance = c[0] + c[1] * N.y + c[2] * N.z + c[3] * N.x + c[4] * N.x * N.y + c[5] * N.y * N.z + c[6] * (3.0 * N.z * N.z - 1.0) + c[7] * N.x * N.z + c[8] * (N.x * N.x - N.y * N.y);
+	return max(irradiance, vec3(0.0));
+}
 
-uniform float u_material_shine;
-uniform vec3 u_camera_pos;
+uniform int u_probe_enabled;
+uniform samplerCube u_probe_texture;
+uniform float u_probe_levels;
+
+//specular from the probe, its mips are prefiltered with GGX from roughness 0 to 1
+vec3 computeReflection(vec3 pos, vec3 N, vec3 albedo)
+{
+	vec3 V = normalize(u_camera_pos - pos);
+	vec3 R = reflect(-V, N);
+	vec3 radiance = textureLod(u_probe_texture, R, u_material.roughness * (u_probe_levels - 1.0)).rgb;
+	vec3 F0 = mix(vec3(0.04), albedo, u_material.metalness);
+	float n_dot_v = max(dot(N, V), 0.0);
+	vec3 F = F0 + (max(vec3(1.0 - u_material.roughness), F0) - F0) * pow(1.0 - n_dot_v, 5.0);
+	return radiance * F;
+}
 
 out vec4 FragColor;
 
@@ -567,77 +655,80 @@ void main()
 {
 
 	vec2 uv = v_uv;
-	vec4 color = u_color;
+	vec4 color = u_material.color;
 	color *= texture( u_texture, v_uv );
 
-	vec3 texture_normal = texture( u_normal_texture, v_uv ).xyz;
-	texture_normal = (texture_normal * 2.0) - 1.0;
-	texture_normal = normalize(texture_normal);
+	//z is rebuilt from xy, compressed normal maps are BC5 and only have two channels
+	vec2 texture_xy = texture( u_normal_texture, v_uv ).xy * 2.0 - 1.0;
+	vec3 texture_normal = vec3(texture_xy, sqrt(max(1.0 - dot(texture_xy, texture_xy), 0.0)));
 	vec3 normal = perturbNormal(normalize(v_normal), v_world_position, v_uv, texture_normal);
 
 	vec3 light_component = vec3(0.0, 0.0, 0.0);
 
-	light_component += u_light_ambient * color.rgb;
+	vec3 ambient = u_light_index != 0 ? vec3(0.0) : u_irr_enabled == 1 ? computeIrradiance(v_world_position, normal) : u_light_ambient;
+	light_component += ambient * color.rgb;
 
-	if(u_light_type == 1) {										//POINT
-		float dist = distance(u_light_pos, v_world_position);
+	if(u_light_type[u_light_index] == 1) {										//POINT
+		float dist = distance(u_light_pos[u_light_index], v_world_position);
 		float attenuation = 1.0 / pow(dist, 2);
-		vec3 L = normalize(u_light_pos - v_world_position);
+		vec3 L = normalize(u_light_pos[u_light_index] - v_world_position);
 
 		float l_dot_n = clamp(dot(L,normalize(normal)), 0.0, 1.0);
-		light_component += u_light_int * attenuation * u_light_color * l_dot_n;
+		light_component += u_light_int[u_light_index] * attenuation * u_light_color[u_light_index] * l_dot_n;
 
 			
 		//SPECULAR FACTOR
 		vec3 R = normalize(reflect(-L, normalize(normal)));
 		vec3 V = normalize(u_camera_pos - v_world_position);
 		float r_dot_v = clamp(dot(R, V), 0.0, 1.0);
-		float specular = pow(r_dot_v, u_material_shine);
-		light_component += specular * u_light_int * attenuation * u_light_color;
+		float specular = pow(r_dot_v, u_material.shininess);
+		light_component += specular * u_light_int[u_light_index] * attenuation * u_light_color[u_light_index];
 
 
-	} else if (u_light_type == 2) {								//SPOT
-		float dist = distance(u_light_pos, v_world_position);
+	} else if (u_light_type[u_light_index] == 2) {								//SPOT
+		float dist = distance(u_light_pos[u_light_index], v_world_position);
 		float attenuation = 1.0 / pow(dist, 2);
-		vec3 L = normalize(u_light_pos - v_world_position);
-		vec3 D = normalize(u_light_dir);
+		vec3 L = normalize(u_light_pos[u_light_index] - v_world_position);
+		vec3 D = normalize(u_light_dir[u_light_index]);
 
-		if(dot(L, D) >= u_light_cone_max) {	//check if the pixel is within the cone
-			float cone_factor = (clamp(dot(L, D) , 0.0, 1.0) - (u_light_cone_max)) / (u_light_cone_min - u_light_cone_max);
+		if(dot(L, D) >= u_light_cone_max[u_light_index]) {	//check if the pixel is within the cone
+			float cone_factor = (clamp(dot(L, D) , 0.0, 1.0) - (u_light_cone_max[u_light_index])) / (u_light_cone_min[u_light_index] - u_light_cone_max[u_light_index]);
 
-			float spot_intensity = u_light_int * attenuation * cone_factor;
+			float spot_intensity = u_light_int[u_light_index] * attenuation * cone_factor;
 
 			float l_dot_n = clamp(abs(dot(L, normal)), 0, 1.0);
-			light_component += spot_intensity * u_light_color * l_dot_n;
+			light_component += spot_intensity * u_light_color[u_light_index] * l_dot_n;
 
 			//SPECULAR FACTOR
 			vec3 R = normalize(reflect(-L, normalize(normal)));
 			vec3 V = normalize(u_camera_pos - v_world_position);
 			float r_dot_v = clamp(dot(R, V), 0.0, 1.0);
-			float specular = pow(r_dot_v, u_material_shine);
-			light_component += specular * u_light_int * attenuation * u_light_color;
+			float specular = pow(r_dot_v, u_material.shininess);
+			light_component += specular * u_light_int[u_light_index] * attenuation * u_light_color[u_light_index];
 		}
 
 
-	} else if (u_light_type == 3) {								//DIRECTIONAL
-		vec3 L = normalize(u_light_dir);
+	} else if (u_light_type[u_light_index] == 3) {								//DIRECTIONAL
+		vec3 L = normalize(u_light_dir[u_light_index]);
 		float l_dot_n = clamp(dot(L,normalize(normal)), 0, 1);
-		light_component += u_light_int * u_light_color * l_dot_n;
+		light_component += u_light_int[u_light_index] * u_light_color[u_light_index] * l_dot_n;
 
 		//SPECULAR FACTOR
 		vec3 R = normalize(reflect(-L, normalize(normal)));
 		vec3 V = normalize(u_camera_pos - v_world_position);
 		float r_dot_v = clamp(dot(R, V), 0.0, 1.0);
-		float specular = pow(r_dot_v, u_material_shine);
-		light_component += specular * u_light_int * u_light_color;
+		float specular = pow(r_dot_v, u_material.shininess);
+		light_component += specular * u_light_int[u_light_index] * u_light_color[u_light_index];
 	}
 
 
-	if(color.a < u_alpha_cutoff) {
+	if(color.a < u_material.alpha_cutoff) {
 		discard;
 	}
 
 	vec3 lit_color = color.rgb * light_component;
+	if(u_probe_enabled == 1)
+		lit_color += computeReflection(v_world_position, normal, color.rgb);
 	FragColor = vec4(lit_color, color.a);
 }
 
@@ -648,6 +739,8 @@ void main()
 
 #version 330 core
 
+#include "blocks"
+
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
@@ -657,25 +750,9 @@ in vec4 v_color;
 uniform vec4 u_color;
 uniform sampler2D u_texture;
 uniform sampler2D u_normal_texture;
-uniform float u_time;
 uniform float u_alpha_cutoff;
 
-uniform vec3 u_light_ambient;
-
-uniform vec3 u_light_pos[10];
-uniform vec3 u_light_color[10];
-uniform float u_light_int[10];
-uniform vec3 u_light_dir[10];
-uniform int u_light_count;
-uniform int u_light_type[10];
-uniform float u_light_min[10];
-uniform float u_light_max[10];
-
-uniform float u_light_cone_max[10];	//FOR SPOT LIGHTS
-uniform float u_light_cone_min[10];		//FOR SPOT LIGHTS
-
 uniform float u_material_shine;
-uniform vec3 u_camera_pos;
 
 out vec4 FragColor;
 
@@ -710,9 +787,9 @@ void main()
 	vec4 color = u_color;
 	color *= texture( u_texture, v_uv );
 
-	vec3 texture_normal = texture( u_normal_texture, v_uv ).xyz;
-	texture_normal = (texture_normal * 2.0) - 1.0;
-	texture_normal = normalize(texture_normal);
+	//z is rebuilt from xy, compressed normal maps are BC5 and only have two channels
+	vec2 texture_xy = texture( u_normal_texture, v_uv ).xy * 2.0 - 1.0;
+	vec3 texture_normal = vec3(texture_xy, sqrt(max(1.0 - dot(texture_xy, texture_xy), 0.0)));
 	vec3 normal = perturbNormal(normalize(v_normal), v_world_position, v_uv, texture_normal);
 
 	vec3 light_component = vec3(0.0, 0.0, 0.0);
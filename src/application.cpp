@@ -6,6 +6,8 @@
 
 #include "editor.h"
 #include "pipeline/light.h"
+#include "pipeline/irradiance.h"
+#include "pipeline/reflection.h"
 
 std::vector<vec3> debug_points; //useful
 
@@ -22,6 +24,8 @@ Application::Application()
 	REGISTER_ENTITY_TYPE(SCN::PrefabEntity);
 	//add here your own entities
 	REGISTER_ENTITY_TYPE(SCN::LightEntity);
+	REGISTER_ENTITY_TYPE(SCN::IrradianceVolumeEntity);
+	REGISTER_ENTITY_TYPE(SCN::ReflectionProbeEntity);
 	//...
 
 	// Create camera
@@ -60,6 +64,9 @@ void Application::render(void)
 	//no need to do it here but in case...
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+	//the shader permutations that finished compiling replace their fallbacks
+	GFX::Shader::UpdatePending();
+
 	//set the camera as default (used by some functions in the framework)
 	camera->enable();
 
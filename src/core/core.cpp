@@ -6,6 +6,11 @@
 
 #include "../gfx/gfx.h" //check errors
 #include "../gfx/texture.h" //??
+#include "../gfx/mesh.h" //capabilities
+#include "../gfx/shader.h"
+#include "../gfx/residency.h"
+#include "../gfx/textureuploader.h"
+#include "../gfx/texturestreaming.h"
 #include "../utils/utils.h" //cleanPath
 
 #ifdef WIN32
@@ -48,7 +53,9 @@ void CORE::init()
 	// TODO(Juan): SDL_init_everything?
 	SDL_Init(SDL_INIT_JOYSTICK | SDL_INIT_GAMEPAD | SDL_INIT_TIMER  | SDL_INIT_EVENTS | SDL_INIT_VIDEO);
 	Input::init();
-	TaskManager::background.startThread();
+	TaskManager::background.startThreads(); //texture decoding
+	std::atexit([]() { TaskManager::background.stopThreads(); }); //waiting threads would block the destruction of the condition variable
+	JobSystem::init();
 }
 
 //create a window using SDL
@@ -105,6 +112,9 @@ CORE::Window* CORE::createWindow(const char* caption, int width, int height, boo
 #ifdef USE_GLEW
 	glewInit();
 #endif
+	GFX::Mesh::init();
+	GFX::Texture::init();
+	GFX::Shader::init(); //the uniform blocks are updated before the first shader is created
 
 	int window_width, window_height;
 	SDL_GetWindowSize(sdl_window, &window_width, &window_height);
@@ -276,6 +286,15 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 		//execute a task in the main task manager (blocking)
 		TaskManager::foreground.fetchTask();
 
+		//stream pending texture levels to VRAM within the frame budget
+		GFX::TextureUploader::update();
+
+		//request or drop mips from what the renderer needed this frame
+		GFX::TextureStreaming::update();
+
+		//account memory and evict unused resources if over budget
+		GFX::Residency::update();
+
 		//check errors in opengl only when working in debug
 #ifdef _DEBUG
 		GFX::checkGLErrors();
@@ -286,6 +305,8 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 void CORE::destroy()
 {
 	// Cleanup
+	GFX::Shader::Release();
+
 #ifndef SKIP_IMGUI
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplSDL3_Shutdown();
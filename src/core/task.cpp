@@ -3,6 +3,8 @@
 #include <thread>         // std::thread
 #include <chrono>		  //ms
 #include <cassert>
+#include <algorithm>
+#include <cstdlib> //atexit
 
 TaskManager TaskManager::foreground;
 TaskManager TaskManager::background;
@@ -10,70 +12,239 @@ TaskManager TaskManager::background;
 TaskManager::TaskManager()
 {
 	must_loop = false;
-	_thread = NULL;
+	last_id = 0;
 }
 
 void TaskManager::loop()
 {
-	using namespace std::chrono_literals;
-	std::cout << "Starting Task Manager ..." << std::endl;
-
-	while (must_loop)
+	while (true)
 	{
-		if (pending_tasks.empty())
 		{
-			std::this_thread::sleep_for(10ms);
-			continue;
+			std::unique_lock<std::mutex> lock(tasks_mutex);
+			tasks_condition.wait(lock, [this] { return !must_loop || !pending_tasks.empty(); });
+			if (!must_loop)
+				break;
 		}
-
 		fetchTask();
 	}
-
-	std::cout << "Ending Task Manager" << std::endl;
 }
 
 void TaskManager::fetchTask()
 {
 	Task* task = NULL;
-	try
 	{
 		//lock
 		const std::lock_guard<std::mutex> lock(tasks_mutex);
 		if (pending_tasks.empty())
 			return;
-		task = pending_tasks.front();
-		pending_tasks.pop_front();
+		//the oldest of the highest priority
+		auto best = pending_tasks.begin();
+		for (auto it = std::next(best); it != pending_tasks.end(); ++it)
+			if ((*it)->priority > (*best)->priority)
+				best = it;
+		task = *best;
+		pending_tasks.erase(best);
 		//unlock after finishing scope
 	}
-	catch (std::logic_error&) {
-		std::cout << "[exception caught]\n";
-	}
 
-	if (task)
+	task->onExecute();
+	delete task;
+}
+
+//by id, a task that already ran was deleted and its address can belong to a new one
+bool TaskManager::setPriority(unsigned int task_id, int priority)
+{
+	const std::lock_guard<std::mutex> lock(tasks_mutex);
+	for (Task* pending : pending_tasks)
+		if (pending->id == task_id)
+		{
+			pending->priority = priority;
+			return true;
+		}
+	return false;
+}
+
+bool TaskManager::cancelTask(unsigned int task_id)
+{
+	Task* task = NULL;
 	{
-		task->onExecute();
-		delete task;
-		task = NULL;
+		const std::lock_guard<std::mutex> lock(tasks_mutex);
+		auto it = std::find_if(pending_tasks.begin(), pending_tasks.end(), [task_id](Task* pending) { return pending->id == task_id; });
+		if (it == pending_tasks.end())
+			return false; //running or done
+		task = *it;
+		pending_tasks.erase(it);
 	}
+	delete task;
+	return true;
 }
 
-void thread_loop_func(TaskManager* manager)
+void TaskManager::startThreads(int num_threads)
 {
-	manager->loop();
-	//join?
+	assert(threads.empty() && "TaskManager already has threads");
+	if (num_threads < 0)
+		num_threads = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+	must_loop = true;
+	for (int i = 0; i < num_threads; ++i)
+		threads.push_back(new std::thread(&TaskManager::loop, this));
+	std::cout << "Task Manager: " << num_threads << " threads" << std::endl;
 }
 
-void TaskManager::startThread()
+void TaskManager::stopThreads()
 {
-	assert(!_thread && "TaskManager already in a thread");
-	must_loop = true;
-	_thread = new std::thread(thread_loop_func, this);
+	{
+		const std::lock_guard<std::mutex> lock(tasks_mutex);
+		must_loop = false;
+	}
+	tasks_condition.notify_all();
+	for (std::thread* thread : threads)
+	{
+		thread->join();
+		delete thread;
+	}
+	threads.clear();
 }
 
-void TaskManager::addTask(Task* task)
+unsigned int TaskManager::addTask(Task* task)
 {
+	unsigned int id;
 	//block pending_tasks
-	const std::lock_guard<std::mutex> lock(tasks_mutex);
-	pending_tasks.push_back(task);
+	{
+		const std::lock_guard<std::mutex> lock(tasks_mutex);
+		id = task->id = ++last_id;
+		pending_tasks.push_back(task);
+	}
 	//release pending_tasks automatically
-}
\ No newline at end of file
+	tasks_condition.notify_one();
+	return id; //the task may be deleted already
+}
+
+// JOBS ***********************************************
+
+struct sJob {
+	std::function<void(int, int)> func;
+	int count;
+	int batch_size;
+	std::atomic<int> next;
+	std::atomic<int> done;
+};
+
+bool JobSystem::enabled = true;
+
+static std::vector<std::thread*> job_workers;
+static std::mutex job_mutex;
+static std::mutex job_owner_mutex; //held by the thread whose loop is in the pool
+static std::condition_variable job_condition;
+static sJob* current_job = NULL; //protected by job_mutex
+static unsigned int job_generation = 0;
+static bool job_quit = false;
+static std::atomic<int> job_busy_workers(0);
+
+static void runJobBatches(sJob* job)
+{
+	int start;
+	while ((start = job->next.fetch_add(job->batch_size)) < job->count)
+	{
+		int end = std::min(start + job->batch_size, job->count);
+		job->func(start, end);
+		job->done.fetch_add(end - start);
+	}
+}
+
+static void job_worker_func()
+{
+	unsigned int seen = 0;
+	while (true)
+	{
+		sJob* job = NULL;
+		{
+			std::unique_lock<std::mutex> lock(job_mutex);
+			job_condition.wait(lock, [&] { return job_quit || (current_job && job_generation != seen); });
+			if (job_quit)
+				return;
+			seen = job_generation;
+			job = current_job;
+			job_busy_workers++; //while busy the job cannot be released
+		}
+		runJobBatches(job);
+		job_busy_workers--;
+	}
+}
+
+void JobSystem::init(int num_workers)
+{
+	assert(job_workers.empty() && "JobSystem already started");
+	if (num_workers < 0)
+		num_workers = std::max((int)std::thread::hardware_concurrency() - 1, 0);
+	for (int i = 0; i < num_workers; ++i)
+		job_workers.push_back(new std::thread(job_worker_func));
+	std::atexit(JobSystem::shutdown); //waiting threads would block the destruction of the condition variable
+	std::cout << "Job System: " << num_workers << " workers" << std::endl;
+}
+
+void JobSystem::shutdown()
+{
+	{
+		const std::lock_guard<std::mutex> lock(job_mutex);
+		job_quit = true;
+	}
+	job_condition.notify_all();
+	for (std::thread* worker : job_workers)
+	{
+		worker->join();
+		delete worker;
+	}
+	job_workers.clear();
+	job_quit = false;
+}
+
+int JobSystem::getNumThreads()
+{
+	return enabled ? (int)job_workers.size() + 1 : 1;
+}
+
+void JobSystem::parallelFor(int count, int batch_size, std::function<void(int start, int end)> func)
+{
+	if (count <= 0)
+		return;
+	batch_size = std::max(batch_size, 1);
+	if (!enabled || job_workers.empty() || count <= batch_size)
+	{
+		func(0, count);
+		return;
+	}
+
+	//a background task (like the texture encoder) may be using the pool, do not wait for it
+	std::unique_lock<std::mutex> owner(job_owner_mutex, std::try_to_lock);
+	if (!owner.owns_lock())
+	{
+		func(0, count);
+		return;
+	}
+
+	sJob job;
+	job.func = func;
+	job.count = count;
+	job.batch_size = batch_size;
+	job.next = 0;
+	job.done = 0;
+
+	{
+		const std::lock_guard<std::mutex> lock(job_mutex);
+		current_job = &job;
+		job_generation++;
+	}
+	job_condition.notify_all();
+
+	runJobBatches(&job);
+	while (job.done.load() < count)
+		std::this_thread::yield();
+
+	//workers that wake up now will not see the job, wait for the ones still inside
+	{
+		const std::lock_guard<std::mutex> lock(job_mutex);
+		current_job = NULL;
+	}
+	while (job_busy_workers.load() > 0)
+		std::this_thread::yield();
+}
@@ -5,30 +5,53 @@
 #include <mutex>
 #include <thread>         // std::thread
 #include <functional>
+#include <atomic>
+#include <condition_variable>
 
 //any task executed in BG should inherit from this one
 class Task {
 public:
 	std::function<void()> callback;
-	Task() { callback = NULL; };
-	Task(std::function<void()> func) { callback = func; };
+	int priority; //pending tasks with higher priority are fetched first
+	unsigned int id; //given by addTask and never reused, the task is deleted after running
+	Task() { callback = NULL; priority = 0; id = 0; };
+	Task(std::function<void()> func) { callback = func; priority = 0; id = 0; };
 	virtual ~Task() {};
 	virtual void onExecute() { if (callback) callback(); }
 };
 
+//queue of tasks, executed by the thread calling fetchTask or by a pool of worker threads
 class TaskManager {
 public:
 	std::list<Task*> pending_tasks;
-	std::mutex tasks_mutex;  // protects pending_tasks
+	std::mutex tasks_mutex;  // protects pending_tasks, the priorities and last_id
+	unsigned int last_id;
+	std::condition_variable tasks_condition; //wakes up the workers
 	bool must_loop;
-	std::thread* _thread;
+	std::vector<std::thread*> threads;
 
 	static TaskManager foreground;
-	static TaskManager background;
+	static TaskManager background; //decodes the textures
 
 	TaskManager();
-	void addTask(Task* task);
+	unsigned int addTask(Task* task); //returns its id
 	void fetchTask();
+	bool setPriority(unsigned int task_id, int priority); //false if it is not pending anymore
+	bool cancelTask(unsigned int task_id); //removes and deletes it if not started yet
 	void loop();
-	void startThread();
-};
\ No newline at end of file
+	void startThread() { startThreads(1); }
+	void startThreads(int num_threads = -1); //-1 uses one per core minus the main thread
+	void stopThreads();
+};
+
+//pool of worker threads to split a loop in batches, the calling thread also works and waits until all are done
+//only one loop runs in the pool at a time, if another thread is using it the loop runs in the calling thread
+class JobSystem {
+public:
+	static bool enabled;
+
+	static void init(int num_workers = -1); //-1 uses one worker per core minus the main thread
+	static void shutdown(); //called at exit
+	static int getNumThreads(); //workers plus the main thread
+	static void parallelFor(int count, int batch_size, std::function<void(int start, int end)> func);
+};
@@ -1,6 +1,7 @@
 
 #include "litengine.h"
 #include "editor.h"
+#include "extra/hdre.h"
 
 long mouse_press_time = 0;
 
@@ -192,6 +193,33 @@ void SceneEditor::render(Camera* camera)
 	if (ImGui::BeginTabItem("Rendering"))
 	{
 		renderer->showUI();
+		if (ImGui::TreeNode("Shaders"))
+		{
+			GFX::Shader::showUI();
+			ImGui::TreePop();
+		}
+		ImGui::EndTabItem();
+	}
+
+	if (ImGui::BeginTabItem("Memory"))
+	{
+		GFX::Residency::showUI();
+		if (ImGui::TreeNode("Texture compression"))
+		{
+			GFX::TextureCompressor::showUI();
+			ImGui::TreePop();
+		}
+		if (ImGui::TreeNode("Mipmaps"))
+		{
+			GFX::MipGenerator::showUI();
+			ImGui::TreePop();
+		}
+		if (ImGui::TreeNode("Texture streaming"))
+		{
+			GFX::TextureUploader::showUI();
+			GFX::TextureStreaming::showUI();
+			ImGui::TreePop();
+		}
 		ImGui::EndTabItem();
 	}
 
@@ -228,6 +256,8 @@ void SceneEditor::render(Camera* camera)
 		{
 		case SCN::eEntityType::PREFAB: inspectEntity((SCN::PrefabEntity*)ent); break;
 		case SCN::eEntityType::LIGHT: inspectEntity((SCN::LightEntity*)ent); break;
+		case SCN::eEntityType::IRRADIANCE_VOLUME: inspectEntity((SCN::IrradianceVolumeEntity*)ent); break;
+		case SCN::eEntityType::REFLECTION_PROBE: inspectEntity((SCN::ReflectionProbeEntity*)ent); break;
 		case SCN::eEntityType::NONE: inspectEntity((SCN::UnknownEntity*)ent); break;
 		default: inspectEntity(ent); break;
 		}
@@ -239,6 +269,7 @@ void SceneEditor::render(Camera* camera)
 
 		if (UI::Filename("Skybox", scene->skybox_filename, scene->base_folder))
 			renderer->setupScene();
+		ImGui::Checkbox("Skybox IBL levels only (on load)", &HDRE::ibl_only);
 
 		//add info to the debug panel about the camera
 		if (ImGui::TreeNode(camera, "Camera")) {
@@ -396,6 +427,70 @@ void SceneEditor::inspectEntity(SCN::LightEntity* entity)
 }
 
 
+void SceneEditor::inspectEntity(SCN::IrradianceVolumeEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	ImGui::DragFloat3("size", entity->size.v, 0.1f, 0.01f, 10000.0f);
+	ImGui::DragInt3("probes", entity->dims, 0.1f, 1, 64);
+	ImGui::DragInt("samples", &entity->num_samples, 1.0f, 16, 4096);
+	char buff[1024];
+	strcpy(buff, entity->filename.c_str());
+	if (ImGui::InputText("filename", buff, 1024))
+		entity->filename = buff;
+
+	//the bake uses the scene as it is now, the same as running the app with --bake-irradiance
+	if (ImGui::Button("Bake"))
+	{
+		SCN::RayTracer tracer;
+		if (tracer.build(scene) && entity->bake(tracer))
+		{
+			if (entity->filename.empty())
+				entity->filename = entity->name + ".irrv";
+			entity->save(entity->getFullPath().c_str());
+		}
+	}
+	if (entity->probes.size())
+		ImGui::Text("%dx%dx%d probes, %d inside geometry, %.1fms", entity->probes_dims[0], entity->probes_dims[1], entity->probes_dims[2], entity->num_invalid_probes, entity->bake_time);
+	else
+		ImGui::Text("Not baked, using the ambient light");
+#endif
+}
+
+void SceneEditor::inspectEntity(SCN::ReflectionProbeEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	ImGui::DragFloat3("size", entity->size.v, 0.1f, 0.01f, 10000.0f);
+	int resolution_index = 0;
+	while ((16 << resolution_index) < entity->resolution && resolution_index < 4)
+		resolution_index++;
+	if (ImGui::Combo("resolution", &resolution_index, "16\0" "32\0" "64\0" "128\0" "256\0"))
+		entity->resolution = 16 << resolution_index;
+	ImGui::SliderInt("levels", &entity->num_levels, 1, 8);
+	char buff[1024];
+	strcpy(buff, entity->filename.c_str());
+	if (ImGui::InputText("filename", buff, 1024))
+		entity->filename = buff;
+
+	//the bake uses the scene as it is now, the same as running the app with --bake-probes --force
+	if (ImGui::Button("Bake"))
+	{
+		if (entity->filename.empty())
+			entity->filename = entity->name + ".probe";
+		SCN::RayTracer tracer;
+		if (tracer.build(scene, true))
+			entity->bake(tracer, true);
+	}
+	if (entity->isBaked())
+		ImGui::Text("%dx%d, %d levels, capture %.1fms, prefilter %.1fms", entity->header.size, entity->header.size, entity->header.num_levels, entity->capture_time, entity->filter_time);
+	else
+		ImGui::Text("Not baked, no reflections");
+#endif
+}
+
 void SceneEditor::inspectEntity( SCN::UnknownEntity* entity )
 {
 #ifndef SKIP_IMGUI
@@ -10,6 +10,8 @@ namespace SCN {
 
 	class PrefabEntity;
 	class LightEntity;
+	class IrradianceVolumeEntity;
+	class ReflectionProbeEntity;
 };
 
 class SceneEditor
@@ -35,6 +37,8 @@ public:
 	void inspectEntity(SCN::PrefabEntity* entity);
 	void inspectEntity(SCN::LightEntity* entity);
 	void inspectEntity(SCN::UnknownEntity* entity);
+	void inspectEntity(SCN::IrradianceVolumeEntity* entity);
+	void inspectEntity(SCN::ReflectionProbeEntity* entity);
 
 	void ParseMaterialsEntity(SCN::Node*);
 
@@ -2,12 +2,31 @@
 #include <fstream>
 #include <cmath>
 #include <cassert>
+#include <cstring>
+#include <chrono>
+#include <vector>
 #include <algorithm>
 
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define HDRE_SSE
+#endif
+
 #include "../utils/utils.h"
 #include "hdre.h"
 
 std::map<std::string, HDRE*> HDRE::s_loaded_hdres;
+bool HDRE::ibl_only = false;
 
 HDRE::HDRE()
 {
@@ -26,6 +45,16 @@ void HDRE::init()
     data = nullptr;
     width = height = 0;
     levels = N_MAX_LEVELS;
+	mapped = nullptr;
+	mapped_size = 0;
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+
+	for (int i = 0; i < N_LEVELS; i++)
+	{
+		level_width[i] = 0;
+		level_offset[i] = 0;
+	}
 
     for (int j = 0; j < N_FACES; j++)
     {
@@ -33,7 +62,6 @@ void HDRE::init()
         {
             pixels_h[i][j] = nullptr;
             pixels_f[i][j] = nullptr;
-            pixels_b[i][j] = nullptr;
         }
     }
 }
@@ -73,48 +101,164 @@ float* HDRE::getData()
 	return this->data;
 }
 
+//every level but the first one is stored upside down
+void HDRE::copyFace(int level, int face, float* dst_f, short* dst_h)
+{
+	int w = level_width[level];
+	size_t row = size_t(w) * header.numChannels;
+	const float* src = data + level_offset[level] + row * w * face;
+	for (int y = 0; y < w; ++y)
+	{
+		size_t dst_row = row * (level ? w - y - 1 : y);
+		if (dst_f)
+			memcpy(dst_f + dst_row, src + row * y, row * sizeof(float));
+		else
+			floatToHalf(src + row * y, (unsigned short*)dst_h + dst_row, row);
+	}
+}
+
 float** HDRE::getFacesf(int level)
 {
+	if (level < 0 || level >= N_LEVELS || !data || !level_width[level])
+		return nullptr;
+	if (!this->pixels_f[level][0])
+		for (int j = 0; j < N_FACES; j++)
+		{
+			this->pixels_f[level][j] = new float[size_t(level_width[level]) * level_width[level] * header.numChannels];
+			copyFace(level, j, this->pixels_f[level][j], nullptr);
+		}
     return this->pixels_f[level];
 }
 float* HDRE::getFacef(int level, int face)
 {
-    return this->pixels_f[level][face];
+	float** faces = getFacesf(level);
+    return faces ? faces[face] : nullptr;
 }
 
-byte** HDRE::getFacesb(int level)
+short** HDRE::getFacesh(int level)
 {
-	return this->pixels_b[level];
+	if (level < 0 || level >= N_LEVELS || !data || !level_width[level])
+		return nullptr;
+	if (!this->pixels_h[level][0])
+		for (int j = 0; j < N_FACES; j++)
+		{
+			this->pixels_h[level][j] = new short[size_t(level_width[level]) * level_width[level] * header.numChannels];
+			copyFace(level, j, nullptr, this->pixels_h[level][j]);
+		}
+    return this->pixels_h[level];
 }
-byte* HDRE::getFaceb(int level, int face)
+short* HDRE::getFaceh(int level, int face)
 {
-    return this->pixels_b[level][face];
+	short** faces = getFacesh(level);
+    return faces ? faces[face] : nullptr;
 }
 
-short** HDRE::getFacesh(int level)
+void HDRE::releaseLevels()
 {
-    return this->pixels_h[level];
+	for (int j = 0; j < N_FACES; j++)
+		for (int i = 0; i < N_MAX_LEVELS; i++)
+		{
+			delete[] pixels_h[i][j];
+			pixels_h[i][j] = nullptr;
+			delete[] pixels_f[i][j];
+			pixels_f[i][j] = nullptr;
+		}
 }
-short* HDRE::getFaceh(int level, int face)
+
+size_t HDRE::getResidentBytes()
+{
+	size_t bytes = 0;
+	for (int i = 0; i < N_LEVELS; i++)
+	{
+		size_t face = size_t(level_width[i]) * level_width[i] * header.numChannels;
+		if (pixels_f[i][0])
+			bytes += face * N_FACES * sizeof(float);
+		if (pixels_h[i][0])
+			bytes += face * N_FACES * sizeof(short);
+	}
+	return bytes;
+}
+
+bool HDRE::map(const char* filename)
 {
-    return this->pixels_h[level][face];
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	mapped = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!mapped)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	mapping_handle = mapping;
+	mapped_size = (size_t)size.QuadPart;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size <= 0)
+	{
+		close(fd);
+		return false;
+	}
+	void* ptr = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); //the mapping keeps the file
+	if (ptr == MAP_FAILED)
+		return false;
+	mapped = (const unsigned char*)ptr;
+	mapped_size = (size_t)info.st_size;
+#endif
+	return true;
 }
 
+void HDRE::unmap()
+{
+	if (!mapped)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(mapped);
+	CloseHandle((HANDLE)mapping_handle);
+	CloseHandle((HANDLE)file_handle);
+	file_handle = mapping_handle = nullptr;
+#else
+	munmap((void*)mapped, mapped_size);
+#endif
+	mapped = nullptr;
+	mapped_size = 0;
+	data = nullptr;
+}
 
 bool HDRE::load(const char* filename)
 {
 	assert(filename);
 
-	FILE *f = fopen(filename,"rb");
-	if (f == nullptr)
+	if (!map(filename))
 		return false;
 
 	sHDREHeader HDREHeader;
-
-	fread(&HDREHeader, sizeof(sHDREHeader), 1, f);
+	if (mapped_size < sizeof(sHDREHeader))
+	{
+		unmap();
+		return false;
+	}
+	memcpy(&HDREHeader, mapped, sizeof(sHDREHeader));
 
 	if (HDREHeader.type != 3) {
         std::cout << "HDRE Header has wrong type: " << HDREHeader.type << std::endl;
+		unmap();
         throw ("ArrayType not supported. Please export in Float32Array.");
     }
 
@@ -126,7 +270,7 @@ bool HDRE::load(const char* filename)
 	this->width = width;
 	this->height = height;
 
-	int dataSize = 0;
+	size_t dataSize = 0;
 	int w = width;
 
 	// Get number of floats inside the HDRE
@@ -134,7 +278,9 @@ bool HDRE::load(const char* filename)
 	for (int i = 0; i < N_LEVELS; i++)
 	{
 		int mip_level = i + 1;
-		dataSize += w * w * N_FACES * HDREHeader.numChannels;
+		level_width[i] = w;
+		level_offset[i] = dataSize;
+		dataSize += size_t(w) * w * N_FACES * HDREHeader.numChannels;
 
 		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
 		w = fmax(8, (int)(width / pow(2.0, mip_level)));
@@ -143,114 +289,188 @@ bool HDRE::load(const char* filename)
 			w = (int)(width / pow(2.0, mip_level));
 	}
 
-	this->data = new float[dataSize];
-
-	fseek(f, HDREHeader.headerSize, SEEK_SET);
+	if (HDREHeader.headerSize < 0 || (size_t)HDREHeader.headerSize + dataSize * sizeof(float) > mapped_size || (size_t)HDREHeader.headerSize % sizeof(float))
+	{
+		std::cout << "[ERROR] HDRE file too small: " << filename << std::endl;
+		unmap();
+		return false;
+	}
 
-	fread(this->data, sizeof(float) * dataSize, 1, f);
-	fclose(f);
+	// nothing is read yet, the pages are loaded when the levels are requested
+	this->data = (float*)(mapped + HDREHeader.headerSize);
 
-	// get separated levels
+	// only the levels with the size of a mip can be uploaded as one
+	levels = 0;
+	while (levels < N_LEVELS && level_width[levels] && level_width[levels] == (width >> levels))
+		levels++;
 
-	w = width;
-	int mapOffset = 0;
-    int mapPrevOffset = 0;
+	std::cout << " + '" << filename << "' (v" << this->header.version << ") loaded successfully" << std::endl;
+	return true;
+}
 
-	int nFullMips = 0;
-	while (w)
-    {
-	    nFullMips++;
-	    w >>= 1;
-    }
-	assert(nFullMips <= N_MAX_LEVELS);
-	levels = nFullMips;
-	w = width;
-    //printf("Load %d mips of HDRE texture\n", nFullMips);
+bool HDRE::clean()
+{
+	releaseLevels();
+	unmap();
+	return true;
+}
 
-    int i;
-    for (i = 0; i < N_LEVELS; i++)
+// same bits as the SSE2 version: overflow to inf, NaN kept, subnormals rounded with a float add
+static inline unsigned short floatToHalfScalar(float value)
+{
+	uint32_t f;
+	memcpy(&f, &value, 4);
+	uint32_t sign = f & 0x80000000u;
+	f ^= sign;
+	unsigned short o;
+	if (f >= 0x47800000u) // 65536 or more, inf or NaN
+		o = f > 0x7f800000u ? 0x7e00 : 0x7c00;
+	else if (f < 0x38800000u) // below the smallest normal half
 	{
-		int mip_level = i + 1;
-		int faceSize = w * w * HDREHeader.numChannels;
-		int mapSize = faceSize * N_FACES;
+		const uint32_t magic_bits = ((127 - 15) + (23 - 10) + 1) << 23;
+		float magic;
+		memcpy(&magic, &magic_bits, 4);
+		float rounded;
+		memcpy(&rounded, &f, 4);
+		rounded += magic;
+		uint32_t bits;
+		memcpy(&bits, &rounded, 4);
+		o = (unsigned short)(bits - magic_bits);
+	}
+	else
+	{
+		uint32_t mant_odd = (f >> 13) & 1;
+		f += (uint32_t(15 - 127) << 23) + 0xfff + mant_odd;
+		o = (unsigned short)(f >> 13);
+	}
+	return o | (unsigned short)(sign >> 16);
+}
 
-		int faceOffset = 0;
+#ifdef HDRE_SSE
+static inline __m128i floatToHalfSSE(__m128 f)
+{
+	const __m128i magic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+	__m128 sign = _mm_and_ps(f, _mm_castsi128_ps(_mm_set1_epi32(0x80000000u)));
+	__m128 absf = _mm_xor_ps(f, sign);
+	__m128i absi = _mm_castps_si128(absf);
 
-		for (int j = 0; j < N_FACES; j++)
-		{
-			// allocate memory
-			this->pixels_f[i][j] = new float[faceSize];
+	__m128i is_nan = _mm_castps_si128(_mm_cmpunord_ps(absf, absf));
+	__m128i is_regular = _mm_cmpgt_epi32(_mm_set1_epi32(0x47800000), absi);
+	__m128i special = _mm_or_si128(_mm_and_si128(is_nan, _mm_set1_epi32(0x200)), _mm_set1_epi32(0x7c00));
 
-			//reverseY
-			if (i && 1)
-			{
-				for (int y = 0; y < w; ++y)
-				{
-					memcpy(this->pixels_f[i][j] + w * (w - y - 1) * HDREHeader.numChannels, &this->data[mapOffset + faceOffset + w * y * HDREHeader.numChannels], sizeof(float) * w * HDREHeader.numChannels);
-				}
-			}
-			else
-			{
-				// set data
-				memcpy(this->pixels_f[i][j], &this->data[mapOffset + faceOffset], faceSize * sizeof(float));
-			}
+	__m128i is_subnormal = _mm_cmpgt_epi32(_mm_set1_epi32(0x38800000), absi);
+	__m128i subnormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(absf, _mm_castsi128_ps(magic))), magic);
 
-			/* OLD
-			for (int k = 0; k < faceSize; k++) {
+	__m128i mant_odd = _mm_srai_epi32(_mm_slli_epi32(absi, 31 - 13), 31); // -1 if odd
+	__m128i normal = _mm_add_epi32(absi, _mm_set1_epi32(int(uint32_t(15 - 127) << 23) + 0xfff));
+	normal = _mm_srli_epi32(_mm_sub_epi32(normal, mant_odd), 13);
 
-				float value = this->data[mapOffset + faceOffset + k];
-				this->pixels_f[i][j][k] = value;
-			}
-			*/
+	__m128i result = _mm_or_si128(_mm_and_si128(is_subnormal, subnormal), _mm_andnot_si128(is_subnormal, normal));
+	result = _mm_or_si128(_mm_and_si128(is_regular, result), _mm_andnot_si128(is_regular, special));
+	return _mm_or_si128(result, _mm_srai_epi32(_mm_castps_si128(sign), 16)); // negatives fit in int16 for the pack
+}
+#endif
 
-			// update face offset
-			faceOffset += faceSize;
+void HDRE::floatToHalf(const float* src, unsigned short* dst, size_t count, bool use_simd)
+{
+	size_t i = 0;
+#ifdef HDRE_SSE
+	if (use_simd)
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128i a = floatToHalfSSE(_mm_loadu_ps(src + i));
+			__m128i b = floatToHalfSSE(_mm_loadu_ps(src + i + 4));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
 		}
-
-		// update level offset
-		mapPrevOffset = mapOffset;
-		mapOffset += mapSize;
-		// reassign width for next level
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
-		w = fmax(8, (int)(width / pow(2.0, mip_level)));
-
-		if (this->header.version > 2.0)
-			w = (int)(width / pow(2.0, mip_level));
-	}
-	std::cout << " + '" << filename << "' (v" << this->header.version << ") loaded successfully" << std::endl;
-	return true;
+#endif
+	for (; i < count; ++i)
+		dst[i] = floatToHalfScalar(src[i]);
 }
 
-bool HDRE::clean()
+bool HDRE::benchmark(const char* filename, int iterations)
 {
-	try
-	{
-		if (data)
-			delete data;
+	bool ok = true;
 
-        for (int j = 0; j < N_FACES; j++)
-        {
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-				delete pixels_h[i][j];
-				pixels_h[i][j] = nullptr;
-			}
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-                delete pixels_f[i][j];
-                pixels_f[i][j] = nullptr;
-            }
+	//every exponent with some mantissas and the special values, scalar against SSE
+	std::vector<float> values;
+	for (uint32_t bits = 0; bits < 0x80000000u; bits += 0x1fff)
+		for (uint32_t sign = 0; sign < 2; ++sign)
+		{
+			uint32_t v = bits | (sign << 31);
+			float f;
+			memcpy(&f, &v, 4);
+			values.push_back(f);
 		}
-
-		return true;
+	const float specials[] = { 0.0f, -0.0f, 65504.0f, 65519.0f, 65520.0f, 1e-8f, 5.96e-8f, 6.1e-5f, 6.104e-5f, 1.0f, -1.0f, 0.33333f, INFINITY, -INFINITY, NAN };
+	values.insert(values.end(), specials, specials + sizeof(specials) / sizeof(float));
+	std::vector<unsigned short> reference(values.size()), result(values.size());
+	floatToHalf(&values[0], &reference[0], values.size(), false);
+	floatToHalf(&values[0], &result[0], values.size(), true);
+	size_t num_wrong = 0;
+	for (size_t i = 0; i < values.size(); ++i)
+		num_wrong += reference[i] != result[i];
+	if (reference[values.size() - 15 + 2] != 0x7bff || reference[values.size() - 15 + 4] != 0x7c00 || reference[values.size() - 15 + 9] != 0x3c00)
+		num_wrong++; //65504, 65520 and 1
+	std::cout << "float to half: " << values.size() << " values " << (num_wrong ? "[ERROR] different from the scalar reference" : "identical") << std::endl;
+	ok = ok && !num_wrong;
+
+	//mapping and paging in the levels against reading the whole file as before
+	auto start = std::chrono::high_resolution_clock::now();
+	size_t file_bytes = 0;
+	for (int i = 0; i < iterations; ++i)
+	{
+		std::vector<unsigned char> buffer;
+		if (!readFileBin(filename, buffer))
+			return false;
+		file_bytes = buffer.size();
 	}
-	catch (const std::exception&)
+	double read_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+	double times[3] = { 0, 0, 0 }; //map, float levels, half levels
+	size_t bytes_f = 0, bytes_h = 0;
+	for (int i = 0; i < iterations; ++i)
 	{
-		std::cout << std::endl << "Error cleaning" << std::endl;
-		return false;
+		HDRE hdre;
+		start = std::chrono::high_resolution_clock::now();
+		if (!hdre.load(filename))
+			return false;
+		auto mapped_time = std::chrono::high_resolution_clock::now();
+		for (int l = 0; l < hdre.levels; ++l)
+			hdre.getFacesf(l);
+		auto float_time = std::chrono::high_resolution_clock::now();
+		for (int l = 0; l < hdre.levels; ++l)
+			hdre.getFacesh(l);
+		auto half_time = std::chrono::high_resolution_clock::now();
+		times[0] += std::chrono::duration<double, std::milli>(mapped_time - start).count() / iterations;
+		times[1] += std::chrono::duration<double, std::milli>(float_time - mapped_time).count() / iterations;
+		times[2] += std::chrono::duration<double, std::milli>(half_time - float_time).count() / iterations;
+		size_t total = hdre.getResidentBytes();
+		bytes_f = total / 3 * 2;
+		bytes_h = total / 3;
+
+		//the half faces must match the float faces converted one by one
+		for (int l = 0; l < hdre.levels && i == 0; ++l)
+			for (int j = 0; j < N_FACES; ++j)
+			{
+				size_t count = size_t(hdre.getLevelWidth(l)) * hdre.getLevelWidth(l) * hdre.header.numChannels;
+				const float* face_f = hdre.getFacef(l, j);
+				const unsigned short* face_h = (const unsigned short*)hdre.getFaceh(l, j);
+				for (size_t k = 0; k < count; ++k)
+					if (face_h[k] != floatToHalfScalar(face_f[k]))
+					{
+						std::cout << TermColor::RED << "[ERROR] level " << l << " face " << j << " differs" << TermColor::DEFAULT << std::endl;
+						ok = false;
+						break;
+					}
+			}
 	}
 
-	return false;
+	const float MB = 1.0f / (1024 * 1024);
+	std::cout << filename << " " << file_bytes * MB << "MB, " << iterations << " iterations" << std::endl;
+	std::cout << " read whole file: " << read_time << "ms" << std::endl;
+	std::cout << " map: " << TermColor::GREEN << times[0] << "ms" << TermColor::DEFAULT << " float levels: " << times[1] << "ms (" << bytes_f * MB << "MB)"
+		<< " half levels: " << TermColor::GREEN << times[2] << "ms (" << bytes_h * MB << "MB)" << TermColor::DEFAULT << std::endl;
+	return ok;
 }
 
 HDRE* HDRE::Get(const char* filename)
@@ -269,4 +489,4 @@ HDRE* HDRE::Get(const char* filename)
 
 	s_loaded_hdres[filename] = hdre;
 	return hdre;
-}
\ No newline at end of file
+}
@@ -45,27 +45,41 @@ typedef struct {
 
 } sHDRELevel;
 
+// The file is memory mapped: the payload is only read from disk when a level is requested,
+// and the faces of every level are copied (or converted to half floats) on the first request.
+// Request the levels from one thread before sharing them between workers.
 class HDRE {
 
 private:
 
     std::string filename;
-	float* data; // only f32 now
+	float* data; // only f32 now, points inside the mapped file
+
+	const unsigned char* mapped;
+	size_t mapped_size;
+	void* file_handle; // windows only
+	void* mapping_handle;
+
+	int level_width[N_LEVELS];
+	size_t level_offset[N_LEVELS]; // in floats from data
 
     float* pixels_f[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
     short* pixels_h[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
-    byte* pixels_b[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
 
 	bool clean();
 	void init();
+	bool map(const char* filename);
+	void unmap();
+	void copyFace(int level, int face, float* dst_f, short* dst_h);
 
 public:
 	static std::map<std::string, HDRE*> s_loaded_hdres;
+	static bool ibl_only; // CubemapFromHDRE skips the base level (the skybox), lod 0 becomes the first prefiltered level
 
 	sHDREHeader header;
 	int width;
 	int height;
-    int levels = N_MAX_LEVELS;
+    int levels = N_MAX_LEVELS; // levels in the file that form a mip chain
 
 	HDRE();
 	HDRE(const char* filename);
@@ -83,16 +97,20 @@ public:
 		return nullptr;
 	}
 
-	float* getData(); // All pixel data
+	float* getData(); // All pixel data, as stored in the file (mapped, read only)
+	int getLevelWidth(int level) { return level >= 0 && level < N_LEVELS ? level_width[level] : 0; }
 
 	float* getFacef(int level, int face);	// Specific level and face
-	float** getFacesf(int level = 0);		// [[]]: Array per face with all level data
-
-    byte* getFaceb(int level, int face);	// Specific level and face
-    byte** getFacesb(int level = 0);		// [[]]: Array per face with all level data
+	float** getFacesf(int level = 0);		// [[]]: Array per face with all level data, NULL if not in the file
 
     short* getFaceh(int level, int face);	// Specific level and face
-	short** getFacesh(int level = 0);		// [[]]: Array per face with all level data
+	short** getFacesh(int level = 0);		// [[]]: Array per face with all level data in half floats
+
+	void releaseLevels(); // frees the copies of the faces, they are read again from the mapping if requested
+	size_t getResidentBytes(); // copies in RAM
+
+	static void floatToHalf(const float* src, unsigned short* dst, size_t count, bool use_simd = true); // round to nearest even
+	static bool benchmark(const char* filename, int iterations = 10); // no GPU needed
 
 	//sHDRELevel getLevel(int level = 0);
 
@@ -512,4 +512,460 @@ int decodePNG(std::vector<unsigned char>& out_image, unsigned int& image_width,
 	image_width = decoder.info.width;
 	image_height = decoder.info.height;
 	return decoder.error;
-}
\ No newline at end of file
+}
+// Faster decoding path, not part of picoPNG (altered source, added for the engine):
+// inflate with a 64 bit bit buffer and table driven Huffman decoding (two literals per lookup when they fit),
+// SSE2 unfiltering of 3 and 4 channel rows, and the rows written in place so the inflated buffer becomes the image.
+
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define PICOPNG_SSE2
+#endif
+
+namespace {
+
+	const unsigned FAST_BITS = 11;
+	const unsigned FAST_MASK = (1 << FAST_BITS) - 1;
+
+	const unsigned short LEN_BASE[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+	const unsigned char LEN_EXTRA[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+	const unsigned short DIST_BASE[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+	const unsigned char DIST_EXTRA[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+	const unsigned char CL_ORDER[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+
+	//reads the stream 8 bytes at a time, the zeros read past the end are counted to detect truncated streams
+	struct BitReader
+	{
+		const unsigned char* ptr;
+		const unsigned char* end;
+		uint64_t bits;
+		unsigned num_bits;
+		size_t padding;
+
+		BitReader(const unsigned char* data, size_t size) : ptr(data), end(data + size), bits(0), num_bits(0), padding(0) {}
+
+		//at least 56 bits available after this
+		inline void refill()
+		{
+			if (end - ptr >= 8)
+			{
+				uint64_t v; memcpy(&v, ptr, 8); //little endian
+				bits |= v << num_bits;
+				ptr += (63 - num_bits) >> 3;
+				num_bits |= 56;
+				return;
+			}
+			while (num_bits <= 56)
+			{
+				if (ptr < end) bits |= uint64_t(*ptr++) << num_bits;
+				else padding++;
+				num_bits += 8;
+			}
+		}
+		inline unsigned get(unsigned n) { unsigned v = unsigned(bits & ((uint64_t(1) << n) - 1)); bits >>= n; num_bits -= n; return v; }
+		bool overrun() const { return padding * 8 > num_bits; }
+
+		//for stored blocks, the bytes still in the buffer are given back
+		bool alignToByte()
+		{
+			get(num_bits & 7);
+			if (overrun()) return false;
+			ptr -= (num_bits >> 3) - padding;
+			bits = 0; num_bits = 0; padding = 0;
+			return true;
+		}
+	};
+
+	//fast entry: bits 0-7 length of the code (0 if longer than FAST_BITS), bits 8-9 literals in the entry (0 for other symbols),
+	//bits 16-31 the symbol, or the two literals in bits 16-23 and 24-31
+	struct HuffmanTable
+	{
+		uint32_t fast[1 << FAST_BITS];
+		unsigned short count[16]; //codes of every length, for the canonical decoding of the long ones
+		unsigned short symbols[288]; //sorted by code
+
+		bool build(const unsigned char* lengths, unsigned num, bool pair_literals)
+		{
+			memset(count, 0, sizeof(count));
+			for (unsigned i = 0; i < num; i++) count[lengths[i]]++;
+			count[0] = 0;
+			int left = 1;
+			for (int len = 1; len < 16; len++) { left = (left << 1) - count[len]; if (left < 0) return false; } //over-subscribed
+			unsigned short offsets[16]; unsigned next_code[16];
+			offsets[1] = 0; next_code[1] = 0;
+			for (int len = 1; len < 15; len++) { offsets[len + 1] = offsets[len] + count[len]; next_code[len + 1] = (next_code[len] + count[len]) << 1; }
+
+			memset(fast, 0, sizeof(fast));
+			for (unsigned i = 0; i < num; i++)
+			{
+				unsigned len = lengths[i];
+				if (!len) continue;
+				symbols[offsets[len]++] = (unsigned short)i;
+				unsigned code = next_code[len]++;
+				if (len > FAST_BITS) continue;
+				unsigned rev = 0; //huffman codes are stored from the most significant bit
+				for (unsigned b = 0; b < len; b++) rev |= ((code >> b) & 1) << (len - 1 - b);
+				uint32_t entry = len | (pair_literals && i < 256 ? 1 << 8 : 0) | (i << 16);
+				for (unsigned j = rev; j <= FAST_MASK; j += 1 << len) fast[j] = entry;
+			}
+			if (!pair_literals) return true;
+
+			//a literal followed by another one that fits in the remaining bits is decoded in one lookup,
+			//from the top as the second code is looked up at a lower index that must still hold a single symbol
+			for (int j = FAST_MASK; j >= 0; j--)
+			{
+				uint32_t first = fast[j];
+				if (((first >> 8) & 3) != 1) continue;
+				unsigned len = first & 0xFF;
+				uint32_t second = fast[j >> len];
+				unsigned len2 = second & 0xFF;
+				if (((second >> 8) & 3) != 1 || len + len2 > FAST_BITS) continue;
+				fast[j] = (len + len2) | (2 << 8) | ((first >> 16) & 0xFF) << 16 | ((second >> 16) & 0xFF) << 24;
+			}
+			return true;
+		}
+
+		//bit by bit for the codes longer than the table, -1 if not valid
+		int decodeSlow(BitReader& reader) const
+		{
+			int code = 0, first = 0, index = 0;
+			for (unsigned len = 1; len < 16; len++)
+			{
+				code |= int((reader.bits >> (len - 1)) & 1);
+				int n = count[len];
+				if (code - n < first) { reader.get(len); return symbols[index + (code - first)]; }
+				index += n; first = (first + n) << 1; code <<= 1;
+			}
+			return -1;
+		}
+
+		inline int decode(BitReader& reader) const
+		{
+			uint32_t entry = fast[reader.bits & FAST_MASK];
+			if (!(entry & 0xFF)) return decodeSlow(reader);
+			reader.get(entry & 0xFF);
+			return int(entry >> 16);
+		}
+	};
+
+	bool inflateBlock(unsigned char* out, size_t out_size, size_t& pos, BitReader& reader, const HuffmanTable& lit, const HuffmanTable& dist)
+	{
+		for (;;)
+		{
+			reader.refill(); //enough bits for a length and a distance with their extra bits
+			uint32_t entry = lit.fast[reader.bits & FAST_MASK];
+			int symbol;
+			if (entry & 0xFF)
+			{
+				reader.get(entry & 0xFF);
+				if (((entry >> 8) & 3) == 2)
+				{
+					if (out_size - pos < 2) return false;
+					out[pos] = (unsigned char)(entry >> 16); out[pos + 1] = (unsigned char)(entry >> 24);
+					pos += 2;
+					continue;
+				}
+				symbol = int(entry >> 16);
+			}
+			else if ((symbol = lit.decodeSlow(reader)) < 0)
+				return false;
+
+			if (symbol < 256)
+			{
+				if (pos >= out_size) return false;
+				out[pos++] = (unsigned char)symbol;
+				continue;
+			}
+			if (symbol == 256)
+				return !reader.overrun();
+			symbol -= 257;
+			if (symbol >= 29) return false;
+			size_t length = LEN_BASE[symbol] + reader.get(LEN_EXTRA[symbol]);
+			int dist_symbol = dist.decode(reader);
+			if (dist_symbol < 0 || dist_symbol >= 30) return false;
+			size_t distance = DIST_BASE[dist_symbol] + reader.get(DIST_EXTRA[dist_symbol]);
+			if (distance > pos || length > out_size - pos) return false;
+
+			//the output has 8 bytes of slack so the copies can go in words
+			unsigned char* dst = out + pos;
+			const unsigned char* src = dst - distance;
+			pos += length;
+			if (distance >= 8)
+				for (size_t i = 0; i < length; i += 8) memcpy(dst + i, src + i, 8);
+			else if (distance == 1)
+				memset(dst, *src, length);
+			else
+				for (size_t i = 0; i < length; i++) dst[i] = src[i];
+		}
+	}
+
+	const HuffmanTable* getFixedTables()
+	{
+		static HuffmanTable tables[2];
+		static bool ready = [](){
+			unsigned char lengths[320];
+			for (unsigned i = 0; i < 288; i++) lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+			for (unsigned i = 0; i < 32; i++) lengths[288 + i] = 5;
+			tables[0].build(lengths, 288, true);
+			tables[1].build(lengths + 288, 32, false);
+			return true;
+		}();
+		(void)ready;
+		return tables;
+	}
+
+	//out needs out_size + 8 bytes, false if the stream is not valid or does not fill it exactly
+	bool inflateZlib(unsigned char* out, size_t out_size, const unsigned char* in, size_t in_size)
+	{
+		if (in_size < 2 || (in[0] * 256 + in[1]) % 31 != 0 || (in[0] & 15) != 8 || (in[0] >> 4) > 7 || (in[1] & 32))
+			return false;
+		BitReader reader(in + 2, in_size - 2);
+		HuffmanTable* dynamic = new HuffmanTable[3]; //too big for the stack of the worker threads
+		size_t pos = 0;
+		bool valid = true, final = false;
+		while (valid && !final)
+		{
+			reader.refill();
+			final = reader.get(1) != 0;
+			unsigned type = reader.get(2);
+			if (type == 0) //stored
+			{
+				if (!reader.alignToByte() || reader.end - reader.ptr < 4) { valid = false; break; }
+				const unsigned char* p = reader.ptr;
+				size_t len = p[0] | (p[1] << 8), nlen = p[2] | (p[3] << 8);
+				if (len + nlen != 65535 || size_t(reader.end - p - 4) < len || out_size - pos < len) { valid = false; break; }
+				memcpy(out + pos, p + 4, len);
+				pos += len;
+				reader.ptr = p + 4 + len;
+			}
+			else if (type == 1)
+			{
+				const HuffmanTable* fixed = getFixedTables();
+				valid = inflateBlock(out, out_size, pos, reader, fixed[0], fixed[1]);
+			}
+			else if (type == 2)
+			{
+				unsigned hlit = reader.get(5) + 257, hdist = reader.get(5) + 1, hclen = reader.get(4) + 4;
+				unsigned char cl_lengths[19] = { 0 };
+				for (unsigned i = 0; i < hclen; i++) { reader.refill(); cl_lengths[CL_ORDER[i]] = (unsigned char)reader.get(3); }
+				HuffmanTable& cl = dynamic[2];
+				if (hlit > 286 || hdist > 30 || !cl.build(cl_lengths, 19, false)) { valid = false; break; }
+				unsigned char lengths[320];
+				unsigned n = 0;
+				while (valid && n < hlit + hdist)
+				{
+					reader.refill();
+					int symbol = cl.decode(reader);
+					if (symbol < 0) valid = false;
+					else if (symbol < 16) lengths[n++] = (unsigned char)symbol;
+					else
+					{
+						unsigned char value = 0; unsigned repeat;
+						if (symbol == 16) { if (!n) { valid = false; break; } value = lengths[n - 1]; repeat = 3 + reader.get(2); }
+						else if (symbol == 17) repeat = 3 + reader.get(3);
+						else repeat = 11 + reader.get(7);
+						if (n + repeat > hlit + hdist) { valid = false; break; }
+						memset(lengths + n, value, repeat); n += repeat;
+					}
+				}
+				if (!valid || !lengths[256] || !dynamic[0].build(lengths, hlit, true) || !dynamic[1].build(lengths + hlit, hdist, false)) { valid = false; break; }
+				valid = inflateBlock(out, out_size, pos, reader, dynamic[0], dynamic[1]);
+			}
+			else
+				valid = false;
+		}
+		delete[] dynamic;
+		return valid && pos == out_size; //the adler32 is not checked, as in picoPNG
+	}
+
+	inline unsigned char paeth(int a, int b, int c)
+	{
+		int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+		return (unsigned char)(pc < pa && pc < pb ? c : pb < pa ? b : a);
+	}
+
+	//out may overlap in as long as it is not ahead of it, prev is NULL for the first row
+	void unfilterRowScalar(unsigned char* out, const unsigned char* in, const unsigned char* prev, unsigned filter, size_t bpp, size_t length)
+	{
+		size_t i = 0;
+		switch (filter)
+		{
+		case 0: memmove(out, in, length); break;
+		case 1: for (; i < bpp; i++) out[i] = in[i]; for (; i < length; i++) out[i] = in[i] + out[i - bpp]; break;
+		case 2: if (prev) for (; i < length; i++) out[i] = in[i] + prev[i]; else memmove(out, in, length); break;
+		case 3:
+			if (prev) { for (; i < bpp; i++) out[i] = in[i] + (prev[i] >> 1); for (; i < length; i++) out[i] = in[i] + ((out[i - bpp] + prev[i]) >> 1); }
+			else { for (; i < bpp; i++) out[i] = in[i]; for (; i < length; i++) out[i] = in[i] + (out[i - bpp] >> 1); }
+			break;
+		case 4:
+			if (prev) { for (; i < bpp; i++) out[i] = in[i] + prev[i]; for (; i < length; i++) out[i] = in[i] + paeth(out[i - bpp], prev[i], prev[i - bpp]); }
+			else { for (; i < bpp; i++) out[i] = in[i]; for (; i < length; i++) out[i] = in[i] + out[i - bpp]; }
+			break;
+		}
+	}
+
+#ifdef PICOPNG_SSE2
+	//one pixel at a time, only the bpp bytes are read and written
+	template<size_t bpp> inline __m128i loadPixel(const unsigned char* p) { int v; memcpy(&v, p, 4); return _mm_cvtsi32_si128(v); }
+	template<size_t bpp> inline void storePixel(unsigned char* p, __m128i v) { int i = _mm_cvtsi128_si32(v); memcpy(p, &i, 4); }
+	//in registers, a 3 byte memcpy goes through the stack
+	template<> inline __m128i loadPixel<3>(const unsigned char* p) { unsigned short v; memcpy(&v, p, 2); return _mm_cvtsi32_si128(v | (p[2] << 16)); }
+	template<> inline void storePixel<3>(unsigned char* p, __m128i v) { int i = _mm_cvtsi128_si32(v); unsigned short lo = (unsigned short)i; memcpy(p, &lo, 2); p[2] = (unsigned char)(i >> 16); }
+
+	//same as the scalar version for 3 and 4 bytes per pixel and a previous row
+	template<size_t bpp>
+	void unfilterRowSSE2(unsigned char* out, const unsigned char* in, const unsigned char* prev, unsigned filter, size_t length)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i a = zero;
+		size_t i = 0;
+		switch (filter)
+		{
+		case 1:
+			for (; i < length; i += bpp) { a = _mm_add_epi8(a, loadPixel<bpp>(in + i)); storePixel<bpp>(out + i, a); }
+			break;
+		case 2:
+			for (; i + 16 <= length; i += 16)
+				_mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(_mm_loadu_si128((const __m128i*)(in + i)), _mm_loadu_si128((const __m128i*)(prev + i))));
+			for (; i < length; i++) out[i] = in[i] + prev[i];
+			break;
+		case 3:
+			for (; i < length; i += bpp)
+			{
+				__m128i b = loadPixel<bpp>(prev + i);
+				__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1))); //rounded down
+				a = _mm_add_epi8(loadPixel<bpp>(in + i), avg);
+				storePixel<bpp>(out + i, a);
+			}
+			break;
+		case 4:
+		{
+			//in 16 bits so the differences do not overflow
+			__m128i b = zero, c, d;
+			for (; i < length; i += bpp)
+			{
+				c = b;
+				b = _mm_unpacklo_epi8(loadPixel<bpp>(prev + i), zero);
+				d = _mm_unpacklo_epi8(loadPixel<bpp>(in + i), zero);
+				__m128i pa = _mm_sub_epi16(b, c); //p - a, with p = a + b - c
+				__m128i pb = _mm_sub_epi16(a, c);
+				__m128i pc = _mm_add_epi16(pa, pb);
+				pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+				pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+				pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+				__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+				//ties go to a, then b, then c
+				__m128i use_b = _mm_cmpeq_epi16(smallest, pb);
+				__m128i nearest = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+				__m128i use_a = _mm_cmpeq_epi16(smallest, pa);
+				nearest = _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, nearest));
+				a = _mm_add_epi8(d, nearest); //wraps in 8 bits, the high bytes stay at zero
+				storePixel<bpp>(out + i, _mm_packus_epi16(a, a));
+			}
+			break;
+		}
+		default:
+			unfilterRowScalar(out, in, prev, filter, bpp, length);
+		}
+	}
+#endif
+
+	inline unsigned readBE32(const unsigned char* p) { return (unsigned(p[0]) << 24) | (unsigned(p[1]) << 16) | (unsigned(p[2]) << 8) | unsigned(p[3]); }
+
+	//formats outside the fast path go through picoPNG as RGBA
+	int decodePNGFallback(unsigned char*& out_pixels, unsigned int& image_width, unsigned int& image_height, unsigned int& num_channels, const unsigned char* in_png, size_t in_size)
+	{
+		std::vector<unsigned char> image;
+		int error = decodePNG(image, image_width, image_height, in_png, in_size, true);
+		if (error) return error;
+		out_pixels = new unsigned char[image.size()];
+		memcpy(out_pixels, &image[0], image.size());
+		num_channels = 4;
+		return 0;
+	}
+}
+
+int decodePNGFast(unsigned char*& out_pixels, unsigned int& image_width, unsigned int& image_height, unsigned int& num_channels, const unsigned char* in_png, size_t in_size)
+{
+	static const unsigned char SIGNATURE[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	out_pixels = NULL;
+	if (in_size < 33 || memcmp(in_png, SIGNATURE, 8) != 0) return 28; //same codes as picoPNG
+	if (memcmp(in_png + 12, "IHDR", 4) != 0) return 29;
+	unsigned width = readBE32(in_png + 16), height = readBE32(in_png + 20);
+	unsigned bit_depth = in_png[24], color_type = in_png[25];
+	bool fast = bit_depth == 8 && (color_type == 2 || color_type == 6) && in_png[26] == 0 && in_png[27] == 0 && in_png[28] == 0;
+
+	//the image data may be split in several chunks
+	const unsigned char* idat = NULL;
+	size_t idat_size = 0;
+	std::vector<unsigned char> idat_joined;
+	size_t pos = 33;
+	while (fast && pos + 12 <= in_size)
+	{
+		size_t chunk_size = readBE32(in_png + pos);
+		const unsigned char* type = in_png + pos + 4;
+		if (chunk_size > in_size - pos - 12) return 63;
+		const unsigned char* chunk = in_png + pos + 8;
+		if (memcmp(type, "IDAT", 4) == 0)
+		{
+			if (!idat) { idat = chunk; idat_size = chunk_size; }
+			else
+			{
+				if (idat_joined.empty()) idat_joined.assign(idat, idat + idat_size);
+				idat_joined.insert(idat_joined.end(), chunk, chunk + chunk_size);
+			}
+		}
+		else if (memcmp(type, "tRNS", 4) == 0)
+			fast = false; //color key, needs an alpha channel
+		else if (memcmp(type, "IEND", 4) == 0)
+			break;
+		pos += chunk_size + 12;
+	}
+	if (!fast || !width || !height || width > (1 << 24) / 4 || height > (1 << 24))
+		return decodePNGFallback(out_pixels, image_width, image_height, num_channels, in_png, in_size);
+	if (!idat) return 48;
+	if (idat_joined.size()) { idat = &idat_joined[0]; idat_size = idat_joined.size(); }
+
+	//inflated rows start with the filter byte, once unfiltered every row moves back over those bytes
+	//so this buffer ends up holding the pixels and is handed to the caller
+	unsigned int channels = color_type == 6 ? 4 : 3;
+	size_t row_bytes = size_t(width) * channels;
+	size_t raw_size = (row_bytes + 1) * height;
+	unsigned char* buffer = new unsigned char[raw_size + 8];
+	if (!inflateZlib(buffer, raw_size, idat, idat_size))
+	{
+		delete[] buffer;
+		return 52;
+	}
+
+	for (size_t y = 0; y < height; ++y)
+	{
+		const unsigned char* in = buffer + y * (row_bytes + 1);
+		unsigned char* out = buffer + y * row_bytes;
+		const unsigned char* prev = y ? out - row_bytes : NULL;
+		unsigned filter = in[0];
+		if (filter > 4)
+		{
+			delete[] buffer;
+			return 36;
+		}
+#ifdef PICOPNG_SSE2
+		if (prev && channels == 4)
+			unfilterRowSSE2<4>(out, in + 1, prev, filter, row_bytes);
+		else if (prev)
+			unfilterRowSSE2<3>(out, in + 1, prev, filter, row_bytes);
+		else
+#endif
+			unfilterRowScalar(out, in + 1, prev, filter, channels, row_bytes);
+	}
+
+	out_pixels = buffer;
+	image_width = width;
+	image_height = height;
+	num_channels = channels;
+	return 0;
+}
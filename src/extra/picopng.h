@@ -9,4 +9,8 @@ using namespace std;
 
 int decodePNG(std::vector<unsigned char>& out_image, unsigned int& image_width, unsigned int& image_height, const unsigned char* in_png, size_t in_size, bool convert_to_rgba32 = true);
 
+//faster decoder, the pixels are written to a buffer allocated with new[] that the caller owns (it may be a bit bigger than needed)
+//8 bit RGB and RGBA images keep their 3 or 4 channels, other formats go through decodePNG and come as RGBA. Returns 0 or an error code
+int decodePNGFast(unsigned char*& out_pixels, unsigned int& image_width, unsigned int& image_height, unsigned int& num_channels, const unsigned char* in_png, size_t in_size);
+
 #endif
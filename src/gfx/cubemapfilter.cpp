@@ -0,0 +1,389 @@
+#include "cubemapfilter.h"
+#include "mipgenerator.h"
+#include "texture.h"
+#include "sphericalharmonics.h"
+
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#include <emmintrin.h>
+	#define CUBEMAP_SSE
+#endif
+
+using namespace GFX;
+
+bool CubemapFilter::use_simd = true;
+int CubemapFilter::num_samples = 64;
+double CubemapFilter::total_time = 0;
+
+const int FILTER_ROWS_PER_BATCH = 4;
+
+struct sGGXSample {
+	Vector3f dir; //tangent space, around +Z
+	float weight; //n dot l
+	float lod; //mip of the source to read, from the pdf of the sample
+};
+
+//4 samples side by side, so their directions are addressed at once
+struct sSampleBlock {
+	float x[4], y[4], z[4];
+	float weight[4];
+	float lod[4];
+	int count;
+};
+
+//the 4 channels of a texel and the addressing of 4 samples,
+//the same operations in both versions so they give the same bits
+struct ScalarTexel {
+	float v[4];
+	ScalarTexel() {}
+	explicit ScalarTexel(float f) { v[0] = v[1] = v[2] = v[3] = f; }
+	ScalarTexel operator+(const ScalarTexel& o) const { ScalarTexel r; for (int i = 0; i < 4; ++i) r.v[i] = v[i] + o.v[i]; return r; }
+	ScalarTexel operator*(float f) const { ScalarTexel r; for (int i = 0; i < 4; ++i) r.v[i] = v[i] * f; return r; }
+	void load(const float* p) { memcpy(v, p, sizeof(v)); }
+	void store(float* p) const { memcpy(p, v, sizeof(v)); }
+
+	static void address(const sSampleBlock& block, const Vector3f& T, const Vector3f& B, const Vector3f& N, int* face, float* u, float* v)
+	{
+		for (int i = 0; i < block.count; ++i)
+		{
+			Vector3f L(T.x * block.x[i] + B.x * block.y[i] + N.x * block.z[i],
+				T.y * block.x[i] + B.y * block.y[i] + N.y * block.z[i],
+				T.z * block.x[i] + B.z * block.y[i] + N.z * block.z[i]);
+			CubemapFilter::getFaceUV(L, face[i], u[i], v[i]);
+		}
+	}
+};
+
+#ifdef CUBEMAP_SSE
+struct SSETexel {
+	__m128 v;
+	SSETexel() {}
+	explicit SSETexel(float f) { v = _mm_set1_ps(f); }
+	SSETexel operator+(const SSETexel& o) const { SSETexel r; r.v = _mm_add_ps(v, o.v); return r; }
+	SSETexel operator*(float f) const { SSETexel r; r.v = _mm_mul_ps(v, _mm_set1_ps(f)); return r; }
+	void load(const float* p) { v = _mm_loadu_ps(p); }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+
+	//getFaceUV with masks instead of branches
+	static void address(const sSampleBlock& block, const Vector3f& T, const Vector3f& B, const Vector3f& N, int* face, float* u, float* v)
+	{
+		__m128 sx = _mm_loadu_ps(block.x), sy = _mm_loadu_ps(block.y), sz = _mm_loadu_ps(block.z);
+		__m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(T.x), sx), _mm_mul_ps(_mm_set1_ps(B.x), sy)), _mm_mul_ps(_mm_set1_ps(N.x), sz));
+		__m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(T.y), sx), _mm_mul_ps(_mm_set1_ps(B.y), sy)), _mm_mul_ps(_mm_set1_ps(N.y), sz));
+		__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(T.z), sx), _mm_mul_ps(_mm_set1_ps(B.z), sy)), _mm_mul_ps(_mm_set1_ps(N.z), sz));
+		__m128 sign = _mm_set1_ps(-0.0f);
+		__m128 ax = _mm_andnot_ps(sign, x), ay = _mm_andnot_ps(sign, y), az = _mm_andnot_ps(sign, z);
+		__m128 is_x = _mm_and_ps(_mm_cmpge_ps(ax, ay), _mm_cmpge_ps(ax, az));
+		__m128 is_y = _mm_andnot_ps(is_x, _mm_cmpge_ps(ay, az));
+		__m128 is_z = _mm_andnot_ps(_mm_or_ps(is_x, is_y), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+		__m128 zero = _mm_setzero_ps();
+		__m128 pos_x = _mm_cmpgt_ps(x, zero), pos_y = _mm_cmpgt_ps(y, zero), pos_z = _mm_cmpgt_ps(z, zero);
+		__m128 major = _mm_or_ps(_mm_and_ps(is_x, ax), _mm_or_ps(_mm_and_ps(is_y, ay), _mm_and_ps(is_z, az)));
+		__m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), major);
+		//flipping the sign is exact, as the negations of the scalar path
+		__m128 nu = _mm_or_ps(_mm_and_ps(is_x, _mm_xor_ps(z, _mm_and_ps(pos_x, sign))),
+			_mm_or_ps(_mm_and_ps(is_y, x), _mm_and_ps(is_z, _mm_xor_ps(x, _mm_andnot_ps(pos_z, sign)))));
+		__m128 nv = _mm_or_ps(_mm_and_ps(is_y, _mm_xor_ps(z, _mm_andnot_ps(pos_y, sign))), _mm_andnot_ps(is_y, _mm_xor_ps(y, sign)));
+		_mm_storeu_ps(u, _mm_mul_ps(nu, inv));
+		_mm_storeu_ps(v, _mm_mul_ps(nv, inv));
+		int mx = _mm_movemask_ps(is_x), my = _mm_movemask_ps(is_y);
+		int px = _mm_movemask_ps(pos_x), py = _mm_movemask_ps(pos_y), pz = _mm_movemask_ps(pos_z);
+		for (int i = 0; i < 4; ++i)
+		{
+			int bit = 1 << i;
+			face[i] = (mx & bit) ? ((px & bit) ? 0 : 1) : (my & bit) ? ((py & bit) ? 2 : 3) : ((pz & bit) ? 4 : 5);
+		}
+	}
+};
+#endif
+
+static float radicalInverse(uint32 bits)
+{
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return float(bits) * 2.3283064365386963e-10f;
+}
+
+//hammersley points mapped to the GGX distribution, only the ones above the horizon
+static void buildSamples(float roughness, int count, float texel_angle, int max_lod, std::vector<sGGXSample>& samples)
+{
+	samples.clear();
+	float a = roughness * roughness;
+	float a2 = std::max(a * a, 1e-8f);
+	for (int i = 0; i < count; ++i)
+	{
+		float phi = float(2.0 * PI) * i / count;
+		float e = radicalInverse(i);
+		float cos_theta = sqrt((1.0f - e) / (1.0f + (a2 - 1.0f) * e));
+		float sin_theta = sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+		Vector3f H(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+		sGGXSample sample;
+		sample.dir = H * (2.0f * cos_theta) - Vector3f(0.0f, 0.0f, 1.0f);
+		if (sample.dir.z <= 0.0f)
+			continue;
+
+		//pdf of L is D * n.h / (4 * v.h), with N = V both dots are the same
+		float d = (a2 - 1.0f) * cos_theta * cos_theta + 1.0f;
+		float D = a2 / float(PI * d * d);
+		float sample_angle = 4.0f / (count * D);
+		sample.lod = clamp(0.5f * log2(sample_angle / texel_angle) + 1.0f, 0.0f, (float)max_lod);
+		sample.weight = sample.dir.z;
+		samples.push_back(sample);
+	}
+}
+
+//bilinear inside the face, the borders are clamped
+template<class P> static inline P fetchBilinear(const sCubemapLevel& level, int face, float u, float v)
+{
+	int size = level.size;
+	float fx = clamp((u * 0.5f + 0.5f) * size - 0.5f, 0.0f, size - 1.0f);
+	float fy = clamp((v * 0.5f + 0.5f) * size - 0.5f, 0.0f, size - 1.0f);
+	int x0 = (int)fx;
+	int y0 = (int)fy;
+	int x1 = std::min(x0 + 1, size - 1);
+	int y1 = std::min(y0 + 1, size - 1);
+	float tx = fx - x0;
+	float ty = fy - y0;
+	const float* pixels = level.getFace(face);
+	P a, b, c, d;
+	a.load(pixels + (size_t(y0) * size + x0) * 4);
+	b.load(pixels + (size_t(y0) * size + x1) * 4);
+	c.load(pixels + (size_t(y1) * size + x0) * 4);
+	d.load(pixels + (size_t(y1) * size + x1) * 4);
+	return (a * (1.0f - tx) + b * tx) * (1.0f - ty) + (c * (1.0f - tx) + d * tx) * ty;
+}
+
+template<class P> static inline P fetchTrilinear(const std::vector<sCubemapLevel>& chain, int face, float u, float v, float lod)
+{
+	int level = (int)lod;
+	float t = lod - level;
+	if (t == 0.0f || level + 1 >= (int)chain.size())
+		return fetchBilinear<P>(chain[std::min(level, (int)chain.size() - 1)], face, u, v);
+	return fetchBilinear<P>(chain[level], face, u, v) * (1.0f - t) + fetchBilinear<P>(chain[level + 1], face, u, v) * t;
+}
+
+template<class P> static void filterRows(const std::vector<sCubemapLevel>& chain, const std::vector<sSampleBlock>& blocks, float inv_weight, sCubemapLevel& out, int first, int last)
+{
+	int size = out.size;
+	for (int row = first; row < last; ++row)
+	{
+		int face = row / size;
+		int y = row % size;
+		float* dst = out.getFace(face) + size_t(y) * size * 4;
+		float v = 2.0f * (y + 0.5f) / size - 1.0f;
+		for (int x = 0; x < size; ++x)
+		{
+			float u = 2.0f * (x + 0.5f) / size - 1.0f;
+			Vector3f N = normalize(CubemapFilter::getDirection(face, u, v));
+			Vector3f up = fabs(N.z) < 0.999f ? Vector3f(0.0f, 0.0f, 1.0f) : Vector3f(1.0f, 0.0f, 0.0f);
+			Vector3f T = normalize(cross(up, N));
+			Vector3f B = cross(N, T);
+			P acc(0.0f);
+			int face[4];
+			float su[4], sv[4];
+			for (const sSampleBlock& block : blocks)
+			{
+				P::address(block, T, B, N, face, su, sv);
+				for (int i = 0; i < block.count; ++i)
+					acc = acc + fetchTrilinear<P>(chain, face[i], su[i], sv[i], block.lod[i]) * block.weight[i];
+			}
+			(acc * inv_weight).store(dst + x * 4);
+		}
+	}
+}
+
+Vector3f CubemapFilter::getDirection(int face, float u, float v)
+{
+	const Vector3f* axis = cubemapFaceNormals[face];
+	return axis[0] * u + axis[1] * v + axis[2];
+}
+
+void CubemapFilter::getFaceUV(const Vector3f& dir, int& face, float& u, float& v)
+{
+	//the axis of cubemapFaceNormals written as signs
+	float ax = fabs(dir.x), ay = fabs(dir.y), az = fabs(dir.z);
+	float inv;
+	if (ax >= ay && ax >= az)
+	{
+		face = dir.x > 0.0f ? 0 : 1;
+		inv = 1.0f / ax;
+		u = (dir.x > 0.0f ? -dir.z : dir.z) * inv;
+		v = -dir.y * inv;
+	}
+	else if (ay >= az)
+	{
+		face = dir.y > 0.0f ? 2 : 3;
+		inv = 1.0f / ay;
+		u = dir.x * inv;
+		v = (dir.y > 0.0f ? dir.z : -dir.z) * inv;
+	}
+	else
+	{
+		face = dir.z > 0.0f ? 4 : 5;
+		inv = 1.0f / az;
+		u = (dir.z > 0.0f ? dir.x : -dir.x) * inv;
+		v = -dir.y * inv;
+	}
+}
+
+void CubemapFilter::prefilter(std::vector<sCubemapLevel>& levels, int num_levels)
+{
+	assert(levels.size() && isPowerOfTwo(levels[0].size));
+	auto start_time = std::chrono::high_resolution_clock::now();
+	int base = levels[0].size;
+	int num_mips = MipGenerator::getNumMips(base, base);
+	num_levels = std::max(1, std::min(num_levels, num_mips));
+	levels.resize(num_levels);
+
+	//box filtered chain of the input, the wide samples of the rough levels read from the small mips
+	std::vector<sCubemapLevel> chain(num_mips);
+	chain[0] = levels[0];
+	for (int i = 1; i < num_mips; ++i)
+	{
+		int size = chain[i - 1].size;
+		chain[i].resize(size >> 1);
+		for (int face = 0; face < 6; ++face)
+			MipGenerator::downsample(chain[i - 1].getFace(face), size, size, 4, chain[i].getFace(face));
+	}
+
+	float texel_angle = float(4.0 * PI / (6.0 * base * base));
+	std::vector<sGGXSample> samples;
+	std::vector<sSampleBlock> blocks;
+	for (int level = 1; level < num_levels; ++level)
+	{
+		buildSamples(getRoughness(level, num_levels), std::max(num_samples, 1), texel_angle, num_mips - 1, samples);
+		float total_weight = 0.0f;
+		blocks.assign((samples.size() + 3) / 4, sSampleBlock());
+		for (size_t i = 0; i < samples.size(); ++i)
+		{
+			sSampleBlock& block = blocks[i / 4];
+			int lane = i % 4;
+			if (!lane) //the unused lanes are addressed too
+				for (int j = 0; j < 4; ++j)
+				{
+					block.x[j] = block.y[j] = 0.0f;
+					block.z[j] = 1.0f;
+				}
+			block.x[lane] = samples[i].dir.x;
+			block.y[lane] = samples[i].dir.y;
+			block.z[lane] = samples[i].dir.z;
+			block.weight[lane] = samples[i].weight;
+			block.lod[lane] = samples[i].lod;
+			block.count = lane + 1;
+			total_weight += samples[i].weight;
+		}
+		float inv_weight = 1.0f / total_weight;
+
+		sCubemapLevel& out = levels[level];
+		out.resize(base >> level);
+		JobSystem::parallelFor(6 * out.size, FILTER_ROWS_PER_BATCH, [&](int first, int last) {
+		#ifdef CUBEMAP_SSE
+			if (use_simd)
+			{
+				filterRows<SSETexel>(chain, blocks, inv_weight, out, first, last);
+				return;
+			}
+		#endif
+			filterRows<ScalarTexel>(chain, blocks, inv_weight, out, first, last);
+		});
+	}
+
+	total_time += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+}
+
+bool CubemapFilter::benchmark(int size, int iterations)
+{
+	size = std::max(size, 4);
+	if (!isPowerOfTwo(size))
+		return false;
+	int num_levels = std::min(6, MipGenerator::getNumMips(size, size));
+	bool previous_simd = use_simd;
+	bool ok = true;
+
+	//a sky gradient with a small and bright sun, the worst case for few samples
+	std::vector<sCubemapLevel> source(1);
+	source[0].resize(size);
+	Vector3f sun = normalize(Vector3f(0.3f, 0.8f, 0.5f));
+	for (int face = 0; face < 6; ++face)
+		for (int y = 0; y < size; ++y)
+			for (int x = 0; x < size; ++x)
+			{
+				Vector3f dir = normalize(getDirection(face, 2.0f * (x + 0.5f) / size - 1.0f, 2.0f * (y + 0.5f) / size - 1.0f));
+				Vector3f color = dir.y > 0.0f ? Vector3f(0.3f, 0.5f, 0.9f) * (0.2f + dir.y) : Vector3f(0.2f, 0.15f, 0.1f);
+				if (dot(dir, sun) > 0.995f)
+					color = Vector3f(50.0f, 45.0f, 40.0f);
+				float* p = source[0].getFace(face) + (size_t(y) * size + x) * 4;
+				p[0] = color.x;
+				p[1] = color.y;
+				p[2] = color.z;
+				p[3] = 1.0f;
+			}
+
+	std::cout << "Cubemap GGX prefilter " << size << "x" << size << ", " << num_levels << " levels, " << num_samples << " samples, " << JobSystem::getNumThreads() << " threads" << std::endl;
+	std::vector<sCubemapLevel> results[2];
+	double times[2] = { 0, 0 };
+	for (int simd = 0; simd < 2; ++simd)
+	{
+		use_simd = simd != 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < iterations; ++i)
+		{
+			results[simd] = source;
+			prefilter(results[simd], num_levels);
+		}
+		times[simd] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / std::max(iterations, 1);
+	}
+	bool identical = true;
+	for (int level = 0; level < num_levels; ++level)
+		identical = identical && results[0][level].pixels == results[1][level].pixels;
+	ok = ok && identical;
+	std::cout << " scalar " << times[0] << "ms SIMD " << TermColor::GREEN << times[1] << "ms" << TermColor::DEFAULT << " x" << times[0] / times[1];
+	if (identical)
+		std::cout << " identical" << std::endl;
+	else
+		std::cout << TermColor::RED << " [ERROR] different from the scalar reference" << TermColor::DEFAULT << std::endl;
+
+	//a constant environment must stay constant in every level
+	std::vector<sCubemapLevel> flat(1);
+	flat[0].resize(size);
+	for (size_t i = 0; i < flat[0].pixels.size(); i += 4)
+	{
+		flat[0].pixels[i] = 1.0f;
+		flat[0].pixels[i + 1] = 0.5f;
+		flat[0].pixels[i + 2] = 0.25f;
+		flat[0].pixels[i + 3] = 1.0f;
+	}
+	prefilter(flat, num_levels);
+	float max_error = 0.0f;
+	for (int level = 0; level < num_levels; ++level)
+		for (size_t i = 0; i < flat[level].pixels.size(); i += 4)
+		{
+			max_error = std::max(max_error, (float)fabs(flat[level].pixels[i] - 1.0f));
+			max_error = std::max(max_error, (float)fabs(flat[level].pixels[i + 1] - 0.5f) * 2.0f);
+			max_error = std::max(max_error, (float)fabs(flat[level].pixels[i + 2] - 0.25f) * 4.0f);
+		}
+	bool flat_ok = max_error < 1e-4f;
+	ok = ok && flat_ok;
+	std::cout << " constant environment: relative error " << max_error;
+	if (flat_ok)
+		std::cout << " ok" << std::endl;
+	else
+		std::cout << TermColor::RED << " [ERROR] the filter does not preserve a constant color" << TermColor::DEFAULT << std::endl;
+	#ifndef CUBEMAP_SSE
+		std::cout << " (SSE not available in this build, both use the scalar path)" << std::endl;
+	#endif
+
+	use_simd = previous_simd;
+	return ok;
+}
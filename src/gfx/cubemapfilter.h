@@ -0,0 +1,44 @@
+/*  GGX prefiltering of cubemaps in the CPU, for the reflection probes.
+	The level l of the output is the input convolved with the GGX lobe of roughness l / (num_levels - 1), with N = V = R.
+	Samples are importance sampled (hammersley) and read from a box filtered mip of the input chosen from their pdf,
+	so a few of them are enough. Rows are split between the JobSystem workers and every fetch blends the 4 channels
+	at once with SSE, the scalar path gives the same bits.
+	Faces follow cubemapFaceNormals, the same order and orientation as GL_TEXTURE_CUBE_MAP_POSITIVE_X + i.
+*/
+
+#pragma once
+
+#include "../core/math.h"
+#include <vector>
+
+namespace GFX {
+
+	//the 6 faces of size * size RGBA floats, one after another
+	struct sCubemapLevel {
+		int size;
+		std::vector<float> pixels;
+
+		sCubemapLevel() : size(0) {}
+		void resize(int size) { this->size = size; pixels.assign(size_t(size) * size * 4 * 6, 0.0f); }
+		float* getFace(int face) { return &pixels[size_t(face) * size * size * 4]; }
+		const float* getFace(int face) const { return &pixels[size_t(face) * size * size * 4]; }
+	};
+
+	class CubemapFilter {
+	public:
+		static bool use_simd;
+		static int num_samples; //per texel of every level
+
+		//stats
+		static double total_time; //ms
+
+		static Vector3f getDirection(int face, float u, float v); //u and v from -1 to 1, not normalized
+		static void getFaceUV(const Vector3f& dir, int& face, float& u, float& v);
+		static float getRoughness(int level, int num_levels) { return num_levels > 1 ? level / float(num_levels - 1) : 0.0f; }
+
+		//levels[0] is the input (a power of two), the next num_levels - 1 are filled with the prefiltered ones
+		static void prefilter(std::vector<sCubemapLevel>& levels, int num_levels);
+		static bool benchmark(int size = 128, int iterations = 3); //SSE against the scalar path and a constant environment, no GPU needed
+	};
+
+};
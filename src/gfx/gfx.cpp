@@ -37,9 +37,10 @@ namespace GFX {
 			nCurAvailMemoryInKB = 0;
 		}
 
-		std::string str = "FPS: " + std::to_string(CORE::BaseApplication::instance->fps) + " Time: " + std::to_string(gpu_frame_microseconds) + "us DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB - nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
+		std::string str = "FPS: " + std::to_string(CORE::BaseApplication::instance->fps) + " Time: " + std::to_string(gpu_frame_microseconds) + "us DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB - nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs Culled meshlets: " + std::to_string(Mesh::num_meshlets_culled);
 		Mesh::num_meshes_rendered = 0;
 		Mesh::num_triangles_rendered = 0;
+		Mesh::num_meshlets_culled = 0;
 		return str;
 	}
 
@@ -235,6 +236,81 @@ namespace GFX {
 		waiting = available == 0;
 		return available != 0;
 	}
+
+	GPUTimer::GPUTimer() { num_frames = 0; current = 0; }
+
+	GPUTimer::~GPUTimer()
+	{
+		for (sFrame& frame : frames)
+			if (frame.queries.size())
+				glDeleteQueries((GLsizei)frame.queries.size(), &frame.queries[0]);
+	}
+
+	void GPUTimer::beginFrame()
+	{
+		current = (current + 1) % GPU_TIMER_FRAMES;
+		collect(frames[current], false);
+		frames[current].used = 0;
+	}
+
+	void GPUTimer::start(const void* key)
+	{
+		sFrame& frame = frames[current];
+		if (frame.queries.size() < size_t(frame.used + 1) * 2)
+		{
+			frame.queries.resize(size_t(frame.used + 1) * 2);
+			glGenQueries(2, &frame.queries[size_t(frame.used) * 2]);
+			frame.keys.resize(frame.used + 1);
+		}
+		frame.keys[frame.used] = key;
+		glQueryCounter(frame.queries[size_t(frame.used) * 2], GL_TIMESTAMP);
+	}
+
+	void GPUTimer::finish()
+	{
+		sFrame& frame = frames[current];
+		glQueryCounter(frame.queries[size_t(frame.used) * 2 + 1], GL_TIMESTAMP);
+		frame.used++;
+	}
+
+	void GPUTimer::flush()
+	{
+		for (int i = 1; i <= GPU_TIMER_FRAMES; ++i) //from the oldest
+		{
+			sFrame& frame = frames[(current + i) % GPU_TIMER_FRAMES];
+			collect(frame, true);
+			frame.used = 0;
+		}
+	}
+
+	void GPUTimer::reset()
+	{
+		times.clear();
+		num_frames = 0;
+		for (sFrame& frame : frames)
+			frame.used = 0;
+	}
+
+	bool GPUTimer::collect(sFrame& frame, bool wait)
+	{
+		if (!frame.used)
+			return false;
+		//the last query is the last to finish
+		GLint available = 1;
+		if (!wait)
+			glGetQueryObjectiv(frame.queries[size_t(frame.used) * 2 - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) //too slow to keep up, the frame is skipped
+			return false;
+		for (int i = 0; i < frame.used; ++i)
+		{
+			GLuint64 start_time = 0, end_time = 0;
+			glGetQueryObjectui64v(frame.queries[size_t(i) * 2], GL_QUERY_RESULT, &start_time);
+			glGetQueryObjectui64v(frame.queries[size_t(i) * 2 + 1], GL_QUERY_RESULT, &end_time);
+			times[frame.keys[i]] += (end_time - start_time) / 1000000.0;
+		}
+		num_frames++;
+		return true;
+	}
 };
 
 /*
@@ -44,6 +44,34 @@ namespace GFX {
 		bool isReady();
 	};
 
+	//GPU time of many draws per frame, with timestamps because GL_TIME_ELAPSED cannot nest inside the frame query.
+	//The results are read some frames later so it never waits for the GPU
+	#define GPU_TIMER_FRAMES 3
+	class GPUTimer
+	{
+	public:
+		std::map<const void*, double> times; //ms accumulated per key since the last reset
+		int num_frames; //accumulated
+
+		GPUTimer();
+		~GPUTimer();
+		void beginFrame(); //collects the oldest frame if the GPU finished it
+		void start(const void* key);
+		void finish();
+		void flush(); //waits for all the frames in flight
+		void reset();
+
+	private:
+		struct sFrame {
+			std::vector<GLuint> queries; //two per draw
+			std::vector<const void*> keys;
+			int used = 0;
+		};
+		sFrame frames[GPU_TIMER_FRAMES];
+		int current;
+		bool collect(sFrame& frame, bool wait);
+	};
+
 };
 
 
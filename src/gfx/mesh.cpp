@@ -10,12 +10,20 @@
 #include <cassert>
 #include <iostream>
 #include <limits>
+#include <algorithm>
+#include <chrono>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#include <emmintrin.h>
+	#define MESHLETS_SSE
+#endif
 #include <sys/stat.h>
 
 #include "../pipeline/camera.h" //??
 #include "texture.h"
 //#include "animation.h"
 #include "../extra/coldet/coldet.h"
+#include "residency.h"
 
 //#include "engine/application.h"
 
@@ -24,12 +32,15 @@ namespace GFX {
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
-bool Mesh::use_vao = false;	//places the geometry in an interleaved array
+bool Mesh::use_vao = true;	//builds a VAO on upload so render is a single bind + draw
+bool Mesh::has_vao = false;
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
 uint32 Mesh::s_last_index = 0;
+bool Mesh::use_meshlets = true;
+long Mesh::num_meshlets_culled = 0;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -40,8 +51,14 @@ Mesh::Mesh()
 {
 	index = s_last_index++;
 	radius = 0;
+	uv_density = 0;
 	vao_id = vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
 	collision_model = NULL;
+	last_used_frame = 0;
+	evicted = false;
+	has_bin = false;
+	reloading = false;
+	gpu_bytes = 0;
 
 	clear();
 }
@@ -100,6 +117,7 @@ void Mesh::clear()
 
 	//GPU Buffers ids set to 0
 	vao_id = vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	gpu_bytes = 0;
 
 	//buffers
 	vertices.clear();
@@ -111,6 +129,11 @@ void Mesh::clear()
 	bones.clear();
 	weights.clear();
 	m_uvs1.clear();
+	uv_density = 0;
+	bones_offset.clear();
+	bones_remap.clear();
+	meshlets.clear();
+	updateMeshletsSoA();
 
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
@@ -126,14 +149,9 @@ void Mesh::uploadToVRAM()
 {
 	assert(vertices.size() || interleaved.size());
 
-	/*
-	if (use_vao)
-	{
-		if (vao_id == 0)
-			glGenVertexArrays(1, &vao_id);
-		glBindVertexArray(vao_id);
-	}
-	*/
+	gpu_bytes = 0;
+	if (!uv_density)
+		updateUVDensity(); //kept when evicted, the RAM copy may be released
 
 	if (glGenBuffersARB == nullptr)
 	{
@@ -148,6 +166,7 @@ void Mesh::uploadToVRAM()
 			glGenBuffersARB(1, &interleaved_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
+		gpu_bytes += interleaved.size() * sizeof(tInterleaved);
 	}
 	else
 	{
@@ -156,6 +175,7 @@ void Mesh::uploadToVRAM()
 			glGenBuffersARB(1, &vertices_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices_vbo_id);
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertices.size() * sizeof(Vector3f), &vertices[0], GL_STATIC_DRAW_ARB);
+		gpu_bytes += vertices.size() * sizeof(Vector3f);
 
 		// UVs
 		if (uvs.size())
@@ -164,6 +184,7 @@ void Mesh::uploadToVRAM()
 				glGenBuffersARB(1, &uvs_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs_vbo_id);
 			glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(Vector2f), &uvs[0], GL_STATIC_DRAW_ARB);
+			gpu_bytes += uvs.size() * sizeof(Vector2f);
 		}
 
 		// Normals
@@ -173,6 +194,7 @@ void Mesh::uploadToVRAM()
 				glGenBuffersARB(1, &normals_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
 			glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3f), &normals[0], GL_STATIC_DRAW_ARB);
+			gpu_bytes += normals.size() * sizeof(Vector3f);
 		}
 	}
 
@@ -183,6 +205,7 @@ void Mesh::uploadToVRAM()
 			glGenBuffersARB(1, &uvs1_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs1_vbo_id);
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, m_uvs1.size() * sizeof(Vector2f), &m_uvs1[0], GL_STATIC_DRAW_ARB);
+		gpu_bytes += m_uvs1.size() * sizeof(Vector2f);
 	}
 
 	// Colors
@@ -192,6 +215,7 @@ void Mesh::uploadToVRAM()
 			glGenBuffersARB(1, &colors_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, colors_vbo_id);
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, colors.size() * sizeof(Vector4f), &colors[0], GL_STATIC_DRAW_ARB);
+		gpu_bytes += colors.size() * sizeof(Vector4f);
 	}
 
 	if (bones.size())
@@ -200,6 +224,7 @@ void Mesh::uploadToVRAM()
 			glGenBuffersARB(1, &bones_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, bones_vbo_id);
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, bones.size() * sizeof(Vector4ub), &bones[0], GL_STATIC_DRAW_ARB);
+		gpu_bytes += bones.size() * sizeof(Vector4ub);
 	}
 	if (weights.size())
 	{
@@ -207,6 +232,7 @@ void Mesh::uploadToVRAM()
 			glGenBuffersARB(1, &weights_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, weights_vbo_id);
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, weights.size() * sizeof(Vector4f), &weights[0], GL_STATIC_DRAW_ARB);
+		gpu_bytes += weights.size() * sizeof(Vector4f);
 	}
 
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
@@ -218,16 +244,13 @@ void Mesh::uploadToVRAM()
 			glGenBuffersARB(1, &indices_vbo_id);
 		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
+		gpu_bytes += m_indices.size() * sizeof(unsigned int);
 	}
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-	/*
-	if (use_vao)
-	{
-		enableBuffers(nullptr);
-		glBindVertexArray(0);
-	}
-	*/
+	//attributes go to the fixed locations (see eAttribLocation), so one VAO per mesh works with every shader
+	if (use_vao && has_vao)
+		buildVAO();
 
 	checkGLErrors();
 	//clear buffers to save memory
@@ -240,10 +263,25 @@ int uv1_location = -1;
 int color_location = -1;
 int bones_location = -1;
 int weights_location = -1;
+bool vao_bound = false; //when true the index buffer is already part of the VAO state
+
+void Mesh::buildVAO()
+{
+	assert(vertices_vbo_id || interleaved_vbo_id); //geometry is not in the VRAM
+	if (vao_id == 0)
+		glGenVertexArrays(1, &vao_id);
+	glBindVertexArray(vao_id);
+	enableBuffers(nullptr);
+	if (indices_vbo_id)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	checkGLErrors();
+}
 
 void Mesh::enableBuffers(Shader* sh)
 {
-	vertex_location = !sh ? 0 : sh->getAttribLocation("a_vertex");
+	vertex_location = !sh ? ATTRIB_VERTEX : sh->getAttribLocation("a_vertex");
 	/*
 	assert(vertex_location != -1 && "No a_vertex found in shader");
 	if (vertex_location == -1)
@@ -277,7 +315,7 @@ void Mesh::enableBuffers(Shader* sh)
 	normal_location = -1;
 	if (normals.size() || spacing)
 	{
-		normal_location = !sh ? 1 : sh->getAttribLocation("a_normal");
+		normal_location = !sh ? ATTRIB_NORMAL : sh->getAttribLocation("a_normal");
 		if (normal_location != -1)
 		{
 			glEnableVertexAttribArray(normal_location);
@@ -295,7 +333,7 @@ void Mesh::enableBuffers(Shader* sh)
 	uv_location = -1;
 	if (uvs.size() || spacing)
 	{
-		uv_location = !sh ? 2 : sh->getAttribLocation("a_coord");
+		uv_location = !sh ? ATTRIB_COORD : sh->getAttribLocation("a_coord");
 		if (uv_location != -1)
 		{
 			glEnableVertexAttribArray(uv_location);
@@ -313,7 +351,7 @@ void Mesh::enableBuffers(Shader* sh)
 	uv1_location = -1;
 	if (m_uvs1.size())
 	{
-		uv1_location = !sh ? 3 : sh->getAttribLocation("a_coord1");
+		uv1_location = !sh ? ATTRIB_COORD1 : sh->getAttribLocation("a_coord1");
 		if (uv1_location != -1)
 		{
 			glEnableVertexAttribArray(uv1_location);
@@ -331,7 +369,7 @@ void Mesh::enableBuffers(Shader* sh)
 	color_location = -1;
 	if (colors.size())
 	{
-		color_location = !sh ? 4 : sh->getAttribLocation("a_color");
+		color_location = !sh ? ATTRIB_COLOR : sh->getAttribLocation("a_color");
 		if (color_location != -1)
 		{
 			glEnableVertexAttribArray(color_location);
@@ -349,7 +387,7 @@ void Mesh::enableBuffers(Shader* sh)
 	bones_location = -1;
 	if (bones.size())
 	{
-		bones_location = !sh ? 5 : sh->getAttribLocation("a_bones");
+		bones_location = !sh ? ATTRIB_BONES : sh->getAttribLocation("a_bones");
 		if (bones_location != -1)
 		{
 			glEnableVertexAttribArray(bones_location);
@@ -365,7 +403,7 @@ void Mesh::enableBuffers(Shader* sh)
 	weights_location = -1;
 	if (weights.size())
 	{
-		weights_location = !sh ? 6 : sh->getAttribLocation("a_weights");
+		weights_location = !sh ? ATTRIB_WEIGHTS : sh->getAttribLocation("a_weights");
 		if (weights_location != -1)
 		{
 			glEnableVertexAttribArray(weights_location);
@@ -391,8 +429,23 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
+	last_used_frame = Residency::frame;
+	if (evicted && !makeResident())
+		return;
 	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
+	//fast path: all the attribute state lives in the VAO (instancing adds its own attribs to the current VAO, so it goes the slow way)
+	if (vao_id && use_vao && num_instances == 0)
+	{
+		glBindVertexArray(vao_id);
+		vao_bound = true;
+		drawCall(primitive, submesh_id, num_instances);
+		vao_bound = false;
+		glBindVertexArray(0);
+		checkGLErrors();
+		return;
+	}
+
 	//bind buffers to attribute locations
 	enableBuffers(shader);
 	checkGLErrors();
@@ -448,7 +501,9 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		{
 			if (indices_vbo_id)
 			{
-				/*if (size != 90)*/ {
+				if (vao_bound) //indices already bound in the VAO, unbinding them would break it
+					glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)));
+				else {
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
@@ -497,19 +552,7 @@ void Mesh::drawUsingVAO(unsigned int primitive, int submesh_id)
 	getSubmeshStartAndSize( submesh_id, start, size );
 
 	if (vao_id == 0) //upload
-	{
-		assert(vertices_vbo_id || interleaved_vbo_id); //geometry is not in the VRAM
-		glGenVertexArrays(1, &vao_id);
-		glBindVertexArray(vao_id);
-		enableBuffers(nullptr);
-		//enable also indices buffer
-		if (indices_vbo_id != 0)
-		{
-			glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
-		}
-		glBindVertexArray(0);
-	}
+		buildVAO();
 
 	glBindVertexArray(vao_id);
 	if (indices_vbo_id)
@@ -764,6 +807,410 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
+// MESHLETS ************************************
+
+//spreads the 10 lower bits so there are two zeros between every bit
+static uint32 expandBits10(uint32 v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+//moves the triangles of a non indexed stream to follow the new order
+template<typename T> static void reorderTriangles(std::vector<T>& stream, const std::vector<uint32>& order)
+{
+	if (stream.empty())
+		return;
+	std::vector<T> result(stream.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		for (int k = 0; k < 3; ++k)
+			result[i * 3 + k] = stream[order[i] * 3 + k];
+	stream.swap(result);
+}
+
+void Mesh::buildMeshlets(uint32 max_triangles)
+{
+	meshlets.clear();
+
+	bool indexed = m_indices.size() != 0;
+	uint32 num_triangles = (indexed ? (uint32)m_indices.size() : getNumVertices()) / 3;
+	if (num_triangles <= max_triangles * 2) //not worth it
+	{
+		updateMeshletsSoA();
+		return;
+	}
+
+	auto position = [&](uint32 t, int k) -> const Vector3f& {
+		uint32 v = indexed ? m_indices[t * 3 + k] : t * 3 + k;
+		return interleaved.size() ? interleaved[v].vertex : vertices[v];
+	};
+
+	//meshlets cannot cross submeshes (ranges are in vertices/indices)
+	std::vector<uint32> ranges; //triangle where every range starts
+	for (sSubmeshInfo& submesh : submeshes)
+		if (submesh.start % 3 == 0 && submesh.start / 3 < (int)num_triangles && (ranges.empty() || submesh.start / 3 > (int)ranges.back()))
+			ranges.push_back(submesh.start / 3);
+	if (ranges.empty() || ranges[0] != 0)
+		ranges.insert(ranges.begin(), 0);
+	ranges.push_back(num_triangles);
+
+	//sort the triangles of every range along a morton curve so consecutive triangles are close in space
+	Vector3f min_pos = position(0, 0);
+	Vector3f max_pos = min_pos;
+	std::vector<Vector3f> centroids(num_triangles);
+	for (uint32 t = 0; t < num_triangles; ++t)
+	{
+		Vector3f c = (position(t, 0) + position(t, 1) + position(t, 2)) * (1.0f / 3.0f);
+		centroids[t] = c;
+		min_pos.set(std::min(min_pos.x, c.x), std::min(min_pos.y, c.y), std::min(min_pos.z, c.z));
+		max_pos.set(std::max(max_pos.x, c.x), std::max(max_pos.y, c.y), std::max(max_pos.z, c.z));
+	}
+	Vector3f size = max_pos - min_pos;
+	Vector3f inv_size(size.x > 0 ? 1023.0f / size.x : 0, size.y > 0 ? 1023.0f / size.y : 0, size.z > 0 ? 1023.0f / size.z : 0);
+
+	std::vector<uint32> codes(num_triangles);
+	std::vector<uint32> order(num_triangles);
+	for (uint32 t = 0; t < num_triangles; ++t)
+	{
+		Vector3f q = (centroids[t] - min_pos) * inv_size;
+		codes[t] = (expandBits10((uint32)q.x) << 2) | (expandBits10((uint32)q.y) << 1) | expandBits10((uint32)q.z);
+		order[t] = t;
+	}
+	for (size_t r = 0; r + 1 < ranges.size(); ++r)
+		std::sort(order.begin() + ranges[r], order.begin() + ranges[r + 1], [&](uint32 a, uint32 b) { return codes[a] < codes[b]; });
+
+	//apply the new order
+	if (indexed)
+	{
+		std::vector<unsigned int> indices(m_indices.size());
+		for (uint32 t = 0; t < num_triangles; ++t)
+			for (int k = 0; k < 3; ++k)
+				indices[t * 3 + k] = m_indices[order[t] * 3 + k];
+		m_indices.swap(indices);
+	}
+	else
+	{
+		reorderTriangles(vertices, order);
+		reorderTriangles(normals, order);
+		reorderTriangles(uvs, order);
+		reorderTriangles(m_uvs1, order);
+		reorderTriangles(colors, order);
+		reorderTriangles(interleaved, order);
+		reorderTriangles(bones, order);
+		reorderTriangles(weights, order);
+	}
+
+	//cut every range in meshlets and compute their bounds
+	for (size_t r = 0; r + 1 < ranges.size(); ++r)
+		for (uint32 first = ranges[r]; first < ranges[r + 1]; first += max_triangles)
+		{
+			uint32 last = std::min(first + max_triangles, ranges[r + 1]);
+
+			Vector3f bmin = position(first, 0);
+			Vector3f bmax = bmin;
+			Vector3f normal_sum(0, 0, 0);
+			for (uint32 t = first; t < last; ++t)
+			{
+				for (int k = 0; k < 3; ++k)
+				{
+					const Vector3f& p = position(t, k);
+					bmin.set(std::min(bmin.x, p.x), std::min(bmin.y, p.y), std::min(bmin.z, p.z));
+					bmax.set(std::max(bmax.x, p.x), std::max(bmax.y, p.y), std::max(bmax.z, p.z));
+				}
+				Vector3f n = cross(position(t, 1) - position(t, 0), position(t, 2) - position(t, 0));
+				float len = n.length();
+				if (len > 0)
+					normal_sum = normal_sum + n * (1.0f / len);
+			}
+
+			sMeshlet meshlet;
+			meshlet.center = (bmin + bmax) * 0.5f;
+			meshlet.radius = 0;
+			for (uint32 t = first; t < last; ++t)
+				for (int k = 0; k < 3; ++k)
+					meshlet.radius = std::max(meshlet.radius, (position(t, k) - meshlet.center).length());
+
+			//normal cone: the spread is the widest angle between the average normal and any triangle normal
+			float axis_len = normal_sum.length();
+			meshlet.cone_axis = axis_len > 0 ? normal_sum * (1.0f / axis_len) : Vector3f(0, 1, 0);
+			float min_dot = axis_len > 0 ? 1.0f : -1.0f;
+			for (uint32 t = first; t < last && min_dot > 0; ++t)
+			{
+				Vector3f n = cross(position(t, 1) - position(t, 0), position(t, 2) - position(t, 0));
+				float len = n.length();
+				if (len > 0)
+					min_dot = std::min(min_dot, dot(n, meshlet.cone_axis) / len);
+			}
+			//wider than ~85 degrees is too wide to be culled, otherwise store sin(angle) to test against the view vector
+			meshlet.cone_cutoff = min_dot <= 0.1f ? 1.0f : sqrtf(1.0f - min_dot * min_dot);
+
+			meshlet.start = first * 3;
+			meshlet.count = (last - first) * 3;
+			meshlets.push_back(meshlet);
+		}
+
+	updateMeshletsSoA();
+}
+
+void Mesh::updateMeshletsSoA()
+{
+	size_t num = (meshlets.size() + 3) & ~size_t(3);
+	std::vector<float>* streams[] = { &meshlets_soa.cx, &meshlets_soa.cy, &meshlets_soa.cz, &meshlets_soa.radius, &meshlets_soa.ax, &meshlets_soa.ay, &meshlets_soa.az, &meshlets_soa.cutoff };
+	for (std::vector<float>* stream : streams)
+		stream->assign(num, 0.0f);
+	for (size_t i = 0; i < meshlets.size(); ++i)
+	{
+		sMeshlet& m = meshlets[i];
+		meshlets_soa.cx[i] = m.center.x;
+		meshlets_soa.cy[i] = m.center.y;
+		meshlets_soa.cz[i] = m.center.z;
+		meshlets_soa.radius[i] = m.radius;
+		meshlets_soa.ax[i] = m.cone_axis.x;
+		meshlets_soa.ay[i] = m.cone_axis.y;
+		meshlets_soa.az[i] = m.cone_axis.z;
+		meshlets_soa.cutoff[i] = m.cone_cutoff;
+	}
+}
+
+uint32 Mesh::cullMeshlets(const Matrix44& model, Camera* camera, bool backface_culling, std::vector<uint8>& visible, bool use_simd)
+{
+	size_t num = meshlets.size();
+	visible.resize(num);
+	if (!num)
+		return 0;
+
+	//bring the frustum planes to object space instead of transforming every meshlet,
+	//the length of the plane normal is how much the model scales the radius in that direction
+	float planes[6][4];
+	float radius_scale[6];
+	const float* m = model.m;
+	for (int p = 0; p < 6; ++p)
+	{
+		const float* f = camera->frustum[p];
+		planes[p][0] = f[0] * m[0] + f[1] * m[1] + f[2] * m[2];
+		planes[p][1] = f[0] * m[4] + f[1] * m[5] + f[2] * m[6];
+		planes[p][2] = f[0] * m[8] + f[1] * m[9] + f[2] * m[10];
+		planes[p][3] = f[0] * m[12] + f[1] * m[13] + f[2] * m[14] + f[3];
+		radius_scale[p] = -sqrtf(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] + planes[p][2] * planes[p][2]);
+	}
+
+	//and the camera too, for the backface cones
+	Matrix44 inv_model = model;
+	inv_model.inverse();
+	Vector3f eye = inv_model * camera->eye;
+
+	const sMeshletsSoA& soa = meshlets_soa;
+	uint32 num_visible = 0;
+	size_t i = 0;
+
+#ifdef MESHLETS_SSE
+	if (use_simd)
+	{
+		__m128 eye_x = _mm_set1_ps(eye.x), eye_y = _mm_set1_ps(eye.y), eye_z = _mm_set1_ps(eye.z);
+		for (; i < num; i += 4) //SoA is padded to 4
+		{
+			__m128 cx = _mm_loadu_ps(&soa.cx[i]);
+			__m128 cy = _mm_loadu_ps(&soa.cy[i]);
+			__m128 cz = _mm_loadu_ps(&soa.cz[i]);
+			__m128 r = _mm_loadu_ps(&soa.radius[i]);
+
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (int p = 0; p < 6; ++p)
+			{
+				__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(planes[p][0])), _mm_mul_ps(cy, _mm_set1_ps(planes[p][1]))),
+					_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(planes[p][2])), _mm_set1_ps(planes[p][3])));
+				inside = _mm_and_ps(inside, _mm_cmpgt_ps(dist, _mm_mul_ps(r, _mm_set1_ps(radius_scale[p]))));
+			}
+
+			if (backface_culling)
+			{
+				__m128 vx = _mm_sub_ps(cx, eye_x), vy = _mm_sub_ps(cy, eye_y), vz = _mm_sub_ps(cz, eye_z);
+				__m128 view_len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+				__m128 view_dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, _mm_loadu_ps(&soa.ax[i])), _mm_mul_ps(vy, _mm_loadu_ps(&soa.ay[i]))), _mm_mul_ps(vz, _mm_loadu_ps(&soa.az[i])));
+				__m128 backfacing = _mm_cmpge_ps(view_dot, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&soa.cutoff[i]), view_len), r));
+				inside = _mm_andnot_ps(backfacing, inside);
+			}
+
+			int mask = _mm_movemask_ps(inside);
+			size_t n = std::min(num - i, size_t(4));
+			for (size_t k = 0; k < n; ++k)
+			{
+				visible[i + k] = (mask >> k) & 1;
+				num_visible += visible[i + k];
+			}
+		}
+	}
+#endif
+
+	for (; i < num; ++i)
+	{
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; ++p)
+			inside = soa.cx[i] * planes[p][0] + soa.cy[i] * planes[p][1] + soa.cz[i] * planes[p][2] + planes[p][3] > soa.radius[i] * radius_scale[p];
+
+		if (inside && backface_culling)
+		{
+			Vector3f v(soa.cx[i] - eye.x, soa.cy[i] - eye.y, soa.cz[i] - eye.z);
+			inside = v.x * soa.ax[i] + v.y * soa.ay[i] + v.z * soa.az[i] < soa.cutoff[i] * v.length() + soa.radius[i];
+		}
+
+		visible[i] = inside;
+		num_visible += inside;
+	}
+
+	return num_visible;
+}
+
+void Mesh::renderMeshlets(unsigned int primitive, const Matrix44& model, Camera* camera, bool backface_culling)
+{
+	//meshlets need the VAO, otherwise render it whole
+	if (!use_meshlets || meshlets.empty() || !camera || evicted || !vao_id || !use_vao)
+	{
+		render(primitive);
+		return;
+	}
+
+	Shader* shader = Shader::current;
+	if (!shader || !shader->compiled)
+	{
+		assert(0 && "no shader or shader not compiled or enabled");
+		return;
+	}
+	last_used_frame = Residency::frame;
+
+	static std::vector<uint8> visible;
+	static std::vector<GLsizei> counts;
+	static std::vector<GLint> firsts;
+	static std::vector<const void*> offsets;
+
+	uint32 num_visible = cullMeshlets(model, camera, backface_culling, visible);
+	num_meshlets_culled += (long)meshlets.size() - num_visible;
+	if (!num_visible)
+		return;
+
+	//consecutive meshlets are contiguous in the buffers, merge them in a single range
+	counts.clear();
+	firsts.clear();
+	offsets.clear();
+	uint32 last_end = 0xFFFFFFFF;
+	uint32 total = 0;
+	for (size_t i = 0; i < meshlets.size(); ++i)
+	{
+		if (!visible[i])
+			continue;
+		sMeshlet& meshlet = meshlets[i];
+		if (meshlet.start == last_end)
+			counts.back() += meshlet.count;
+		else
+		{
+			counts.push_back(meshlet.count);
+			firsts.push_back(meshlet.start);
+			offsets.push_back((const void*)(size_t(meshlet.start) * sizeof(unsigned int)));
+		}
+		last_end = meshlet.start + meshlet.count;
+		total += meshlet.count;
+	}
+
+	glBindVertexArray(vao_id);
+	if (indices_vbo_id)
+		glMultiDrawElements(primitive, &counts[0], GL_UNSIGNED_INT, &offsets[0], (GLsizei)counts.size());
+	else
+		glMultiDrawArrays(primitive, &firsts[0], &counts[0], (GLsizei)counts.size());
+	glBindVertexArray(0);
+	checkGLErrors();
+
+	num_triangles_rendered += total / 3;
+	num_meshes_rendered++;
+}
+
+bool Mesh::benchmarkMeshlets(const char* filename, int iterations)
+{
+	auto_upload_to_vram = false;
+	Mesh* mesh = Get(filename);
+	if (!mesh)
+		return false;
+	if (mesh->meshlets.empty())
+		mesh->buildMeshlets();
+	if (mesh->meshlets.empty())
+	{
+		std::cout << "Mesh too small for meshlets: " << filename << std::endl;
+		return false;
+	}
+
+	//orbit around the mesh so part of it is always outside or facing away
+	Camera camera;
+	camera.setPerspective(60.0f, 1.0f, 0.1f, mesh->radius * 100.0f + 100.0f);
+	Matrix44 model;
+	std::vector<uint8> visible;
+
+	for (int simd = 0; simd < 2; ++simd)
+	{
+		uint64 num_visible = 0;
+		double time = 0;
+		for (int i = 0; i < iterations; ++i)
+		{
+			float angle = i * 0.1f;
+			Vector3f eye = mesh->box.center + Vector3f(sinf(angle), 0.3f, cosf(angle)) * (mesh->radius * 1.5f + 1.0f);
+			camera.lookAt(eye, mesh->box.center + Vector3f(cosf(angle * 3.0f), 0, 0) * mesh->radius, Vector3f(0, 1, 0));
+			auto start = std::chrono::high_resolution_clock::now();
+			num_visible += mesh->cullMeshlets(model, &camera, true, visible, simd != 0);
+			time += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+		std::cout << (simd ? " SIMD" : " Scalar") << " culling of " << mesh->meshlets.size() << " meshlets: " << TermColor::GREEN << time / iterations << "us" << TermColor::DEFAULT
+			<< " visible: " << (100.0 * num_visible) / (double(iterations) * mesh->meshlets.size()) << "%" << std::endl;
+	}
+	#ifndef MESHLETS_SSE
+		std::cout << " (SSE not available in this build, both use the scalar path)" << std::endl;
+	#endif
+	return true;
+}
+
+bool Mesh::benchmarkDraws(const char* filename, int num_draws)
+{
+	Mesh* mesh = Get(filename);
+	if (!mesh || (!mesh->vertices_vbo_id && !mesh->interleaved_vbo_id))
+		return false;
+	if (!mesh->vao_id && has_vao)
+		mesh->buildVAO();
+
+	Shader* shader = Shader::getDefaultShader("flat");
+	shader->enable();
+	shader->setUniform("u_model", Matrix44());
+	shader->setUniform("u_viewprojection", Matrix44());
+	shader->setUniform("u_color", Vector4f(1, 1, 1, 1));
+
+	//the same draws with the attribute setup per draw and with the VAO, glFinish so the driver work is counted
+	bool previous = use_vao;
+	double times[2] = { 0, 0 };
+	for (int vao = 0; vao < 2; ++vao)
+	{
+		use_vao = vao == 1;
+		if (use_vao && !mesh->vao_id)
+			break;
+		mesh->render(GL_TRIANGLES); //warm up
+		glFinish();
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < num_draws; ++i)
+			mesh->render(GL_TRIANGLES);
+		glFinish();
+		times[vao] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		std::cout << (vao ? " VAO" : " Attributes") << ": " << TermColor::GREEN << times[vao] * 1000.0 / num_draws << "ms" << TermColor::DEFAULT << " per 1000 draws" << std::endl;
+	}
+	use_vao = previous;
+	shader->disable();
+
+	if (!mesh->vao_id)
+	{
+		std::cout << "[WARN] no VAO in this context, only the attribute path was measured" << std::endl;
+		return false;
+	}
+	std::cout << " x" << times[0] / std::max(times[1], 1e-6) << " with " << mesh->getNumVertices() << " vertices per draw" << std::endl;
+	return true;
+}
+
 typedef struct 
 {
 	int version;
@@ -779,7 +1226,8 @@ typedef struct
 	int num_submeshes;
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
+	int num_meshlets; //old bins have 0 here
+	char extra[28]; //unused
 } sMeshInfo;
 
 bool Mesh::readBin(const char* filename)
@@ -794,19 +1242,27 @@ bool Mesh::readBin(const char* filename)
 	if (f == NULL)
 		return false;
 
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
+	std::vector<uint8> data((size_t)stbuffer.st_size);
+	if (data.size())
+		fread(&data[0], data.size(), 1, f);
 	fclose(f);
 
+	if (!parseBin(data, filename))
+		return false;
+	createCollisionModel();
+	return true;
+}
+
+bool Mesh::parseBin(const std::vector<uint8>& data, const char* filename)
+{
 	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
+	if ( data.size() < 4 + sizeof(sMeshInfo) || memcmp(&data[0],"MBIN",4) != 0 )
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
 		return false;
 	}
 
-	char* pos = data + 4;
+	const uint8* pos = &data[4];
 	sMeshInfo info;
 	memcpy(&info,pos,sizeof(sMeshInfo));
 	pos += sizeof(sMeshInfo);
@@ -855,7 +1311,7 @@ bool Mesh::readBin(const char* filename)
 	{
 		m_indices.resize(info.num_indices);
 		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		pos += sizeof(unsigned int) * info.num_indices;
 	}
 
 	if (info.streams[5] == 'B')
@@ -872,13 +1328,7 @@ bool Mesh::readBin(const char* filename)
 		pos += sizeof(Vector4f) * info.size;
 	}
 
-	if (info.streams[7] == 'u')
-	{
-		m_uvs1.resize(info.size);
-		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2f) * info.size);
-		pos += sizeof(Vector2f) * info.size;
-	}
-
+	//same order than in writeBin
 	if (info.num_bones)
 	{
 		bones_info.resize(info.num_bones);
@@ -886,6 +1336,13 @@ bool Mesh::readBin(const char* filename)
 		pos += sizeof(BoneInfo) * info.num_bones;
 	}
 
+	if (info.streams[7] == 'u')
+	{
+		m_uvs1.resize(info.size);
+		memcpy((void*)&m_uvs1[0], pos, sizeof(Vector2f) * info.size);
+		pos += sizeof(Vector2f) * info.size;
+	}
+
 	aabb_max = info.aabb_max;
 	aabb_min = info.aabb_min;
 	box.center = info.center;
@@ -894,10 +1351,15 @@ bool Mesh::readBin(const char* filename)
 	bind_matrix = info.bind_matrix;
 
 	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
+	if (info.num_submeshes)
+		memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
-	createCollisionModel();
+	meshlets.resize(info.num_meshlets);
+	if (info.num_meshlets)
+		memcpy(&meshlets[0], pos, sizeof(sMeshlet) * info.num_meshlets);
+	pos += sizeof(sMeshlet) * info.num_meshlets;
+	updateMeshletsSoA();
 	return true;
 }
 
@@ -931,6 +1393,7 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	info.num_meshlets = meshlets.size();
 
 	info.streams[0] = interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
@@ -971,12 +1434,112 @@ bool Mesh::writeBin(const char* filename)
 	if (m_uvs1.size())
 		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2f), 1, f);
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	if (submeshes.size())
+		fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	if (meshlets.size())
+		fwrite((void*)&meshlets[0], meshlets.size() * sizeof(sMeshlet), 1, f);
 
 	fclose(f);
 	return true;
 }
 
+std::string Mesh::getBinFilename()
+{
+	std::string binfilename = name;
+	if (toLowerCase(getExtension(binfilename)) == "mbin")
+		return binfilename;
+	//names from GLTFs use :: to separate submeshes
+	std::replace(binfilename.begin(), binfilename.end(), ':', '_');
+	return binfilename + ".mbin";
+}
+
+size_t Mesh::getCPUBytes()
+{
+	return vertices.capacity() * sizeof(Vector3f) + normals.capacity() * sizeof(Vector3f) + uvs.capacity() * sizeof(Vector2f) +
+		m_uvs1.capacity() * sizeof(Vector2f) + colors.capacity() * sizeof(Vector4f) + interleaved.capacity() * sizeof(tInterleaved) +
+		m_indices.capacity() * sizeof(unsigned int) + bones.capacity() * sizeof(Vector4ub) + weights.capacity() * sizeof(Vector4f) +
+		meshlets.capacity() * sizeof(sMeshlet);
+}
+
+//swap with an empty one, clear() keeps the capacity
+template<typename T> void freeVector(std::vector<T>& v) { std::vector<T>().swap(v); }
+
+bool Mesh::evict()
+{
+	if (evicted || !gpu_bytes || name.empty())
+		return false;
+
+	//the .mbin was written when the mesh was loaded, without it we keep the RAM copy
+	bool keep_cpu = !has_bin;
+
+	//release VRAM
+	if (vao_id)
+		glDeleteVertexArrays(1, &vao_id);
+	unsigned int* vbos[] = { &vertices_vbo_id, &uvs_vbo_id, &normals_vbo_id, &colors_vbo_id, &indices_vbo_id, &interleaved_vbo_id, &bones_vbo_id, &weights_vbo_id, &uvs1_vbo_id };
+	for (unsigned int* vbo : vbos)
+	{
+		if (*vbo)
+			glDeleteBuffers(1, vbo);
+		*vbo = 0;
+	}
+	vao_id = 0;
+	gpu_bytes = 0;
+
+	//release RAM, bounding and collision model are kept
+	if (!keep_cpu)
+	{
+		freeVector(vertices);
+		freeVector(normals);
+		freeVector(uvs);
+		freeVector(m_uvs1);
+		freeVector(colors);
+		freeVector(interleaved);
+		freeVector(m_indices);
+		freeVector(bones);
+		freeVector(weights);
+	}
+
+	evicted = true;
+	return true;
+}
+
+bool Mesh::makeResident(bool wait)
+{
+	if (!evicted)
+		return true;
+
+	//without the RAM copy the .mbin is read in the background, the draws skip the mesh until it is uploaded
+	if (!vertices.size() && !interleaved.size())
+	{
+		if (wait)
+		{
+			std::string binfilename = getBinFilename();
+			std::vector<uint8> buffer;
+			submeshes.clear();
+			bones_info.clear();
+			if (!readFileBin(binfilename, buffer) || !parseBin(buffer, binfilename.c_str()))
+			{
+				std::cout << TermColor::RED << "[ERROR] cannot read " << binfilename << TermColor::DEFAULT << std::endl;
+				return false;
+			}
+		}
+		else
+		{
+			if (!reloading)
+			{
+				reloading = true;
+				TaskManager::background.addTask(new LoadMeshTask(name.c_str(), getBinFilename().c_str()));
+			}
+			return false;
+		}
+	}
+
+	uploadToVRAM();
+	evicted = false;
+	Residency::num_reloads++;
+	return true;
+}
+
 bool Mesh::loadASE(const char* filename)
 {
 	int nVtx,nFcs;
@@ -1622,6 +2185,36 @@ void Mesh::updateBoundingBox()
 	box.halfsize = aabb_max - box.center;
 }
 
+//ratio between the area of the triangles in uv space and in object space
+void Mesh::updateUVDensity()
+{
+	uv_density = 1;
+	bool indexed = m_indices.size() != 0;
+	uint32 num_vertices = indexed ? (uint32)m_indices.size() : getNumVertices();
+	if (!interleaved.size() && uvs.size() != vertices.size())
+		return;
+
+	double uv_area = 0;
+	double area = 0;
+	for (uint32 i = 0; i + 2 < num_vertices; i += 3)
+	{
+		Vector3f p[3];
+		Vector2f uv[3];
+		for (int k = 0; k < 3; ++k)
+		{
+			uint32 v = indexed ? m_indices[i + k] : i + k;
+			p[k] = interleaved.size() ? interleaved[v].vertex : vertices[v];
+			uv[k] = interleaved.size() ? interleaved[v].uv : uvs[v];
+		}
+		area += cross(p[1] - p[0], p[2] - p[0]).length();
+		Vector2f e1 = uv[1] - uv[0];
+		Vector2f e2 = uv[2] - uv[0];
+		uv_area += fabs(e1.x * e2.y - e1.y * e2.x);
+	}
+	if (area > 0 && uv_area > 0)
+		uv_density = (float)sqrt(uv_area / area);
+}
+
 Mesh* wire_box = NULL;
 
 void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
@@ -1714,12 +2307,16 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	//try loading the binary version
 	if (use_binary && m->readBin(binfilename.c_str()) )
 	{
+		m->has_bin = true;
 		if (interleave_meshes && m->interleaved.size() == 0)
 		{
 			std::cout << "[INTERL] ";
 			m->interleaveBuffers();
 		}
 
+		if (use_meshlets && m->meshlets.empty())
+			m->buildMeshlets();
+
 		if (auto_upload_to_vram)
 		{
 			std::cout << "[VRAM] ";
@@ -1727,7 +2324,7 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		}
 
 		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-		sMeshesLoaded[filename] = m;
+		m->registerMesh(filename);
 		return m;
 	}
 
@@ -1754,6 +2351,10 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		m->interleaveBuffers();
 	}
 
+	//split in meshlets so parts of it can be culled
+	if (use_meshlets)
+		m->buildMeshlets();
+
 	//and upload them to VRAM
 	if (auto_upload_to_vram)
 	{
@@ -1765,7 +2366,7 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	if (use_binary)
 	{
 		std::cout << "\t\t Writing .BIN ... ";
-		m->writeBin(filename);
+		m->has_bin = m->writeBin(filename);
 		std::cout << "[OK]" << std::endl;
 	}
 
@@ -1773,10 +2374,39 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	return m;
 }
 
+//the .mbin is not older than the file of the mesh (submeshes of a GLTF are "file::name"), meshes made in code have no file
+static bool isBinUpToDate(const std::string& name, const std::string& binfilename)
+{
+	struct stat bin_info;
+	struct stat source_info;
+	std::string source = name.substr(0, name.find("::"));
+	if (source == binfilename || stat(source.c_str(), &source_info) != 0 || stat(binfilename.c_str(), &bin_info) != 0)
+		return source == binfilename;
+	return bin_info.st_mtime >= source_info.st_mtime;
+}
+
 void Mesh::registerMesh( std::string name )
 {
 	this->name = name;
 	sMeshesLoaded[name] = this;
+
+	//evictable meshes get their .mbin now, while loading, so evicting one never writes to disk in the frame
+	if (Residency::enabled && !has_bin && (vertices.size() || interleaved.size()))
+	{
+		std::string binfilename = getBinFilename();
+		has_bin = isBinUpToDate(name, binfilename) || writeBin(binfilename.substr(0, binfilename.size() - 5).c_str());
+	}
+}
+
+void Mesh::init()
+{
+	//core since 3.0, the osx context is 2.1
+	GLint major = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetError(); //GL_MAJOR_VERSION is not known before 3.0
+	has_vao = major >= 3 || SDL_GL_ExtensionSupported("GL_ARB_vertex_array_object");
+	if (!has_vao)
+		std::cout << "[WARN] no vertex array objects, meshes use the attribute path" << std::endl;
 }
 
 void Mesh::Release()
@@ -1789,4 +2419,51 @@ void Mesh::Release()
 	sMeshesLoaded.clear();
 }
 
-};
\ No newline at end of file
+};
+
+LoadMeshTask::LoadMeshTask(const char* name, const char* filename)
+{
+	this->name = name;
+	this->filename = filename;
+}
+
+void LoadMeshTask::onExecute()
+{
+	//only the disk read, the parsing and the upload need the mesh and go to the main thread
+	std::vector<uint8> buffer;
+	readFileBin(filename, buffer);
+	TaskManager::foreground.addTask(new UploadMeshTask(name.c_str(), filename.c_str(), buffer));
+}
+
+UploadMeshTask::UploadMeshTask(const char* name, const char* filename, std::vector<uint8>& buffer)
+{
+	this->name = name;
+	this->filename = filename;
+	this->buffer.swap(buffer);
+}
+
+void UploadMeshTask::onExecute()
+{
+	auto it = GFX::Mesh::sMeshesLoaded.find(name);
+	if (it == GFX::Mesh::sMeshesLoaded.end())
+		return; //released while reading
+	GFX::Mesh* mesh = it->second;
+	if (!mesh->evicted)
+	{
+		mesh->reloading = false;
+		return;
+	}
+
+	double time = getTime();
+	std::cout << " + Mesh reloading: " << TermColor::YELLOW << name << TermColor::DEFAULT << " ... ";
+	mesh->submeshes.clear();
+	mesh->bones_info.clear();
+	if (buffer.empty() || !mesh->parseBin(buffer, filename.c_str()))
+	{
+		std::cout << TermColor::RED << "[ERROR] cannot read " << filename << TermColor::DEFAULT << std::endl;
+		return; //still reloading, so it is not requested again every frame
+	}
+	mesh->reloading = false;
+	mesh->makeResident();
+	std::cout << "[OK] Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+}
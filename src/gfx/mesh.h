@@ -3,10 +3,13 @@
 
 #include <vector>
 #include "../core/math.h"
+#include "../core/task.h"
 
 #include <map>
 #include <string>
 
+class Camera;
+
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
 	Matrix44 bind_pose;
@@ -28,6 +31,24 @@ namespace GFX {
 		int length;//in primitive
 	};
 
+	//a cluster of triangles with its bounds, used to cull parts of the mesh in the CPU
+	#define MESHLET_MAX_TRIANGLES 124
+	struct sMeshlet
+	{
+		Vector3f center; //bounding sphere in object space
+		float radius;
+		Vector3f cone_axis; //average normal, for backface culling
+		float cone_cutoff; //sin of the normal cone angle, 1 means it cannot be backface culled
+		uint32 start; //first index (or vertex if not indexed)
+		uint32 count; //num of indices (or vertices)
+	};
+
+	//same bounds as in sMeshlet but in SoA (padded to 4) so the culling can process 4 meshlets at once
+	struct sMeshletsSoA
+	{
+		std::vector<float> cx, cy, cz, radius, ax, ay, az, cutoff;
+	};
+
 	class Mesh
 	{
 	public:
@@ -35,10 +56,13 @@ namespace GFX {
 		static bool use_binary; //always load the binary version of a mesh when possible
 		static bool interleave_meshes; //loaded meshes will me automatically interleaved
 		static bool use_vao; //use vertex array object
+		static bool has_vao; //the GL context supports them, set by init
 		static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
 		static long num_meshes_rendered;
 		static long num_triangles_rendered;
 		static uint32 s_last_index;
+		static bool use_meshlets; //split big meshes in meshlets when loading and cull them when rendering
+		static long num_meshlets_culled;
 
 		std::string name;
 		uint32 index; //used internally
@@ -61,17 +85,23 @@ namespace GFX {
 
 		std::vector<unsigned int> m_indices; //for indexed meshes
 
+		std::vector<sMeshlet> meshlets; //triangles are sorted so every meshlet is a contiguous range
+		sMeshletsSoA meshlets_soa;
+
 		//for animated meshes
 		std::vector< Vector4ub > bones; //tells which bones afect the vertex (4 max)
 		std::vector< Vector4f > weights; //tells how much affect every bone
 		std::vector< BoneInfo > bones_info; //tells 
 		Matrix44 bind_matrix;
+		std::vector< Matrix44 > bones_offset; //bind_matrix * bind_pose of every bone, built on the first skinning
+		std::map< uint32, std::vector<int> > bones_remap; //per skeleton layout_id, index of every bones_info entry in the skeleton
 
 		Vector3f aabb_min;
 		Vector3f	aabb_max;
 		BoundingBox box;
 
 		float radius;
+		float uv_density; //uv units per object space unit, used to estimate the mip a texture needs
 
 		unsigned int vao_id; //Vertex Array Object
 
@@ -86,6 +116,13 @@ namespace GFX {
 		unsigned int weights_vbo_id;
 		unsigned int uvs1_vbo_id;
 
+		//residency (see residency.h)
+		uint32 last_used_frame; //Residency::frame when it was rendered for the last time
+		bool evicted; //buffers released, reloaded from the .mbin when rendered again
+		bool has_bin; //its .mbin is up to date, so evicting can release the RAM without writing anything
+		bool reloading; //its .mbin is being read in TaskManager::background
+		size_t gpu_bytes; //bytes uploaded to the VRAM
+
 		Mesh();
 		~Mesh();
 
@@ -97,14 +134,21 @@ namespace GFX {
 		void renderFixedPipeline(int primitive); //sloooooooow
 		//void renderAnimated(unsigned int primitive, Skeleton *sk);
 
-		void enableBuffers(Shader* shader); //if shader is null the attrib locations must be POS=0, NORM=1, COORD=2, COORD1=3, COLOR=4, BONES=5, WEIGHTS=6
+		void enableBuffers(Shader* shader); //if shader is null it uses the fixed locations from eAttribLocation (POS=0, NORM=1, COORD=2, COORD1=3, COLOR=4, BONES=5, WEIGHTS=6)
 		void drawCall(unsigned int primitive, int submesh_id = -1, int num_instances = 0);
 		void disableBuffers(Shader* shader);
 
 		void getSubmeshStartAndSize(int submesh_id, unsigned int& start, unsigned int& size);
 
 		bool readBin(const char* filename);
+		bool parseBin(const std::vector<uint8>& data, const char* filename); //the content of a .mbin, filename only for the errors
 		bool writeBin(const char* filename);
+		std::string getBinFilename(); //where the binary cache of this mesh is stored
+
+		//memory
+		size_t getCPUBytes();
+		bool evict(); //releases the VRAM (and the RAM if it can be reloaded from the bin)
+		bool makeResident(bool wait = false); //reloads an evicted mesh, false while its .mbin is being read unless wait
 
 		unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
 		unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
@@ -119,6 +163,7 @@ namespace GFX {
 		//loader
 		static Mesh* Get(const char* filename, bool skip_load = false);
 		static void Release();
+		static void init(); //once there is a GL context, checks its capabilities
 		void registerMesh(std::string name);
 
 		//create help meshes
@@ -133,12 +178,22 @@ namespace GFX {
 		static Mesh* getQuad(); //get global quad
 
 		void updateBoundingBox();
+		void updateUVDensity();
 
 		//optimize meshes
 		void uploadToVRAM();
+		void buildVAO(); //captures the buffers in vao_id using the fixed attrib locations
 		void drawUsingVAO(unsigned int primitive, int submesh_id = -1);
 		bool interleaveBuffers();
 
+		//meshlets
+		void buildMeshlets(uint32 max_triangles = MESHLET_MAX_TRIANGLES); //reorders the triangles, call it before uploading
+		void updateMeshletsSoA();
+		uint32 cullMeshlets(const Matrix44& model, Camera* camera, bool backface_culling, std::vector<uint8>& visible, bool use_simd = true); //returns num visible
+		void renderMeshlets(unsigned int primitive, const Matrix44& model, Camera* camera, bool backface_culling = true);
+		static bool benchmarkMeshlets(const char* filename, int iterations = 1000); //no GPU needed
+		static bool benchmarkDraws(const char* filename, int num_draws = 1000); //CPU time of the draw calls with and without VAO, needs a GL context
+
 	private:
 		bool loadASE(const char* filename);
 		bool loadOBJ(const char* filename);
@@ -148,4 +203,24 @@ namespace GFX {
 
 };
 
+//the .mbin of an evicted mesh is read in a bg thread and the main thread uploads it, see Mesh::makeResident
+class LoadMeshTask : public Task {
+public:
+	std::string name;
+	std::string filename;
+
+	LoadMeshTask(const char* name, const char* filename);
+	void onExecute();
+};
+
+class UploadMeshTask : public Task {
+public:
+	std::string name;
+	std::string filename;
+	std::vector<uint8> buffer; //the .mbin file
+
+	UploadMeshTask(const char* name, const char* filename, std::vector<uint8>& buffer);
+	void onExecute();
+};
+
 #endif
@@ -0,0 +1,452 @@
+#include "mipgenerator.h"
+#include "texture.h"
+
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#include <emmintrin.h>
+	#define MIPS_SSE
+#endif
+
+using namespace GFX;
+
+eMipFilter MipGenerator::filter = MIP_BOX;
+bool MipGenerator::use_simd = true;
+uint32 MipGenerator::num_levels = 0;
+double MipGenerator::total_time = 0;
+
+const int KAISER_TAPS = 6;
+const int ROWS_PER_BATCH = 16;
+
+struct sMipTables {
+	float srgb_to_linear[256];
+	uint8 linear_to_srgb[65536]; //linear in 16 bits, enough for the darkest sRGB steps
+	float kaiser[KAISER_TAPS]; //source pixels from -2.5 to 2.5 around the center of the new one
+
+	sMipTables()
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			float c = i / 255.0f;
+			srgb_to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+		}
+		for (int i = 0; i < 65536; ++i)
+		{
+			float l = i / 65535.0f;
+			float c = l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+			linear_to_srgb[i] = uint8(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+		}
+
+		//half band sinc windowed with a kaiser of alpha 4 and radius 3
+		auto bessel0 = [](double x) { double sum = 1, term = 1; for (int k = 1; k < 20; ++k) { term *= (x / (2 * k)) * (x / (2 * k)); sum += term; } return sum; };
+		double total = 0;
+		double weights[KAISER_TAPS];
+		for (int i = 0; i < KAISER_TAPS; ++i)
+		{
+			double d = i - 2.5;
+			double x = d * 0.5 * PI;
+			double sinc = fabs(x) < 1e-6 ? 1.0 : sin(x) / x;
+			double r = d / 3.0;
+			weights[i] = sinc * bessel0(4.0 * sqrt(std::max(1.0 - r * r, 0.0))) / bessel0(4.0);
+			total += weights[i];
+		}
+		for (int i = 0; i < KAISER_TAPS; ++i)
+			kaiser[i] = float(weights[i] / total);
+	}
+};
+
+static const sMipTables& getTables()
+{
+	static sMipTables tables; //built once, thread safe
+	return tables;
+}
+
+static inline float clamp01(float v) { return v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v); }
+
+//pixels are 4 floats in linear space while filtering, the conversions are shared by both paths
+static inline void decodePixel(const uint8* p, int num_channels, eMipContent content, float* out)
+{
+	const sMipTables& tables = getTables();
+	for (int c = 0; c < 3; ++c)
+		out[c] = content == MIP_COLOR ? tables.srgb_to_linear[p[c]] : (content == MIP_NORMALMAP ? p[c] * (2.0f / 255.0f) - 1.0f : p[c] * (1.0f / 255.0f));
+	out[3] = num_channels == 4 ? p[3] * (1.0f / 255.0f) : 1.0f;
+}
+
+static inline void encodePixel(const float* v, int num_channels, eMipContent content, uint8* p)
+{
+	const sMipTables& tables = getTables();
+	float n[3] = { v[0], v[1], v[2] };
+	if (content == MIP_NORMALMAP)
+	{
+		float length = sqrtf((v[0] * v[0] + v[1] * v[1]) + v[2] * v[2]);
+		if (length > 1e-6f)
+			for (int c = 0; c < 3; ++c)
+				n[c] = v[c] / length;
+		else
+			n[0] = n[1] = 0.0f, n[2] = 1.0f;
+		for (int c = 0; c < 3; ++c)
+			n[c] = n[c] * 0.5f + 0.5f;
+	}
+	for (int c = 0; c < 3; ++c)
+		p[c] = content == MIP_COLOR ? tables.linear_to_srgb[int(clamp01(n[c]) * 65535.0f + 0.5f)] : uint8(clamp01(n[c]) * 255.0f + 0.5f);
+	if (num_channels == 4)
+		p[3] = uint8(clamp01(v[3]) * 255.0f + 0.5f);
+}
+
+struct ScalarPixel {
+	float v[4];
+	ScalarPixel() {}
+	explicit ScalarPixel(float f) { v[0] = v[1] = v[2] = v[3] = f; }
+	ScalarPixel operator+(const ScalarPixel& o) const { ScalarPixel r; for (int i = 0; i < 4; ++i) r.v[i] = v[i] + o.v[i]; return r; }
+	ScalarPixel operator*(float f) const { ScalarPixel r; for (int i = 0; i < 4; ++i) r.v[i] = v[i] * f; return r; }
+	void load(const float* p) { memcpy(v, p, sizeof(v)); }
+	void store(float* p) const { memcpy(p, v, sizeof(v)); }
+
+	static void decodeRow(const uint8* src, int width, int num_channels, eMipContent content, ScalarPixel* out)
+	{
+		for (int x = 0; x < width; ++x)
+			decodePixel(src + x * num_channels, num_channels, content, out[x].v);
+	}
+	static void encodeRow(const ScalarPixel* in, int width, int num_channels, eMipContent content, uint8* dst)
+	{
+		for (int x = 0; x < width; ++x)
+			encodePixel(in[x].v, num_channels, content, dst + x * num_channels);
+	}
+};
+
+#ifdef MIPS_SSE
+struct SSEPixel {
+	__m128 v;
+	SSEPixel() {}
+	explicit SSEPixel(float f) { v = _mm_set1_ps(f); }
+	SSEPixel operator+(const SSEPixel& o) const { SSEPixel r; r.v = _mm_add_ps(v, o.v); return r; }
+	SSEPixel operator*(float f) const { SSEPixel r; r.v = _mm_mul_ps(v, _mm_set1_ps(f)); return r; }
+	void load(const float* p) { v = _mm_loadu_ps(p); }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+
+	//the same operations as decodePixel/encodePixel, 4 channels at once
+	static void decodeRow(const uint8* src, int width, int num_channels, eMipContent content, SSEPixel* out)
+	{
+		if (content == MIP_COLOR)
+		{
+			const float* lut = getTables().srgb_to_linear;
+			for (int x = 0; x < width; ++x, src += num_channels)
+				out[x].v = _mm_set_ps(num_channels == 4 ? src[3] * (1.0f / 255.0f) : 1.0f, lut[src[2]], lut[src[1]], lut[src[0]]);
+			return;
+		}
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 scale = content == MIP_NORMALMAP ? _mm_set_ps(1.0f / 255.0f, 2.0f / 255.0f, 2.0f / 255.0f, 2.0f / 255.0f) : _mm_set1_ps(1.0f / 255.0f);
+		const __m128 bias = content == MIP_NORMALMAP ? _mm_set_ps(0.0f, 1.0f, 1.0f, 1.0f) : _mm_setzero_ps();
+		const __m128 opaque = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
+		const __m128 rgb_mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+		for (int x = 0; x < width; ++x, src += num_channels)
+		{
+			int bytes = num_channels == 4 ? (src[3] << 24) : 0;
+			bytes |= src[0] | (src[1] << 8) | (src[2] << 16);
+			__m128i i = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+			__m128 f = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(i), scale), bias);
+			out[x].v = num_channels == 4 ? f : _mm_or_ps(_mm_and_ps(f, rgb_mask), opaque);
+		}
+	}
+	static void encodeRow(const SSEPixel* in, int width, int num_channels, eMipContent content, uint8* dst)
+	{
+		if (content != MIP_LINEAR) //lookups and normalization per pixel
+		{
+			float v[4];
+			for (int x = 0; x < width; ++x)
+			{
+				_mm_storeu_ps(v, in[x].v);
+				encodePixel(v, num_channels, content, dst + x * num_channels);
+			}
+			return;
+		}
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 scale = _mm_set1_ps(255.0f);
+		const __m128 half = _mm_set1_ps(0.5f);
+		for (int x = 0; x < width; ++x, dst += num_channels)
+		{
+			__m128 f = _mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(in[x].v, zero), one), scale), half);
+			__m128i i = _mm_cvttps_epi32(f);
+			i = _mm_packus_epi16(_mm_packs_epi32(i, i), i);
+			int bytes = _mm_cvtsi128_si32(i);
+			dst[0] = uint8(bytes);
+			dst[1] = uint8(bytes >> 8);
+			dst[2] = uint8(bytes >> 16);
+			if (num_channels == 4)
+				dst[3] = uint8(bytes >> 24);
+		}
+	}
+};
+#endif
+
+//floats have no conversion, a missing alpha is 1
+template<class P> static void decodeRowFloat(const float* src, int width, int num_channels, P* out)
+{
+	float v[4] = { 0, 0, 0, 1 };
+	for (int x = 0; x < width; ++x, src += num_channels)
+	{
+		memcpy(v, src, num_channels * sizeof(float));
+		out[x].load(v);
+	}
+}
+
+template<class P> static void encodeRowFloat(const P* in, int width, int num_channels, float* dst)
+{
+	float v[4];
+	for (int x = 0; x < width; ++x, dst += num_channels)
+	{
+		in[x].store(v);
+		memcpy(dst, v, num_channels * sizeof(float));
+	}
+}
+
+//reads the rows of a level as pixels, for 8 bits or floats
+struct sRowSource {
+	const uint8* src8;
+	const float* srcf;
+	int width;
+	int num_channels;
+	eMipContent content;
+
+	template<class P> void decode(int y, P* out) const
+	{
+		if (src8)
+			P::decodeRow(src8 + size_t(y) * width * num_channels, width, num_channels, content, out);
+		else
+			decodeRowFloat(srcf + size_t(y) * width * num_channels, width, num_channels, out);
+	}
+};
+
+struct sRowTarget {
+	uint8* dst8;
+	float* dstf;
+	int width;
+	int num_channels;
+	eMipContent content;
+
+	template<class P> void encode(int y, const P* in) const
+	{
+		if (dst8)
+			P::encodeRow(in, width, num_channels, content, dst8 + size_t(y) * width * num_channels);
+		else
+			encodeRowFloat(in, width, num_channels, dstf + size_t(y) * width * num_channels);
+	}
+};
+
+//output rows from start to end
+template<class P> static void boxRows(const sRowSource& source, int height, const sRowTarget& target, int start, int end)
+{
+	std::vector<P> top(source.width), bottom(source.width), out(target.width);
+	int step_x = source.width > 1 ? 1 : 0;
+	for (int y = start; y < end; ++y)
+	{
+		source.decode(y * 2, &top[0]);
+		if (height > 1)
+			source.decode(y * 2 + 1, &bottom[0]);
+		const P* second = height > 1 ? &bottom[0] : &top[0];
+		for (int x = 0; x < target.width; ++x)
+			out[x] = ((top[x * 2] + top[x * 2 + step_x]) + (second[x * 2] + second[x * 2 + step_x])) * 0.25f;
+		target.encode(y, &out[0]);
+	}
+}
+
+//separable, the rows filtered horizontally are kept for the vertical pass of the batch
+template<class P> static void kaiserRows(const sRowSource& source, int height, const sRowTarget& target, int start, int end)
+{
+	const float* weights = getTables().kaiser;
+	int first_row = height > 1 ? start * 2 - 2 : 0;
+	int num_rows = height > 1 ? (end - start) * 2 + KAISER_TAPS - 2 : 1;
+	std::vector<P> row(source.width), filtered(size_t(num_rows) * target.width), out(target.width);
+
+	for (int r = 0; r < num_rows; ++r)
+	{
+		source.decode(((first_row + r) % height + height) % height, &row[0]);
+		P* dst = &filtered[size_t(r) * target.width];
+		if (source.width == 1)
+		{
+			dst[0] = row[0];
+			continue;
+		}
+		for (int x = 0; x < target.width; ++x)
+		{
+			P sum(0.0f);
+			int first = x * 2 - 2;
+			if (first >= 0 && first + KAISER_TAPS <= source.width) //only the borders wrap
+				for (int k = 0; k < KAISER_TAPS; ++k)
+					sum = sum + row[first + k] * weights[k];
+			else
+				for (int k = 0; k < KAISER_TAPS; ++k)
+					sum = sum + row[((first + k) % source.width + source.width) % source.width] * weights[k];
+			dst[x] = sum;
+		}
+	}
+
+	for (int y = start; y < end; ++y)
+	{
+		if (height == 1)
+		{
+			target.encode(y, &filtered[0]);
+			continue;
+		}
+		const P* rows = &filtered[size_t((y - start) * 2) * target.width];
+		for (int x = 0; x < target.width; ++x)
+		{
+			P sum(0.0f);
+			for (int k = 0; k < KAISER_TAPS; ++k)
+				sum = sum + rows[size_t(k) * target.width + x] * weights[k];
+			out[x] = sum;
+		}
+		target.encode(y, &out[0]);
+	}
+}
+
+static void downsampleLevel(const sRowSource& source, int height, const sRowTarget& target, int target_height, eMipFilter filter, bool simd)
+{
+	auto start_time = std::chrono::high_resolution_clock::now();
+	JobSystem::parallelFor(target_height, ROWS_PER_BATCH, [&](int start, int end) {
+	#ifdef MIPS_SSE
+		if (simd)
+		{
+			if (filter == MIP_KAISER)
+				kaiserRows<SSEPixel>(source, height, target, start, end);
+			else
+				boxRows<SSEPixel>(source, height, target, start, end);
+			return;
+		}
+	#endif
+		if (filter == MIP_KAISER)
+			kaiserRows<ScalarPixel>(source, height, target, start, end);
+		else
+			boxRows<ScalarPixel>(source, height, target, start, end);
+	});
+	MipGenerator::num_levels++;
+	MipGenerator::total_time += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+}
+
+eMipContent MipGenerator::getContent(const std::string& filename)
+{
+	std::string name = toLowerCase(filename);
+	size_t slash = name.find_last_of("/\\");
+	if (slash != std::string::npos)
+		name = name.substr(slash + 1);
+	const char* normals[] = { "normal", "_nor", "_nrm", "_norm", "_n." };
+	for (const char* tag : normals)
+		if (name.find(tag) != std::string::npos)
+			return MIP_NORMALMAP;
+	const char* data[] = { "rough", "metal", "occlusion", "_ao", "height", "disp", "bump", "mask", "lut", "specular", "gloss" };
+	for (const char* tag : data)
+		if (name.find(tag) != std::string::npos)
+			return MIP_LINEAR;
+	return MIP_COLOR;
+}
+
+void MipGenerator::downsample(const uint8* src, int width, int height, int num_channels, uint8* dst, eMipContent content)
+{
+	assert(num_channels == 3 || num_channels == 4);
+	sRowSource source = { src, NULL, width, num_channels, content };
+	sRowTarget target = { dst, NULL, std::max(width >> 1, 1), num_channels, content };
+	downsampleLevel(source, height, target, std::max(height >> 1, 1), filter, use_simd);
+}
+
+void MipGenerator::downsample(const float* src, int width, int height, int num_channels, float* dst)
+{
+	assert(num_channels == 3 || num_channels == 4);
+	sRowSource source = { NULL, src, width, num_channels, MIP_LINEAR };
+	sRowTarget target = { NULL, dst, std::max(width >> 1, 1), num_channels, MIP_LINEAR };
+	downsampleLevel(source, height, target, std::max(height >> 1, 1), filter, use_simd);
+}
+
+int MipGenerator::getNumMips(int width, int height)
+{
+	int num_mips = 1;
+	if (isPowerOfTwo(width) && isPowerOfTwo(height))
+		while (std::max(width, height) >> num_mips)
+			num_mips++;
+	return num_mips;
+}
+
+bool MipGenerator::benchmark(const char* filename, int iterations)
+{
+	::Image image;
+	if (!image.load(filename) || (image.num_channels != 3 && image.num_channels != 4))
+		return false;
+
+	int w = image.width;
+	int h = image.height;
+	int nc = image.num_channels;
+	size_t size = size_t(std::max(w >> 1, 1)) * std::max(h >> 1, 1) * nc;
+	std::vector<uint8> reference(size), result(size);
+	std::vector<float> source_f(size_t(w) * h * nc), reference_f(size), result_f(size);
+	for (size_t i = 0; i < source_f.size(); ++i)
+		source_f[i] = image.data[i] * (4.0f / 255.0f); //some HDR range
+	const char* content_names[] = { "color", "linear", "normal", "float" };
+	const char* filter_names[] = { "box", "kaiser" };
+	bool ok = true;
+	eMipFilter previous_filter = filter;
+	bool previous_simd = use_simd;
+
+	std::cout << filename << " " << w << "x" << h << "x" << nc << " -> level 1" << std::endl;
+	for (int f = 0; f < 2; ++f)
+		for (int c = 0; c < 4; ++c)
+		{
+			filter = (eMipFilter)f;
+			double times[2] = { 0, 0 };
+			for (int simd = 0; simd < 2; ++simd)
+			{
+				use_simd = simd != 0;
+				auto start = std::chrono::high_resolution_clock::now();
+				for (int i = 0; i < iterations; ++i)
+				{
+					if (c == 3)
+						downsample(&source_f[0], w, h, nc, simd ? &result_f[0] : &reference_f[0]);
+					else
+						downsample(image.data, w, h, nc, simd ? &result[0] : &reference[0], (eMipContent)c);
+				}
+				times[simd] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+			}
+			bool identical = c == 3 ? reference_f == result_f : reference == result;
+			ok = ok && identical;
+
+			//the normals must come out unit length, up to the 8 bits quantization
+			float max_error = 0;
+			if (c == MIP_NORMALMAP)
+				for (size_t i = 0; i < size; i += nc)
+				{
+					Vector3f n(result[i] / 127.5f - 1.0f, result[i + 1] / 127.5f - 1.0f, result[i + 2] / 127.5f - 1.0f);
+					max_error = std::max(max_error, (float)fabs(n.length() - 1.0f));
+				}
+
+			std::cout << " " << filter_names[f] << " " << content_names[c] << ": scalar " << times[0] << "ms SIMD " << TermColor::GREEN << times[1] << "ms" << TermColor::DEFAULT
+				<< " x" << times[0] / times[1];
+			if (c == MIP_NORMALMAP)
+				std::cout << " length error " << max_error;
+			if (identical)
+				std::cout << " identical" << std::endl;
+			else
+				std::cout << TermColor::RED << " [ERROR] different from the scalar reference" << TermColor::DEFAULT << std::endl;
+		}
+	#ifndef MIPS_SSE
+		std::cout << " (SSE not available in this build, both use the scalar path)" << std::endl;
+	#endif
+
+	filter = previous_filter;
+	use_simd = previous_simd;
+	return ok;
+}
+
+void MipGenerator::showUI()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Combo("Mip filter", (int*)&filter, "Box\0Kaiser\0");
+	ImGui::Checkbox("SIMD mip generation", &use_simd);
+	ImGui::Text("Levels generated: %d (%.2fs)", num_levels, total_time * 0.001);
+#endif
+}
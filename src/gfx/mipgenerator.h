@@ -0,0 +1,47 @@
+/*  CPU mipmaps: every level is filtered from the previous one in the thread that decoded the image,
+	so the whole chain is uploaded at once instead of calling glGenerateMipmap after the upload.
+	Color maps are averaged in linear space (sRGB decoded and encoded again), normal maps are
+	renormalized and float images are filtered as they are. The filters are written once and
+	built with a scalar reference and with SSE, rows are split between the JobSystem workers.
+*/
+
+#pragma once
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include <string>
+
+namespace GFX {
+
+	enum eMipContent {
+		MIP_COLOR, //sRGB encoded (albedo, emissive)
+		MIP_LINEAR, //data (roughness, metalness, occlusion, luts)
+		MIP_NORMALMAP //tangent space normals, renormalized after filtering
+	};
+
+	enum eMipFilter {
+		MIP_BOX, //2x2 average
+		MIP_KAISER //6x6 Kaiser windowed sinc, sharper, the textures are assumed to tile
+	};
+
+	class MipGenerator {
+	public:
+		static eMipFilter filter;
+		static bool use_simd;
+
+		//stats
+		static uint32 num_levels;
+		static double total_time; //ms
+
+		static eMipContent getContent(const std::string& filename); //from the usual suffixes: _normal, _nor, _rough...
+
+		//half size of a level, the sizes are powers of two so only a side of size 1 cannot be halved
+		static void downsample(const uint8* src, int width, int height, int num_channels, uint8* dst, eMipContent content = MIP_COLOR);
+		static void downsample(const float* src, int width, int height, int num_channels, float* dst);
+		static int getNumMips(int width, int height); //1 if the size is not a power of two
+
+		static bool benchmark(const char* filename, int iterations = 10); //SSE against the scalar reference, no GPU needed
+		static void showUI();
+	};
+
+};
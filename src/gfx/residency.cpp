@@ -0,0 +1,154 @@
+#include "residency.h"
+
+#include <algorithm> //sort
+#include <vector>
+
+#include "mesh.h"
+#include "texture.h"
+#include "../utils/utils.h"
+
+namespace GFX {
+
+bool Residency::enabled = true;
+size_t Residency::gpu_budget = size_t(1024) * 1024 * 1024;
+size_t Residency::cpu_budget = size_t(1024) * 1024 * 1024;
+uint32 Residency::min_idle_frames = 120; //~2 seconds at 60fps, avoids thrashing resources that blink in and out of view
+
+uint32 Residency::frame = 0;
+
+size_t Residency::gpu_bytes = 0;
+size_t Residency::cpu_bytes = 0;
+uint32 Residency::num_evictions = 0;
+uint32 Residency::num_reloads = 0;
+
+struct sResidencyCandidate {
+	uint32 last_used_frame;
+	Mesh* mesh;
+	Texture* texture;
+};
+
+//evicts the least recently used resources idle for more than idle_frames, if check_budget it stops once under budget
+static uint32 evictLRU(uint32 idle_frames, bool check_budget)
+{
+	uint32 frame = Residency::frame;
+	std::vector<sResidencyCandidate> candidates;
+
+	for (auto& it : Mesh::sMeshesLoaded)
+	{
+		Mesh* mesh = it.second;
+		if (!mesh->evicted && mesh->gpu_bytes && frame - mesh->last_used_frame > idle_frames)
+			candidates.push_back({ mesh->last_used_frame, mesh, nullptr });
+	}
+
+	for (auto& it : Texture::sTextures)
+	{
+		Texture* texture = it.second;
+		if (frame - texture->last_used_frame > idle_frames && texture->canEvict())
+			candidates.push_back({ texture->last_used_frame, nullptr, texture });
+	}
+
+	std::sort(candidates.begin(), candidates.end(), [](const sResidencyCandidate& a, const sResidencyCandidate& b) { return a.last_used_frame < b.last_used_frame; });
+
+	uint32 num = 0;
+	for (sResidencyCandidate& c : candidates)
+	{
+		if (check_budget && Residency::gpu_bytes <= Residency::gpu_budget && Residency::cpu_bytes <= Residency::cpu_budget)
+			break;
+
+		size_t gpu = c.mesh ? c.mesh->gpu_bytes : c.texture->getGPUBytes();
+		size_t cpu = c.mesh ? c.mesh->getCPUBytes() : c.texture->getCPUBytes();
+		if (c.mesh ? !c.mesh->evict() : !c.texture->evict())
+			continue;
+
+		//meshes without a binary cache keep the RAM copy
+		Residency::gpu_bytes -= gpu;
+		Residency::cpu_bytes -= cpu - (c.mesh ? c.mesh->getCPUBytes() : 0);
+		num++;
+	}
+
+	Residency::num_evictions += num;
+	return num;
+}
+
+void Residency::update()
+{
+	frame++;
+
+	gpu_bytes = cpu_bytes = 0;
+	for (auto& it : Mesh::sMeshesLoaded)
+	{
+		gpu_bytes += it.second->gpu_bytes;
+		cpu_bytes += it.second->getCPUBytes();
+	}
+	for (auto& it : Texture::sTextures)
+	{
+		gpu_bytes += it.second->getGPUBytes();
+		cpu_bytes += it.second->getCPUBytes();
+	}
+
+	if (!enabled || (gpu_bytes <= gpu_budget && cpu_bytes <= cpu_budget))
+		return;
+
+	evictLRU(min_idle_frames, true);
+}
+
+uint32 Residency::evictUnused(uint32 idle_frames)
+{
+	return evictLRU(idle_frames, false);
+}
+
+void Residency::showUI()
+{
+#ifndef SKIP_IMGUI
+	const float MB = 1.0f / (1024 * 1024);
+
+	ImGui::Checkbox("Evict when over budget", &enabled);
+	int gpu_mb = int(gpu_budget / (1024 * 1024));
+	if (ImGui::SliderInt("VRAM budget (MB)", &gpu_mb, 16, 8192))
+		gpu_budget = size_t(gpu_mb) * 1024 * 1024;
+	int cpu_mb = int(cpu_budget / (1024 * 1024));
+	if (ImGui::SliderInt("RAM budget (MB)", &cpu_mb, 16, 8192))
+		cpu_budget = size_t(cpu_mb) * 1024 * 1024;
+	int idle = (int)min_idle_frames;
+	if (ImGui::SliderInt("Min idle frames", &idle, 1, 1000))
+		min_idle_frames = idle;
+
+	ImGui::ProgressBar(gpu_bytes / (float)gpu_budget, ImVec2(-1, 0), (std::to_string(int(gpu_bytes * MB)) + " / " + std::to_string(int(gpu_budget * MB)) + " MB VRAM").c_str());
+	ImGui::ProgressBar(cpu_bytes / (float)cpu_budget, ImVec2(-1, 0), (std::to_string(int(cpu_bytes * MB)) + " / " + std::to_string(int(cpu_budget * MB)) + " MB RAM").c_str());
+	ImGui::Text("Evictions: %d Reloads: %d", num_evictions, num_reloads);
+	if (ImGui::Button("Evict unused"))
+		evictUnused(min_idle_frames);
+
+	if (ImGui::TreeNode("Meshes"))
+	{
+		for (auto& it : Mesh::sMeshesLoaded)
+		{
+			Mesh* mesh = it.second;
+			if (mesh->evicted)
+				ImGui::TextDisabled("[evicted] %s", it.first.c_str());
+			else
+				ImGui::Text("%s RAM: %.2fMB VRAM: %.2fMB idle: %d", it.first.c_str(), mesh->getCPUBytes() * MB, mesh->gpu_bytes * MB, frame - mesh->last_used_frame);
+		}
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Textures"))
+	{
+		for (auto& it : Texture::sTextures)
+		{
+			Texture* texture = it.second;
+			const char* name = texture->filename.size() ? texture->filename.c_str() : "[no name]";
+			if (texture->evicted)
+				ImGui::TextDisabled("[evicted] %s", name);
+			else if (texture->stream_filename.size()) //resident and desired mips
+				ImGui::Text("%s %dx%d VRAM: %.2fMB idle: %d mip: %d desired: %d/%d%s", name, (int)texture->width, (int)texture->height, texture->getGPUBytes() * MB, frame - texture->last_used_frame,
+					texture->resident_mip, frame - texture->desired_frame <= 1 ? texture->desired_mip : texture->initial_mip, texture->num_mips - 1, texture->streaming_mips ? " [streaming]" : "");
+			else
+				ImGui::Text("%s %dx%d VRAM: %.2fMB idle: %d%s", name, (int)texture->width, (int)texture->height, texture->getGPUBytes() * MB, frame - texture->last_used_frame, texture->loading ? " [loading]" : "");
+		}
+		ImGui::TreePop();
+	}
+#endif
+}
+
+};
@@ -0,0 +1,36 @@
+/*  Keeps track of the memory used by the meshes and textures loaded through the managers.
+	When the budget is exceeded the least recently rendered resources are released
+	and reloaded the next time they are used (meshes from their .mbin, textures from their file).
+*/
+
+#pragma once
+
+#include "../core/includes.h"
+#include "../core/math.h"
+
+namespace GFX {
+
+	class Mesh;
+	class Texture;
+
+	class Residency {
+	public:
+		static bool enabled;
+		static size_t gpu_budget; //in bytes
+		static size_t cpu_budget; //in bytes
+		static uint32 min_idle_frames; //resources used in the last N frames are never evicted
+
+		static uint32 frame; //used to timestamp the use of every resource
+
+		//stats, updated every frame
+		static size_t gpu_bytes;
+		static size_t cpu_bytes;
+		static uint32 num_evictions;
+		static uint32 num_reloads;
+
+		static void update(); //call once per frame, evicts if over budget
+		static uint32 evictUnused(uint32 idle_frames); //evicts everything not used in the last idle_frames, returns how many
+		static void showUI();
+	};
+
+};
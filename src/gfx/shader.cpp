@@ -5,10 +5,14 @@
 #include <functional> 
 #include <cctype>
 #include <locale>
+#include <cstdio>
+#include <chrono>
+#include <set>
 
 #include "../utils/utils.h"
 
 #include "texture.h"
+#include "residency.h"
 
 #ifndef MAX
 	#define MAX(A,B) ((A)>(B)?(A):(B))
@@ -63,8 +67,129 @@ std::map<std::string, Shader::UberShader*> Shader::s_ubershaders;
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+const char* Shader::s_attrib_names[ATTRIB_COUNT] = { "a_vertex", "a_normal", "a_coord", "a_coord1", "a_color", "a_bones", "a_weights" };
+const char* Shader::s_block_names[NUM_UNIFORM_BLOCKS] = { "u_camera_block", "u_frame_block", "u_material_block" };
+bool Shader::has_uniform_blocks = false;
 std::vector<char> Shader::lines_with_error;
 
+bool Shader::use_binary_cache = true;
+bool Shader::clear_binary_cache = false;
+uint32 Shader::num_binary_hits = 0;
+uint32 Shader::num_binary_misses = 0;
+double Shader::atlas_load_time = 0;
+
+bool Shader::async_permutations = true;
+bool Shader::warm_permutations = true;
+float Shader::compile_budget = 2.0f;
+uint32 Shader::num_fallbacks = 0;
+double Shader::permutations_time = 0;
+
+//lines of the manifest: the name of the ubershader and its macros
+static std::set<std::string> s_manifest;
+static bool s_manifest_dirty = false;
+
+#define PROGRAM_BINARY_VERSION 1 //change it if the format of the .pbin changes
+
+//.pbin layout: header, then for every program its key, format, size and the bytes
+struct sProgramBinaryHeader {
+	char magic[4]; //PBIN
+	uint32 version;
+	uint64 driver_hash; //the binaries of another driver are useless, the whole file is ignored
+	uint32 num_programs;
+	uint32 padding;
+};
+
+struct sProgramBinary {
+	uint32 format;
+	std::vector<unsigned char> data;
+};
+
+//uniform blocks, the last data of every block is kept for the programs that read it from plain uniforms
+static BufferObject* s_block_buffers[NUM_UNIFORM_BLOCKS] = { nullptr };
+static std::vector<uint8> s_block_data[NUM_UNIFORM_BLOCKS];
+static uint32 s_block_versions[NUM_UNIFORM_BLOCKS] = { 0 };
+
+static std::map<uint64, sProgramBinary> s_binaries;
+static bool s_binaries_loaded = false; //the file is read on the first lookup
+static bool s_binaries_dirty = false;
+
+static uint64 hashBytes(uint64 hash, const void* data, size_t size)
+{
+	//fnv-1a
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
+
+static uint64 getDriverHash()
+{
+	static uint64 driver_hash = 0;
+	if (!driver_hash)
+	{
+		GLenum names[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		uint64 hash = 14695981039346656037ULL;
+		for (int i = 0; i < 3; ++i)
+		{
+			const char* str = (const char*)glGetString(names[i]);
+			if (str)
+				hash = hashBytes(hash, str, strlen(str) + 1);
+		}
+		driver_hash = hash;
+	}
+	return driver_hash;
+}
+
+static bool isBinaryCacheSupported()
+{
+	static GLint num_formats = -1;
+	if (num_formats == -1)
+	{
+		num_formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+		while (glGetError() != GL_NO_ERROR); //not available before GL 4.1
+	}
+	return num_formats > 0;
+}
+
+static void loadBinaryCacheFile()
+{
+	if (s_binaries_loaded)
+		return;
+	s_binaries_loaded = true;
+
+	std::string filename = Shader::GetBinaryCacheFilename();
+	std::vector<unsigned char> buffer;
+	if (!fileExists(filename) || !readFileBin(filename, buffer) || buffer.size() < sizeof(sProgramBinaryHeader))
+		return;
+	sProgramBinaryHeader header;
+	memcpy(&header, &buffer[0], sizeof(header));
+	if (memcmp(header.magic, "PBIN", 4) != 0 || header.version != PROGRAM_BINARY_VERSION || header.driver_hash != getDriverHash())
+	{
+		s_binaries_dirty = true; //rewritten with the binaries of this driver
+		return;
+	}
+
+	size_t pos = sizeof(header);
+	for (uint32 i = 0; i < header.num_programs; ++i)
+	{
+		uint64 key;
+		uint32 format, size;
+		if (pos + sizeof(key) + sizeof(format) + sizeof(size) > buffer.size())
+			break;
+		memcpy(&key, &buffer[pos], sizeof(key));
+		memcpy(&format, &buffer[pos + sizeof(key)], sizeof(format));
+		memcpy(&size, &buffer[pos + sizeof(key) + sizeof(format)], sizeof(size));
+		pos += sizeof(key) + sizeof(format) + sizeof(size);
+		if (pos + size > buffer.size())
+			break;
+		sProgramBinary& binary = s_binaries[key];
+		binary.format = format;
+		binary.data.assign(buffer.begin() + pos, buffer.begin() + pos + size);
+		pos += size;
+	}
+}
+
 Shader::Shader()
 {
 	if(!Shader::s_ready)
@@ -72,7 +197,13 @@ Shader::Shader()
 	program = vs = fs = cs = 0;
 	compiled = false;
 	from_atlas = false;
-
+	pending = false;
+	pending_key = 0;
+	for (int i = 0; i < NUM_UNIFORM_BLOCKS; ++i)
+	{
+		has_block[i] = false;
+		block_versions[i] = 0;
+	}
 }
 
 Shader::~Shader()
@@ -225,7 +356,7 @@ bool Shader::hasInfoLog() const
 
 // ******************************************
 
-bool Shader::compileRasterShaderFromMemory(const std::string& vsm, const std::string& psm)
+bool Shader::compileRasterShaderFromMemory(const std::string& vsm, const std::string& psm, bool wait)
 {
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -240,21 +371,35 @@ bool Shader::compileRasterShaderFromMemory(const std::string& vsm, const std::st
 	program = glCreateProgram();
 	assert (glGetError() == GL_NO_ERROR);
 
-	if (!createVertexShaderObject(vsm))
+	pending = false;
+	if (!createShaderObject(GL_VERTEX_SHADER, vs, vsm, wait))
 	{
 		printf("Vertex shader compilation failed\n");
 		return false;
 	}
 
-	if (!createFragmentShaderObject(psm))
+	if (!createShaderObject(GL_FRAGMENT_SHADER, fs, psm, wait))
 	{
 		printf("Fragment shader compilation failed\n");
 		return false;
 	}
 
+	//force the fixed locations so mesh VAOs dont depend on the shader (layout qualifiers in the code take precedence)
+	for (int i = 0; i < ATTRIB_COUNT; ++i)
+		glBindAttribLocation(program, i, s_attrib_names[i]);
+
+	if (use_binary_cache && isBinaryCacheSupported())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
+	s_type = RASTER_SHADER;
+	if (!wait) //the errors of the stages are checked with the link
+	{
+		pending = true;
+		return true;
+	}
+
 	GLint linked=0;
     
 	glGetProgramiv(program,GL_LINK_STATUS,&linked);
@@ -273,9 +418,53 @@ bool Shader::compileRasterShaderFromMemory(const std::string& vsm, const std::st
 
 	compiled = true;
 	locations.clear(); //regenerate table
+	bindUniformBlocks();
 
-	s_type = RASTER_SHADER;
+	return true;
+}
+
+#ifndef GL_COMPLETION_STATUS_KHR
+	#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+bool Shader::isLinkDone()
+{
+	if (!pending)
+		return true;
+	GLint done = 1;
+	glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &done);
+	return done != 0;
+}
 
+bool Shader::finishLink()
+{
+	if (!pending)
+		return compiled;
+	pending = false;
+
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	assert(glGetError() == GL_NO_ERROR);
+	if (!linked)
+	{
+		//the log of the stage that failed, or the one of the link
+		GLint vs_compiled = 0, fs_compiled = 0;
+		glGetShaderiv(vs, GL_COMPILE_STATUS, &vs_compiled);
+		glGetShaderiv(fs, GL_COMPILE_STATUS, &fs_compiled);
+		if (!vs_compiled || !fs_compiled)
+		{
+			printf(vs_compiled ? "Fragment shader compilation failed\n" : "Vertex shader compilation failed\n");
+			saveShaderInfoLog(vs_compiled ? fs : vs);
+		}
+		else
+			saveProgramInfoLog(program);
+		release();
+		return false;
+	}
+
+	compiled = true;
+	locations.clear();
+	bindUniformBlocks();
 	return true;
 }
 
@@ -300,6 +489,8 @@ bool Shader::compileComputeShaderFromMemory(const std::string& csm) {
 		return false;
 	}
 
+	if (use_binary_cache && isBinaryCacheSupported())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(program);
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -346,6 +537,99 @@ bool Shader::validate()
 	return true;
 }
 
+void Shader::bindUniformBlocks()
+{
+	//GLSL 330 has no binding qualifier, the points are assigned here
+	for (int i = 0; i < NUM_UNIFORM_BLOCKS; ++i)
+	{
+		GLuint index = has_uniform_blocks ? glGetUniformBlockIndex(program, s_block_names[i]) : GL_INVALID_INDEX;
+		has_block[i] = index != GL_INVALID_INDEX;
+		block_versions[i] = 0; //a new program, its old uniforms are not set
+		if (has_block[i])
+			glUniformBlockBinding(program, index, i);
+	}
+}
+
+void Shader::UpdateUniformBlock(eUniformBlock block, const void* data, int size)
+{
+	assert(block < NUM_UNIFORM_BLOCKS);
+	s_block_data[block].assign((const uint8*)data, (const uint8*)data + size);
+	s_block_versions[block]++;
+	if (current && !current->has_block[block])
+		current->uploadLegacyBlock(block);
+	if (!s_block_buffers[block])
+		return; //no uniform blocks in this context
+	s_block_buffers[block]->updateFromPointer(data, size);
+	s_block_buffers[block]->bind(nullptr, block);
+}
+
+void Shader::UpdateUniformBlockRange(eUniformBlock block, const void* data, int offset, int size)
+{
+	assert(block < NUM_UNIFORM_BLOCKS && offset >= 0 && offset + size <= (int)s_block_data[block].size());
+	memcpy(&s_block_data[block][offset], data, size);
+	s_block_versions[block]++;
+	if (current && !current->has_block[block])
+		current->uploadLegacyBlock(block);
+	if (s_block_buffers[block])
+		s_block_buffers[block]->updateRange(data, offset, size); //still bound to its point
+}
+
+void Shader::uploadLegacyBlock(eUniformBlock block)
+{
+	block_versions[block] = s_block_versions[block];
+	const std::vector<uint8>& data = s_block_data[block];
+	if (block == CAMERA_BLOCK && data.size() == sizeof(sCameraBlock))
+	{
+		sCameraBlock camera;
+		memcpy(&camera, &data[0], sizeof(camera));
+		setMatrix44("u_viewprojection", camera.viewprojection);
+		setUniform3("u_camera_pos", camera.camera_pos);
+		setUniform3("u_camera_position", camera.camera_pos);
+	}
+	else if (block == FRAME_BLOCK && data.size() == sizeof(sFrameBlock))
+	{
+		sFrameBlock frame;
+		memcpy(&frame, &data[0], sizeof(frame));
+		setUniform1("u_time", frame.time);
+		setUniform3("u_light_ambient", frame.light_ambient);
+		setUniform1("u_light_count", frame.light_count);
+		setUniform1("u_irr_enabled", frame.irr_enabled);
+		setUniform3("u_irr_start", frame.irr_start.x, frame.irr_start.y, frame.irr_start.z);
+		setUniform3("u_irr_inv_delta", frame.irr_inv_delta.x, frame.irr_inv_delta.y, frame.irr_inv_delta.z);
+		setUniform3("u_irr_dims", frame.irr_dims.x, frame.irr_dims.y, frame.irr_dims.z);
+		if (frame.light_count <= 0)
+			return;
+
+		//the block pads every element to a vec4, the plain arrays are packed
+		int count = frame.light_count;
+		float vec3s[3][BLOCK_MAX_LIGHTS * 3];
+		float floats[5][BLOCK_MAX_LIGHTS];
+		int types[BLOCK_MAX_LIGHTS];
+		for (int i = 0; i < count; ++i)
+		{
+			memcpy(&vec3s[0][i * 3], frame.light_pos[i].v, sizeof(float) * 3);
+			memcpy(&vec3s[1][i * 3], frame.light_color[i].v, sizeof(float) * 3);
+			memcpy(&vec3s[2][i * 3], frame.light_dir[i].v, sizeof(float) * 3);
+			floats[0][i] = frame.light_int[i].x;
+			floats[1][i] = frame.light_min[i].x;
+			floats[2][i] = frame.light_max[i].x;
+			floats[3][i] = frame.light_cone_max[i].x;
+			floats[4][i] = frame.light_cone_min[i].x;
+			types[i] = frame.light_type[i][0];
+		}
+		setUniform3Array("u_light_pos", vec3s[0], count);
+		setUniform3Array("u_light_color", vec3s[1], count);
+		setUniform3Array("u_light_dir", vec3s[2], count);
+		setUniform1Array("u_light_int", floats[0], count);
+		setUniform1Array("u_light_min", floats[1], count);
+		setUniform1Array("u_light_max", floats[2], count);
+		setUniform1Array("u_light_cone_max", floats[3], count);
+		setUniform1Array("u_light_cone_min", floats[4], count);
+		setUniform1Array("u_light_type", types, count);
+	}
+	//the values of the materials are set in every draw by Material::bind
+}
+
 bool Shader::createVertexShaderObject(const std::string& shader)
 {
 	return createShaderObject(GL_VERTEX_SHADER,vs,shader);
@@ -362,7 +646,7 @@ bool Shader::createComputeShaderObject(const std::string& shader)
 }
 
 
-bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code)
+bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code, bool check)
 {
 	if (handle != 0)
 		glDeleteShader(handle);
@@ -380,8 +664,10 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	glCompileShader(handle);
 	assert( glGetError() == GL_NO_ERROR );
 
-	GLint compile=0;
-	glGetShaderiv(handle,GL_COMPILE_STATUS,&compile);
+	//querying the status waits for the compilation
+	GLint compile=1;
+	if (check)
+		glGetShaderiv(handle,GL_COMPILE_STATUS,&compile);
 	assert( glGetError() == GL_NO_ERROR );
 
 	//we want to see the compile log if we are in debug (to check warnings)
@@ -443,6 +729,7 @@ void Shader::release()
 	locations.clear();
 
 	compiled = false;
+	pending = false;
 }
 
 
@@ -458,6 +745,11 @@ void Shader::enable()
 	assert (err == GL_NO_ERROR);
 
 	last_slot = 0;
+
+	//only the blocks updated since it was enabled the last time
+	for (int i = 0; i < NUM_UNIFORM_BLOCKS; ++i)
+		if (!has_block[i] && block_versions[i] != s_block_versions[i])
+			uploadLegacyBlock((eUniformBlock)i);
 }
 
 
@@ -615,6 +907,9 @@ int Shader::getUniformBlockLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
+	tex->last_used_frame = Residency::frame;
+	if (tex->evicted)
+		tex->makeResident();
 	glActiveTexture(GL_TEXTURE0 + slot);
 	glBindTexture(tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
@@ -837,9 +1132,19 @@ void Shader::init()
 		IMPORT_GLEXT( glUniform4fv );
 		IMPORT_GLEXT( glUniformMatrix4fv );
 	#endif
+
+		//the osx context is 2.1, there the programs read the blocks from plain uniforms
+		GLint major = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetError(); //GL_MAJOR_VERSION is not known before 3.0
+		has_uniform_blocks = major >= 3 || SDL_GL_ExtensionSupported("GL_ARB_uniform_buffer_object");
 	}
 	
 	firsttime = false;
+
+	for (int i = 0; i < NUM_UNIFORM_BLOCKS && has_uniform_blocks; ++i)
+		if (!s_block_buffers[i])
+			s_block_buffers[i] = new BufferObject(s_block_names[i]);
 }
 
 Shader* Shader::getDefaultShader(std::string name)
@@ -1068,8 +1373,24 @@ bool Shader::_ProcessShaderAtlas(const char* filename, const char* base_path_cst
 
 bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 {
+	auto start_time = std::chrono::high_resolution_clock::now();
+	uint32 previous_hits = num_binary_hits;
+	int num_programs = 0;
 	std::vector<std::string> lines;
+	if (s_shader_atlas_filename.size() && s_shader_atlas_filename != filename) //another atlas has its own .pbin
+	{
+		SaveBinaryCache();
+		s_binaries.clear();
+		s_binaries_loaded = false;
+		SavePermutationManifest();
+		s_manifest.clear();
+	}
 	s_shader_atlas_filename = filename;
+	if (clear_binary_cache) //requested before the name of the .pbin was known
+	{
+		ClearBinaryCache();
+		clear_binary_cache = false;
+	}
 
 	// Load all the different files from the atlas
 	if (!_ProcessShaderAtlas(filename, base_path_cstr, lines)) {
@@ -1122,6 +1443,7 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 			}
 			shader->cs_filename = vs_filename;
 			shader->from_atlas = true;
+			num_programs++;
 			std::cout << " + Compute shader from atlas: " << TermColor::CYAN << name << TermColor::DEFAULT << std::endl;
 		}
 		else //regular shader
@@ -1145,10 +1467,17 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 			shader->vs_filename = vs_filename;
 			shader->fs_filename = fs_filename;
 			shader->from_atlas = true;
+			num_programs++;
 			std::cout << " + Raster shader from atlas: " << TermColor::CYAN << name << TermColor::DEFAULT << std::endl;
 		}
 	}
 
+	if (warm_permutations)
+		LoadPermutationManifest();
+	SaveBinaryCache();
+	SavePermutationManifest();
+	atlas_load_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	std::cout << " + Shader atlas: " << num_programs << " programs in " << atlas_load_time << " ms (" << num_binary_hits - previous_hits << " from the binary cache)" << std::endl;
 	return true;
 }
 
@@ -1230,7 +1559,7 @@ void _compileShaderProcessMacros(const char* macros, std::string &shader_code) {
 	shader_code = version_shader + "\n" + macros_str + "\n" + shader_code;
 }
 
-Shader* Shader::CompileShader(const eShaderType type, const char* name, const char* vs_code, const char* fs_code, const char* macros = nullptr)
+Shader* Shader::CompileShader(const eShaderType type, const char* name, const char* vs_code, const char* fs_code, const char* macros, bool wait)
 {
 	//expand macros
 	std::string vs(vs_code);
@@ -1254,11 +1583,24 @@ Shader* Shader::CompileShader(const eShaderType type, const char* name, const ch
 	else
 		shader = it2->second;
 
-	bool compile_shader_result;
-	if (type == COMPUTE_SHADER) {
-		compile_shader_result = shader->compileComputeShaderFromMemory(vs.c_str());
-	} else {
-		compile_shader_result = shader->compileRasterShaderFromMemory(vs.c_str(), fs.c_str());
+	//the binary of a previous launch skips the compilation and the link
+	uint64 key = use_binary_cache && isBinaryCacheSupported() ? GetBinaryKey(type, vs, fs) : 0;
+	bool compile_shader_result = key && shader->loadBinary(type, key);
+	if (compile_shader_result)
+		num_binary_hits++;
+	else
+	{
+		if (type == COMPUTE_SHADER) {
+			compile_shader_result = shader->compileComputeShaderFromMemory(vs.c_str());
+		} else {
+			compile_shader_result = shader->compileRasterShaderFromMemory(vs.c_str(), fs.c_str(), wait);
+		}
+		shader->pending_key = shader->pending ? key : 0; //stored by finishLink's caller
+		if (compile_shader_result && key && !shader->pending)
+		{
+			shader->storeBinary(key);
+			num_binary_misses++;
+		}
 	}
 
 	if (!compile_shader_result)
@@ -1292,15 +1634,51 @@ bool Shader::GetShaderFile(const char* filename, std::string& content)
 	return false;
 }
 
-Shader* Shader::UberShader::get(uint64 macros)
+Shader* Shader::UberShader::get(uint64 macros, bool wait)
 {
 	auto it = compiled_shaders.find(macros);
 	if (it != compiled_shaders.end())
 		return it->second;
 
 	if (has_error)
+	{
+		pending_shaders.clear(); //nothing else compiles
 		return nullptr;
+	}
 
+	auto pending_it = pending_shaders.find(macros);
+	if (wait || !async_permutations || macros == fallback_macros)
+	{
+		Shader* shader = pending_it != pending_shaders.end() ? pending_it->second : nullptr;
+		if (pending_it != pending_shaders.end())
+			pending_shaders.erase(pending_it);
+		if (shader) //already linking, wait for it
+			shader = finish(macros, shader) ? shader : nullptr;
+		else
+			shader = compile(macros);
+		return shader;
+	}
+
+	//requested now, ready in some frames
+	if (pending_it == pending_shaders.end())
+	{
+		Shader* shader = nullptr;
+		if (HasParallelCompile())
+		{
+			shader = compile(macros, false);
+			if (!shader)
+				return nullptr;
+			if (!shader->pending) //from the binary cache
+				return shader;
+		}
+		pending_shaders[macros] = shader;
+	}
+	num_fallbacks++;
+	return getFallback();
+}
+
+Shader* Shader::UberShader::compile(uint64 macros, bool wait)
+{
 	std::string fullname = name + "[" + std::to_string(macros) + "]";
 
 	std::string vs_code;
@@ -1310,36 +1688,67 @@ Shader* Shader::UberShader::get(uint64 macros)
 		!Shader::GetShaderFile(this->fs_name.c_str(), fs_code) )
 		return nullptr;
 
-	std::string macros_str;
-	if (macros)
-	{
-		int bit = 1;
-		int max_macros = this->macros.size() < 64 ? this->macros.size() : 64;
-		for (int i = 0; i < max_macros; ++i)
-		{
-			if (macros & bit << i)
-				macros_str += this->macros[i] + ",";
-		}
-		macros_str = macros_str.substr(0, macros_str.size() - 1); //remove last comma
-	}
-
-	Shader* shader = Shader::CompileShader(RASTER_SHADER, fullname.c_str(), vs_code.c_str(), fs_code.c_str(), macros_str.c_str());
+	Shader* shader = Shader::CompileShader(RASTER_SHADER, fullname.c_str(), vs_code.c_str(), fs_code.c_str(), getMacrosString(macros).c_str(), wait);
 	if (!shader)
 	{
 		has_error = true;
 		return nullptr;
 	}
-	compiled_shaders[macros] = shader;
 	shader->vs_filename = this->vs_name;
 	shader->fs_filename = this->fs_name;
 	shader->from_atlas = true;
-	std::cout << " + Shader from Ubershader: " << TermColor::CYAN << fullname << TermColor::DEFAULT << std::endl;
+	if (!shader->pending && !finish(macros, shader))
+		return nullptr;
 	return shader;
 }
 
+bool Shader::UberShader::finish(uint64 macros, Shader* shader)
+{
+	std::string fullname = name + "[" + std::to_string(macros) + "]";
+	if (shader->pending)
+	{
+		if (!shader->finishLink())
+		{
+			has_error = true;
+			std::cout << " * Compilation error in shader at atlas: " << fullname << std::endl;
+			s_Shaders.erase(fullname);
+			delete shader;
+			return false;
+		}
+		if (shader->pending_key)
+		{
+			shader->storeBinary(shader->pending_key);
+			num_binary_misses++;
+			shader->pending_key = 0;
+		}
+	}
+
+	compiled_shaders[macros] = shader;
+	std::string macros_str = getMacrosString(macros);
+	if (s_manifest.insert(macros_str.size() ? name + " " + macros_str : name).second)
+		s_manifest_dirty = true;
+	std::cout << " + Shader from Ubershader: " << TermColor::CYAN << fullname << TermColor::DEFAULT << std::endl;
+	return true;
+}
+
+std::string Shader::UberShader::getMacrosString(uint64 macros)
+{
+	std::string macros_str;
+	int max_macros = this->macros.size() < 64 ? this->macros.size() : 64;
+	for (int i = 0; i < max_macros; ++i)
+	{
+		if (macros & uint64(1) << i)
+			macros_str += this->macros[i] + ",";
+	}
+	if (macros_str.size())
+		macros_str = macros_str.substr(0, macros_str.size() - 1); //remove last comma
+	return macros_str;
+}
+
 void Shader::UberShader::clear()
 {
 	compiled_shaders.clear();
+	pending_shaders.clear();
 	//no need to delete shaders, as they are already in the global s_shaders container
 }
 
@@ -1353,6 +1762,377 @@ Shader::UberShader* Shader::GetUberShader(const char* name)
 
 // **************************************
 
+std::string Shader::GetBinaryCacheFilename()
+{
+	return (s_shader_atlas_filename.size() ? s_shader_atlas_filename : std::string("data/shaders")) + ".pbin";
+}
+
+uint64 Shader::GetBinaryKey(eShaderType type, const std::string& vs_code, const std::string& fs_code)
+{
+	uint64 hash = getDriverHash();
+	hash = hashBytes(hash, &type, sizeof(type));
+	hash = hashBytes(hash, vs_code.c_str(), vs_code.size() + 1);
+	hash = hashBytes(hash, fs_code.c_str(), fs_code.size() + 1);
+	for (int i = 0; i < ATTRIB_COUNT; ++i) //bound before linking, not in the code
+		hash = hashBytes(hash, s_attrib_names[i], strlen(s_attrib_names[i]) + 1);
+	return hash ? hash : 1; //0 means no key
+}
+
+bool Shader::loadBinary(eShaderType type, uint64 key)
+{
+	loadBinaryCacheFile();
+	auto it = s_binaries.find(key);
+	if (it == s_binaries.end())
+		return false;
+
+	release();
+	program = glCreateProgram();
+	glProgramBinary(program, it->second.format, &it->second.data[0], (GLsizei)it->second.data.size());
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	while (glGetError() != GL_NO_ERROR); //a rejected binary can raise an error too
+	if (!linked) //the driver changed the format, compile it again
+	{
+		glDeleteProgram(program);
+		program = 0;
+		s_binaries.erase(it);
+		s_binaries_dirty = true;
+		return false;
+	}
+
+	compiled = true;
+	locations.clear();
+	s_type = type;
+	if (type == RASTER_SHADER) //the bindings are not part of the binary
+		bindUniformBlocks();
+	return true;
+}
+
+void Shader::storeBinary(uint64 key)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+	loadBinaryCacheFile(); //so the file is not replaced with this binary alone
+	sProgramBinary& binary = s_binaries[key];
+	binary.data.resize(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, NULL, &format, &binary.data[0]);
+	binary.format = format;
+	s_binaries_dirty = true;
+}
+
+void Shader::Release()
+{
+	//the permutations compiled while running are written once, not after every compile
+	SaveBinaryCache();
+	SavePermutationManifest();
+
+	//their GL buffers go before the context, init creates them again
+	for (int i = 0; i < NUM_UNIFORM_BLOCKS; ++i)
+	{
+		delete s_block_buffers[i];
+		s_block_buffers[i] = nullptr;
+	}
+	s_ready = false;
+}
+
+void Shader::ClearBinaryCache()
+{
+	s_binaries.clear();
+	s_binaries_loaded = true; //the old file is not read again
+	s_binaries_dirty = false;
+	remove(GetBinaryCacheFilename().c_str());
+}
+
+bool Shader::SaveBinaryCache()
+{
+	if (!s_binaries_dirty || !use_binary_cache)
+		return true;
+	std::string filename = GetBinaryCacheFilename();
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write PBIN: " << filename << std::endl;
+		return false;
+	}
+
+	sProgramBinaryHeader header;
+	memcpy(header.magic, "PBIN", 4);
+	header.version = PROGRAM_BINARY_VERSION;
+	header.driver_hash = getDriverHash();
+	header.num_programs = (uint32)s_binaries.size();
+	header.padding = 0;
+	fwrite(&header, sizeof(header), 1, f);
+	for (auto& it : s_binaries)
+	{
+		uint32 size = (uint32)it.second.data.size();
+		fwrite(&it.first, sizeof(uint64), 1, f);
+		fwrite(&it.second.format, sizeof(uint32), 1, f);
+		fwrite(&size, sizeof(uint32), 1, f);
+		fwrite(&it.second.data[0], 1, size, f);
+	}
+	fclose(f);
+	s_binaries_dirty = false;
+	return true;
+}
+
+bool Shader::BenchmarkAtlas(const char* filename)
+{
+	if (!isBinaryCacheSupported())
+	{
+		std::cout << "[WARN] program binaries not supported by this driver, nothing to cache" << std::endl;
+		return false;
+	}
+
+	bool previous_cache = use_binary_cache;
+	double times[3];
+
+	//everything from the code, then an empty cache that stores the binaries, then the warm one
+	use_binary_cache = false;
+	bool ok = LoadAtlas(filename);
+	times[0] = atlas_load_time;
+	use_binary_cache = true;
+	ClearBinaryCache();
+	ok = ok && LoadAtlas(filename);
+	times[1] = atlas_load_time;
+	uint32 hits = num_binary_hits;
+	uint32 misses = num_binary_misses;
+	ok = ok && LoadAtlas(filename);
+	times[2] = atlas_load_time;
+	bool warm = num_binary_misses == misses && num_binary_hits > hits;
+	ok = ok && warm;
+
+	std::cout << "Shader atlas " << filename << ": compiled " << times[0] << "ms, storing binaries " << times[1] << "ms, from the cache "
+		<< TermColor::GREEN << times[2] << "ms" << TermColor::DEFAULT << " x" << times[0] / times[2] << " (" << num_binary_hits - hits << " binaries)" << std::endl;
+	if (!warm)
+		std::cout << TermColor::RED << " [ERROR] the warm load compiled some programs" << TermColor::DEFAULT << std::endl;
+
+	use_binary_cache = previous_cache;
+	return ok;
+}
+
+void Shader::showUI()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Program binary cache (.pbin)", &use_binary_cache);
+	ImGui::Text("Atlas loaded in %.1fms, binaries: %d hits %d compiled", atlas_load_time, num_binary_hits, num_binary_misses);
+	if (ImGui::Button("Clear shader cache"))
+		ClearBinaryCache();
+
+	ImGui::Checkbox("Async permutations", &async_permutations);
+	ImGui::SameLine();
+	ImGui::Checkbox("Warm up from the manifest", &warm_permutations);
+	if (!HasParallelCompile())
+		ImGui::SliderFloat("Compile budget (ms)", &compile_budget, 0.0f, 16.0f);
+	ImGui::Text("%s, pending: %d, fallbacks used: %d, warm up %.1fms", HasParallelCompile() ? "Parallel compile (KHR)" : "Time sliced queue", GetNumPending(), num_fallbacks, permutations_time);
+#endif
+}
+
+bool Shader::HasParallelCompile()
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+		typedef void (*max_threads_func)(GLuint count);
+		max_threads_func max_threads = nullptr;
+		if (SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile"))
+			max_threads = (max_threads_func)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+		else if (SDL_GL_ExtensionSupported("GL_ARB_parallel_shader_compile")) //same enums
+			max_threads = (max_threads_func)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsARB");
+		supported = max_threads ? 1 : 0;
+		if (max_threads)
+			max_threads(0xFFFFFFFF); //as many threads as the driver wants
+	}
+	return supported == 1;
+}
+
+void Shader::UpdatePending()
+{
+	auto start_time = std::chrono::high_resolution_clock::now();
+	bool done = false;
+	for (auto& it : s_ubershaders)
+	{
+		UberShader* ubershader = it.second;
+		for (auto pending_it = ubershader->pending_shaders.begin(); pending_it != ubershader->pending_shaders.end() && !ubershader->has_error;)
+		{
+			uint64 macros = pending_it->first;
+			Shader* shader = pending_it->second;
+			//the queue compiles while there is budget left, at least one per frame
+			double elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+			if (shader ? !shader->isLinkDone() : done && elapsed > compile_budget)
+			{
+				++pending_it;
+				continue;
+			}
+			pending_it = ubershader->pending_shaders.erase(pending_it);
+			if (shader)
+				ubershader->finish(macros, shader);
+			else
+				ubershader->compile(macros);
+			done = true;
+		}
+	}
+}
+
+void Shader::FinishPending()
+{
+	for (auto& it : s_ubershaders)
+		while (it.second->pending_shaders.size())
+			it.second->get(it.second->pending_shaders.begin()->first, true);
+}
+
+uint32 Shader::GetNumPending()
+{
+	uint32 num = 0;
+	for (auto& it : s_ubershaders)
+		num += (uint32)it.second->pending_shaders.size();
+	return num;
+}
+
+std::string Shader::GetManifestFilename()
+{
+	return (s_shader_atlas_filename.size() ? s_shader_atlas_filename : std::string("data/shaders")) + ".permutations";
+}
+
+bool Shader::LoadPermutationManifest()
+{
+	std::string content;
+	if (!readFile(GetManifestFilename(), content))
+		return false;
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	std::vector<std::pair<UberShader*, uint64>> permutations;
+	for (std::string line : tokenize(content, "\n"))
+	{
+		line = trim(line);
+		size_t pos = line.find(' ');
+		UberShader* ubershader = line.size() ? GetUberShader(line.substr(0, pos).c_str()) : nullptr;
+		if (!ubershader) //not in the atlas anymore
+			continue;
+		uint64 macros = 0;
+		bool valid = true;
+		if (pos != std::string::npos)
+			for (const std::string& macro : tokenize(line.substr(pos + 1), ","))
+			{
+				int index = ubershader->getMacroIndex(trim(macro).c_str());
+				valid = valid && index >= 0 && index < 64;
+				if (valid)
+					macros |= uint64(1) << index;
+			}
+		if (!valid)
+			continue;
+		s_manifest.insert(line); //the file is not written again for these
+		permutations.push_back(std::make_pair(ubershader, macros));
+	}
+
+	int num_compiled = 0;
+	for (auto& permutation : permutations)
+		if (permutation.first->get(permutation.second, true))
+			num_compiled++;
+
+	permutations_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	std::cout << " + Permutations from " << GetManifestFilename() << ": " << num_compiled << " in " << permutations_time << " ms" << std::endl;
+	return num_compiled == (int)permutations.size();
+}
+
+bool Shader::SavePermutationManifest()
+{
+	if (!s_manifest_dirty)
+		return true;
+	std::string filename = GetManifestFilename();
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write the permutations: " << filename << std::endl;
+		return false;
+	}
+	for (const std::string& line : s_manifest)
+		fprintf(f, "%s\n", line.c_str());
+	fclose(f);
+	s_manifest_dirty = false;
+	return true;
+}
+
+bool Shader::BenchmarkPermutations(const char* filename, const char* ubershader_name)
+{
+	bool previous_cache = use_binary_cache;
+	bool previous_async = async_permutations;
+	bool previous_warm = warm_permutations;
+	use_binary_cache = false; //so every permutation is compiled
+	warm_permutations = false;
+	std::string manifest; //restored at the end, the benchmark is not a real use
+	bool has_manifest = readFile(GetManifestFilename(), manifest);
+
+	if (!LoadAtlas(filename))
+		return false;
+	UberShader* ubershader = ubershader_name ? GetUberShader(ubershader_name) : (s_ubershaders.size() ? s_ubershaders.begin()->second : nullptr);
+	if (!ubershader)
+	{
+		std::cout << "[ERROR] no ubershader " << (ubershader_name ? ubershader_name : "") << " in " << filename << std::endl;
+		return false;
+	}
+	std::string name = ubershader->name;
+	uint64 num_permutations = uint64(1) << std::min((int)ubershader->macros.size(), 4); //the first 4 macros
+
+	//every permutation in a single frame
+	double max_sync = 0;
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (uint64 macros = 0; macros < num_permutations; ++macros)
+	{
+		auto frame_start = std::chrono::high_resolution_clock::now();
+		ubershader->get(macros, true);
+		max_sync = std::max(max_sync, std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - frame_start).count());
+	}
+	double sync_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	//the same requested every frame until none is pending, only the fallback waits
+	async_permutations = true;
+	LoadAtlas(filename);
+	ubershader = GetUberShader(name.c_str());
+	double max_async = 0;
+	int num_frames = 0;
+	bool ok = true;
+	start_time = std::chrono::high_resolution_clock::now();
+	do
+	{
+		auto frame_start = std::chrono::high_resolution_clock::now();
+		UpdatePending();
+		bool all_ready = true;
+		for (uint64 macros = 0; macros < num_permutations; ++macros)
+		{
+			ok = ok && ubershader->get(macros) != nullptr;
+			all_ready = all_ready && ubershader->isReady(macros);
+		}
+		max_async = std::max(max_async, std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - frame_start).count());
+		num_frames++;
+		if (all_ready)
+			break;
+		SDL_Delay(1); //the rest of the frame
+	} while (ok);
+	double async_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+
+	std::cout << "Permutations of " << name << " (" << num_permutations << "): sync " << sync_time << "ms, worst frame " << max_sync << "ms. Async ("
+		<< (HasParallelCompile() ? "parallel compile" : "time sliced") << ") " << async_time << "ms in " << num_frames << " frames, worst frame "
+		<< TermColor::GREEN << max_async << "ms" << TermColor::DEFAULT << std::endl;
+	if (!ok)
+		std::cout << TermColor::RED << " [ERROR] some permutations did not compile" << TermColor::DEFAULT << std::endl;
+
+	s_manifest.clear();
+	s_manifest_dirty = false;
+	if (has_manifest)
+		writeFile(GetManifestFilename(), manifest);
+	else
+		remove(GetManifestFilename().c_str());
+	use_binary_cache = previous_cache;
+	async_permutations = previous_async;
+	warm_permutations = previous_warm;
+	return ok;
+}
+
+// **************************************
+
 BufferObject::BufferObject()
 {
 	id = 0;
@@ -1416,6 +2196,14 @@ void BufferObject::updateFromPointer(const void* data, int size)
 	glBindBuffer(type, 0);
 }
 
+void BufferObject::updateRange(const void* data, int offset, int size)
+{
+	assert(id && size && offset + size <= (int)this->size);
+	glBindBuffer(type, id);
+	glBufferSubData(type, offset, size, data);
+	glBindBuffer(type, 0);
+}
+
 void BufferObject::readToPointer(void* data, int size)
 {
 	assert(size && id);
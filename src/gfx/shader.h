@@ -28,6 +28,68 @@ namespace GFX {
 		UNDEF_SHADER
 	};
 
+	//fixed attribute locations, bound to every program before linking so any mesh VAO works with any shader
+	enum eAttribLocation : uint8_t {
+		ATTRIB_VERTEX = 0u,
+		ATTRIB_NORMAL,
+		ATTRIB_COORD,
+		ATTRIB_COORD1,
+		ATTRIB_COLOR,
+		ATTRIB_BONES,
+		ATTRIB_WEIGHTS,
+		ATTRIB_COUNT
+	};
+
+	//uniform blocks of the atlas ("blocks"), bound to these points after linking
+	enum eUniformBlock : uint8_t {
+		CAMERA_BLOCK = 0u,	//when a camera is enabled
+		FRAME_BLOCK,		//once per frame: time, ambient, lights and irradiance volume
+		MATERIAL_BLOCK,		//once per frame: the materials drawn, indexed by u_material_index
+		NUM_UNIFORM_BLOCKS
+	};
+
+	#define BLOCK_MAX_LIGHTS 10
+	#define BLOCK_MAX_MATERIALS 256
+
+	//std140 layouts of "blocks": a vec3 takes 16 bytes unless a scalar follows, every element of an array takes 16 bytes
+	struct sCameraBlock {
+		Matrix44 viewprojection;
+		Vector3f camera_pos;
+		float padding;
+	};
+
+	struct sFrameBlock {
+		Vector3f light_ambient;
+		float time;
+		int light_count;
+		int irr_enabled;
+		int padding[2];
+		Vector4f irr_start; //xyz
+		Vector4f irr_inv_delta;
+		Vector4f irr_dims;
+		Vector4f light_pos[BLOCK_MAX_LIGHTS]; //xyz
+		Vector4f light_color[BLOCK_MAX_LIGHTS];
+		Vector4f light_dir[BLOCK_MAX_LIGHTS];
+		Vector4f light_int[BLOCK_MAX_LIGHTS]; //x
+		int light_type[BLOCK_MAX_LIGHTS][4]; //[i][0]
+		Vector4f light_min[BLOCK_MAX_LIGHTS];
+		Vector4f light_max[BLOCK_MAX_LIGHTS];
+		Vector4f light_cone_max[BLOCK_MAX_LIGHTS];
+		Vector4f light_cone_min[BLOCK_MAX_LIGHTS];
+	};
+
+	struct sMaterialBlock {
+		Vector4f color;
+		Vector3f emissive_factor;
+		float alpha_cutoff;
+		float shininess;
+		float roughness;
+		float metalness;
+		float padding;
+	};
+
+	static_assert(sizeof(sCameraBlock) == 80 && sizeof(sFrameBlock) == 1520 && sizeof(sMaterialBlock) == 48, "the blocks must match their std140 layout");
+
 	class Texture;
 	class UBO;
 
@@ -41,6 +103,9 @@ namespace GFX {
 
 	public:
 		static Shader* current;
+		static const char* s_attrib_names[ATTRIB_COUNT]; //indexed by eAttribLocation
+		static const char* s_block_names[NUM_UNIFORM_BLOCKS]; //indexed by eUniformBlock
+		static bool has_uniform_blocks; //the GL context supports them, set by init
 
 		Shader();
 		~Shader();
@@ -53,13 +118,15 @@ namespace GFX {
 		bool load(const std::string& csf, const char* macros);
 
 		//internal functions
-		bool compileRasterShaderFromMemory(const std::string& vsm, const std::string& psm);
+		bool compileRasterShaderFromMemory(const std::string& vsm, const std::string& psm, bool wait = true); //without waiting the link goes on in the driver, see finishLink
+		bool isLinkDone(); //GL_COMPLETION_STATUS_KHR, never blocks
+		bool finishLink(); //the status of a link that did not wait, blocks if it is not done
 		bool compileComputeShaderFromMemory(const std::string& csm);
 		void release();
 		void enable();
 		void disable();
 
-		static void init();
+		static void init(); //creates the buffers of the uniform blocks, see Release
 		static void disableShaders();
 
 		//check
@@ -134,7 +201,8 @@ namespace GFX {
 		std::string macros;
 		bool compiled;
 		bool from_atlas;
-
+		bool pending; //linking in the threads of the driver
+		uint64 pending_key; //binary to store when the link is done
 		GLuint vs;
 		GLuint fs;
 		GLuint cs; //compute
@@ -147,11 +215,20 @@ namespace GFX {
 		bool createVertexShaderObject(const std::string& shader);
 		bool createFragmentShaderObject(const std::string& shader);
 		bool createComputeShaderObject(const std::string& shader); //not used yet
-		bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
+		bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader, bool check = true);
 		void saveShaderInfoLog(GLuint obj);
 		void saveProgramInfoLog(GLuint obj);
 
 		bool validate();
+		void bindUniformBlocks(); //to their eUniformBlock points, after linking
+
+		//uploads the data of a block and binds it to its point, every program that includes "blocks" reads it
+		static void UpdateUniformBlock(eUniformBlock block, const void* data, int size);
+		static void UpdateUniformBlockRange(eUniformBlock block, const void* data, int offset, int size); //part of a block already uploaded
+		//programs without a block (the osx atlas is GLSL 120) get its values in their old uniforms when enabled
+		bool has_block[NUM_UNIFORM_BLOCKS];
+		uint32 block_versions[NUM_UNIFORM_BLOCKS]; //of the values in the old uniforms
+		void uploadLegacyBlock(eUniformBlock block);
 
 		void computeDispatch(const uint32_t dispatch_x, const uint32_t dispatch_y, const uint32_t dispatch_z, const bool wait_for = true);
 
@@ -170,12 +247,49 @@ namespace GFX {
 		static std::map<std::string, std::string> s_shader_files; //stores strings with shadercode
 
 		//compiles and stores shader, if exist it will recompile it!
-		static Shader* CompileShader(const eShaderType type, const char* name, const char* vs_code, const char* fs_code, const char* macros);
+		static Shader* CompileShader(const eShaderType type, const char* name, const char* vs_code, const char* fs_code, const char* macros, bool wait = true);
 		static std::string ExpandIncludes(std::string name, std::string content, std::map<std::string, std::string>& subfiles, const std::string& base_path);
 		static bool LoadAtlas(const char* filename, const char* base_path = nullptr);
 		static bool _ProcessShaderAtlas(const char* filename, const char* base_path_cstr, std::vector<std::string>& shader_lines);
 		static bool GetShaderFile(const char* filename, std::string& content);
 
+		//Program binary cache ************************
+		//linked programs are kept in a .pbin beside the atlas, keyed by a hash of the final code (macros expanded) and the driver,
+		//anything that does not match compiles from the code and its binary is stored for the next launch
+		static bool use_binary_cache;
+		static bool clear_binary_cache; //the next LoadAtlas starts with an empty cache
+		static uint32 num_binary_hits;
+		static uint32 num_binary_misses;
+		static double atlas_load_time; //ms of the last LoadAtlas
+		static std::string GetBinaryCacheFilename();
+		static uint64 GetBinaryKey(eShaderType type, const std::string& vs_code, const std::string& fs_code);
+		static void ClearBinaryCache(); //invalidates all, every program compiles again from the code
+		static bool SaveBinaryCache(); //only writes when there are new binaries
+		static void Release(); //saves the caches and frees the uniform blocks, before destroying the GL context
+		static bool BenchmarkAtlas(const char* filename); //load time compiling everything against a warm cache, needs a GL context
+		static void showUI();
+		bool loadBinary(eShaderType type, uint64 key);
+		void storeBinary(uint64 key);
+
+		//Asynchronous permutations ************************
+		//UberShader permutations requested while rendering do not stall the frame: with GL_KHR_parallel_shader_compile
+		//the driver links them in its threads and they are polled every frame, otherwise they wait in a queue
+		//that compiles a few ms per frame. Meanwhile UberShader::get returns the fallback permutation.
+		//Every permutation used goes to a manifest beside the atlas, LoadAtlas compiles them before the first frame.
+		static bool async_permutations;
+		static bool warm_permutations;
+		static float compile_budget; //ms per frame of the queue
+		static uint32 num_fallbacks; //times a fallback was returned
+		static double permutations_time; //ms of the last warm up
+		static bool HasParallelCompile();
+		static void UpdatePending(); //once per frame, registers the permutations that are ready
+		static void FinishPending(); //blocks until all are ready
+		static uint32 GetNumPending();
+		static std::string GetManifestFilename();
+		static bool LoadPermutationManifest(); //compiles every permutation of the manifest
+		static bool SavePermutationManifest(); //only writes when there are new permutations
+		static bool BenchmarkPermutations(const char* filename, const char* ubershader_name = nullptr); //frame stalls async against sync, needs a GL context
+
 		//UberShaders allow permutations, use @ as the first char in the name to specify it
 		class UberShader {
 		public:
@@ -183,17 +297,25 @@ namespace GFX {
 			std::string vs_name;
 			std::string fs_name;
 			bool has_error;
+			uint64 fallback_macros; //returned while a permutation compiles, always compiled synchronously
 			std::vector<std::string> macros;
 			std::map<std::string,int> macros_index;
 			std::map<uint64,Shader*> compiled_shaders;
+			std::map<uint64,Shader*> pending_shaders; //null while they wait in the queue
 			UberShader(std::string name, std::string vs_name, std::string fs_name, std::vector<std::string> macros) {
 				has_error = false;
+				fallback_macros = 0;
 				this->name = name, this->vs_name = vs_name, this->fs_name = fs_name, this->macros = macros;
 				for (size_t i = 0; i < macros.size(); ++i) 
 					macros_index[ macros[i] ] = i;
 			}
-			Shader* get(uint64 macros);
+			Shader* get(uint64 macros, bool wait = false); //without waiting it can return the fallback
+			Shader* getFallback() { return get(fallback_macros, true); }
+			bool isReady(uint64 macros) { return compiled_shaders.find(macros) != compiled_shaders.end(); }
+			Shader* compile(uint64 macros, bool wait = true); //a pending shader if it did not wait
+			bool finish(uint64 macros, Shader* shader); //registers a pending shader, false if it failed
 			void clear();
+			std::string getMacrosString(uint64 macros); //comma separated
 			int getMacroIndex(const char* name) { auto it = macros_index.find(name); return it == macros_index.end() ? -1 : it->second; }
 		};
 		static std::map<std::string, UberShader*> s_ubershaders;
@@ -221,6 +343,7 @@ namespace GFX {
 		template <typename T>
 		void read(T& obj) { readToPointer(&obj, sizeof(T)); }
 		void updateFromPointer(const void* data, int size);
+		void updateRange(const void* data, int offset, int size); //keeps the rest of the buffer
 		void readToPointer(void* data, int size);
 		//the global index behaves similar to slots in textures, you bind a UBO to an index, and a block to the same index
 		void bind(Shader* shader, int global_index, int start = 0, int length = -1);
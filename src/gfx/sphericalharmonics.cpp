@@ -1,4 +1,18 @@
 #include "sphericalharmonics.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+#include "../extra/hdre.h"
+
+#include <cmath>
+#include <mutex>
+#include <memory>
+#include <map>
+#include <chrono>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    #include <emmintrin.h>
+    #define SH_SSE
+#endif
 
 //system axis
 Vector3f cubemapFaceNormals[6][3] = {
@@ -12,114 +26,418 @@ Vector3f cubemapFaceNormals[6][3] = {
     {{-1, 0, 0},{0, -1, 0},{0, 0, -1}}  // negz
 };
 
-const int sh_length = 9;
-std::vector< std::vector<Vector3f> > cubeMapVecs;
-int cubeMapVecs_size = 0;
+const int sh_max_coeffs = 16;
 
-float areaElement(float x, float y) {
-    return atan2(x * y, sqrtf(x * x + y * y + 1.0f));
+static double areaElement(double x, double y) {
+    return atan2(x * y, sqrt(x * x + y * y + 1.0));
 }
 
-float texelSolidAngle(float aU, float aV, float width, float height) {
+static double texelSolidAngle(float aU, float aV, float width, float height) {
     // transform from [0..res - 1] to [- (1 - 1 / res) .. (1 - 1 / res)]
     // ( 0.5 is for texel center addressing)
-    float  U = (2.0 * (aU + 0.5) / width) - 1.0;
-    float  V = (2.0 * (aV + 0.5) / height) - 1.0;
+    double U = (2.0 * (aU + 0.5) / width) - 1.0;
+    double V = (2.0 * (aV + 0.5) / height) - 1.0;
 
     // shift from a demi texel, mean 1.0 / size  with U and V in [-1..1]
-    float  invResolutionW = 1.0 / width;
-    float  invResolutionH = 1.0 / height;
+    double invResolutionW = 1.0 / width;
+    double invResolutionH = 1.0 / height;
 
     // U and V are the -1..1 texture coordinate on the current face.
     // get projected area for this texel
-    float  x0 = U - invResolutionW;
-    float  y0 = V - invResolutionH;
-    float  x1 = U + invResolutionW;
-    float  y1 = V + invResolutionH;
-    float  angle = areaElement(x0, y0) - areaElement(x0, y1) - areaElement(x1, y0) + areaElement(x1, y1);
+    double x0 = U - invResolutionW;
+    double y0 = V - invResolutionH;
+    double x1 = U + invResolutionW;
+    double y1 = V + invResolutionH;
+    double angle = areaElement(x0, y0) - areaElement(x0, y1) - areaElement(x1, y0) + areaElement(x1, y1);
     return angle;
 }
 
-// give me a cubemap, its size and number of channels
-// and i'll give you spherical harmonics
-SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
-	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
-    int size = images[0].width;
-    int channels = 3;
+// per face size: the texel center direction before applying the face axis (U, V, 1) / length
+// and its solid angle, the same for the six faces. Rows are padded to 4 texels with weight 0
+struct sSHTable {
+    int size;
+    int stride;
+    std::vector<float> a, b, c, w;
+    double total_weight; // of the six faces, close to 4PI
+};
+
+static std::shared_ptr<sSHTable> getSHTable(int size)
+{
+    static std::mutex mutex;
+    static std::map<int, std::shared_ptr<sSHTable>> tables;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<sSHTable>& table = tables[size];
+    if (table)
+        return table;
+
+    table = std::make_shared<sSHTable>();
+    table->size = size;
+    table->stride = (size + 3) & ~3;
+    size_t count = size_t(table->stride) * size;
+    table->a.assign(count, 0.0f);
+    table->b.assign(count, 0.0f);
+    table->c.assign(count, 0.0f);
+    table->w.assign(count, 0.0f);
+    double total = 0;
+    for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
+        {
+            double U = 2.0 * (x + 0.5) / size - 1.0;
+            double V = 2.0 * (y + 0.5) / size - 1.0;
+            double inv_length = 1.0 / sqrt(U * U + V * V + 1.0);
+            size_t i = size_t(y) * table->stride + x;
+            table->a[i] = float(U * inv_length);
+            table->b[i] = float(V * inv_length);
+            table->c[i] = float(inv_length);
+            double weight = texelSolidAngle((float)x, (float)y, (float)size, (float)size);
+            table->w[i] = float(weight);
+            total += weight;
+        }
+    table->total_weight = total * 6.0;
+    return table;
+}
+
+// x^2.2 for gamma encoded pixels, interpolated from a table in [0..1]
+static float degammaValue(float v)
+{
+    const int steps = 4096;
+    static std::vector<float> table = []() {
+        std::vector<float> t(steps + 2);
+        for (int i = 0; i <= steps + 1; ++i)
+            t[i] = (float)pow(i / double(steps), 2.2);
+        return t;
+    }();
+    if (!(v > 0.0f))
+        return 0.0f;
+    if (v >= 1.0f)
+        return powf(v, 2.2f);
+    float f = v * steps;
+    int i = (int)f;
+    return table[i] + (table[i + 1] - table[i]) * (f - i);
+}
+
+#ifdef SH_SSE
+struct SHFloat4 {
+    __m128 v;
+    SHFloat4() {}
+    SHFloat4(__m128 v) : v(v) {}
+    SHFloat4(float f) : v(_mm_set1_ps(f)) {}
+};
+static inline SHFloat4 operator+(SHFloat4 a, SHFloat4 b) { return _mm_add_ps(a.v, b.v); }
+static inline SHFloat4 operator-(SHFloat4 a, SHFloat4 b) { return _mm_sub_ps(a.v, b.v); }
+static inline SHFloat4 operator*(SHFloat4 a, SHFloat4 b) { return _mm_mul_ps(a.v, b.v); }
+#endif
+
+// real SH basis, written once for floats and for 4 texels at a time
+template<class T> static inline void shBasis(T x, T y, T z, int order, T* b)
+{
+    b[0] = T(0.282094792f);
+    if (order < 1)
+        return;
+    b[1] = y * T(0.488602512f);
+    b[2] = z * T(0.488602512f);
+    b[3] = x * T(0.488602512f);
+    if (order < 2)
+        return;
+    T xx = x * x;
+    T yy = y * y;
+    T zz = z * z;
+    b[4] = x * y * T(1.092548431f);
+    b[5] = y * z * T(1.092548431f);
+    b[6] = (zz * T(3.0f) - T(1.0f)) * T(0.315391565f);
+    b[7] = x * z * T(1.092548431f);
+    b[8] = (xx - yy) * T(0.546274215f);
+    if (order < 3)
+        return;
+    b[9] = y * (xx * T(3.0f) - yy) * T(0.590043589f);
+    b[10] = x * y * z * T(2.890611442f);
+    b[11] = y * (zz * T(5.0f) - T(1.0f)) * T(0.457045799f);
+    b[12] = z * (zz * T(5.0f) - T(3.0f)) * T(0.373176333f);
+    b[13] = x * (zz * T(5.0f) - T(1.0f)) * T(0.457045799f);
+    b[14] = z * (xx - yy) * T(1.445305721f);
+    b[15] = x * (xx - yy * T(3.0f)) * T(0.590043589f);
+}
+
+SHProjection::SHProjection(int order)
+{
+    this->order = order;
+    for (int i = 0; i < sh_max_coeffs; ++i)
+        coeffs[i] = Vector3f(0, 0, 0);
+}
+
+void SHProjection::evalBasis(const Vector3f& dir, int order, float* basis)
+{
+    shBasis<float>(dir.x, dir.y, dir.z, order, basis);
+}
+
+Vector3f SHProjection::evaluate(const Vector3f& dir) const
+{
+    float basis[sh_max_coeffs];
+    evalBasis(dir, order, basis);
+    Vector3f result(0, 0, 0);
+    for (int i = 0; i < getNumCoeffs(); ++i)
+        result += coeffs[i] * basis[i];
+    return result;
+}
+
+SphericalHarmonics SHProjection::toIrradiance() const
+{
+    assert(order >= 2 && "irradiance needs 9 coefficients");
+    // forsyths weights over the basis constants, the same scale computeSH always had
+    const float weights[9] = { 4.0f / 17, 8.0f / 17, 8.0f / 17, 8.0f / 17, 15.0f / 17, 15.0f / 17, 5.0f / 68, 15.0f / 17, 15.0f / 68 };
+    const float constants[9] = { 0.282094792f, 0.488602512f, 0.488602512f, 0.488602512f, 1.092548431f, 1.092548431f, 0.315391565f, 1.092548431f, 0.546274215f };
     SphericalHarmonics sh;
+    for (int i = 0; i < 9; ++i)
+        sh.coeffs[i] = coeffs[i] * (weights[i] / (3.0f * constants[i]));
+    return sh;
+}
+
+// one row of a face, the channels are split (and degammaed) first so both paths read the same values
+struct sSHRow {
+    std::vector<float> r, g, b;
+};
 
-    // generate cube map vectors
-    if (cubeMapVecs_size != size)
+static void projectRowScalar(const sSHTable& table, const Vector3f* axis, int y, const sSHRow& row, int order, double* out)
+{
+    int num_coeffs = (order + 1) * (order + 1);
+    float acc[sh_max_coeffs][3] = {};
+    float basis[sh_max_coeffs];
+    size_t start = size_t(y) * table.stride;
+    for (int x = 0; x < table.stride; ++x)
     {
-        cubeMapVecs_size = size;
-        cubeMapVecs.clear();
-        for (int index = 0; index < 6; ++index)
+        float a = table.a[start + x], b = table.b[start + x], c = table.c[start + x], w = table.w[start + x];
+        shBasis<float>(axis[0].x * a + axis[1].x * b + axis[2].x * c, axis[0].y * a + axis[1].y * b + axis[2].y * c, axis[0].z * a + axis[1].z * b + axis[2].z * c, order, basis);
+        for (int k = 0; k < num_coeffs; ++k)
         {
-            std::vector<Vector3f> faceVecs;
-            for (int v = 0; v < size; v++) {
-                for (int u = 0; u < size; u++)
-                {
-                    float fU = (2.0f * u / (size - 1.0f)) - 1.0f;
-                    float fV = (2.0f * v / (size - 1.0f)) - 1.0f;
+            float bw = basis[k] * w;
+            acc[k][0] += row.r[x] * bw;
+            acc[k][1] += row.g[x] * bw;
+            acc[k][2] += row.b[x] * bw;
+        }
+    }
+    for (int k = 0; k < num_coeffs; ++k)
+        for (int c = 0; c < 3; ++c)
+            out[k * 3 + c] = acc[k][c];
+}
 
-                    Vector3f vecX = cubemapFaceNormals[index][0] * fU;
-                    Vector3f vecY = cubemapFaceNormals[index][1] * fV;
-                    Vector3f vecZ = cubemapFaceNormals[index][2];
+#ifdef SH_SSE
+static void projectRowSSE(const sSHTable& table, const Vector3f* axis, int y, const sSHRow& row, int order, double* out)
+{
+    int num_coeffs = (order + 1) * (order + 1);
+    __m128 acc[sh_max_coeffs][3];
+    for (int k = 0; k < num_coeffs; ++k)
+        acc[k][0] = acc[k][1] = acc[k][2] = _mm_setzero_ps();
+    SHFloat4 basis[sh_max_coeffs];
+    size_t start = size_t(y) * table.stride;
+    for (int x = 0; x < table.stride; x += 4)
+    {
+        SHFloat4 a = _mm_loadu_ps(&table.a[start + x]), b = _mm_loadu_ps(&table.b[start + x]), c = _mm_loadu_ps(&table.c[start + x]);
+        __m128 w = _mm_loadu_ps(&table.w[start + x]);
+        shBasis<SHFloat4>(a * axis[0].x + b * axis[1].x + c * axis[2].x, a * axis[0].y + b * axis[1].y + c * axis[2].y, a * axis[0].z + b * axis[1].z + c * axis[2].z, order, basis);
+        __m128 r = _mm_loadu_ps(&row.r[x]), g = _mm_loadu_ps(&row.g[x]), bl = _mm_loadu_ps(&row.b[x]);
+        for (int k = 0; k < num_coeffs; ++k)
+        {
+            __m128 bw = _mm_mul_ps(basis[k].v, w);
+            acc[k][0] = _mm_add_ps(acc[k][0], _mm_mul_ps(r, bw));
+            acc[k][1] = _mm_add_ps(acc[k][1], _mm_mul_ps(g, bw));
+            acc[k][2] = _mm_add_ps(acc[k][2], _mm_mul_ps(bl, bw));
+        }
+    }
+    float lanes[4];
+    for (int k = 0; k < num_coeffs; ++k)
+        for (int c = 0; c < 3; ++c)
+        {
+            _mm_storeu_ps(lanes, acc[k][c]);
+            out[k * 3 + c] = (double(lanes[0]) + lanes[1]) + (double(lanes[2]) + lanes[3]);
+        }
+}
+#endif
 
-                    Vector3f res = normalize(vecX + vecY + vecZ);
-                    faceVecs.push_back(res);
-                }
+bool projectSH(const float* const faces[6], int size, int num_channels, int order, SHProjection& out, bool degamma, bool use_simd)
+{
+    if (size <= 0 || order < 0 || order > 3 || (num_channels != 3 && num_channels != 4))
+        return false;
+    for (int i = 0; i < 6; ++i)
+        if (!faces[i])
+            return false;
+
+    std::shared_ptr<sSHTable> table = getSHTable(size);
+    int num_coeffs = (order + 1) * (order + 1);
+    int num_rows = size * 6;
+
+    // every row writes its own sums, added in order at the end so the result does not depend on the threads
+    std::vector<double> partials(size_t(num_rows) * num_coeffs * 3);
+    JobSystem::parallelFor(num_rows, 16, [&](int start, int end) {
+        sSHRow row;
+        row.r.assign(table->stride, 0.0f);
+        row.g.assign(table->stride, 0.0f);
+        row.b.assign(table->stride, 0.0f);
+        for (int i = start; i < end; ++i)
+        {
+            int face = i / size;
+            int y = i % size;
+            const float* pixels = faces[face] + size_t(y) * size * num_channels;
+            for (int x = 0; x < size; ++x, pixels += num_channels)
+            {
+                row.r[x] = degamma ? degammaValue(pixels[0]) : pixels[0];
+                row.g[x] = degamma ? degammaValue(pixels[1]) : pixels[1];
+                row.b[x] = degamma ? degammaValue(pixels[2]) : pixels[2];
             }
-            cubeMapVecs.push_back(faceVecs);
+            double* result = &partials[size_t(i) * num_coeffs * 3];
+        #ifdef SH_SSE
+            if (use_simd)
+            {
+                projectRowSSE(*table, cubemapFaceNormals[face], y, row, order, result);
+                continue;
+            }
+        #endif
+            projectRowScalar(*table, cubemapFaceNormals[face], y, row, order, result);
         }
+    });
+
+    std::vector<double> sums(num_coeffs * 3, 0.0);
+    for (int i = 0; i < num_rows; ++i)
+        for (int k = 0; k < num_coeffs * 3; ++k)
+            sums[k] += partials[size_t(i) * num_coeffs * 3 + k];
+
+    // the solid angles do not add exactly to 4PI, normalized as before
+    double scale = 4.0 * PI / table->total_weight;
+    out = SHProjection(order);
+    for (int k = 0; k < num_coeffs; ++k)
+        out.coeffs[k] = Vector3f(float(sums[k * 3] * scale), float(sums[k * 3 + 1] * scale), float(sums[k * 3 + 2] * scale));
+    return true;
+}
+
+bool projectSH(HDRE* hdre, int level, int order, SHProjection& out)
+{
+    float** faces = hdre ? hdre->getFacesf(level) : nullptr;
+    if (!faces)
+        return false;
+    return projectSH(faces, hdre->getLevelWidth(level), hdre->header.numChannels, order, out);
+}
+
+SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
+	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
+    const float* faces[6];
+    for (int i = 0; i < 6; ++i)
+        faces[i] = images[i].data;
+
+    SHProjection projection(2);
+    if (!projectSH(faces, images[0].width, images[0].num_channels, 2, projection, degamma))
+        return SphericalHarmonics();
+    return projection.toIrradiance();
+}
+
+bool benchmarkSH(const char* filename, int iterations)
+{
+    // the faces of the level 0 of an HDRE or an image repeated on the six faces
+    std::vector<float> pixels;
+    std::vector<const float*> faces(6);
+    int size = 0;
+    int num_channels = 3;
+    bool degamma = false;
+    std::string ext = toLowerCase(getExtension(filename));
+    if (ext == "hdre")
+    {
+        HDRE* hdre = HDRE::Get(filename);
+        if (!hdre || !hdre->getFacesf(0))
+            return false;
+        size = hdre->getLevelWidth(0);
+        num_channels = hdre->header.numChannels;
+        for (int i = 0; i < 6; ++i)
+            faces[i] = hdre->getFacef(0, i);
+    }
+    else
+    {
+        ::Image image;
+        if (!image.load(filename))
+            return false;
+        size = std::min(image.width, image.height);
+        num_channels = image.num_channels;
+        pixels.resize(size_t(size) * size * num_channels);
+        for (int y = 0; y < size; ++y)
+            for (int x = 0; x < size * num_channels; ++x)
+                pixels[size_t(y) * size * num_channels + x] = image.data[size_t(y) * image.width * num_channels + x] / 255.0f;
+        for (int i = 0; i < 6; ++i)
+            faces[i] = &pixels[0];
+        degamma = true;
     }
+    if (num_channels != 3 && num_channels != 4)
+        return false;
 
-    // generate spherical harmonics
-    float weightAccum = 0;
+    bool ok = true;
+    auto start = std::chrono::high_resolution_clock::now();
+    getSHTable(size);
+    double table_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << filename << " faces " << size << "x" << size << "x" << num_channels << " table: " << table_time << "ms" << std::endl;
 
-    for (int index = 0; index < 6; ++index)
+    for (int order = 1; order <= 3; ++order)
     {
-        FloatImage& face = images[index];
-        float* pixels = face.data;
-        bool gammaCorrect = degamma;
-        for (int y = 0; y < size; y++) {
-            for (int x = 0; x < size; x++) {
-                Vector3f texelVect = cubeMapVecs[index][y * size + x];
-                float weight = texelSolidAngle(x, y, size, size);
-                    // forsyths weights
-                float weight1 = weight * 4 / 17;
-                float weight2 = weight * 8 / 17;
-                float weight3 = weight * 15 / 17;
-                float weight4 = weight * 5 / 68;
-                float weight5 = weight * 15 / 68;
-
-                float dx = texelVect[0];
-                float dy = texelVect[1];
-                float dz = texelVect[2];
-
-                Vector3f value = face.getPixel(x,y).xyz();
-                if (gammaCorrect)
-                    value = Vector3f(pow(value.x, 2.2), pow(value.y, 2.2), pow(value.z, 2.2));
-                    
-                sh.coeffs[0] += value * weight1;
-                sh.coeffs[1] += value * weight2 * dy;
-                sh.coeffs[2] += value * weight2 * dz;
-                sh.coeffs[3] += value * weight2 * dx;
-
-                sh.coeffs[4] += value * weight3 * dx * dy;
-                sh.coeffs[5] += value * weight3 * dy * dz;
-                sh.coeffs[6] += value * weight4 * (3.0f * dz * dz - 1.0f);
-
-                sh.coeffs[7] += value * weight3 * dx * dz;
-                sh.coeffs[8] += value * weight5 * (dx * dx - dy * dy);
-
-                weightAccum += weight * 3.0f;
-            }
+        SHProjection results[2];
+        double times[2] = { 0, 0 };
+        for (int simd = 0; simd < 2; ++simd)
+        {
+            start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; ++i)
+                projectSH(&faces[0], size, num_channels, order, results[simd], degamma, simd != 0);
+            times[simd] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
         }
-    };
 
-    SphericalHarmonics linear_sh;
-    for (int i = 0; i < sh_length; i++)
-        linear_sh.coeffs[i] = sh.coeffs[i] * (float)(4 * PI / weightAccum);
-    return linear_sh;
+        // the sums are done in another order, only rounding differences are expected
+        float max_error = 0;
+        float max_value = 0;
+        for (int k = 0; k < results[0].getNumCoeffs(); ++k)
+            for (int c = 0; c < 3; ++c)
+            {
+                max_error = std::max(max_error, (float)fabs(results[0].coeffs[k][c] - results[1].coeffs[k][c]));
+                max_value = std::max(max_value, (float)fabs(results[0].coeffs[k][c]));
+            }
+        bool same = max_error <= max_value * 1e-4f;
+        ok = ok && same;
+        std::cout << " L" << order << ": scalar " << times[0] << "ms SIMD " << TermColor::GREEN << times[1] << "ms" << TermColor::DEFAULT << " x" << times[0] / times[1]
+            << (same ? " same result" : " [ERROR] different from the scalar path") << std::endl;
+    }
+
+    // analytic checks: a constant and every basis function must project to themselves
+    int check_size = 64;
+    std::vector<float> check(size_t(check_size) * check_size * 3 * 6);
+    const float* check_faces[6];
+    for (int i = 0; i < 6; ++i)
+        check_faces[i] = &check[size_t(i) * check_size * check_size * 3];
+    float max_error = 0;
+    float irradiance_error = 0;
+    for (int target = -1; target < sh_max_coeffs; ++target)
+    {
+        for (int face = 0; face < 6; ++face)
+            for (int y = 0; y < check_size; ++y)
+                for (int x = 0; x < check_size; ++x)
+                {
+                    Vector3f* axis = cubemapFaceNormals[face];
+                    float U = 2.0f * (x + 0.5f) / check_size - 1.0f;
+                    float V = 2.0f * (y + 0.5f) / check_size - 1.0f;
+                    Vector3f dir = normalize(axis[0] * U + axis[1] * V + axis[2]);
+                    float basis[sh_max_coeffs];
+                    SHProjection::evalBasis(dir, 3, basis);
+                    float value = target < 0 ? 1.0f : basis[target];
+                    float* p = &check[((size_t(face) * check_size + y) * check_size + x) * 3];
+                    p[0] = value;
+                    p[1] = value * 0.5f;
+                    p[2] = -value;
+                }
+        SHProjection projection;
+        projectSH(check_faces, check_size, 3, 3, projection);
+        for (int k = 0; k < sh_max_coeffs; ++k)
+        {
+            float expected = target < 0 ? (k == 0 ? float(2.0 * sqrt(PI)) : 0.0f) : (k == target ? 1.0f : 0.0f);
+            max_error = std::max(max_error, (float)fabs(projection.coeffs[k].x - expected));
+            max_error = std::max(max_error, (float)fabs(projection.coeffs[k].y - expected * 0.5f));
+            max_error = std::max(max_error, (float)fabs(projection.coeffs[k].z + expected));
+        }
+        if (target < 0) // a constant radiance of 1 comes back as ~1, forsyths window scales it a bit
+            irradiance_error = (float)fabs(projection.toIrradiance().coeffs[0].x - 1.0f);
+    }
+    bool exact = max_error < 0.01f && irradiance_error < 0.02f;
+    ok = ok && exact;
+    std::cout << " analytic projections: max error " << max_error << " irradiance error " << irradiance_error << (exact ? "" : " [ERROR]") << std::endl;
+    return ok;
 }
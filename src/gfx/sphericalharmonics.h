@@ -3,10 +3,34 @@
 #include "../core/math.h"
 #include "texture.h"
 
+class HDRE;
+
 extern Vector3f cubemapFaceNormals[6][3]; //(x,y,z)
 
+//irradiance ready to evaluate: c0 + c1*y + c2*z + c3*x + c4*xy + c5*yz + c6*(3z^2-1) + c7*xz + c8*(x^2-y^2)
 struct SphericalHarmonics {
 	Vector3f coeffs[9];
 };
 
+//radiance projected on the real SH basis, bands 0 to order (L1: 4 coeffs, L2: 9, L3: 16)
+struct SHProjection {
+    int order;
+    Vector3f coeffs[16];
+
+    SHProjection(int order = 2);
+    int getNumCoeffs() const { return (order + 1) * (order + 1); }
+    Vector3f evaluate(const Vector3f& dir) const; //radiance in that direction
+    SphericalHarmonics toIrradiance() const; //convolved with the cosine lobe, needs order 2 or more
+    static void evalBasis(const Vector3f& dir, int order, float* basis);
+};
+
+//the solid angles and directions of every texel are computed once per face size and shared (thread safe)
+//faces are rows of size * size pixels of 3 or 4 floats, in the order of cubemapFaceNormals
+bool projectSH(const float* const faces[6], int size, int num_channels, int order, SHProjection& out, bool degamma = false, bool use_simd = true);
+bool projectSH(HDRE* hdre, int level, int order, SHProjection& out);
+
+// give me a cubemap, its size and number of channels
+// and i'll give you spherical harmonics
 SphericalHarmonics computeSH( FloatImage images[], bool degamma = false);
+
+bool benchmarkSH(const char* filename, int iterations = 10); //SSE against the scalar path and analytic checks, no GPU needed
@@ -3,6 +3,9 @@
 #include <iostream> //to output
 #include <cmath>
 #include <cassert>
+#include <chrono>
+#include <atomic>
+#include <sys/stat.h>
 
 #include "texture.h"
 #include "fbo.h"
@@ -18,6 +21,11 @@
 #include "../extra/stb_image.h"
 
 #include "../extra/hdre.h"
+#include "residency.h"
+#include "texturecompressor.h"
+#include "textureuploader.h"
+#include "texturestreaming.h"
+#include "mipgenerator.h"
 
 //bilinear interpolation
 Color Image::getPixelInterpolated(float x, float y, bool repeat) {
@@ -55,9 +63,12 @@ namespace GFX
 	std::map<unsigned int, Texture*> Texture::sTextures;
 	unsigned int Texture::s_last_index = 0;
 
+	bool Texture::use_disk_cache = true;
+
 	int Texture::default_mag_filter = GL_LINEAR;
 	int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 	FBO* Texture::global_fbo = NULL;
+	bool Texture::has_copy_image = false;
 
 	Texture::Texture()
 	{
@@ -73,6 +84,13 @@ namespace GFX
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index, this));
 		near_far.set(0.1f, 1000.0f);
+		last_used_frame = 0;
+		evicted = false;
+		load_task = 0;
+		num_mips = 1;
+		resident_mip = initial_mip = desired_mip = 0;
+		desired_frame = 0;
+		streaming_mips = false;
 	}
 
 	Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
@@ -82,6 +100,13 @@ namespace GFX
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index, this));
 		near_far.set(0.1f, 1000.0f);
+		last_used_frame = 0;
+		evicted = false;
+		load_task = 0;
+		num_mips = 1;
+		resident_mip = initial_mip = desired_mip = 0;
+		desired_frame = 0;
+		streaming_mips = false;
 		create(width, height, format, type, mipmaps, data, internal_format);
 	}
 
@@ -92,11 +117,22 @@ namespace GFX
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index,this));
 		near_far.set(0.1f, 1000.0f);
+		last_used_frame = 0;
+		evicted = false;
+		load_task = 0;
+		num_mips = 1;
+		resident_mip = initial_mip = desired_mip = 0;
+		desired_frame = 0;
+		streaming_mips = false;
 		create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
 	}
 
 	Texture::~Texture()
 	{
+		if (loading && load_task)
+			TaskManager::background.cancelTask(load_task);
+		if (loading || streaming_mips)
+			TextureUploader::cancel(this);
 		clear();
 		auto it = sTextures.find(index);
 		if (it != sTextures.end())
@@ -126,6 +162,19 @@ namespace GFX
 		}
 	}
 
+	void Texture::init()
+	{
+		//core since 4.3, the osx context stops at 4.1
+		GLint major = 0;
+		GLint minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		glGetError(); //GL_MAJOR_VERSION is not known before 3.0
+		has_copy_image = major > 4 || (major == 4 && minor >= 3) || SDL_GL_ExtensionSupported("GL_ARB_copy_image");
+		if (!has_copy_image)
+			std::cout << "[WARN] no glCopyImageSubData, streamed textures only add levels" << std::endl;
+	}
+
 	void Texture::Release()
 	{
 		std::vector<Texture*> texs;
@@ -178,8 +227,7 @@ namespace GFX
 		upload(format, type, mipmaps, data, internal_format);
 	}
 
-	/*
-	void Texture::create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
+	void Texture::create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format, unsigned int type, bool mipmaps, const Uint8* data, unsigned int internal_format)
 	{
 		assert(width && height && depth && "texture must have a size");
 
@@ -204,7 +252,6 @@ namespace GFX
 
 		upload3D(format, type, mipmaps, data, internal_format);
 	}
-	*/
 
 	void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 	{
@@ -276,8 +323,7 @@ namespace GFX
 		temp->loading = true;
 
 		//add action to BG Thread 
-		LoadTextureTask* task = new LoadTextureTask(filename);
-		TaskManager::background.addTask(task);
+		temp->load_task = TaskManager::background.addTask(new LoadTextureTask(filename));
 
 		return temp;
 	}
@@ -299,8 +345,7 @@ namespace GFX
 		temp->loading = true;
 
 		//add action to BG Thread 
-		LoadTextureTask* task = new LoadTextureTask(filename,buffer);
-		TaskManager::background.addTask(task);
+		temp->load_task = TaskManager::background.addTask(new LoadTextureTask(filename,buffer));
 
 		return temp;
 	}
@@ -318,6 +363,39 @@ namespace GFX
 			return true;
 		}
 
+		//block compressed containers are uploaded as they are
+		if (ext == "ktx" || ext == "dds")
+		{
+			if (!loadKTX(filename))
+				return false;
+			setName(filename);
+			return true;
+		}
+
+		bool cacheable = type == GL_UNSIGNED_BYTE && TextureCompressor::canCompress(str);
+
+		//images are converted once to BC blocks with their mips, kept in a .tbin beside the source
+		bool use_tbin = use_disk_cache && cacheable;
+		std::vector<uint8> tbin;
+		if (TextureCompressor::enabled && cacheable && TextureCompressor::loadOrCreate(filename, tbin, mipmaps))
+		{
+			if (loadContainer(tbin))
+			{
+				setWrap(wrap);
+				setName(filename);
+				return true;
+			}
+			use_tbin = false; //not supported by the GPU, the blocks stay cached and the image is uploaded as it is
+		}
+
+		//or the decoded pixels are kept (not compressing or images the encoder does not support)
+		if (use_tbin && readTBIN(filename, tbin) && !getTBINFormat(tbin) && loadContainer(tbin))
+		{
+			setWrap(wrap);
+			setName(filename);
+			return true;
+		}
+
 		//image based textures
 		::Image* image = new ::Image();
 		if (!image->load(filename))
@@ -326,7 +404,11 @@ namespace GFX
 			return false;
 		}
 
-		loadFromImage(image, mipmaps, wrap, type);
+		if (use_tbin && writeTBIN(filename, image, mipmaps, tbin) && loadContainer(tbin))
+			setWrap(wrap);
+		else
+			loadFromImage(image, mipmaps, wrap, type);
+		delete image;
 		setName(filename);
 
 		this->image.clear(); //remove from RAM after loading. ???
@@ -361,7 +443,35 @@ namespace GFX
 	void Texture::upload(FloatImage* img)
 	{
 		create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT, true);
-		upload(this->format, this->type, false, (Uint8*)img->data);
+		if (!this->mipmaps)
+		{
+			upload(this->format, this->type, false, (Uint8*)img->data);
+			return;
+		}
+
+		//the levels are filtered on the CPU and uploaded together instead of glGenerateMipmap
+		int num_channels = img->num_channels;
+		int w = width;
+		int h = height;
+		int num_mips = MipGenerator::getNumMips(w, h);
+		std::vector<float> levels[2];
+		const float* level = img->data;
+		glBindTexture(this->texture_type, texture_id);
+		for (int i = 0; i < num_mips; ++i)
+		{
+			if (i)
+			{
+				std::vector<float>& next = levels[i & 1];
+				next.resize(size_t(std::max(w >> 1, 1)) * std::max(h >> 1, 1) * num_channels);
+				MipGenerator::downsample(level, w, h, num_channels, &next[0]);
+				level = &next[0];
+				w = std::max(w >> 1, 1);
+				h = std::max(h >> 1, 1);
+			}
+			glTexImage2D(this->texture_type, i, num_channels == 3 ? GL_RGB32F : GL_RGBA32F, w, h, 0, this->format, GL_FLOAT, level);
+		}
+		glBindTexture(this->texture_type, 0);
+		assert(checkGLErrors() && "Error uploading texture");
 	}
 
 
@@ -396,8 +506,7 @@ namespace GFX
 		assert(checkGLErrors() && "Error uploading texture");
 	}
 
-	/*
-	void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format) {
+	void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, const Uint8* data, unsigned int internal_format) {
 		assert(texture_id && "Must create texture before uploading data.");
 		assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
@@ -417,7 +526,6 @@ namespace GFX
 		glBindTexture(this->texture_type, 0);
 		assert(checkGLErrors() && "Error uploading texture");
 	}
-	*/
 
 	void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint8** data, unsigned int intFormat, int level) {
 
@@ -551,46 +659,335 @@ namespace GFX
 		std::vector<unsigned char> buffer;
 		if (!readFileBin(filename, buffer))
 			return false;
-		return loadKTX(buffer);
+		return loadContainer(buffer);
+	}
+
+	//GL formats of the containers that can be uploaded, returns false if not supported
+	static bool getKTXFormat(const ddsktx_texture_info& tc, unsigned int& internal_format, unsigned int& format, unsigned int& type)
+	{
+		//srgb flags are ignored, gamma is handled in the shaders like with the png/jpg textures
+		type = GL_UNSIGNED_BYTE;
+		switch (tc.format)
+		{
+			//BC1 always as RGBA so cutout blocks decode to transparent instead of black
+			case DDSKTX_FORMAT_BC1: internal_format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT; format = GL_RGBA; return true;
+			case DDSKTX_FORMAT_BC2: internal_format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT; format = GL_RGBA; return true;
+			case DDSKTX_FORMAT_BC3: internal_format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; format = GL_RGBA; return true;
+			case DDSKTX_FORMAT_BC4: internal_format = GL_COMPRESSED_RED_RGTC1; format = GL_RED; return true;
+			case DDSKTX_FORMAT_BC5: internal_format = GL_COMPRESSED_RG_RGTC2; format = GL_RG; return true;
+			case DDSKTX_FORMAT_BC7: internal_format = GL_COMPRESSED_RGBA_BPTC_UNORM; format = GL_RGBA; return true;
+			case DDSKTX_FORMAT_R8: internal_format = GL_R8; format = GL_RED; return true;
+			case DDSKTX_FORMAT_RG8: internal_format = GL_RG8; format = GL_RG; return true;
+			case DDSKTX_FORMAT_RGB8: internal_format = GL_RGB8; format = GL_RGB; return true;
+			case DDSKTX_FORMAT_RGBA8: internal_format = GL_RGBA8; format = GL_RGBA; return true;
+			case DDSKTX_FORMAT_BGRA8: internal_format = GL_RGBA8; format = GL_BGRA; return true;
+			default: return false;
+		}
+	}
+
+	//bytes per 4x4 block of the compressed formats, 0 if it is not compressed
+	static size_t getBlockBytes(unsigned int internal_format)
+	{
+		switch (internal_format)
+		{
+			case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT: case GL_COMPRESSED_RED_RGTC1: return 8;
+			case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT: case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: case GL_COMPRESSED_RG_RGTC2: case GL_COMPRESSED_RGBA_BPTC_UNORM: return 16;
+		}
+		return 0;
+	}
+
+	#define TEXTURE_BIN_VERSION 3 //2: gamma correct mips, 3: BC blocks
+
+	//.tbin layout: "TBIN", header, every level one after the other (tightly packed rows or 4x4 blocks)
+	struct sTextureBinHeader {
+		int version;
+		int header_bytes;
+		int64_t source_mtime; //the cache is outdated when the source changes
+		int64_t source_size;
+		int width;
+		int height;
+		int num_channels;
+		int num_mips;
+		unsigned int internal_format; //of the BC blocks, 0 if the levels are raw pixels
+		char extra[20];
+	};
+
+	bool Texture::readTBIN(const char* filename, std::vector<unsigned char>& buffer)
+	{
+		std::string bin_filename = std::string(filename) + ".tbin";
+		if (!fileExists(bin_filename) || !readFileBin(bin_filename, buffer))
+			return false;
+
+		if (buffer.size() < 4 + sizeof(sTextureBinHeader) || memcmp(&buffer[0], "TBIN", 4) != 0)
+		{
+			std::cout << "[ERROR] loading TBIN: invalid content: " << bin_filename << std::endl;
+			return false;
+		}
+
+		sTextureBinHeader header;
+		memcpy(&header, &buffer[4], sizeof(header));
+		if (header.version != TEXTURE_BIN_VERSION || header.header_bytes != sizeof(sTextureBinHeader))
+		{
+			std::cout << "[WARN] loading TBIN: old version: " << bin_filename << std::endl;
+			return false;
+		}
+
+		struct stat stbuffer;
+		if (stat(filename, &stbuffer) == 0 && (header.source_mtime != (int64_t)stbuffer.st_mtime || header.source_size != (int64_t)stbuffer.st_size))
+			return false; //source modified, it will be written again
+		return true;
+	}
+
+	unsigned int Texture::getTBINFormat(const std::vector<unsigned char>& buffer)
+	{
+		if (buffer.size() < 4 + sizeof(sTextureBinHeader) || memcmp(&buffer[0], "TBIN", 4) != 0)
+			return 0;
+		sTextureBinHeader header;
+		memcpy(&header, &buffer[4], sizeof(header));
+		return header.internal_format;
+	}
+
+	size_t Texture::createTBIN(const char* filename, int width, int height, int num_channels, int num_mips, unsigned int internal_format, size_t levels_bytes, std::vector<unsigned char>& buffer)
+	{
+		sTextureBinHeader header = sTextureBinHeader();
+		header.version = TEXTURE_BIN_VERSION;
+		header.header_bytes = sizeof(sTextureBinHeader);
+		struct stat stbuffer;
+		if (filename && stat(filename, &stbuffer) == 0)
+		{
+			header.source_mtime = (int64_t)stbuffer.st_mtime;
+			header.source_size = (int64_t)stbuffer.st_size;
+		}
+		header.width = width;
+		header.height = height;
+		header.num_channels = num_channels;
+		header.num_mips = num_mips;
+		header.internal_format = internal_format;
+
+		buffer.resize(4 + sizeof(header) + levels_bytes);
+		memcpy(&buffer[0], "TBIN", 4);
+		memcpy(&buffer[4], &header, sizeof(header));
+		return 4 + sizeof(header);
+	}
+
+	bool Texture::saveTBIN(const char* filename, const std::vector<unsigned char>& buffer)
+	{
+		std::string bin_filename = std::string(filename) + ".tbin";
+		FILE* f = fopen(bin_filename.c_str(), "wb");
+		if (f == NULL)
+		{
+			std::cout << "[ERROR] cannot write TBIN: " << bin_filename << std::endl;
+			return false;
+		}
+		fwrite(&buffer[0], 1, buffer.size(), f);
+		fclose(f);
+		return true;
+	}
+
+	bool Texture::writeTBIN(const char* filename, ::Image* image, bool mipmaps, std::vector<unsigned char>& buffer, bool save_file)
+	{
+		if (!image->data || (image->num_channels != 3 && image->num_channels != 4))
+			return false;
+
+		int w = image->width;
+		int h = image->height;
+		int num_mips = mipmaps ? MipGenerator::getNumMips(w, h) : 1;
+		size_t levels_bytes = 0;
+		for (int i = 0; i < num_mips; ++i)
+			levels_bytes += size_t(std::max(w >> i, 1)) * std::max(h >> i, 1) * image->num_channels;
+		size_t offset = createTBIN(filename, w, h, image->num_channels, num_mips, 0, levels_bytes, buffer);
+
+		//every level is filtered from the previous one already in the buffer
+		eMipContent content = MipGenerator::getContent(filename);
+		uint8* level = &buffer[offset];
+		memcpy(level, image->data, size_t(w) * h * image->num_channels);
+		for (int i = 1; i < num_mips; ++i)
+		{
+			uint8* next = level + size_t(w) * h * image->num_channels;
+			MipGenerator::downsample(level, w, h, image->num_channels, next, content);
+			level = next;
+			w = std::max(w >> 1, 1);
+			h = std::max(h >> 1, 1);
+		}
+
+		if (save_file)
+			saveTBIN(filename, buffer); //if it fails the buffer is still valid
+		return true;
 	}
 
-	bool Texture::loadKTX(std::vector<unsigned char>& buffer)
+	//where every mip (and face) of a KTX/DDS or TBIN file is, compressed ones go straight to VRAM
+	bool Texture::getLayout(std::vector<unsigned char>& buffer, sTextureLayout& layout)
 	{
-		std::vector<unsigned char> out_image;
+		layout.levels.clear();
+		if (buffer.size() > 4 + sizeof(sTextureBinHeader) && memcmp(&buffer[0], "TBIN", 4) == 0)
+		{
+			sTextureBinHeader header;
+			memcpy(&header, &buffer[4], sizeof(header));
+			int block_bytes = header.internal_format ? (int)getBlockBytes(header.internal_format) : 0;
+			if (header.internal_format && !block_bytes)
+				return false;
+			layout.texture_type = GL_TEXTURE_2D;
+			layout.format = header.internal_format == GL_COMPRESSED_RG_RGTC2 ? GL_RG : (header.num_channels == 3 ? GL_RGB : GL_RGBA);
+			layout.internal_format = header.internal_format ? header.internal_format : layout.format;
+			layout.type = GL_UNSIGNED_BYTE;
+			layout.compressed = block_bytes != 0;
+			layout.width = header.width;
+			layout.height = header.height;
+			layout.num_mips = header.num_mips;
+
+			size_t offset = 4 + sizeof(header);
+			for (int i = 0; i < header.num_mips; ++i)
+			{
+				sTextureLevel level;
+				level.target = GL_TEXTURE_2D;
+				level.level = i;
+				level.width = std::max(header.width >> i, 1);
+				level.height = std::max(header.height >> i, 1);
+				level.offset = offset;
+				level.row_bytes = block_bytes ? size_t((level.width + 3) / 4) * block_bytes : size_t(level.width) * header.num_channels; //one row of blocks when compressed
+				level.size = level.row_bytes * (block_bytes ? (level.height + 3) / 4 : level.height);
+				offset += level.size;
+				layout.levels.push_back(level);
+			}
+			return offset <= buffer.size();
+		}
 
 		ddsktx_texture_info tc = { 0 };
-		if (!ddsktx_parse(&tc, &buffer[0], buffer.size(), NULL))
+		ddsktx_error error;
+		if (buffer.empty() || !ddsktx_parse(&tc, &buffer[0], (int)buffer.size(), &error))
+		{
+			std::cout << TermColor::RED << "[ERROR]: " << (buffer.empty() ? "empty file" : error.msg) << TermColor::DEFAULT << std::endl;
 			return false;
+		}
 
-		this->texture_type = GL_TEXTURE_2D;
-		if (tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP)
-			this->texture_type = GL_TEXTURE_CUBE_MAP;
-		else if (tc.flags & DDSKTX_TEXTURE_FLAG_VOLUME)
-			this->texture_type = GL_TEXTURE_3D;
+		if (!getKTXFormat(tc, layout.internal_format, layout.format, layout.type) || (tc.flags & DDSKTX_TEXTURE_FLAG_VOLUME) || tc.num_layers > 1)
+		{
+			std::cout << TermColor::RED << "[ERROR]: unsupported KTX/DDS texture " << ddsktx_format_str(tc.format) << TermColor::DEFAULT << std::endl;
+			return false;
+		}
 
-		if (texture_id == 0)
-			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bool cubemap = (tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP) != 0;
+		layout.texture_type = cubemap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+		layout.compressed = ddsktx_format_compressed(tc.format);
+		layout.width = tc.width;
+		layout.height = tc.height;
+		layout.num_mips = tc.num_mips;
 
-		for (int mip = 0; mip < tc.num_mips; mip++) {
-			ddsktx_sub_data sub_data;
-			ddsktx_get_sub(&tc, &sub_data, &buffer[0], buffer.size(), 0, 0, mip);
-			// Fill/Set texture sub resource data (mips in this case)
-			/*
-			if (ddsktx_format_compressed(tc.format))
-				//glCompressedTexImage2D(this->texture_type,mip,
-			else
-				glTexImage2D(this->texture_type, mip, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
-				//glTexImage2D(..);
-			*/
+		int num_faces = cubemap ? 6 : 1;
+		for (int face = 0; face < num_faces; ++face)
+			for (int mip = 0; mip < tc.num_mips; mip++)
+			{
+				ddsktx_sub_data sub_data;
+				ddsktx_get_sub(&tc, &sub_data, &buffer[0], (int)buffer.size(), 0, face, mip);
+				sTextureLevel level;
+				level.target = cubemap ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+				level.level = mip;
+				level.width = sub_data.width;
+				level.height = sub_data.height;
+				level.offset = (const uint8*)sub_data.buff - &buffer[0];
+				level.size = sub_data.size_bytes;
+				level.row_bytes = sub_data.row_pitch_bytes;
+				layout.levels.push_back(level);
+			}
+		return true;
+	}
+
+	//uploads one full level, data NULL only reserves the memory
+	static void uploadLevel(const sTextureLayout& layout, const sTextureLevel& level, const void* data)
+	{
+		if (layout.compressed)
+			glCompressedTexImage2D(level.target, level.level, layout.internal_format, level.width, level.height, 0, (GLsizei)level.size, data);
+		else
+			glTexImage2D(level.target, level.level, layout.internal_format, level.width, level.height, 0, layout.format, layout.type, data);
+	}
+
+	GLuint Texture::allocateLayout(const sTextureLayout& layout, GLuint id)
+	{
+		if (!id)
+			glGenTextures(1, &id);
+		glBindTexture(layout.texture_type, id);
+		for (const sTextureLevel& level : layout.levels)
+			uploadLevel(layout, level, NULL);
+		glBindTexture(layout.texture_type, 0);
+		return id;
+	}
+
+	void Texture::applyLayout(const sTextureLayout& layout, GLuint id, int first_mip)
+	{
+		//Delete previous texture and ensure that previous bounded texture_id is not of another texture type
+		if (this->texture_id != 0)
+		{
+			glBindTexture(this->texture_type, 0);
+			glDeleteTextures(1, &texture_id);
 		}
 
+		bool cubemap = layout.texture_type == GL_TEXTURE_CUBE_MAP;
+		this->texture_id = id;
+		this->texture_type = layout.texture_type;
+		this->width = (float)layout.width;
+		this->height = (float)layout.height;
+		this->depth = 0;
+		this->format = layout.format;
+		this->type = layout.type;
+		this->internal_format = layout.compressed ? layout.internal_format : (layout.internal_format == layout.format ? 0 : layout.internal_format);
+		this->mipmaps = layout.num_mips > 1;
+		this->num_mips = layout.num_mips;
+		this->resident_mip = first_mip;
+
+		glBindTexture(this->texture_type, texture_id);
+		//files may not have the full chain, streamed ones start with the small levels
+		glTexParameteri(this->texture_type, GL_TEXTURE_BASE_LEVEL, first_mip);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, layout.num_mips - 1);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+		wrapS = wrapT = (this->mipmaps && !cubemap) ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, wrapS);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, wrapT);
+		if (cubemap)
+			glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+		glBindTexture(this->texture_type, 0);
+	}
+
+	//uploads every level at once, TextureUploader does the same spread over several frames
+	bool Texture::loadContainer(std::vector<unsigned char>& buffer, int first_mip)
+	{
+		sTextureLayout layout;
+		if (!getLayout(buffer, layout))
+			return false;
+
+		GLuint id = 0;
+		glGenTextures(1, &id); //we need to create an unique ID for the texture
+		glBindTexture(layout.texture_type, id);	//we activate this id to tell opengl we are going to use this texture
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1); //RGB rows are not aligned to 4
+		for (const sTextureLevel& level : layout.levels)
+			if (level.level >= first_mip)
+				uploadLevel(layout, level, &buffer[level.offset]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glBindTexture(layout.texture_type, 0);
+
+		applyLayout(layout, id, first_mip);
+		assert(checkGLErrors() && "Error uploading texture container");
 		return true;
 	}
 
+	void Texture::setWrap(bool repeat)
+	{
+		//non power of two textures cannot repeat
+		wrapS = wrapT = (this->mipmaps && repeat) ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+		glBindTexture(this->texture_type, texture_id);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, wrapS);
+		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, wrapT);
+		glBindTexture(this->texture_type, 0);
+	}
 
 	void Texture::bind()
 	{
+		//textures visible in this frame are decoded first
+		if (loading && load_task && last_used_frame != Residency::frame)
+			TaskManager::background.setPriority(load_task, (int)Residency::frame);
+		last_used_frame = Residency::frame;
+		if (evicted)
+			makeResident();
 		//glEnable(this->texture_type); //enable the textures 
 		glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
 	}
@@ -632,6 +1029,144 @@ namespace GFX
 #endif
 	}
 
+	size_t Texture::getGPUBytes(int base_mip)
+	{
+		if (!texture_id || !width || !height)
+			return 0;
+
+		//streamed textures only have the levels from resident_mip
+		if (base_mip < 0)
+			base_mip = resident_mip;
+		int w = std::max(int(width) >> base_mip, 1);
+		int h = std::max(int(height) >> base_mip, 1);
+
+		size_t bytes = 0;
+		size_t block_bytes = getBlockBytes(internal_format);
+		if (block_bytes)
+			bytes = size_t((w + 3) / 4) * size_t((h + 3) / 4) * block_bytes;
+		else
+		{
+			size_t channels = 4;
+			switch (format)
+			{
+				case GL_RED: case GL_DEPTH_COMPONENT: channels = 1; break;
+				case GL_RG: channels = 2; break;
+				case GL_RGB: channels = 3; break;
+			}
+			size_t channel_bytes = (type == GL_FLOAT || format == GL_DEPTH_COMPONENT) ? 4 : (type == GL_HALF_FLOAT ? 2 : 1);
+			bytes = size_t(w) * size_t(h) * channels * channel_bytes;
+		}
+		if (depth > 0)
+			bytes *= size_t(depth);
+		if (texture_type == GL_TEXTURE_CUBE_MAP)
+			bytes *= 6;
+		if (mipmaps)
+			bytes += bytes / 3; //full chain is 4/3 of the base level
+		return bytes;
+	}
+
+	bool Texture::canEvict()
+	{
+		return !evicted && !loading && texture_id && texture_type == GL_TEXTURE_2D && filename.size() && fileExists(filename);
+	}
+
+	bool Texture::evict()
+	{
+		if (!canEvict())
+			return false;
+
+		if (streaming_mips)
+			TextureUploader::cancel(this);
+		streaming_mips = false; //a request being read is ignored when it arrives
+		glDeleteTextures(1, &texture_id);
+		texture_id = 0;
+		image.clear();
+		evicted = true;
+		return true;
+	}
+
+	bool Texture::makeResident()
+	{
+		if (!evicted)
+			return true;
+
+		static uint8 default_color[] = { 128,128,128 };
+		evicted = false;
+		create(1, 1, GL_RGB, GL_UNSIGNED_BYTE, false, default_color);
+		sTexturesLoaded[filename] = this;
+		loading = true;
+		load_task = TaskManager::background.addTask(new LoadTextureTask(filename.c_str()));
+		Residency::num_reloads++;
+		return true;
+	}
+
+	bool Texture::cancelLoading()
+	{
+		//embedded images cannot be requested again from the file
+		if (!loading || !load_task || !fileExists(filename))
+			return false;
+		if (!TaskManager::background.cancelTask(load_task))
+			return false; //already decoding, the upload will replace the 1x1 texture
+
+		//like an evicted texture, it will be requested again if it is bound
+		load_task = 0;
+		loading = false;
+		glDeleteTextures(1, &texture_id);
+		texture_id = 0;
+		evicted = true;
+		return true;
+	}
+
+
+	void Texture::setResidentMip(int mip)
+	{
+		resident_mip = mip;
+		glBindTexture(this->texture_type, texture_id);
+		glTexParameteri(this->texture_type, GL_TEXTURE_BASE_LEVEL, mip);
+		glBindTexture(this->texture_type, 0);
+	}
+
+	//the coarse levels are copied in the GPU to a texture without the finer ones
+	bool Texture::dropMips(int mip)
+	{
+		if (!has_copy_image || mip <= resident_mip || mip >= num_mips || texture_type != GL_TEXTURE_2D || streaming_mips || !texture_id)
+			return false;
+
+		sTextureLayout layout;
+		layout.texture_type = GL_TEXTURE_2D;
+		layout.format = format;
+		layout.type = type;
+		layout.internal_format = internal_format ? internal_format : format;
+		layout.compressed = getBlockBytes(internal_format) != 0;
+		layout.width = (int)width;
+		layout.height = (int)height;
+		layout.num_mips = num_mips;
+		for (int i = mip; i < num_mips; ++i)
+		{
+			sTextureLevel level;
+			level.target = GL_TEXTURE_2D;
+			level.level = i;
+			level.width = std::max(layout.width >> i, 1);
+			level.height = std::max(layout.height >> i, 1);
+			level.offset = 0;
+			level.size = size_t((level.width + 3) / 4) * size_t((level.height + 3) / 4) * getBlockBytes(internal_format); //only used when compressed
+			level.row_bytes = 0;
+			layout.levels.push_back(level);
+		}
+
+		GLuint id = allocateLayout(layout);
+		for (const sTextureLevel& level : layout.levels)
+			glCopyImageSubData(texture_id, GL_TEXTURE_2D, level.level, 0, 0, 0, id, GL_TEXTURE_2D, level.level, 0, 0, 0, level.width, level.height, 1);
+
+		unsigned int wrap_s = wrapS;
+		unsigned int wrap_t = wrapT;
+		applyLayout(layout, id, mip);
+		glBindTexture(GL_TEXTURE_2D, texture_id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS = wrap_s);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT = wrap_t);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return true;
+	}
 
 	void Texture::toViewport(Shader* shader)
 	{
@@ -883,14 +1418,16 @@ bool Image::loadPNG(const char* filename, bool flip_y)
 
 bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
 {
-    std::vector<unsigned char> out_image;
-
-	if (decodePNG(out_image, width, height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
+	//decoded straight into the image buffer, RGB files keep 3 channels
+	unsigned char* pixels = NULL;
+	unsigned int channels = 0;
+	if (buffer.empty() || decodePNGFast(pixels, width, height, channels, &buffer[0], buffer.size()) != 0)
 		return false;
 
-	data = new Uint8[out_image.size()];
-	memcpy(data, &out_image[0], out_image.size());
-	num_channels = 4;
+	if (data)
+		delete[] data;
+	data = pixels;
+	num_channels = channels;
 
 	//flip pixels in Y
 	if (flip_y)
@@ -899,6 +1436,58 @@ bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
 	return true;
 }
 
+bool Image::benchmarkPNG(const char* filename, int iterations)
+{
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer) || buffer.empty())
+		return false;
+
+	//the reference output, always RGBA
+	std::vector<unsigned char> reference;
+	unsigned int width = 0, height = 0;
+	if (decodePNG(reference, width, height, &buffer[0], buffer.size(), true) != 0)
+	{
+		std::cout << TermColor::RED << "[ERROR] cannot decode " << filename << TermColor::DEFAULT << std::endl;
+		return false;
+	}
+
+	double times[2] = { 0, 0 };
+	unsigned int num_channels = 4;
+	size_t mismatches = 0;
+	for (int fast = 0; fast < 2; ++fast)
+	{
+		for (int i = 0; i < iterations; ++i)
+		{
+			std::vector<unsigned char> out_image;
+			unsigned char* pixels = NULL;
+			auto start = std::chrono::high_resolution_clock::now();
+			if (fast)
+				decodePNGFast(pixels, width, height, num_channels, &buffer[0], buffer.size());
+			else
+				decodePNG(out_image, width, height, &buffer[0], buffer.size(), true);
+			times[fast] += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			if (fast && i == 0 && pixels)
+				for (size_t p = 0; p < size_t(width) * height; ++p)
+					for (unsigned int c = 0; c < num_channels; ++c)
+						mismatches += reference[p * 4 + c] != pixels[p * num_channels + c];
+			if (fast && !pixels)
+				mismatches = reference.size();
+			delete[] pixels;
+		}
+		times[fast] /= iterations;
+	}
+
+	//throughput in decoded bytes, the same for both as RGB files keep 3 channels in the fast path
+	double mb = size_t(width) * height * num_channels / (1024.0 * 1024.0);
+	std::cout << filename << " " << width << "x" << height << "x" << num_channels << " (" << buffer.size() / 1024 << "KB)" << std::endl;
+	std::cout << " picoPNG: " << times[0] << "ms " << mb * 1000.0 / times[0] << "MB/s" << std::endl;
+	std::cout << " Fast:    " << TermColor::GREEN << times[1] << "ms " << mb * 1000.0 / times[1] << "MB/s" << TermColor::DEFAULT
+		<< " x" << times[0] / times[1] << (mismatches ? "" : " identical") << std::endl;
+	if (mismatches)
+		std::cout << TermColor::RED << " [ERROR] " << mismatches << " different bytes" << TermColor::DEFAULT << std::endl;
+	return mismatches == 0;
+}
+
 bool Image::loadJPG(const char* filename, bool flip_y)
 {
 	std::vector<unsigned char> buffer;
@@ -907,34 +1496,250 @@ bool Image::loadJPG(const char* filename, bool flip_y)
 	return loadJPG(buffer);
 }
 
-bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
+//rows of MCUs of a JPEG with restart markers, with the headers it is a valid JPEG on its own
+struct sJPGStripe {
+	std::vector<unsigned char> data;
+	int y;
+	int height;
+};
+
+static int gcd(int a, int b) { return b ? gcd(b, a % b) : a; }
+
+//the entropy data is cut at the restart markers that start a row of MCUs, false if the file has none or cannot be split
+static bool splitJPGStripes(const std::vector<unsigned char>& buffer, int num_stripes, int& width, int& height, std::vector<sJPGStripe>& stripes)
+{
+	const unsigned char* d = &buffer[0];
+	size_t size = buffer.size();
+	if (size < 4 || d[0] != 0xFF || d[1] != 0xD8)
+		return false;
+
+	int num_components = 0, restart_interval = 0, mcu_width = 8, mcu_height = 8;
+	size_t height_offset = 0, pos = 2;
+	width = height = 0;
+	while (true)
+	{
+		if (pos + 4 > size || d[pos] != 0xFF)
+			return false;
+		unsigned char marker = d[pos + 1];
+		if (marker == 0xFF) //fill byte
+		{
+			pos++;
+			continue;
+		}
+		size_t length = (d[pos + 2] << 8) | d[pos + 3];
+		if (length < 2 || pos + 2 + length > size)
+			return false;
+		const unsigned char* segment = d + pos + 4;
+		pos += 2 + length;
+
+		if (marker == 0xC0 || marker == 0xC1) //huffman, sequential
+		{
+			if (length < 8 || length < 8 + 3 * size_t(segment[5]))
+				return false;
+			height = (segment[1] << 8) | segment[2];
+			width = (segment[3] << 8) | segment[4];
+			num_components = segment[5];
+			height_offset = segment + 1 - d;
+			int h_max = 1, v_max = 1;
+			for (int i = 0; i < num_components; ++i)
+			{
+				h_max = std::max(h_max, segment[7 + i * 3] >> 4);
+				v_max = std::max(v_max, segment[7 + i * 3] & 15);
+			}
+			if (num_components > 1) //interleaved
+			{
+				mcu_width = 8 * h_max;
+				mcu_height = 8 * v_max;
+			}
+		}
+		else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+			return false; //progressive, lossless or arithmetic coding
+		else if (marker == 0xDD && length >= 4)
+			restart_interval = (segment[0] << 8) | segment[1];
+		else if (marker == 0xDA) //only one scan with every component
+		{
+			if (!num_components || segment[0] != num_components)
+				return false;
+			break;
+		}
+	}
+	if (!restart_interval || !width || !height)
+		return false;
+
+	int mcus_per_row = (width + mcu_width - 1) / mcu_width;
+	int mcu_rows = (height + mcu_height - 1) / mcu_height;
+	int num_mcus = mcus_per_row * mcu_rows;
+	int num_intervals = (num_mcus + restart_interval - 1) / restart_interval;
+	int row_step = restart_interval / gcd(restart_interval, mcus_per_row); //rows between intervals that start a row
+	if (row_step >= mcu_rows)
+		return false;
+	int rows_per_stripe = std::max(mcu_rows / num_stripes / row_step, 1) * row_step;
+
+	//the intervals end at the restart markers, 0xFF00 is a 0xFF in the data
+	size_t header_size = pos, end = 0;
+	std::vector<size_t> markers;
+	markers.reserve(num_intervals);
+	for (size_t i = pos; i + 1 < size; ++i)
+	{
+		const unsigned char* next = (const unsigned char*)memchr(d + i, 0xFF, size - i - 1);
+		if (!next)
+			break;
+		i = next - d;
+		unsigned char marker = d[i + 1];
+		if (marker >= 0xD0 && marker <= 0xD7)
+			markers.push_back(i);
+		else if (marker == 0xD9)
+		{
+			end = i;
+			break;
+		}
+	}
+	if (!end || (int)markers.size() != num_intervals - 1)
+		return false;
+
+	for (int row = 0; row < mcu_rows; row += rows_per_stripe)
+	{
+		int rows = std::min(rows_per_stripe, mcu_rows - row);
+		int first = row * mcus_per_row / restart_interval;
+		int last = (std::min((row + rows) * mcus_per_row, num_mcus) + restart_interval - 1) / restart_interval - 1;
+		size_t start = first ? markers[first - 1] + 2 : header_size;
+		size_t stop = last + 1 < num_intervals ? markers[last] : end;
+
+		stripes.push_back(sJPGStripe());
+		sJPGStripe& stripe = stripes.back();
+		stripe.y = row * mcu_height;
+		stripe.height = std::min(rows * mcu_height, height - stripe.y);
+		stripe.data.reserve(header_size + stop - start + 2);
+		stripe.data.assign(d, d + header_size);
+		stripe.data[height_offset] = (unsigned char)(stripe.height >> 8);
+		stripe.data[height_offset + 1] = (unsigned char)(stripe.height & 0xFF);
+		stripe.data.insert(stripe.data.end(), d + start, d + stop);
+		stripe.data.push_back(0xFF);
+		stripe.data.push_back(0xD9); //EOI
+	}
+	return stripes.size() > 1;
+}
+
+//decoded RGB rows go to their final place in the image, so flipping costs nothing
+static void writeJPGRows(Image* image, const unsigned char* pixels, int y, int height, bool flip_y)
 {
-	std::vector<unsigned char> out_image;
+	size_t row_size = size_t(image->width) * 3;
+	for (int i = 0; i < height; ++i)
+	{
+		size_t row = flip_y ? image->height - 1 - (y + i) : y + i;
+		memcpy(image->data + row * row_size, pixels + i * row_size, row_size);
+	}
+}
 
+bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
+{
+	if (buffer.empty())
+		return false;
 	int width;
 	int height;
-	int actual_comps;
 	int channels;
 
-	//stb_image
-	unsigned char* image_data = stbi_load_from_memory( (stbi_uc*) &buffer[0], (unsigned long)buffer.size(), &width, &height, &channels, STBI_rgb);
+	//files with restart markers are decoded in stripes on the job system
+	std::vector<sJPGStripe> stripes;
+	if (JobSystem::getNumThreads() > 1 && splitJPGStripes(buffer, JobSystem::getNumThreads() * 2, width, height, stripes))
+	{
+		if (data)
+			delete[] data;
+		this->width = (unsigned int)width;
+		this->height = (unsigned int)height;
+		this->num_channels = 3;
+		data = new unsigned char[size_t(width) * height * 3];
+		std::atomic<bool> failed(false);
+		JobSystem::parallelFor((int)stripes.size(), 1, [&](int start, int end) {
+			for (int i = start; i < end; ++i)
+			{
+				sJPGStripe& stripe = stripes[i];
+				int w, h, comps;
+				unsigned char* pixels = stbi_load_from_memory(&stripe.data[0], (int)stripe.data.size(), &w, &h, &comps, STBI_rgb);
+				if (pixels && w == width && h == stripe.height)
+					writeJPGRows(this, pixels, stripe.y, h, flip_y);
+				else
+					failed = true;
+				stbi_image_free(pixels);
+			}
+		});
+		if (!failed)
+			return true;
+		clear(); //try again in one piece
+	}
+
+	//stb_image, uses SSE2 for the IDCT, upsampling and color conversion
+	unsigned char* image_data = stbi_load_from_memory( (stbi_uc*) &buffer[0], (int)buffer.size(), &width, &height, &channels, STBI_rgb);
 	if (!image_data)
 		return false;
+	if (data)
+		delete[] data;
 	this->width = (unsigned int)width;
 	this->height = (unsigned int)height;
 	this->num_channels = 3;// (unsigned int)channels;
+	data = new unsigned char[size_t(width) * height * this->num_channels];
+	writeJPGRows(this, image_data, 0, height, flip_y);
+	stbi_image_free(image_data);
+	return true;
+}
 
-	//clone
-	data = new unsigned char[width * height * this->num_channels];
-	memcpy(data, image_data, width * height * this->num_channels);
+bool Image::benchmarkJPG(const char* filename, int iterations)
+{
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer) || buffer.empty())
+		return false;
 
-	stbi_image_free(image_data);
+	int width = 0, height = 0, channels = 0;
+	std::vector<sJPGStripe> stripes;
+	bool split = splitJPGStripes(buffer, JobSystem::getNumThreads() * 2, width, height, stripes);
 
-	//flip pixels in Y
-	if (flip_y)
-		flipY();
+	//before: stb_image, a copy and flipping in another pass
+	Image reference;
+	double times[2] = { 0, 0 };
+	for (int i = 0; i < iterations; ++i)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		unsigned char* pixels = stbi_load_from_memory(&buffer[0], (int)buffer.size(), &width, &height, &channels, STBI_rgb);
+		if (!pixels)
+		{
+			std::cout << TermColor::RED << "[ERROR] cannot decode " << filename << TermColor::DEFAULT << std::endl;
+			return false;
+		}
+		reference.clear();
+		reference.width = width;
+		reference.height = height;
+		reference.num_channels = 3;
+		reference.data = new unsigned char[size_t(width) * height * 3];
+		memcpy(reference.data, pixels, size_t(width) * height * 3);
+		stbi_image_free(pixels);
+		reference.flipY();
+		times[0] += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
 
-	return true;
+	Image image;
+	for (int i = 0; i < iterations; ++i)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		image.loadJPG(buffer, true);
+		times[1] += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+	times[0] /= iterations;
+	times[1] /= iterations;
+
+	bool identical = image.width == reference.width && image.height == reference.height &&
+		memcmp(image.data, reference.data, size_t(width) * height * 3) == 0;
+	double mb = size_t(width) * height * 3 / (1024.0 * 1024.0);
+	std::cout << filename << " " << width << "x" << height << " (" << buffer.size() / 1024 << "KB) ";
+	if (split)
+		std::cout << stripes.size() << " stripes on " << JobSystem::getNumThreads() << " threads" << std::endl;
+	else
+		std::cout << "no restart markers, one thread" << std::endl;
+	std::cout << " Before: " << times[0] << "ms " << mb * 1000.0 / times[0] << "MB/s" << std::endl;
+	std::cout << " Now:    " << TermColor::GREEN << times[1] << "ms " << mb * 1000.0 / times[1] << "MB/s" << TermColor::DEFAULT
+		<< " x" << times[0] / times[1] << (identical ? " identical" : "") << std::endl;
+	if (!identical)
+		std::cout << TermColor::RED << " [ERROR] the output does not match" << TermColor::DEFAULT << std::endl;
+	return identical;
 }
 
 // Saves the image to a TGA file
@@ -1078,27 +1883,25 @@ bool isPowerOfTwo( int n )
 GFX::Texture* CubemapFromHDRE(const char* filename, GFX::Texture* output)
 {
 	HDRE* hdre = HDRE::Get(filename);
-	if (!hdre)
+	if (!hdre || !hdre->levels)
 		return NULL;
 
+	//half floats, half the memory of the floats in the file
+	//the ibl mode skips the base level (skybox) and the first prefiltered level becomes lod 0
+	int first_level = (HDRE::ibl_only && hdre->levels > 1) ? 1 : 0;
+	unsigned int format = hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA;
+	unsigned int internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+	int size = hdre->getLevelWidth(first_level);
+
 	GFX::Texture* texture = output ? output : new GFX::Texture();
-	if (hdre->getFacesf(0))
-	{
-		texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesf(0),
-			hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT);
-		for (int i = 1; i < hdre->levels; ++i)
-			texture->uploadCubemap(texture->format, texture->type, false,
-				(Uint8**)hdre->getFacesf(i), GL_RGBA32F, i);
-	}
-	else
-		if (hdre->getFacesh(0))
-		{
-			texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesh(0),
-				hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_HALF_FLOAT);
-			for (int i = 1; i < hdre->levels; ++i)
-				texture->uploadCubemap(texture->format, texture->type, false,
-					(Uint8**)hdre->getFacesh(i), GL_RGBA16F, i);
-		}
+	texture->createCubemap(size, size, (Uint8**)hdre->getFacesh(first_level), format, GL_HALF_FLOAT, true, internal_format);
+	for (int i = first_level + 1; i < hdre->levels; ++i)
+		texture->uploadCubemap(format, GL_HALF_FLOAT, false, (Uint8**)hdre->getFacesh(i), internal_format, i - first_level);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, hdre->levels - first_level - 1); //the smallest levels are not in the file
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	hdre->releaseLevels(); //in VRAM now, the file stays mapped
 	return texture;
 }
 
@@ -1108,87 +1911,102 @@ GFX::Texture* CubemapFromHDRE(const char* filename, GFX::Texture* output)
 LoadTextureTask::LoadTextureTask(const char* str)
 {
 	filename = str;
-	image = NULL;
 }
 
 LoadTextureTask::LoadTextureTask(const char* filename, std::vector<uint8>& buffer)
 {
 	this->filename = filename;
-	image = NULL;
 	this->buffer = buffer;
 }
 
 void LoadTextureTask::onExecute()
 {
-	image = new Image();
+	//compressed containers skip the decoding, the blocks are uploaded in the main thread
+	std::string ext = toLowerCase(getExtension(filename));
+	bool is_container = ext == "ktx" || ext == "dds";
+	bool cacheable = !buffer.size() && GFX::TextureCompressor::canCompress(filename);
+	if (!buffer.size() && is_container)
+	{
+		std::vector<uint8> ktx;
+		if (!readFileBin(filename, ktx))
+			return;
+		TaskManager::foreground.addTask(new UploadTextureTask(filename.c_str(), ktx));
+		return;
+	}
+
+	//images are cached with all their mips, as BC blocks when compressing
+	std::vector<uint8> tbin;
+	if (cacheable && GFX::TextureCompressor::enabled && GFX::TextureCompressor::loadOrCreate(filename.c_str(), tbin))
+	{
+		TaskManager::foreground.addTask(new UploadTextureTask(filename.c_str(), tbin));
+		return;
+	}
+	if (cacheable && GFX::Texture::use_disk_cache && GFX::Texture::readTBIN(filename.c_str(), tbin) && !GFX::Texture::getTBINFormat(tbin))
+	{
+		TaskManager::foreground.addTask(new UploadTextureTask(filename.c_str(), tbin));
+		return;
+	}
 
+	Image image;
 	if (buffer.size())
 	{
 		double time = getTime();
 		std::cout << " + Image decoding: " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ... ";
-		std::string ext = toLowerCase(getExtension(filename));
 		if(ext == "png")
-			image->loadPNG(buffer);
+			image.loadPNG(buffer);
 		else if(ext == "jpg" || ext == "jpeg")
-			image->loadJPG(buffer);
-		if (!image->width)
+			image.loadJPG(buffer);
+		if (!image.width)
 		{
-			delete image;
-			image = NULL;
 			std::cout << TermColor::RED << "[ERROR]: unsupported format" << TermColor::DEFAULT << std::endl;
 			return;
 		}
-		std::cout << "[OK] Size: " << image->width << "x" << image->height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		std::cout << "[OK] Size: " << image.width << "x" << image.height << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	}
-	else if (!image->load(filename.c_str()))
-	{
-		delete image;
-		image = NULL;
+	else if (!image.load(filename.c_str()))
+		return;
+
+	//the mips are built here so the main thread only has to copy levels
+	bool save_file = cacheable && GFX::Texture::use_disk_cache;
+	if (!GFX::Texture::writeTBIN(filename.c_str(), &image, true, tbin, save_file))
 		return;
-	}
 
 	//image loaded, ready to go back to main thread
-	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image);
-	TaskManager::foreground.addTask(upload_task);
+	TaskManager::foreground.addTask(new UploadTextureTask(filename.c_str(), tbin));
 }
 
-UploadTextureTask::UploadTextureTask(const char* filename, Image* image)
+UploadTextureTask::UploadTextureTask(const char* filename, std::vector<uint8>& container)
 {
 	this->filename = filename;
-	this->image = image;
-	assert(image && "image cannot be null");
+	this->container.swap(container);
 }
 
 void UploadTextureTask::onExecute()
 {
 	GFX::Texture* texture = NULL;
-	if (!image)
+	if (container.empty())
 	{
 		std::cerr << "Image is null: " << filename << std::endl;
 		return;
 	}
-	assert(image && "image cant be null");
 
 	//in case somehow it got loaded while I was loading it in the background
 	auto it = GFX::Texture::sTexturesLoaded.find(filename);
 	if (it == GFX::Texture::sTexturesLoaded.end())
 	{
-		/*
-		//create texture
-		if (!texture)
-			texture = new Texture();
-		*/
-		delete image;
 		std::cout << "Warning: image loaded in background not found foreground thread" << std::endl;
 		return;
 	}
 
 	texture = it->second;
+	texture->load_task = 0;
 
-	//upload to GPU
-	texture->loadFromImage(image);
-	texture->loading = false;
+	//with mip streaming only the small levels are uploaded, the rest when the renderer needs them
+	int first_mip = GFX::TextureStreaming::getInitialMip(texture, container);
 
-	//delete image
-	delete image;
+	//levels are streamed to the GPU under a time budget per frame
+	if (GFX::TextureUploader::enabled && GFX::TextureUploader::add(texture, container, first_mip))
+		return; //loading is cleared once every level is uploaded
+	texture->loadContainer(container, first_mip);
+	texture->loading = false;
 }
@@ -31,6 +31,21 @@ namespace GFX {
 	#define GL_TEXTURE_EXTERNAL_OES 0x8D65
 #endif
 
+//block compressed formats (S3TC, RGTC and BPTC)
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+	#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+	#define GL_COMPRESSED_RGBA_S3TC_DXT3_EXT 0x83F2
+	#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RED_RGTC1
+	#define GL_COMPRESSED_RED_RGTC1 0x8DBB
+	#define GL_COMPRESSED_RG_RGTC2 0x8DBD
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+	#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+
 //Simple class to handle images
 template <typename T> class tImage
 {
@@ -56,7 +71,7 @@ public:
 	Color getPixel(int x, int y) {
 		assert(x >= 0 && x < (int)width && y >= 0 && y < (int)height && "reading of memory");
 		int pos = y*width* num_channels + x* num_channels;
-		return Color(data[pos], data[pos + 1], data[pos + 2], num_channels == 4 ? 255 : data[pos + 3]);
+		return Color(data[pos], data[pos + 1], data[pos + 2], num_channels == 3 ? 255 : data[pos + 3]);
 	};
 	void setPixel(int x, int y, Color v) {
 		assert(x >= 0 && x < (int)width && y >= 0 && y < (int)height && "writing of memory");
@@ -78,6 +93,9 @@ public:
 	bool loadJPG(const char* filename, bool flip_y = false);
 	bool loadJPG(std::vector<unsigned char>& buffer, bool flip_y = false);
 	bool saveTGA(const char* filename, bool flip_y = false);
+
+	static bool benchmarkPNG(const char* filename, int iterations = 10); //picoPNG against the fast decoder, no GPU needed
+	static bool benchmarkJPG(const char* filename, int iterations = 10); //whole against striped decoding, no GPU needed
 };
 
 class FloatImage : public tImage<float>
@@ -105,13 +123,39 @@ public:
 
 namespace GFX {
 
+	//one level (or cubemap face) of a texture file, stored inside the file buffer
+	struct sTextureLevel {
+		unsigned int target; //GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP_POSITIVE_X + face
+		int level;
+		int width;
+		int height;
+		size_t offset; //from the start of the buffer
+		size_t size;
+		size_t row_bytes; //a row of blocks when compressed
+	};
+
+	//how to upload a KTX/DDS or TBIN file
+	struct sTextureLayout {
+		unsigned int texture_type; //GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP
+		unsigned int internal_format;
+		unsigned int format;
+		unsigned int type;
+		bool compressed;
+		int width;
+		int height;
+		int num_mips;
+		std::vector<sTextureLevel> levels;
+	};
+
 	// TEXTURE CLASS
 	class Texture
 	{
 	public:
+		static bool use_disk_cache; //images are stored with all their mips in a .tbin beside the source, as BC blocks when compressed
 		static int default_mag_filter;
 		static int default_min_filter;
 		static FBO* global_fbo;
+		static bool has_copy_image; //glCopyImageSubData is available, set by init, without it the levels are never dropped
 
 		//a general struct to store all the information about a TGA file
 
@@ -132,7 +176,7 @@ namespace GFX {
 		unsigned int format; //GL_RGB, GL_RGBA, GL_DEPTH_COMPONENT
 		unsigned int type; //GL_UNSIGNED_INT, GL_FLOAT
 		unsigned int internal_format;
-		unsigned int texture_type; //GL_TEXTURE_2D, GL_TEXTURE_CUBE, GL_TEXTURE_2D_ARRAY
+		unsigned int texture_type; //GL_TEXTURE_2D, GL_TEXTURE_CUBE, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_3D
 		bool mipmaps;
 
 		unsigned int wrapS;
@@ -141,32 +185,60 @@ namespace GFX {
 		//original data info
 		::Image image;
 
+		//residency (see residency.h)
+		uint32 last_used_frame; //Residency::frame when it was bound for the last time
+		bool evicted; //VRAM released, reloaded from the file when bound again
+		unsigned int load_task; //id of the decode in TaskManager::background, 0 if none, only used to reprioritize or cancel it
+
+		//mip streaming (see texturestreaming.h)
+		int num_mips; //levels in the file, the resident ones go from resident_mip to the last
+		int resident_mip; //finest level in VRAM (GL_TEXTURE_BASE_LEVEL), 0 is the full resolution
+		int initial_mip; //levels uploaded when loading, it never drops below them
+		int desired_mip; //finest level needed by the draws of desired_frame
+		uint32 desired_frame;
+		bool streaming_mips; //finer levels requested and not uploaded yet
+		std::string stream_filename; //where the levels are read again, empty if it cannot stream
+
 		Texture();
 		Texture(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 		Texture(::Image* img);
 		~Texture();
 
+		static void init(); //call once after the GL context is created
 		static void Release();
 
 
 		void clear();
 
 		void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-		//void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, const Uint8* data = NULL, unsigned int internal_format = 0);
 		void createCubemap(unsigned int width, unsigned int height, Uint8** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0);
 
 		void upload(::Image* img);
 		void upload(::FloatImage* img);
 		void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, const Uint8* data = NULL, unsigned int internal_format = 0);
-		//void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, const Uint8* data = NULL, unsigned int internal_format = 0);
 		void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
 		void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
 
 		bool loadKTX(const char* filename);
-		bool loadKTX(std::vector<unsigned char>& buffer);
+
+		//texture cache, keyed by the source path, modification time and size
+		static bool readTBIN(const char* filename, std::vector<unsigned char>& buffer); //false if missing or outdated
+		static bool writeTBIN(const char* filename, ::Image* image, bool mipmaps, std::vector<unsigned char>& buffer, bool save_file = true); //builds the mips and saves it
+		static size_t createTBIN(const char* filename, int width, int height, int num_channels, int num_mips, unsigned int internal_format, size_t levels_bytes, std::vector<unsigned char>& buffer); //header stamped with the source, returns where the levels go
+		static bool saveTBIN(const char* filename, const std::vector<unsigned char>& buffer);
+		static unsigned int getTBINFormat(const std::vector<unsigned char>& buffer); //of the BC blocks, 0 if the levels are raw pixels
+
+		//KTX/DDS or TBIN files in memory
+		static bool getLayout(std::vector<unsigned char>& buffer, sTextureLayout& layout); //false if not supported
+		static GLuint allocateLayout(const sTextureLayout& layout, GLuint id = 0); //reserves every level in the layout, creates the texture if id is 0
+		void applyLayout(const sTextureLayout& layout, GLuint id, int first_mip = 0); //replaces the current texture with id and sets the sampling
+		bool loadContainer(std::vector<unsigned char>& buffer, int first_mip = 0); //uploads the levels from first_mip now
 
 		void bind();
 		void unbind();
+		void setWrap(bool repeat);
 
 		void debugInMenu();
 
@@ -190,6 +262,16 @@ namespace GFX {
 
 		void generateMipmaps();
 
+		//memory
+		size_t getGPUBytes(int base_mip = -1); //estimated from the format, includes mipmaps, -1 uses resident_mip
+		size_t getCPUBytes() { return image.data ? image.width * image.height * image.num_channels : 0; }
+		bool canEvict(); //only 2D textures loaded from a file can be reloaded
+		bool evict();
+		bool makeResident(); //reloads it in the background, a 1x1 texture is used meanwhile
+		bool cancelLoading(); //drops the pending decode, false if it already started
+		void setResidentMip(int mip); //finer levels must be uploaded already
+		bool dropMips(int mip); //releases the levels finer than mip
+
 		//show the texture on the current viewport
 		void toViewport(Shader* shader = NULL);
 		//copy to another texture
@@ -209,13 +291,12 @@ bool isPowerOfTwo(int n);
 
 //When loading textures asyncrhonously, first we load them from the hard drive in a background thread
 //afterwards we pass the data to the main thread as bg threads cannot access opengl, and main thread
-//uploads to GPU. While loading a fake 1x1 texture is created
+//uploads to GPU (see TextureUploader). While loading a fake 1x1 texture is created
 
 class LoadTextureTask : public Task {
 public:
 	std::string filename;
 	std::vector<uint8> buffer;
-	Image* image;
 
 	LoadTextureTask(const char* filename);
 	LoadTextureTask(const char* filename, std::vector<uint8>& buffer);
@@ -225,9 +306,9 @@ public:
 class UploadTextureTask : public Task {
 public:
 	std::string filename;
-	Image* image;
+	std::vector<uint8> container; //KTX/DDS or TBIN file, decoded images are converted to TBIN in memory
 
-	UploadTextureTask(const char* filename, Image* image);
+	UploadTextureTask(const char* filename, std::vector<uint8>& container);
 	void onExecute();
 };
 
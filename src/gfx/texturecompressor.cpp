@@ -0,0 +1,406 @@
+#include "texturecompressor.h"
+#include "texture.h"
+
+#include "../core/task.h"
+#include "../utils/utils.h"
+
+#include <cmath>
+#include <cstring>
+#include <cfloat>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define BLOCKS_SSE
+#endif
+
+using namespace GFX;
+
+bool TextureCompressor::enabled = true;
+bool TextureCompressor::use_simd = true;
+uint32 TextureCompressor::num_encoded = 0;
+uint32 TextureCompressor::num_cache_hits = 0;
+double TextureCompressor::encode_time = 0;
+
+//position of the pixel along the segment between endpoints to the index stored in the block
+static const uint8 bc1_index_map[4] = { 1, 3, 2, 0 }; //c1 -> c0
+static const uint8 bc4_index_map[8] = { 1, 7, 6, 5, 4, 3, 2, 0 }; //a1 -> a0
+
+static inline uint16 packRGB565(const int* c)
+{
+	return uint16((((c[0] * 31 + 127) / 255) << 11) | (((c[1] * 63 + 127) / 255) << 5) | ((c[2] * 31 + 127) / 255));
+}
+
+static inline void unpackRGB565(uint16 v, int* c)
+{
+	int r = (v >> 11) & 31;
+	int g = (v >> 5) & 63;
+	int b = v & 31;
+	c[0] = (r << 3) | (r >> 2);
+	c[1] = (g << 2) | (g >> 4);
+	c[2] = (b << 3) | (b >> 2);
+}
+
+//reads a 4x4 block as RGBA, the blocks on the border repeat the last row and column
+static void fetchBlock(const uint8* rgba, int width, int height, int bx, int by, uint8* block)
+{
+	int x0 = bx * 4;
+	int y0 = by * 4;
+	if (x0 + 4 <= width && y0 + 4 <= height)
+	{
+		for (int y = 0; y < 4; ++y)
+			memcpy(block + y * 16, rgba + (size_t(y0 + y) * width + x0) * 4, 16);
+		return;
+	}
+
+	for (int y = 0; y < 4; ++y)
+	{
+		int py = std::min(y0 + y, height - 1);
+		for (int x = 0; x < 4; ++x)
+		{
+			int px = std::min(x0 + x, width - 1);
+			memcpy(block + (y * 4 + x) * 4, rgba + (size_t(py) * width + px) * 4, 4);
+		}
+	}
+}
+
+//picks the two pixels at the ends of the principal axis of the colors (power iteration over the covariance)
+static void findColorEndpoints(const uint8* block, int* max_color, int* min_color)
+{
+	float mean[3] = { 0,0,0 };
+	for (int i = 0; i < 16; ++i)
+		for (int c = 0; c < 3; ++c)
+			mean[c] += block[i * 4 + c];
+	for (int c = 0; c < 3; ++c)
+		mean[c] *= 1.0f / 16.0f;
+
+	float cov[6] = { 0,0,0,0,0,0 }; //rr rg rb gg gb bb
+	for (int i = 0; i < 16; ++i)
+	{
+		float r = block[i * 4] - mean[0];
+		float g = block[i * 4 + 1] - mean[1];
+		float b = block[i * 4 + 2] - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+	}
+
+	//start from the column with the biggest variance, the bbox diagonal fails with anticorrelated channels
+	float axis[3];
+	if (cov[0] >= cov[3] && cov[0] >= cov[5])
+		{ axis[0] = cov[0]; axis[1] = cov[1]; axis[2] = cov[2]; }
+	else if (cov[3] >= cov[5])
+		{ axis[0] = cov[1]; axis[1] = cov[3]; axis[2] = cov[4]; }
+	else
+		{ axis[0] = cov[2]; axis[1] = cov[4]; axis[2] = cov[5]; }
+
+	for (int it = 0; it < 4; ++it)
+	{
+		float x = axis[0] * cov[0] + axis[1] * cov[1] + axis[2] * cov[2];
+		float y = axis[0] * cov[1] + axis[1] * cov[3] + axis[2] * cov[4];
+		float z = axis[0] * cov[2] + axis[1] * cov[4] + axis[2] * cov[5];
+		float m = std::max(std::fabs(x), std::max(std::fabs(y), std::fabs(z)));
+		if (m < 1e-6f)
+			break;
+		axis[0] = x / m; axis[1] = y / m; axis[2] = z / m;
+	}
+
+	int min_i = 0, max_i = 0;
+	float min_d = FLT_MAX, max_d = -FLT_MAX;
+	for (int i = 0; i < 16; ++i)
+	{
+		float d = block[i * 4] * axis[0] + block[i * 4 + 1] * axis[1] + block[i * 4 + 2] * axis[2];
+		if (d < min_d) { min_d = d; min_i = i; }
+		if (d > max_d) { max_d = d; max_i = i; }
+	}
+
+	for (int c = 0; c < 3; ++c)
+	{
+		max_color[c] = block[max_i * 4 + c];
+		min_color[c] = block[min_i * 4 + c];
+	}
+}
+
+//projects every pixel on the segment c1 -> c0 and rounds to the closest of the 4 colors of the palette
+static uint32 computeColorIndices(const uint8* block, const int* c0, const int* c1)
+{
+	int axis[3] = { c0[0] - c1[0], c0[1] - c1[1], c0[2] - c1[2] };
+	int len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	float scale = 3.0f / len2;
+	uint8 t[16];
+
+#ifdef BLOCKS_SSE
+	if (TextureCompressor::use_simd)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i origin = _mm_setr_epi16(c1[0], c1[1], c1[2], 0, c1[0], c1[1], c1[2], 0);
+		const __m128i dir = _mm_setr_epi16(axis[0], axis[1], axis[2], 0, axis[0], axis[1], axis[2], 0);
+		const __m128 vscale = _mm_set1_ps(scale);
+		__m128i pos[4];
+		for (int i = 0; i < 4; ++i) //4 pixels per iteration
+		{
+			__m128i pixels = _mm_loadu_si128((const __m128i*)(block + i * 16));
+			__m128i lo = _mm_madd_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(pixels, zero), origin), dir);
+			__m128i hi = _mm_madd_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(pixels, zero), origin), dir);
+			//add the (r+g, b+a) pairs of every pixel
+			__m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+			__m128i dot = _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+			pos[i] = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(dot), vscale));
+		}
+		//saturating packs clamp the negatives to 0
+		__m128i t8 = _mm_packus_epi16(_mm_packs_epi32(pos[0], pos[1]), _mm_packs_epi32(pos[2], pos[3]));
+		t8 = _mm_min_epu8(t8, _mm_set1_epi8(3));
+		_mm_storeu_si128((__m128i*)t, t8);
+	}
+	else
+#endif
+	{
+		for (int i = 0; i < 16; ++i)
+		{
+			const uint8* p = block + i * 4;
+			int dot = (p[0] - c1[0]) * axis[0] + (p[1] - c1[1]) * axis[1] + (p[2] - c1[2]) * axis[2];
+			t[i] = (uint8)std::min(std::max((int)lrintf(dot * scale), 0), 3);
+		}
+	}
+
+	uint32 indices = 0;
+	for (int i = 0; i < 16; ++i)
+		indices |= uint32(bc1_index_map[t[i]]) << (i * 2);
+	return indices;
+}
+
+//BC1 block (also the color part of BC3): two RGB565 endpoints and 2 bits per pixel
+static void encodeColorBlock(const uint8* block, uint8* output)
+{
+	int max_color[3], min_color[3];
+	findColorEndpoints(block, max_color, min_color);
+
+	uint16 c0 = packRGB565(max_color);
+	uint16 c1 = packRGB565(min_color);
+	if (c0 < c1) //c0 > c1 selects the 4 colors mode
+		std::swap(c0, c1);
+
+	uint32 indices = 0; //solid blocks use c0
+	if (c0 != c1)
+	{
+		int p0[3], p1[3];
+		unpackRGB565(c0, p0);
+		unpackRGB565(c1, p1);
+		indices = computeColorIndices(block, p0, p1);
+	}
+
+	memcpy(output, &c0, 2);
+	memcpy(output + 2, &c1, 2);
+	memcpy(output + 4, &indices, 4);
+}
+
+//BC4 block (alpha of BC3, each channel of BC5): two 8 bits endpoints and 3 bits per pixel
+static void encodeChannelBlock(const uint8* block, int channel, uint8* output)
+{
+	uint8 values[16];
+	for (int i = 0; i < 16; ++i)
+		values[i] = block[i * 4 + channel];
+
+	int min_v = 255, max_v = 0;
+	uint8 t[16];
+	memset(t, 0, 16);
+
+#ifdef BLOCKS_SSE
+	if (TextureCompressor::use_simd)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i v = _mm_loadu_si128((const __m128i*)values);
+		__m128i vmin = _mm_min_epu8(v, _mm_srli_si128(v, 8));
+		__m128i vmax = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+		vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 4));
+		vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 4));
+		vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 2));
+		vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 2));
+		vmin = _mm_min_epu8(vmin, _mm_srli_si128(vmin, 1));
+		vmax = _mm_max_epu8(vmax, _mm_srli_si128(vmax, 1));
+		min_v = _mm_cvtsi128_si32(vmin) & 0xFF;
+		max_v = _mm_cvtsi128_si32(vmax) & 0xFF;
+		if (max_v > min_v)
+		{
+			const __m128 vscale = _mm_set1_ps(7.0f / (max_v - min_v));
+			__m128i d = _mm_subs_epu8(v, _mm_set1_epi8((char)min_v));
+			__m128i d_lo = _mm_unpacklo_epi8(d, zero);
+			__m128i d_hi = _mm_unpackhi_epi8(d, zero);
+			__m128i t0 = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(d_lo, zero)), vscale));
+			__m128i t1 = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(d_lo, zero)), vscale));
+			__m128i t2 = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(d_hi, zero)), vscale));
+			__m128i t3 = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(d_hi, zero)), vscale));
+			_mm_storeu_si128((__m128i*)t, _mm_packus_epi16(_mm_packs_epi32(t0, t1), _mm_packs_epi32(t2, t3)));
+		}
+	}
+	else
+#endif
+	{
+		for (int i = 0; i < 16; ++i)
+		{
+			min_v = std::min(min_v, (int)values[i]);
+			max_v = std::max(max_v, (int)values[i]);
+		}
+		if (max_v > min_v)
+		{
+			float scale = 7.0f / (max_v - min_v);
+			for (int i = 0; i < 16; ++i)
+				t[i] = (uint8)lrintf((values[i] - min_v) * scale);
+		}
+	}
+
+	//a0 > a1 selects the 8 values mode, solid blocks use a0
+	uint64_t indices = 0;
+	if (max_v > min_v)
+		for (int i = 0; i < 16; ++i)
+			indices |= uint64_t(bc4_index_map[t[i]]) << (i * 3);
+	output[0] = (uint8)max_v;
+	output[1] = (uint8)min_v;
+	for (int i = 0; i < 6; ++i)
+		output[2 + i] = uint8(indices >> (i * 8));
+}
+
+bool TextureCompressor::canCompress(const std::string& filename)
+{
+	std::string ext = toLowerCase(getExtension(filename));
+	return ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "tga";
+}
+
+bool TextureCompressor::loadOrCreate(const char* filename, std::vector<uint8>& tbin, bool mipmaps)
+{
+	eMipContent content = MipGenerator::getContent(filename);
+	if (Texture::use_disk_cache && Texture::readTBIN(filename, tbin))
+	{
+		//raw pixels cached while not compressing, or normal maps cached before they were BC5, are compressed again
+		unsigned int internal_format = Texture::getTBINFormat(tbin);
+		if (internal_format && (content != MIP_NORMALMAP || internal_format == GL_COMPRESSED_RG_RGTC2))
+		{
+			num_cache_hits++;
+			return true;
+		}
+	}
+
+	::Image image;
+	if (!image.load(filename))
+		return false;
+
+	long time = getTime();
+	std::cout << " + Compressing: " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ... ";
+	eBlockFormat format = chooseFormat(&image, content);
+	if (!encode(&image, format, mipmaps, tbin, content, filename))
+	{
+		std::cout << TermColor::RED << "[ERROR]: unsupported image" << TermColor::DEFAULT << std::endl;
+		return false;
+	}
+	long elapsed = getTime() - time;
+	encode_time += elapsed;
+	num_encoded++;
+
+	//if the folder is read-only it will be compressed again next time
+	if (Texture::use_disk_cache)
+		Texture::saveTBIN(filename, tbin);
+
+	std::cout << "[OK] " << (format == BLOCK_BC1 ? "BC1" : (format == BLOCK_BC3 ? "BC3" : "BC5")) << " Time: " << elapsed * 0.001 << "sec" << std::endl;
+	return true;
+}
+
+eBlockFormat TextureCompressor::chooseFormat(::Image* image, eMipContent content)
+{
+	//two channels with their own endpoints, BC1 would quantize the normals to 5:6:5 and 4 levels per block
+	if (content == MIP_NORMALMAP)
+		return BLOCK_BC5;
+	if (image->num_channels == 4)
+		for (size_t i = 3, l = size_t(image->width) * image->height * 4; i < l; i += 4)
+			if (image->data[i] != 255)
+				return BLOCK_BC3;
+	return BLOCK_BC1;
+}
+
+size_t TextureCompressor::getLevelBytes(int width, int height, eBlockFormat format)
+{
+	return size_t((width + 3) / 4) * size_t((height + 3) / 4) * (format == BLOCK_BC1 ? 8 : 16);
+}
+
+bool TextureCompressor::encode(::Image* image, eBlockFormat format, bool mipmaps, std::vector<uint8>& tbin, eMipContent content, const char* source)
+{
+	if (!image->data || !image->width || !image->height || (image->num_channels != 3 && image->num_channels != 4))
+		return false;
+
+	int width = image->width;
+	int height = image->height;
+	int num_mips = mipmaps ? MipGenerator::getNumMips(width, height) : 1;
+	unsigned int internal_format = format == BLOCK_BC1 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : (format == BLOCK_BC3 ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RG_RGTC2);
+
+	size_t levels_bytes = 0;
+	for (int i = 0; i < num_mips; ++i)
+		levels_bytes += getLevelBytes(std::max(width >> i, 1), std::max(height >> i, 1), format);
+	size_t offset = Texture::createTBIN(source, width, height, image->num_channels, num_mips, internal_format, levels_bytes, tbin);
+	uint8* pos = &tbin[offset];
+
+	//expand to RGBA once, the mips are built from it
+	std::vector<uint8> level(size_t(width) * height * 4);
+	if (image->num_channels == 4)
+		memcpy(&level[0], image->data, level.size());
+	else
+		for (size_t i = 0, l = size_t(width) * height; i < l; ++i)
+		{
+			level[i * 4] = image->data[i * 3];
+			level[i * 4 + 1] = image->data[i * 3 + 1];
+			level[i * 4 + 2] = image->data[i * 3 + 2];
+			level[i * 4 + 3] = 255;
+		}
+
+	std::vector<uint8> next_level;
+	for (int i = 0; i < num_mips; ++i)
+	{
+		if (i > 0)
+		{
+			next_level.resize(size_t(std::max(width >> 1, 1)) * std::max(height >> 1, 1) * 4);
+			MipGenerator::downsample(&level[0], width, height, 4, &next_level[0], content);
+			level.swap(next_level);
+			width = std::max(width >> 1, 1);
+			height = std::max(height >> 1, 1);
+		}
+
+		encodeLevel(&level[0], width, height, format, pos);
+		pos += getLevelBytes(width, height, format);
+	}
+
+	return true;
+}
+
+void TextureCompressor::encodeLevel(const uint8* rgba, int width, int height, eBlockFormat format, uint8* output)
+{
+	int blocks_x = (width + 3) / 4;
+	int blocks_y = (height + 3) / 4;
+	int block_bytes = format == BLOCK_BC1 ? 8 : 16;
+
+	//every row of blocks is independent
+	JobSystem::parallelFor(blocks_y, 4, [&](int start, int end) {
+		uint8 block[64];
+		for (int by = start; by < end; ++by)
+		{
+			uint8* out = output + size_t(by) * blocks_x * block_bytes;
+			for (int bx = 0; bx < blocks_x; ++bx, out += block_bytes)
+			{
+				fetchBlock(rgba, width, height, bx, by, block);
+				switch (format)
+				{
+					case BLOCK_BC1: encodeColorBlock(block, out); break;
+					case BLOCK_BC3: encodeChannelBlock(block, 3, out); encodeColorBlock(block, out + 8); break;
+					case BLOCK_BC5: encodeChannelBlock(block, 0, out); encodeChannelBlock(block, 1, out + 8); break;
+				}
+			}
+		}
+	});
+}
+
+void TextureCompressor::showUI()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Compress textures", &enabled);
+	ImGui::Checkbox("SIMD encoder", &use_simd);
+	ImGui::Checkbox("Cache textures with their mips (.tbin)", &Texture::use_disk_cache);
+	ImGui::Text("Encoded: %d (%.2fs) Cache hits: %d", num_encoded, encode_time * 0.001, num_cache_hits);
+#endif
+}
@@ -0,0 +1,48 @@
+/*  CPU encoder of block compressed textures (BC1, BC3 and BC5).
+	Source images (png, jpg, tga) are converted once and the blocks with their mips are kept
+	in the .tbin cache beside the original (see Texture::readTBIN), so the next runs upload
+	them directly, saving decode time and VRAM.
+*/
+
+#pragma once
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include "mipgenerator.h"
+#include <string>
+#include <vector>
+
+class Image;
+
+namespace GFX {
+
+	enum eBlockFormat {
+		BLOCK_BC1, //RGB, 8 bytes per 4x4 block
+		BLOCK_BC3, //RGBA, 16 bytes per 4x4 block
+		BLOCK_BC5  //RG (normal maps), 16 bytes per 4x4 block
+	};
+
+	class TextureCompressor {
+	public:
+		static bool enabled; //compress the textures loaded from png/jpg/tga, cached when Texture::use_disk_cache
+		static bool use_simd;
+
+		//stats
+		static uint32 num_encoded;
+		static uint32 num_cache_hits;
+		static double encode_time; //ms spent encoding
+
+		static bool canCompress(const std::string& filename); //only the formats decoded by Image
+
+		//reads the cache or builds it from the source image, returns the .tbin file in memory
+		static bool loadOrCreate(const char* filename, std::vector<uint8>& tbin, bool mipmaps = true); //false if the image cannot be compressed
+
+		static eBlockFormat chooseFormat(::Image* image, eMipContent content = MIP_COLOR); //BC5 for normal maps, BC3 if there is any transparency, BC1 otherwise
+		static bool encode(::Image* image, eBlockFormat format, bool mipmaps, std::vector<uint8>& tbin, eMipContent content = MIP_COLOR, const char* source = NULL); //writes a TBIN in memory, stamped with the source file
+		static void encodeLevel(const uint8* rgba, int width, int height, eBlockFormat format, uint8* output); //one level, RGBA8 input
+		static size_t getLevelBytes(int width, int height, eBlockFormat format);
+
+		static void showUI();
+	};
+
+};
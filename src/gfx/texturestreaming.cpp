@@ -0,0 +1,244 @@
+#include "texturestreaming.h"
+#include "texture.h"
+#include "mesh.h"
+#include "gfx.h"
+#include "residency.h"
+#include "textureuploader.h"
+
+#include "../pipeline/camera.h"
+#include "../utils/utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace GFX;
+
+bool TextureStreaming::enabled = true;
+size_t TextureStreaming::budget = size_t(512) * 1024 * 1024;
+int TextureStreaming::initial_size = 64;
+float TextureStreaming::mip_bias = 0;
+uint32 TextureStreaming::drop_delay = 300; //~5 seconds at 60fps
+int TextureStreaming::max_requests = 4;
+
+size_t TextureStreaming::streamed_bytes = 0;
+uint32 TextureStreaming::num_streamed = 0;
+uint32 TextureStreaming::num_requests = 0;
+uint32 TextureStreaming::num_drops = 0;
+
+static int num_in_flight = 0;
+
+//reads the file again in the background, only the levels from first_mip to last_mip are uploaded
+class LoadMipsTask : public Task {
+public:
+	std::string filename; //of the texture, used to find it back
+	std::string source;
+	int first_mip;
+	int last_mip;
+
+	LoadMipsTask(Texture* texture, int first_mip);
+	void onExecute();
+};
+
+class UploadMipsTask : public Task {
+public:
+	std::string filename;
+	std::vector<uint8> container;
+	int first_mip;
+	int last_mip;
+
+	void onExecute();
+};
+
+LoadMipsTask::LoadMipsTask(Texture* texture, int first_mip)
+{
+	filename = texture->filename;
+	source = texture->stream_filename;
+	this->first_mip = first_mip;
+	this->last_mip = texture->resident_mip - 1;
+	priority = (int)Residency::frame;
+}
+
+void LoadMipsTask::onExecute()
+{
+	UploadMipsTask* task = new UploadMipsTask();
+	task->filename = filename;
+	task->first_mip = first_mip;
+	task->last_mip = last_mip;
+	if (!readFileBin(source, task->container))
+		task->container.clear(); //the main thread still has to know it failed
+	TaskManager::foreground.addTask(task);
+}
+
+void UploadMipsTask::onExecute()
+{
+	num_in_flight--;
+
+	//the texture may be gone or reloaded while reading
+	auto it = Texture::sTexturesLoaded.find(filename);
+	if (it == Texture::sTexturesLoaded.end())
+		return;
+	Texture* texture = it->second;
+	if (!texture->streaming_mips || texture->loading || texture->evicted || texture->resident_mip != last_mip + 1)
+		return;
+
+	//the file must still be the one that was loaded
+	sTextureLayout layout;
+	bool valid = container.size() && Texture::getLayout(container, layout) && layout.num_mips == texture->num_mips &&
+		layout.width == (int)texture->width && layout.height == (int)texture->height && layout.format == texture->format;
+	if (!valid || !TextureUploader::add(texture, container, first_mip, last_mip))
+	{
+		std::cout << TermColor::RED << "[ERROR] cannot stream mips of " << filename << TermColor::DEFAULT << std::endl;
+		texture->streaming_mips = false;
+		texture->stream_filename.clear(); //keep the current levels
+	}
+}
+
+int TextureStreaming::getInitialMip(Texture* texture, std::vector<uint8>& container)
+{
+	texture->stream_filename.clear();
+	texture->initial_mip = 0;
+	if (!enabled)
+		return 0;
+
+	sTextureLayout layout;
+	if (!Texture::getLayout(container, layout) || layout.texture_type != GL_TEXTURE_2D || layout.num_mips < 2)
+		return 0;
+
+	//the levels are read again from the same file that was loaded
+	std::string source;
+	std::string ext = toLowerCase(getExtension(texture->filename));
+	if (memcmp(&container[0], "TBIN", 4) == 0)
+		source = texture->filename + ".tbin";
+	else if (ext == "ktx" || ext == "dds")
+		source = texture->filename;
+	if (source.empty() || !fileExists(source))
+		return 0; //embedded images and caches that could not be written
+
+	int mip = 0;
+	while (mip < layout.num_mips - 1 && std::max(layout.width >> mip, layout.height >> mip) > initial_size)
+		mip++;
+	texture->stream_filename = source;
+	texture->initial_mip = mip;
+	return mip;
+}
+
+//texels per world unit of the base level against pixels per world unit at the closest point of the mesh
+int TextureStreaming::computeMip(Texture* texture, Mesh* mesh, const Matrix44& model, Camera* camera)
+{
+	Vector3f center = model * mesh->box.center;
+	float scale = model.rotateVector(Vector3f(1, 0, 0)).length();
+	float radius = mesh->box.halfsize.length() * scale;
+	float viewport_height = (float)CORE::getWindowSize().y;
+
+	float pixels_per_unit;
+	if (camera->type == Camera::ORTHOGRAPHIC)
+		pixels_per_unit = viewport_height / std::max((float)fabs(camera->top - camera->bottom), 0.0001f);
+	else
+	{
+		float distance = std::max(camera->eye.distance(center) - radius, camera->near_plane);
+		pixels_per_unit = viewport_height / (2.0f * tan(camera->fov * 0.5f * DEG2RAD) * distance);
+	}
+
+	float uv_density = mesh->uv_density ? mesh->uv_density : 1.0f;
+	float texels_per_unit = std::max(texture->width, texture->height) * uv_density / std::max(scale, 0.0001f);
+	float mip = log2(std::max(texels_per_unit / pixels_per_unit, 1.0f)) + mip_bias;
+	return std::min(std::max((int)mip, 0), texture->num_mips - 1);
+}
+
+void TextureStreaming::addDemand(Texture* texture, Mesh* mesh, const Matrix44& model, Camera* camera)
+{
+	if (!texture || texture->stream_filename.empty() || !mesh || !camera)
+		return;
+
+	int mip = enabled ? computeMip(texture, mesh, model, camera) : 0;
+	if (texture->desired_frame != Residency::frame)
+	{
+		texture->desired_frame = Residency::frame;
+		texture->desired_mip = mip;
+	}
+	else
+		texture->desired_mip = std::min(texture->desired_mip, mip);
+}
+
+void TextureStreaming::update()
+{
+	uint32 frame = Residency::frame;
+	std::vector<Texture*> finer;
+	std::vector<Texture*> coarser;
+
+	streamed_bytes = 0;
+	num_streamed = 0;
+	for (auto& it : Texture::sTextures)
+	{
+		Texture* texture = it.second;
+		if (texture->stream_filename.empty() || texture->loading || texture->evicted || !texture->texture_id)
+			continue;
+		num_streamed++;
+
+		//not drawn for a while, back to the initial levels
+		if (frame - texture->last_used_frame > drop_delay && texture->resident_mip < texture->initial_mip && texture->dropMips(texture->initial_mip))
+			num_drops++;
+		streamed_bytes += texture->getGPUBytes();
+
+		if (texture->desired_frame != frame || texture->streaming_mips)
+			continue;
+		if (texture->desired_mip < texture->resident_mip)
+			finer.push_back(texture);
+		else if (texture->desired_mip > texture->resident_mip)
+			coarser.push_back(texture);
+	}
+
+	//over budget, release the levels not needed starting with the biggest
+	if (streamed_bytes > budget)
+	{
+		std::sort(coarser.begin(), coarser.end(), [](Texture* a, Texture* b) { return a->getGPUBytes() > b->getGPUBytes(); });
+		for (Texture* texture : coarser)
+		{
+			if (streamed_bytes <= budget)
+				break;
+			size_t bytes = texture->getGPUBytes();
+			if (!texture->dropMips(texture->desired_mip))
+				continue;
+			streamed_bytes -= bytes - texture->getGPUBytes();
+			num_drops++;
+		}
+	}
+
+	//the textures further from what they need go first
+	std::sort(finer.begin(), finer.end(), [](Texture* a, Texture* b) { return a->resident_mip - a->desired_mip > b->resident_mip - b->desired_mip; });
+	for (Texture* texture : finer)
+	{
+		if (num_in_flight >= max_requests)
+			break;
+		size_t extra = texture->getGPUBytes(texture->desired_mip) - texture->getGPUBytes();
+		if (streamed_bytes + extra > budget)
+			continue;
+		streamed_bytes += extra; //reserved
+		texture->streaming_mips = true;
+		num_in_flight++;
+		num_requests++;
+		TaskManager::background.addTask(new LoadMipsTask(texture, texture->desired_mip));
+	}
+}
+
+void TextureStreaming::showUI()
+{
+#ifndef SKIP_IMGUI
+	const float MB = 1.0f / (1024 * 1024);
+	ImGui::Checkbox("Stream mips on demand", &enabled);
+	int budget_mb = int(budget / (1024 * 1024));
+	if (ImGui::SliderInt("Streaming budget (MB)", &budget_mb, 16, 4096))
+		budget = size_t(budget_mb) * 1024 * 1024;
+	ImGui::SliderInt("Initial size", &initial_size, 1, 1024);
+	ImGui::SliderFloat("Mip bias", &mip_bias, -2.0f, 4.0f);
+	int delay = (int)drop_delay;
+	if (ImGui::SliderInt("Drop delay (frames)", &delay, 1, 3000))
+		drop_delay = delay;
+	ImGui::SliderInt("Max requests", &max_requests, 1, 32);
+	ImGui::ProgressBar(streamed_bytes / (float)budget, ImVec2(-1, 0), (std::to_string(int(streamed_bytes * MB)) + " / " + std::to_string(int(budget * MB)) + " MB streamed").c_str());
+	ImGui::Text("Textures: %d Requests: %d (%d in flight) Drops: %d", num_streamed, num_requests, num_in_flight, num_drops);
+	if (!Texture::has_copy_image)
+		ImGui::TextColored(ImVec4(1, 1, 0, 1), "No glCopyImageSubData, levels are never dropped");
+#endif
+}
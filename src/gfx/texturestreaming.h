@@ -0,0 +1,42 @@
+/*  Mip streaming: textures loaded in the background start with only their small levels.
+	Every draw estimates the finest mip it needs from its projected size and the uv density of the mesh,
+	the finer levels are read again from the cached file (.ktx/.dds or the .tbin cache) when needed and dropped
+	when not used anymore or when the budget is exceeded.
+*/
+
+#pragma once
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include <vector>
+
+class Camera;
+
+namespace GFX {
+
+	class Texture;
+	class Mesh;
+
+	class TextureStreaming {
+	public:
+		static bool enabled;
+		static size_t budget; //VRAM for the streamed textures, in bytes
+		static int initial_size; //textures start with the levels up to this size
+		static float mip_bias; //added to the estimated mip, positive saves memory
+		static uint32 drop_delay; //frames without being drawn before going back to the initial levels
+		static int max_requests; //textures reading finer levels at the same time
+
+		//stats, updated every frame
+		static size_t streamed_bytes;
+		static uint32 num_streamed; //textures that can stream
+		static uint32 num_requests;
+		static uint32 num_drops;
+
+		static int getInitialMip(Texture* texture, std::vector<uint8>& container); //first level to upload, 0 if it cannot stream
+		static int computeMip(Texture* texture, Mesh* mesh, const Matrix44& model, Camera* camera);
+		static void addDemand(Texture* texture, Mesh* mesh, const Matrix44& model, Camera* camera); //call for every draw
+		static void update(); //call once per frame after rendering, requests and drops levels
+		static void showUI();
+	};
+
+};
@@ -0,0 +1,341 @@
+#include "textureuploader.h"
+#include "texture.h"
+
+#include <chrono>
+#include <deque>
+#include <cstring>
+#include <algorithm>
+
+using namespace GFX;
+
+bool TextureUploader::enabled = true;
+float TextureUploader::budget_ms = 2.0f;
+size_t TextureUploader::staging_size = size_t(16) * 1024 * 1024;
+size_t TextureUploader::chunk_size = 256 * 1024;
+
+float TextureUploader::last_ms = 0;
+float TextureUploader::max_ms = 0;
+size_t TextureUploader::bytes_uploaded = 0;
+uint32 TextureUploader::num_uploaded = 0;
+uint32 TextureUploader::num_stalls = 0;
+bool TextureUploader::persistent = false;
+
+struct sPendingUpload {
+	Texture* texture;
+	std::vector<uint8> container;
+	sTextureLayout layout;
+	GLuint texture_id; //replaces the 1x1 texture once every level is in VRAM
+	int first_mip;
+	bool refine; //finer levels of the current texture, it becomes the base level when done
+	size_t level; //next level to upload
+	int row; //next row of that level (row of blocks when compressed)
+};
+
+//piece of the staging buffer the GPU may still be reading
+struct sStagingRegion {
+	size_t offset;
+	size_t size;
+	GLsync fence;
+};
+
+static std::vector<sPendingUpload*> pending;
+static std::deque<sStagingRegion> in_flight;
+static GLuint staging_buffer = 0;
+static uint8* staging_ptr = NULL; //only when persistent
+static size_t staging_capacity = 0;
+static size_t staging_head = 0;
+
+static void createStaging()
+{
+	staging_capacity = TextureUploader::staging_size;
+	staging_head = 0;
+	staging_ptr = NULL;
+	TextureUploader::persistent = false;
+
+	glGenBuffers(1, &staging_buffer);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buffer);
+#ifdef GL_MAP_PERSISTENT_BIT
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (major > 4 || (major == 4 && minor >= 4))
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, staging_capacity, NULL, flags);
+		staging_ptr = (uint8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, staging_capacity, flags);
+		if (!staging_ptr) //immutable storage cannot be redefined, start again
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &staging_buffer);
+			glGenBuffers(1, &staging_buffer);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buffer);
+		}
+	}
+#endif
+	TextureUploader::persistent = staging_ptr != NULL;
+	if (!staging_ptr)
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, staging_capacity, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+static void destroyStaging()
+{
+	for (sStagingRegion& region : in_flight)
+		glDeleteSync(region.fence);
+	in_flight.clear();
+	if (!staging_buffer)
+		return;
+	if (staging_ptr)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buffer);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		staging_ptr = NULL;
+	}
+	glDeleteBuffers(1, &staging_buffer);
+	staging_buffer = 0;
+}
+
+//forgets the regions the GPU already consumed
+static void retireRegions()
+{
+	while (in_flight.size())
+	{
+		GLenum result = glClientWaitSync(in_flight.front().fence, 0, 0);
+		if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+			break;
+		glDeleteSync(in_flight.front().fence);
+		in_flight.pop_front();
+	}
+	if (in_flight.empty())
+		staging_head = 0;
+}
+
+//reserves size bytes of the ring, false if the GPU is still using them
+static bool allocRegion(size_t size, size_t& offset)
+{
+	size = (size + 15) & ~size_t(15);
+	if (size > staging_capacity)
+		return false;
+
+	if (in_flight.size())
+	{
+		//used memory goes from tail to head, wrapping around the end
+		size_t tail = in_flight.front().offset;
+		if (staging_head >= tail)
+		{
+			if (staging_head + size <= staging_capacity)
+				offset = staging_head;
+			else if (size < tail)
+				offset = 0;
+			else
+				return false;
+		}
+		else if (staging_head + size < tail)
+			offset = staging_head;
+		else
+			return false;
+	}
+	else
+		offset = 0;
+
+	staging_head = offset + size;
+	in_flight.push_back({ offset, size, 0 });
+	return true;
+}
+
+//copies the next rows of the current level, false if there is no staging memory free
+static bool uploadChunk(sPendingUpload* upload)
+{
+	const sTextureLayout& layout = upload->layout;
+	const sTextureLevel& level = layout.levels[upload->level];
+	int block = layout.compressed ? 4 : 1;
+	int num_rows = (level.height + block - 1) / block;
+	size_t max_bytes = std::min(TextureUploader::chunk_size, staging_capacity);
+	int rows = (int)std::max(max_bytes / level.row_bytes, size_t(1));
+	rows = std::min(rows, num_rows - upload->row);
+	size_t size = rows * level.row_bytes;
+	const uint8* data = &upload->container[level.offset + upload->row * level.row_bytes];
+	int y = upload->row * block;
+	int height = std::min(rows * block, level.height - y);
+
+	//rows that do not fit in the staging buffer go directly from RAM
+	size_t offset = 0;
+	bool staged = level.row_bytes <= staging_capacity;
+	if (staged)
+	{
+		if (!allocRegion(size, offset))
+			return false;
+		if (staging_ptr)
+			memcpy(staging_ptr + offset, data, size);
+		else
+		{
+			//unsynchronized as the fences already guarantee nobody is reading this region
+			void* ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+			if (ptr)
+			{
+				memcpy(ptr, data, size);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			}
+			else
+				staged = false; //the region is released with the next fence anyway
+		}
+	}
+	if (!staged)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	//with a pixel buffer bound the pointer is an offset inside it
+	const void* pixels = staged ? (const void*)offset : (const void*)data;
+	glBindTexture(layout.texture_type, upload->texture_id);
+	if (layout.compressed)
+		glCompressedTexSubImage2D(level.target, level.level, 0, y, level.width, height, layout.internal_format, (GLsizei)size, pixels);
+	else
+		glTexSubImage2D(level.target, level.level, 0, y, level.width, height, layout.format, layout.type, pixels);
+
+	if (in_flight.size() && in_flight.back().fence == 0)
+		in_flight.back().fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	if (!staged)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buffer);
+
+	TextureUploader::bytes_uploaded += size;
+	upload->row += rows;
+	if (upload->row >= num_rows)
+	{
+		upload->level++;
+		upload->row = 0;
+	}
+	return true;
+}
+
+bool TextureUploader::add(Texture* texture, std::vector<uint8>& container, int first_mip, int last_mip)
+{
+	sTextureLayout layout;
+	if (!Texture::getLayout(container, layout) || layout.levels.empty())
+		return false;
+
+	//only the requested levels
+	bool refine = last_mip >= 0;
+	if (!refine)
+		last_mip = layout.num_mips - 1;
+	layout.levels.erase(std::remove_if(layout.levels.begin(), layout.levels.end(), [&](const sTextureLevel& level) { return level.level < first_mip || level.level > last_mip; }), layout.levels.end());
+	if (layout.levels.empty())
+		return false;
+
+	cancel(texture);
+	if (refine)
+		texture->streaming_mips = true;
+	sPendingUpload* upload = new sPendingUpload();
+	upload->texture = texture;
+	upload->container.swap(container);
+	upload->layout = layout;
+	upload->texture_id = Texture::allocateLayout(layout, refine ? texture->texture_id : 0);
+	upload->first_mip = first_mip;
+	upload->refine = refine;
+	upload->level = 0;
+	upload->row = 0;
+	pending.push_back(upload);
+	return true;
+}
+
+void TextureUploader::cancel(Texture* texture)
+{
+	for (size_t i = 0; i < pending.size(); ++i)
+	{
+		if (pending[i]->texture != texture)
+			continue;
+		if (pending[i]->refine)
+			texture->streaming_mips = false;
+		else
+			glDeleteTextures(1, &pending[i]->texture_id);
+		delete pending[i];
+		pending.erase(pending.begin() + i);
+		return;
+	}
+}
+
+size_t TextureUploader::getPendingCount()
+{
+	return pending.size();
+}
+
+void TextureUploader::update()
+{
+	if (staging_buffer)
+		retireRegions();
+
+	if (pending.empty())
+	{
+		last_ms = 0;
+		return;
+	}
+
+	//size changed from the UI
+	if (staging_buffer && staging_capacity != staging_size && in_flight.empty())
+		destroyStaging();
+	if (!staging_buffer)
+		createStaging();
+
+	auto start = std::chrono::high_resolution_clock::now();
+	float elapsed = 0;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buffer);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); //RGB rows are not aligned to 4
+
+	while (pending.size() && elapsed < budget_ms)
+	{
+		//textures bound in the last frames go first
+		size_t index = 0;
+		for (size_t i = 1; i < pending.size(); ++i)
+			if (pending[i]->texture->last_used_frame > pending[index]->texture->last_used_frame)
+				index = i;
+		sPendingUpload* upload = pending[index];
+
+		if (!uploadChunk(upload))
+		{
+			num_stalls++;
+			break;
+		}
+
+		if (upload->level == upload->layout.levels.size())
+		{
+			if (upload->refine)
+			{
+				upload->texture->setResidentMip(upload->first_mip);
+				upload->texture->streaming_mips = false;
+			}
+			else
+			{
+				upload->texture->applyLayout(upload->layout, upload->texture_id, upload->first_mip);
+				upload->texture->loading = false;
+			}
+			pending.erase(pending.begin() + index);
+			delete upload;
+			num_uploaded++;
+		}
+
+		elapsed = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	last_ms = elapsed;
+	max_ms = std::max(max_ms, elapsed);
+}
+
+void TextureUploader::showUI()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Stream textures (PBO uploads)", &enabled);
+	ImGui::SliderFloat("Upload budget (ms)", &budget_ms, 0.1f, 16.0f);
+	int staging_mb = int(staging_size / (1024 * 1024));
+	if (ImGui::SliderInt("Staging buffer (MB)", &staging_mb, 1, 256))
+		staging_size = size_t(staging_mb) * 1024 * 1024;
+	int chunk_kb = int(chunk_size / 1024);
+	if (ImGui::SliderInt("Chunk size (KB)", &chunk_kb, 16, 4096))
+		chunk_size = size_t(chunk_kb) * 1024;
+	ImGui::Text("Pending: %d Uploaded: %d (%.2fMB) Stalls: %d %s", (int)pending.size(), num_uploaded, bytes_uploaded / (1024.0f * 1024.0f), num_stalls, persistent ? "[persistent]" : "");
+	ImGui::Text("Last frame: %.2fms Worst: %.2fms", last_ms, max_ms);
+	ImGui::SameLine();
+	if (ImGui::Button("Reset"))
+		max_ms = 0;
+#endif
+}
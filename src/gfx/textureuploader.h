@@ -0,0 +1,41 @@
+/*  Streams the textures decoded in the background to VRAM without stalling the frame.
+	The levels are copied to a staging pixel buffer (persistent mapped when the driver supports it)
+	and uploaded in pieces until the time budget of the frame is spent. Fences tell when the GPU
+	has consumed a piece of the staging buffer so it can be reused.
+*/
+
+#pragma once
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include <vector>
+
+namespace GFX {
+
+	class Texture;
+
+	class TextureUploader {
+	public:
+		static bool enabled; //otherwise the textures are uploaded at once when they arrive
+		static float budget_ms; //main thread time per frame spent uploading
+		static size_t staging_size; //bytes of the staging buffer, applied when it is created
+		static size_t chunk_size; //levels bigger than this are uploaded in several pieces
+
+		//stats
+		static float last_ms; //time spent in the last frame
+		static float max_ms; //worst frame since the stats were reset
+		static size_t bytes_uploaded;
+		static uint32 num_uploaded; //textures completed
+		static uint32 num_stalls; //frames that stopped waiting for the GPU to release staging memory
+		static bool persistent; //staging buffer mapped once (GL 4.4), otherwise mapped for every copy
+
+		//takes the KTX/DDS/TBIN buffer and uploads the levels from first_mip, false if it cannot be parsed
+		//with last_mip the levels are added to the current texture (see TextureStreaming), otherwise it is replaced
+		static bool add(Texture* texture, std::vector<uint8>& container, int first_mip = 0, int last_mip = -1);
+		static void cancel(Texture* texture); //drops the levels not uploaded yet
+		static size_t getPendingCount();
+		static void update(); //call once per frame from the main thread
+		static void showUI();
+	};
+
+};
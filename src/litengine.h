@@ -5,12 +5,20 @@
 #include "core/math.h"
 #include "core/input.h"
 #include "core/ui.h"
+#include "core/task.h"
 
 #include "gfx/gfx.h"
 #include "gfx/texture.h"
 #include "gfx/shader.h"
 #include "gfx/mesh.h"
 #include "gfx/fbo.h"
+#include "gfx/residency.h"
+#include "gfx/texturecompressor.h"
+#include "gfx/textureuploader.h"
+#include "gfx/texturestreaming.h"
+#include "gfx/mipgenerator.h"
+#include "gfx/sphericalharmonics.h"
+#include "gfx/cubemapfilter.h"
 
 #include "utils/utils.h"
 
@@ -20,5 +28,8 @@
 #include "pipeline/scene.h"
 #include "pipeline/renderer.h"
 #include "pipeline/light.h"
+#include "pipeline/raytracer.h"
+#include "pipeline/irradiance.h"
+#include "pipeline/reflection.h"
 
 
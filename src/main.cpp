@@ -8,6 +8,7 @@
 */
 
 #include "litengine.h"
+#include "extra/hdre.h"
 
 #include "application.h"
 
@@ -21,6 +22,105 @@ Application* app = NULL;
 //The application main loop
 int main(int argc, char **argv)
 {
+	//headless benchmark of the meshlet culling, no window needed: app --bench-meshlets data/mesh.obj
+	if (argc > 2 && std::string(argv[1]) == "--bench-meshlets")
+		return GFX::Mesh::benchmarkMeshlets(argv[2]) ? 0 : 1;
+
+	//headless benchmark of the compressed animation clips: app --bench-anim data/anim.skanim
+	if (argc > 2 && std::string(argv[1]) == "--bench-anim")
+		return Animation::benchmark(argv[2]) ? 0 : 1;
+
+	//headless benchmark of the parallel animation update: app --bench-crowd data/anim.skanim 500
+	if (argc > 2 && std::string(argv[1]) == "--bench-crowd")
+	{
+		JobSystem::init();
+		return AnimationManager::benchmark(argv[2], argc > 3 ? atoi(argv[3]) : 500) ? 0 : 1;
+	}
+
+	//headless benchmark of the PNG decoders, no window needed: app --bench-png data/a.png data/b.png ...
+	if (argc > 2 && std::string(argv[1]) == "--bench-png")
+	{
+		bool ok = true;
+		for (int i = 2; i < argc; ++i)
+			ok = Image::benchmarkPNG(argv[i]) && ok;
+		return ok ? 0 : 1;
+	}
+
+	//headless benchmark of the JPG decoding, no window needed: app --bench-jpg data/a.jpg data/b.jpg ...
+	if (argc > 2 && std::string(argv[1]) == "--bench-jpg")
+	{
+		JobSystem::init();
+		bool ok = true;
+		for (int i = 2; i < argc; ++i)
+			ok = Image::benchmarkJPG(argv[i]) && ok;
+		return ok ? 0 : 1;
+	}
+
+	//headless check of the mip generation, SSE against the scalar reference: app --bench-mips data/a.png ...
+	if (argc > 2 && std::string(argv[1]) == "--bench-mips")
+	{
+		JobSystem::init();
+		bool ok = true;
+		for (int i = 2; i < argc; ++i)
+			ok = GFX::MipGenerator::benchmark(argv[i]) && ok;
+		return ok ? 0 : 1;
+	}
+
+	//headless check of the HDRE paging and half float conversion: app --bench-hdre data/a.hdre ...
+	if (argc > 2 && std::string(argv[1]) == "--bench-hdre")
+	{
+		bool ok = true;
+		for (int i = 2; i < argc; ++i)
+			ok = HDRE::benchmark(argv[i]) && ok;
+		return ok ? 0 : 1;
+	}
+
+	//headless check of the SH projection of a .hdre (or an image as the six faces): app --bench-sh data/a.hdre ...
+	if (argc > 2 && std::string(argv[1]) == "--bench-sh")
+	{
+		JobSystem::init();
+		bool ok = true;
+		for (int i = 2; i < argc; ++i)
+			ok = benchmarkSH(argv[i]) && ok;
+		return ok ? 0 : 1;
+	}
+
+	//headless bake of the irradiance volumes of a scene, checked against a serial bake: app --bake-irradiance data/scene.json
+	if (argc > 2 && std::string(argv[1]) == "--bake-irradiance")
+	{
+		JobSystem::init();
+		REGISTER_ENTITY_TYPE(SCN::PrefabEntity);
+		REGISTER_ENTITY_TYPE(SCN::LightEntity);
+		REGISTER_ENTITY_TYPE(SCN::IrradianceVolumeEntity);
+		return SCN::IrradianceVolumeEntity::bakeScene(argv[2]) ? 0 : 1;
+	}
+
+	//headless check of the GGX prefilter of the probes, SSE against the scalar path: app --bench-prefilter 128
+	if (argc > 2 && std::string(argv[1]) == "--bench-prefilter")
+	{
+		JobSystem::init();
+		return GFX::CubemapFilter::benchmark(atoi(argv[2])) ? 0 : 1;
+	}
+
+	//headless bake of the reflection probes that changed, --force bakes all of them: app --bake-probes data/scene.json [--force]
+	if (argc > 2 && std::string(argv[1]) == "--bake-probes")
+	{
+		JobSystem::init();
+		REGISTER_ENTITY_TYPE(SCN::PrefabEntity);
+		REGISTER_ENTITY_TYPE(SCN::LightEntity);
+		REGISTER_ENTITY_TYPE(SCN::ReflectionProbeEntity);
+		return SCN::ReflectionProbeEntity::bakeScene(argv[2], argc > 3 && std::string(argv[3]) == "--force") ? 0 : 1;
+	}
+
+	//switches of the program binary cache, they go with any other option
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::string(argv[i]) == "--no-shader-cache")
+			GFX::Shader::use_binary_cache = false;
+		else if (std::string(argv[i]) == "--clear-shader-cache")
+			GFX::Shader::clear_binary_cache = true; //the .pbin is beside the atlas, not loaded yet
+	}
+
 	std::cout << "Initiating app..." << std::endl;
 	CORE::init();
 
@@ -35,9 +135,29 @@ int main(int argc, char **argv)
 	if (!window)
 		return 0;
 
+	//CPU time of the draw calls of a mesh with and without its VAO: app --bench-draws data/mesh.obj [draws]
+	if (argc > 2 && std::string(argv[1]) == "--bench-draws")
+		return GFX::Mesh::benchmarkDraws(argv[2], argc > 3 ? atoi(argv[3]) : 1000) ? 0 : 1;
+
+	//load time of the shader atlas compiling everything and from the binary cache: app --bench-shaders data/shader_atlas.glsl
+	if (argc > 2 && std::string(argv[1]) == "--bench-shaders")
+		return GFX::Shader::BenchmarkAtlas(argv[2]) ? 0 : 1;
+
+	//worst frame compiling ubershader permutations synchronously and asynchronously: app --bench-permutations data/shader_atlas.glsl [@name]
+	if (argc > 2 && std::string(argv[1]) == "--bench-permutations")
+		return GFX::Shader::BenchmarkPermutations(argv[2], argc > 3 ? argv[3] : nullptr) ? 0 : 1;
+
 	//create the app
 	app = new Application();
 
+	//GPU time of every material with the generic shader and with its permutation, on the sample scene: app --bench-materials [frames]
+	if (argc > 1 && std::string(argv[1]) == "--bench-materials")
+		return app->renderer->benchmarkMaterials(app->scene, app->camera, argc > 2 ? atoi(argv[2]) : 100) ? 0 : 1;
+
+	//CPU time of the draw calls of a frame of the sample scene: app --bench-draw-cpu [frames]
+	if (argc > 1 && std::string(argv[1]) == "--bench-draw-cpu")
+		return app->renderer->benchmarkDrawCPU(app->scene, app->camera, argc > 2 ? atoi(argv[2]) : 100) ? 0 : 1;
+
 	//main loop, application gets inside here till user closes it
 	CORE::mainLoop(window,app);
 
@@ -6,12 +6,86 @@
 #include "camera.h"
 #include "../gfx/shader.h"
 #include "../gfx/mesh.h"
+#include "../core/task.h"
+#include "../utils/gltf_loader.h"
 
 #include <sys/stat.h>
+#include <chrono>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#include <xmmintrin.h>
+	#define SKELETON_SSE
+#endif
 
 Skeleton::Skeleton()
 {
 	num_bones = 0;
+	layout_id = 0;
+	globals_dirty = true;
+	memset(bone_lods, ANIM_LOD_ALL, sizeof(bone_lods));
+}
+
+void Skeleton::computeLayoutId()
+{
+	//FNV-1a
+	uint32 hash = 2166136261u;
+	for (int i = 0; i < num_bones; ++i)
+	{
+		for (const char* c = bones[i].name; *c && c < bones[i].name + sizeof(bones[i].name); ++c)
+			hash = (hash ^ (uint8)*c) * 16777619u;
+		hash = (hash ^ (uint8)bones[i].parent) * 16777619u;
+	}
+	layout_id = hash;
+}
+
+const std::vector<int>& Skeleton::getBoneRemap(GFX::Mesh* mesh)
+{
+	//once cached it only reads from the mesh, so it is safe to call from several threads
+	size_t num = mesh->bones_info.size();
+	auto found = mesh->bones_remap.find(layout_id);
+	if (found != mesh->bones_remap.end() && found->second.size() == num && mesh->bones_offset.size() == num)
+		return found->second;
+
+	//bind_matrix * bind_pose only depends on the mesh
+	mesh->bones_offset.resize(num);
+	for (size_t i = 0; i < num; ++i)
+		mesh->bones_offset[i] = mesh->bind_matrix * mesh->bones_info[i].bind_pose;
+
+	std::vector<int>& remap = mesh->bones_remap[layout_id];
+	remap.resize(num);
+	for (size_t i = 0; i < mesh->bones_info.size(); ++i)
+	{
+		auto it = bones_by_name.find(mesh->bones_info[i].name);
+		remap[i] = it == bones_by_name.end() ? -1 : it->second;
+	}
+	return remap;
+}
+
+//out = a * b, every row of out is a combination of the rows of b
+static inline void multiplyBoneMatrix(const float* a, const float* b, float* out)
+{
+#ifdef SKELETON_SSE
+	__m128 b0 = _mm_loadu_ps(b);
+	__m128 b1 = _mm_loadu_ps(b + 4);
+	__m128 b2 = _mm_loadu_ps(b + 8);
+	__m128 b3 = _mm_loadu_ps(b + 12);
+	for (int i = 0; i < 4; ++i)
+	{
+		const float* r = a + i * 4;
+		__m128 v = _mm_mul_ps(_mm_set1_ps(r[0]), b0);
+		v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(r[1]), b1));
+		v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(r[2]), b2));
+		v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(r[3]), b3));
+		_mm_storeu_ps(out + i * 4, v);
+	}
+#else
+	for (int i = 0; i < 4; ++i)
+	{
+		const float* r = a + i * 4;
+		for (int j = 0; j < 4; ++j)
+			out[i * 4 + j] = r[0] * b[j] + r[1] * b[4 + j] + r[2] * b[8 + j] + r[3] * b[12 + j];
+	}
+#endif
 }
 
 Skeleton::Bone* Skeleton::getBone(const char* name)
@@ -36,18 +110,32 @@ Matrix44& Skeleton::getBoneMatrix(const char* name, bool local )
 void Skeleton::computeFinalBoneMatrices( std::vector<Matrix44>& bone_matrices, GFX::Mesh* mesh )
 {
 	assert(mesh);
-
-	updateGlobalMatrices();
-
 	bone_matrices.resize(mesh->bones_info.size());
-	#pragma omp for  
-	for (int i = 0; i < mesh->bones_info.size(); ++i)
+	computeFinalBoneMatrices(bone_matrices.data(), mesh);
+}
+
+//bones for the shader from the global matrices, shared by skeletons and poses
+static void computePalette(const Matrix44* globals, const int* remap, const Matrix44* offsets, int num, Matrix44* result)
+{
+	static const Matrix44 identity;
+	for (int i = 0; i < num; ++i)
 	{
-		BoneInfo& bone_info = mesh->bones_info[i];
-		bone_matrices[i] = mesh->bind_matrix * bone_info.bind_pose * getBoneMatrix( bone_info.name, false ); //use globals
+		const Matrix44* global = remap[i] >= 0 ? &globals[remap[i]] : &identity; //bones missing in the skeleton stay in bind pose
+		multiplyBoneMatrix(offsets[i].m, global->m, result[i].m);
 	}
 }
 
+void Skeleton::computeFinalBoneMatrices( Matrix44* result, GFX::Mesh* mesh )
+{
+	assert(mesh);
+
+	if (globals_dirty)
+		updateGlobalMatrices();
+
+	const int* remap = getBoneRemap(mesh).data();
+	computePalette(global_bone_matrices, remap, mesh->bones_offset.data(), (int)mesh->bones_info.size(), result);
+}
+
 void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 layer)
 {
 	assert(a && b && result && "skeleton cannot be NULL");
@@ -55,39 +143,37 @@ void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 la
 
 	w = clamp(w, 0.0f, 1.0f);//safety
 
-	if (layer == 0xFF)
+	//the structure is only copied if result has different bones, otherwise only the local matrices
+	if (result != a && (result->layout_id != a->layout_id || result->num_bones != a->num_bones))
 	{
-		if (w == 0.0f)
-		{
-			if(result == a) //nothing to do
-				return;
-			*result = *a; //copy A in Result
-			return;
-		}
-		if (w == 1.0f) //copy B in result
-		{
-			*result = *b;
-			return;
-		}
+		memcpy(result->bones, a->bones, sizeof(Skeleton::Bone) * a->num_bones); //copy skeleton structure
+		result->bones_by_name = a->bones_by_name;
+		result->num_bones = a->num_bones;
+		result->layout_id = a->layout_id;
 	}
+	result->globals_dirty = true;
 
-	if (result != a) //copy bone names
+	if (layer == 0xFF && (w == 0.0f || w == 1.0f))
 	{
-		memcpy(result->bones, a->bones, sizeof(result->bones)); //copy skeleton structure
-		result->bones_by_name = a->bones_by_name;
-		result->num_bones = a->num_bones;
+		Skeleton* from = w == 0.0f ? a : b;
+		if (from != result)
+			for (int i = 0; i < result->num_bones; ++i)
+				result->bones[i].model = from->bones[i].model;
+		return;
 	}
 
 	//blend bones locally
-	#pragma omp for  
 	for (int i = 0; i < result->num_bones; ++i)
 	{
 		Skeleton::Bone& bone = result->bones[i];
 		Skeleton::Bone& boneA = a->bones[i];
 		Skeleton::Bone& boneB = b->bones[i];
 		if ( layer != 0xFF && !(bone.layer & layer) ) //not in the same layer
+		{
+			if (result != a)
+				bone.model = boneA.model;
 			continue;
-		#pragma omp for  
+		}
 		for (int j = 0; j < 16; ++j)
 			bone.model.m[j] = lerp( boneA.model.m[j], boneB.model.m[j], w);
 	}
@@ -132,6 +218,7 @@ void Skeleton::applyTransformToBones(const char* root, Matrix44 transform)
 	if (!bone)
 		return;
 	bone->model = bone->model * transform;
+	globals_dirty = true;
 }
 
 void Skeleton::updateGlobalMatrices()
@@ -142,8 +229,9 @@ void Skeleton::updateGlobalMatrices()
 	for (int i = 1; i < num_bones; ++i)
 	{
 		Skeleton::Bone& bone = bones[i];
-		global_bone_matrices[i] = bone.model * global_bone_matrices[ bone.parent ];
+		multiplyBoneMatrix(bone.model.m, global_bone_matrices[ (int)bone.parent ].m, global_bone_matrices[i].m);
 	}
+	globals_dirty = false;
 }
 
 void Skeleton::assignLayer( Bone* bone, uint8 layer )
@@ -161,9 +249,56 @@ void Skeleton::assignLayer( Bone* bone, uint8 layer )
 	}
 }
 
+void Skeleton::assignDefaultLayers()
+{
+	for (int i = 0; i < num_bones; ++i)
+		bones[i].layer = BODY;
+
+	Bone* hips = getBone("mixamorig_Hips");
+	if (hips)
+	{
+		hips->layer |= HIPS;
+		assignLayer(hips, BODY);//force every bone to have a bit
+		assignLayer(getBone("mixamorig_Spine"), UPPER_BODY);
+		assignLayer(getBone("mixamorig_RightUpLeg"), LOWER_BODY | RIGHT_LEG);
+		assignLayer(getBone("mixamorig_LeftUpLeg"), LOWER_BODY | LEFT_LEG);
+		assignLayer(getBone("mixamorig_RightShoulder"), RIGHT_ARM);
+		assignLayer(getBone("mixamorig_LeftShoulder"), LEFT_ARM);
+	}
+}
+
+void Skeleton::assignLODs( Bone* bone, uint8 lods )
+{
+	if (!bone)
+		return;
+	bone_lods[bone - bones] = lods;
+	for (int i = 0; i < bone->num_children; ++i)
+		assignLODs(&bones[(int)bone->children[i]], lods);
+}
+
+void Skeleton::assignDefaultLODs()
+{
+	memset(bone_lods, ANIM_LOD_ALL, sizeof(bone_lods));
+
+	//fingers
+	const char* hands[] = { "mixamorig_RightHand", "mixamorig_LeftHand" };
+	for (const char* name : hands)
+	{
+		Bone* hand = getBone(name);
+		if (!hand)
+			continue;
+		for (int i = 0; i < hand->num_children; ++i)
+			assignLODs(&bones[(int)hand->children[i]], ANIM_LOD0 | ANIM_LOD1);
+	}
+}
+
+float Animation::compression_error = 0.0005f;
+bool Animation::use_simd = true;
+
 Animation::Animation()
 {
 	duration = 0.0f;
+	samples_per_second = 0.0f;
 	keyframes = NULL;
 	num_keyframes = 0;
 	num_animated_bones = 0;
@@ -175,9 +310,822 @@ Animation::~Animation()
 		delete[] keyframes;
 }
 
+// COMPRESSION *****************************************
+
+#define QUAT_RANGE 0.70710678f //the three smallest components of a unit quaternion are in [-1/sqrt(2), 1/sqrt(2)]
+
+//splits a bone matrix in translation, rotation (x,y,z,w) and scale
+static void decomposeTRS(const Matrix44& m, Vector3f& t, float* q, Vector3f& s)
+{
+	t.set(m.m[12], m.m[13], m.m[14]);
+	s.set(Vector3f(m.m[0], m.m[1], m.m[2]).length(), Vector3f(m.m[4], m.m[5], m.m[6]).length(), Vector3f(m.m[8], m.m[9], m.m[10]).length());
+	float det = m.m[0] * (m.m[5] * m.m[10] - m.m[6] * m.m[9]) - m.m[1] * (m.m[4] * m.m[10] - m.m[6] * m.m[8]) + m.m[2] * (m.m[4] * m.m[9] - m.m[5] * m.m[8]);
+	if (det < 0) //mirrored
+		s.x = -s.x;
+
+	float r[9];
+	for (int i = 0; i < 3; ++i)
+	{
+		float inv = s.v[i] != 0.0f ? 1.0f / s.v[i] : 0.0f;
+		for (int j = 0; j < 3; ++j)
+			r[i * 3 + j] = m.m[i * 4 + j] * inv;
+	}
+
+	float trace = r[0] + r[4] + r[8];
+	if (trace > 0)
+	{
+		float k = 2.0f * sqrtf(trace + 1.0f);
+		q[3] = 0.25f * k;
+		q[0] = (r[5] - r[7]) / k;
+		q[1] = (r[6] - r[2]) / k;
+		q[2] = (r[1] - r[3]) / k;
+	}
+	else if (r[0] > r[4] && r[0] > r[8])
+	{
+		float k = 2.0f * sqrtf(1.0f + r[0] - r[4] - r[8]);
+		q[3] = (r[5] - r[7]) / k;
+		q[0] = 0.25f * k;
+		q[1] = (r[1] + r[3]) / k;
+		q[2] = (r[2] + r[6]) / k;
+	}
+	else if (r[4] > r[8])
+	{
+		float k = 2.0f * sqrtf(1.0f + r[4] - r[0] - r[8]);
+		q[3] = (r[6] - r[2]) / k;
+		q[0] = (r[1] + r[3]) / k;
+		q[1] = 0.25f * k;
+		q[2] = (r[5] + r[7]) / k;
+	}
+	else
+	{
+		float k = 2.0f * sqrtf(1.0f + r[8] - r[0] - r[4]);
+		q[3] = (r[1] - r[3]) / k;
+		q[0] = (r[2] + r[6]) / k;
+		q[1] = (r[5] + r[7]) / k;
+		q[2] = 0.25f * k;
+	}
+
+	float len = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+	for (int i = 0; i < 4; ++i)
+		q[i] /= len;
+}
+
+//inverse of decomposeTRS
+static inline void composeTRS(const float* q, const Vector3f& t, const Vector3f& s, Matrix44& out)
+{
+	float x2 = q[0] + q[0], y2 = q[1] + q[1], z2 = q[2] + q[2];
+	float xx = q[0] * x2, yx = q[1] * x2, yy = q[1] * y2;
+	float zx = q[2] * x2, zy = q[2] * y2, zz = q[2] * z2;
+	float wx = q[3] * x2, wy = q[3] * y2, wz = q[3] * z2;
+	float* m = out.m;
+	m[0] = (1.0f - yy - zz) * s.x;	m[1] = (yx + wz) * s.x;			m[2] = (zx - wy) * s.x;			m[3] = 0.0f;
+	m[4] = (yx - wz) * s.y;			m[5] = (1.0f - xx - zz) * s.y;	m[6] = (zy + wx) * s.y;			m[7] = 0.0f;
+	m[8] = (zx + wy) * s.z;			m[9] = (zy - wx) * s.z;			m[10] = (1.0f - xx - yy) * s.z;	m[11] = 0.0f;
+	m[12] = t.x;					m[13] = t.y;					m[14] = t.z;					m[15] = 1.0f;
+}
+
+//smallest-three: the biggest component is dropped (and rebuilt from the unit length), the other three use 15 bits each
+static void encodeQuat(const float* q, uint16* out)
+{
+	int big = 0;
+	for (int i = 1; i < 4; ++i)
+		if (fabs(q[i]) > fabs(q[big]))
+			big = i;
+	float sign = q[big] < 0.0f ? -1.0f : 1.0f; //q and -q are the same rotation, this way the dropped one is always positive
+
+	uint16 c[3];
+	for (int i = 0, j = 0; i < 4; ++i)
+	{
+		if (i == big)
+			continue;
+		float v = clamp(q[i] * sign * (0.5f / QUAT_RANGE) + 0.5f, 0.0f, 1.0f);
+		c[j++] = (uint16)(v * 32767.0f + 0.5f);
+	}
+	out[0] = c[0] | ((big & 1) << 15);
+	out[1] = c[1] | ((big >> 1) << 15);
+	out[2] = c[2];
+}
+
+//returns the three stored components and the index of the dropped one, used to decode in batches
+static inline void unpackQuat(const uint16* v, float& a, float& b, float& c, float& big)
+{
+	const float k = 2.0f * QUAT_RANGE / 32767.0f;
+	a = (v[0] & 0x7FFF) * k - QUAT_RANGE;
+	b = (v[1] & 0x7FFF) * k - QUAT_RANGE;
+	c = (v[2] & 0x7FFF) * k - QUAT_RANGE;
+	big = (float)((v[0] >> 15) | ((v[1] >> 15) << 1));
+}
+
+static inline void decodeQuat(float a, float b, float c, float big, float* q)
+{
+	float d = sqrtf(std::max(0.0f, 1.0f - a * a - b * b - c * c));
+	int i = (int)big;
+	q[0] = i == 0 ? d : a;
+	q[1] = i == 0 ? a : (i == 1 ? d : b);
+	q[2] = i <= 1 ? b : (i == 2 ? d : c);
+	q[3] = i == 3 ? d : c;
+}
+
+static inline void decodeQuat(const uint16* v, float* q)
+{
+	float a, b, c, big;
+	unpackQuat(v, a, b, c, big);
+	decodeQuat(a, b, c, big, q);
+}
+
+static inline void nlerpQuat(const float* a, const float* b, float f, float* out)
+{
+	float dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+	float fb = dot < 0.0f ? -f : f; //shortest path
+	float fa = 1.0f - f;
+	float len2 = 0.0f;
+	for (int i = 0; i < 4; ++i)
+	{
+		out[i] = a[i] * fa + b[i] * fb;
+		len2 += out[i] * out[i];
+	}
+	float inv = 1.0f / sqrtf(len2);
+	for (int i = 0; i < 4; ++i)
+		out[i] *= inv;
+}
+
+//angle between two rotations, from the chord as acos loses all the precision near 1
+static inline float quatAngle(const float* a, const float* b)
+{
+	float sign = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3] < 0.0f ? -1.0f : 1.0f;
+	float len2 = 0.0f;
+	for (int i = 0; i < 4; ++i)
+		len2 += (a[i] - b[i] * sign) * (a[i] - b[i] * sign);
+	return 4.0f * asinf(std::min(sqrtf(len2) * 0.5f, 1.0f));
+}
+
+static void encodeVector(const Vector3f& v, const Vector3f& min, const Vector3f& extent, uint16* out)
+{
+	for (int i = 0; i < 3; ++i)
+		out[i] = extent.v[i] > 0.0f ? (uint16)(clamp((v.v[i] - min.v[i]) / extent.v[i], 0.0f, 1.0f) * 65535.0f + 0.5f) : 0;
+}
+
+static inline Vector3f decodeVector(const uint16* v, const Vector3f& min, const Vector3f& extent)
+{
+	const float k = 1.0f / 65535.0f;
+	return Vector3f(min.x + v[0] * k * extent.x, min.y + v[1] * k * extent.y, min.z + v[2] * k * extent.z);
+}
+
+//greedy key reduction: a frame is only kept if the frames around it cannot be interpolated from the previous kept key within tolerance
+template<typename ErrorFunc>
+static void reduceKeys(int num_frames, float tolerance, std::vector<int>& kept, ErrorFunc error)
+{
+	kept.clear();
+	kept.push_back(0);
+
+	//constant track
+	bool constant = true;
+	for (int i = 1; i < num_frames && constant; ++i)
+		constant = error(0, 0, i) <= tolerance;
+	if (constant || num_frames == 1)
+		return;
+
+	int start = 0;
+	for (int end = 2; end < num_frames; ++end)
+	{
+		for (int i = start + 1; i < end; ++i)
+			if (error(start, end, i) > tolerance)
+			{
+				start = end - 1;
+				kept.push_back(start);
+				break;
+			}
+	}
+	kept.push_back(num_frames - 1);
+}
+
+//finds the keys around frame v, next is the key to interpolate with and f the factor
+//cursor is the key found the last time, when playing forward it is usually still valid or the next one
+static inline int findKey(const sAnimKey* k, int count, float v, float& f, int& next, uint16& cursor)
+{
+	if (count == 1 || v <= k[0].frame)
+	{
+		next = 0;
+		f = 0.0f;
+		return 0;
+	}
+	int last = count - 1;
+	if (v >= k[last].frame) //after the last keyframe blends with the first one, as the raw keyframes do
+	{
+		next = 0;
+		f = v - k[last].frame;
+		return last;
+	}
+	int index = cursor;
+	if (index >= last || v < k[index].frame || v >= k[index + 1].frame) //not the same interval as last time
+	{
+		if (index + 2 <= last && v >= k[index + 1].frame && v < k[index + 2].frame)
+			index++;
+		else
+			index = int(std::upper_bound(k, k + count, v, [](float v, const sAnimKey& key) { return v < key.frame; }) - k) - 1;
+		cursor = (uint16)index;
+	}
+	next = index + 1;
+	f = (v - k[index].frame) / float(k[next].frame - k[index].frame);
+	return index;
+}
+
+static inline Vector3f sampleVector(const sAnimKey* k, int count, float v, const Vector3f& min, const Vector3f& extent, uint16& cursor)
+{
+	if (count == 1) //most translation and scale tracks are constant
+		return decodeVector(k[0].v, min, extent);
+	float f;
+	int next;
+	int index = findKey(k, count, v, f, next, cursor);
+	return lerp(decodeVector(k[index].v, min, extent), decodeVector(k[next].v, min, extent), f);
+}
+
+void Animation::compress(float error, bool free_raw)
+{
+	assert(keyframes && num_keyframes && num_animated_bones);
+
+	int n = num_keyframes;
+	int nb = num_animated_bones;
+	assert(n < 65536 && "frame index stored in 16 bits");
+	size_t raw_bytes = sizeof(Matrix44) * n * nb;
+
+	//decompose the raw matrices
+	std::vector<Vector3f> raw_pos(n * nb);
+	std::vector<Vector3f> raw_scale(n * nb);
+	std::vector<float> raw_rot(n * nb * 4);
+	for (int b = 0; b < nb; ++b)
+		for (int i = 0; i < n; ++i)
+		{
+			int k = b * n + i;
+			float* q = &raw_rot[k * 4];
+			decomposeTRS(keyframes[i * nb + b], raw_pos[k], q, raw_scale[k]);
+			if (i > 0 && q[0] * q[-4] + q[1] * q[-3] + q[2] * q[-2] + q[3] * q[-1] < 0.0f) //keep the track in the same hemisphere
+				for (int j = 0; j < 4; ++j)
+					q[j] = -q[j];
+		}
+
+	//the tolerance depends on the size of the skeleton, split among the bones of the longest chain as their errors add up
+	for (int b = 0; b < nb; ++b)
+		skeleton.bones[(int)bones_map[b]].model = keyframes[b];
+	skeleton.updateGlobalMatrices();
+	Vector3f root = skeleton.global_bone_matrices[0].getTranslation();
+	float size = 0.0f;
+	int depth[128];
+	int max_depth = 1;
+	for (int i = 0; i < skeleton.num_bones; ++i)
+	{
+		size = std::max(size, (skeleton.global_bone_matrices[i].getTranslation() - root).length());
+		depth[i] = i == 0 ? 1 : depth[(int)skeleton.bones[i].parent] + 1;
+		max_depth = std::max(max_depth, depth[i]);
+	}
+	if (size <= 0.0f)
+		size = 1.0f;
+	float tolerance = error * size;
+	float bone_tolerance = tolerance / sqrtf((float)max_depth); //errors of different bones rarely point the same way
+
+	//a rotation error moves every joint below by the distance to it, so the furthest one sets the angle allowed
+	float reach[128];
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		reach[i] = size * 0.05f; //leaf bones still move the vertices around them
+	for (int i = 0; i < skeleton.num_bones; ++i)
+	{
+		Vector3f pos = skeleton.global_bone_matrices[i].getTranslation();
+		for (int p = skeleton.bones[i].parent; p >= 0; p = skeleton.bones[p].parent)
+			reach[p] = std::max(reach[p], (pos - skeleton.global_bone_matrices[p].getTranslation()).length());
+	}
+
+	tracks.resize(nb);
+	keys.clear();
+
+	std::vector<sAnimKey> quantized(n);
+	std::vector<float> decoded_rot(n * 4);
+	std::vector<Vector3f> decoded(n);
+	std::vector<int> kept;
+	size_t num_rot = 0, num_pos = 0, num_scale = 0;
+
+	for (int b = 0; b < nb; ++b)
+	{
+		sAnimTrack& track = tracks[b];
+		track = sAnimTrack();
+		float length = reach[(int)bones_map[b]];
+
+		//rotation, error measured as an angle so the tip of the bone moves less than the tolerance
+		const float* rot = &raw_rot[b * n * 4];
+		for (int i = 0; i < n; ++i)
+		{
+			quantized[i].frame = (uint16)i;
+			encodeQuat(rot + i * 4, quantized[i].v);
+			decodeQuat(quantized[i].v, &decoded_rot[i * 4]);
+		}
+		reduceKeys(n, bone_tolerance / length, kept, [&](int a, int c, int i) {
+			float q[4];
+			nlerpQuat(&decoded_rot[a * 4], &decoded_rot[c * 4], a == c ? 0.0f : (i - a) / float(c - a), q);
+			return quatAngle(q, rot + i * 4);
+		});
+		track.rot_start = (uint32)keys.size();
+		track.rot_count = (uint16)kept.size();
+		for (int i : kept)
+			keys.push_back(quantized[i]);
+		num_rot += kept.size();
+
+		//translation and scale
+		for (int type = 0; type < 2; ++type)
+		{
+			const Vector3f* raw = type == 0 ? &raw_pos[b * n] : &raw_scale[b * n];
+			Vector3f min = raw[0], max = raw[0];
+			for (int i = 1; i < n; ++i)
+				for (int j = 0; j < 3; ++j)
+				{
+					min.v[j] = std::min(min.v[j], raw[i].v[j]);
+					max.v[j] = std::max(max.v[j], raw[i].v[j]);
+				}
+			Vector3f extent = max - min;
+			for (int i = 0; i < n; ++i)
+			{
+				quantized[i].frame = (uint16)i;
+				encodeVector(raw[i], min, extent, quantized[i].v);
+				decoded[i] = decodeVector(quantized[i].v, min, extent);
+			}
+			reduceKeys(n, type == 0 ? bone_tolerance : bone_tolerance / length, kept, [&](int a, int c, int i) {
+				return (lerp(decoded[a], decoded[c], a == c ? 0.0f : (i - a) / float(c - a)) - raw[i]).length();
+			});
+
+			uint32 start = (uint32)keys.size();
+			for (int i : kept)
+				keys.push_back(quantized[i]);
+			if (type == 0)
+			{
+				track.pos_start = start;
+				track.pos_count = (uint16)kept.size();
+				track.pos_min = min;
+				track.pos_extent = extent;
+				num_pos += kept.size();
+			}
+			else
+			{
+				track.scale_start = start;
+				track.scale_count = (uint16)kept.size();
+				track.scale_min = min;
+				track.scale_extent = extent;
+				num_scale += kept.size();
+			}
+		}
+	}
+
+	//error report, compares the position of every joint against the raw keyframes
+	Vector3f raw_global[128];
+	double sum_error = 0.0;
+	float max_error = 0.0f;
+	for (int i = 0; i < n; ++i)
+	{
+		for (int b = 0; b < nb; ++b)
+			skeleton.bones[(int)bones_map[b]].model = keyframes[i * nb + b];
+		skeleton.updateGlobalMatrices();
+		for (int j = 0; j < skeleton.num_bones; ++j)
+			raw_global[j] = skeleton.global_bone_matrices[j].getTranslation();
+
+		sampleFrame((float)i, skeleton);
+		skeleton.updateGlobalMatrices();
+		for (int j = 0; j < skeleton.num_bones; ++j)
+		{
+			float e = (skeleton.global_bone_matrices[j].getTranslation() - raw_global[j]).length();
+			max_error = std::max(max_error, e);
+			sum_error += e;
+		}
+	}
+
+	size_t bytes = tracks.size() * sizeof(sAnimTrack) + keys.size() * sizeof(sAnimKey);
+	std::cout << "[Compressed] " << raw_bytes / 1024 << "KB -> " << bytes / 1024 << "KB (" << raw_bytes / (float)bytes << "x) ";
+	std::cout << "Keys rot: " << num_rot << " pos: " << num_pos << " scale: " << num_scale << " of " << n * nb << " ";
+	std::cout << "Joint error max: " << max_error << " avg: " << sum_error / (n * skeleton.num_bones) << " (tolerance " << tolerance << ") ";
+
+	if (free_raw)
+	{
+		delete[] keyframes;
+		keyframes = NULL;
+	}
+	sampleFrame(0.0f, skeleton);
+	skeleton.updateGlobalMatrices();
+}
+
+size_t Animation::getMemoryUsage()
+{
+	if (tracks.size())
+		return tracks.size() * sizeof(sAnimTrack) + keys.size() * sizeof(sAnimKey) + (keyframes ? sizeof(Matrix44) * num_keyframes * num_animated_bones : 0);
+	return sizeof(Matrix44) * num_keyframes * num_animated_bones;
+}
+
+#define MAX_SAMPLED (128 + 4) //padded so the SIMD loops can read 4 at a time
+
+//keys of the animated bones around a frame, the rotations are decoded and interpolated four at a time
+struct sSampledTracks {
+	float qa[4][MAX_SAMPLED], qb[4][MAX_SAMPLED], qf[MAX_SAMPLED]; //a,b,c,dropped component of both rotation keys
+	float q[4][MAX_SAMPLED]; //rotation x,y,z,w
+	float p[3][MAX_SAMPLED], s[3][MAX_SAMPLED]; //translation and scale, already interpolated
+	int track[MAX_SAMPLED];
+	int num;
+};
+
+static void sampleTracks(const Animation& anim, float v, const Skeleton& skeleton, uint8 layers, uint8 lods, uint16* track_cursors, sSampledTracks& out)
+{
+	v = clamp(v, 0.0f, (float)anim.num_keyframes);
+	uint16 no_cursors[128 * 3];
+	if (!track_cursors)
+	{
+		memset(no_cursors, 0, sizeof(uint16) * anim.tracks.size() * 3);
+		track_cursors = no_cursors;
+	}
+
+	int num = 0;
+	for (int i = 0; i < anim.num_animated_bones; ++i)
+	{
+		int bone = anim.bones_map[i];
+		if ((layers != 0xFF && !(skeleton.bones[bone].layer & layers)) || !(skeleton.bone_lods[bone] & lods))
+			continue;
+		const sAnimTrack& track = anim.tracks[i];
+		const sAnimKey* k = &anim.keys[track.rot_start];
+		int next;
+		int index = findKey(k, track.rot_count, v, out.qf[num], next, track_cursors[i * 3]);
+		unpackQuat(k[index].v, out.qa[0][num], out.qa[1][num], out.qa[2][num], out.qa[3][num]);
+		unpackQuat(k[next].v, out.qb[0][num], out.qb[1][num], out.qb[2][num], out.qb[3][num]);
+		Vector3f pos = sampleVector(&anim.keys[track.pos_start], track.pos_count, v, track.pos_min, track.pos_extent, track_cursors[i * 3 + 1]);
+		Vector3f scale = sampleVector(&anim.keys[track.scale_start], track.scale_count, v, track.scale_min, track.scale_extent, track_cursors[i * 3 + 2]);
+		for (int j = 0; j < 3; ++j)
+		{
+			out.p[j][num] = pos.v[j];
+			out.s[j][num] = scale.v[j];
+		}
+		out.track[num++] = i;
+	}
+	out.num = num;
+
+	int done = 0;
+#ifdef SKELETON_SSE
+	if (Animation::use_simd)
+	{
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), three = _mm_set1_ps(3.0f);
+		const __m128 sign_mask = _mm_set1_ps(-0.0f);
+		auto select = [](__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); };
+		auto decode = [&](float (*k)[MAX_SAMPLED], int i, __m128* q) {
+			__m128 a = _mm_loadu_ps(k[0] + i), b = _mm_loadu_ps(k[1] + i), c = _mm_loadu_ps(k[2] + i), big = _mm_loadu_ps(k[3] + i);
+			__m128 d = _mm_sqrt_ps(_mm_max_ps(zero, _mm_sub_ps(one, _mm_add_ps(_mm_mul_ps(a, a), _mm_add_ps(_mm_mul_ps(b, b), _mm_mul_ps(c, c))))));
+			__m128 is0 = _mm_cmpeq_ps(big, zero), is1 = _mm_cmpeq_ps(big, one), is2 = _mm_cmpeq_ps(big, two), is3 = _mm_cmpeq_ps(big, three);
+			q[0] = select(is0, d, a);
+			q[1] = select(is0, a, select(is1, d, b));
+			q[2] = select(is3, c, select(is2, d, b));
+			q[3] = select(is3, d, c);
+		};
+
+		for (; done + 4 <= num; done += 4)
+		{
+			__m128 a[4], b[4];
+			decode(out.qa, done, a);
+			decode(out.qb, done, b);
+			__m128 f = _mm_loadu_ps(out.qf + done);
+			__m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_add_ps(_mm_mul_ps(a[2], b[2]), _mm_mul_ps(a[3], b[3])));
+			__m128 fb = _mm_xor_ps(f, _mm_and_ps(_mm_cmplt_ps(dot, zero), sign_mask)); //shortest path
+			__m128 fa = _mm_sub_ps(one, f);
+			__m128 r[4];
+			for (int j = 0; j < 4; ++j)
+				r[j] = _mm_add_ps(_mm_mul_ps(a[j], fa), _mm_mul_ps(b[j], fb));
+			__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r[0], r[0]), _mm_mul_ps(r[1], r[1])), _mm_add_ps(_mm_mul_ps(r[2], r[2]), _mm_mul_ps(r[3], r[3])))));
+			for (int j = 0; j < 4; ++j)
+				_mm_storeu_ps(out.q[j] + done, _mm_mul_ps(r[j], inv));
+		}
+	}
+#endif
+	for (; done < num; ++done)
+	{
+		float a[4], b[4], q[4];
+		decodeQuat(out.qa[0][done], out.qa[1][done], out.qa[2][done], out.qa[3][done], a);
+		decodeQuat(out.qb[0][done], out.qb[1][done], out.qb[2][done], out.qb[3][done], b);
+		nlerpQuat(a, b, out.qf[done], q);
+		for (int j = 0; j < 4; ++j)
+			out.q[j][done] = q[j];
+	}
+}
+
+//builds the local matrices from rotation, translation and scale in SoA, four at a time
+static void composeSoA(float* const* q, float* const* p, float* const* s, int num, Matrix44** models)
+{
+	int done = 0;
+#ifdef SKELETON_SSE
+	if (Animation::use_simd)
+	{
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+		for (; done + 4 <= num; done += 4)
+		{
+			//same as composeTRS
+			__m128 x = _mm_loadu_ps(q[0] + done), y = _mm_loadu_ps(q[1] + done), z = _mm_loadu_ps(q[2] + done), w = _mm_loadu_ps(q[3] + done);
+			__m128 x2 = _mm_add_ps(x, x), y2 = _mm_add_ps(y, y), z2 = _mm_add_ps(z, z);
+			__m128 xx = _mm_mul_ps(x, x2), yx = _mm_mul_ps(y, x2), yy = _mm_mul_ps(y, y2);
+			__m128 zx = _mm_mul_ps(z, x2), zy = _mm_mul_ps(z, y2), zz = _mm_mul_ps(z, z2);
+			__m128 wx = _mm_mul_ps(w, x2), wy = _mm_mul_ps(w, y2), wz = _mm_mul_ps(w, z2);
+			__m128 sx = _mm_loadu_ps(s[0] + done), sy = _mm_loadu_ps(s[1] + done), sz = _mm_loadu_ps(s[2] + done);
+			__m128 rows[4][4] = {
+				{ _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, yy), zz), sx), _mm_mul_ps(_mm_add_ps(yx, wz), sx), _mm_mul_ps(_mm_sub_ps(zx, wy), sx), zero },
+				{ _mm_mul_ps(_mm_sub_ps(yx, wz), sy), _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, xx), zz), sy), _mm_mul_ps(_mm_add_ps(zy, wx), sy), zero },
+				{ _mm_mul_ps(_mm_add_ps(zx, wy), sz), _mm_mul_ps(_mm_sub_ps(zy, wx), sz), _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, xx), yy), sz), zero },
+				{ _mm_loadu_ps(p[0] + done), _mm_loadu_ps(p[1] + done), _mm_loadu_ps(p[2] + done), one } };
+
+			//from SoA to one matrix per bone
+			for (int j = 0; j < 4; ++j)
+			{
+				_MM_TRANSPOSE4_PS(rows[j][0], rows[j][1], rows[j][2], rows[j][3]);
+				for (int l = 0; l < 4; ++l)
+					_mm_storeu_ps(models[done + l]->m + j * 4, rows[j][l]);
+			}
+		}
+	}
+#endif
+	for (; done < num; ++done)
+	{
+		float rot[4] = { q[0][done], q[1][done], q[2][done], q[3][done] };
+		composeTRS(rot, Vector3f(p[0][done], p[1][done], p[2][done]), Vector3f(s[0][done], s[1][done], s[2][done]), *models[done]);
+	}
+}
+
+void Animation::sampleFrame(float v, Skeleton& out, uint8 layers, uint16* track_cursors)
+{
+	assert((int)tracks.size() == num_animated_bones);
+
+	sSampledTracks sampled;
+	sampleTracks(*this, v, out, layers, ANIM_LOD_ALL, track_cursors, sampled);
+
+	Matrix44* models[MAX_SAMPLED];
+	for (int i = 0; i < sampled.num; ++i)
+		models[i] = &out.bones[(int)bones_map[sampled.track[i]]].model;
+	float* q[4] = { sampled.q[0], sampled.q[1], sampled.q[2], sampled.q[3] };
+	float* p[3] = { sampled.p[0], sampled.p[1], sampled.p[2] };
+	float* s[3] = { sampled.s[0], sampled.s[1], sampled.s[2] };
+	composeSoA(q, p, s, sampled.num, models);
+	out.globals_dirty = true;
+}
+
+void Animation::samplePose(float t, Pose& out, bool loop, uint16* track_cursors, uint8 lods)
+{
+	assert((keyframes || tracks.size()) && out.skeleton && out.num_bones == skeleton.num_bones);
+
+	if (loop)
+	{
+		t = fmod(t, duration);
+		if (t < 0)
+			t = duration + t;
+	}
+	else
+		t = clamp( t, 0.0f, duration - (1.0/samples_per_second) );
+	float v = samples_per_second * t;
+
+	//bones without track keep the rest pose
+	if (num_animated_bones < out.num_bones)
+	{
+		bool animated[128] = {};
+		for (int i = 0; i < num_animated_bones; ++i)
+			animated[(int)bones_map[i]] = true;
+		for (int i = 0; i < out.num_bones; ++i)
+			if (!animated[i])
+				out.setLocal(i, skeleton.bones[i].model);
+	}
+
+	if (tracks.size())
+	{
+		sSampledTracks sampled;
+		sampleTracks(*this, v, *out.skeleton, 0xFF, lods, track_cursors, sampled);
+		for (int i = 0; i < sampled.num; ++i)
+		{
+			int bone = bones_map[sampled.track[i]];
+			for (int j = 0; j < 4; ++j)
+				out.r[j][bone] = sampled.q[j][i];
+			for (int j = 0; j < 3; ++j)
+			{
+				out.t[j][bone] = sampled.p[j][i];
+				out.s[j][bone] = sampled.s[j][i];
+			}
+		}
+		return;
+	}
+
+	//raw clip, lerp the matrices and split them
+	int index = clamp(floor(v), 0, num_keyframes - 1);
+	int index2 = index + 1;
+	if (index2 >= num_keyframes)
+		index2 = 0;
+	float f = v - floor(v);
+	Matrix44* k = keyframes + index * num_animated_bones;
+	Matrix44* k2 = keyframes + index2 * num_animated_bones;
+	for (int i = 0; i < num_animated_bones; ++i)
+	{
+		if (!(out.skeleton->bone_lods[(int)bones_map[i]] & lods))
+			continue;
+		Matrix44 m;
+		for (int j = 0; j < 16; ++j)
+			m.m[j] = lerp(k[i].m[j], k2[i].m[j], f);
+		out.setLocal(bones_map[i], m);
+	}
+}
+
+// POSES *********************************************
+
+PosePool PosePool::frame;
+
+PosePool::PosePool(size_t block_size)
+{
+	this->block_size = block_size;
+	current_block = 0;
+	offset = 0;
+	used_bytes = 0;
+}
+
+PosePool::~PosePool()
+{
+	for (char* block : blocks)
+		delete[] block;
+}
+
+Pose* PosePool::alloc(Skeleton* skeleton)
+{
+	assert(skeleton && skeleton->num_bones);
+	size_t header = (sizeof(Pose) + 15) & ~15;
+	size_t size = header + Pose::getSize(skeleton);
+	assert(size <= block_size);
+
+	if (blocks.size() && offset + size > block_size)
+	{
+		current_block++;
+		offset = 0;
+	}
+	if (current_block == (int)blocks.size())
+		blocks.push_back(new char[block_size]);
+	char* data = blocks[current_block] + offset;
+	offset += size;
+	used_bytes += size;
+
+	Pose* pose = (Pose*)data;
+	pose->init(skeleton, data + header);
+	return pose;
+}
+
+void PosePool::reset()
+{
+	current_block = 0;
+	offset = 0;
+	used_bytes = 0;
+}
+
+size_t Pose::getSize(Skeleton* skeleton)
+{
+	int stride = (skeleton->num_bones + 3) & ~3;
+	return stride * sizeof(float) * 10 + stride * sizeof(Matrix44);
+}
+
+void Pose::init(Skeleton* skeleton, char* data)
+{
+	this->skeleton = skeleton;
+	num_bones = skeleton->num_bones;
+	stride = (num_bones + 3) & ~3;
+	float* channels = (float*)data;
+	for (int i = 0; i < 3; ++i)
+	{
+		t[i] = channels + stride * i;
+		s[i] = channels + stride * (3 + i);
+	}
+	for (int i = 0; i < 4; ++i)
+		r[i] = channels + stride * (6 + i);
+	globals = (Matrix44*)(channels + stride * 10);
+
+	//padding is an identity that blends with itself
+	for (int i = num_bones; i < stride; ++i)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			t[j][i] = 0.0f;
+			s[j][i] = 1.0f;
+			r[j][i] = 0.0f;
+		}
+		r[3][i] = 1.0f;
+	}
+}
+
+void Pose::setRest(int bone)
+{
+	setLocal(bone, skeleton->bones[bone].model);
+}
+
+void Pose::setRest()
+{
+	for (int i = 0; i < num_bones; ++i)
+		setRest(i);
+}
+
+void Pose::setLocal(int bone, const Matrix44& m)
+{
+	Vector3f pos, scale;
+	float q[4];
+	decomposeTRS(m, pos, q, scale);
+	for (int j = 0; j < 3; ++j)
+	{
+		t[j][bone] = pos.v[j];
+		s[j][bone] = scale.v[j];
+	}
+	for (int j = 0; j < 4; ++j)
+		r[j][bone] = q[j];
+}
+
+void Pose::copy(const Pose& pose)
+{
+	assert(pose.stride == stride);
+	//the channels are contiguous
+	memcpy(t[0], pose.t[0], stride * sizeof(float) * 10);
+}
+
+void Pose::computeGlobals()
+{
+	Matrix44* models[128];
+	for (int i = 0; i < num_bones; ++i)
+		models[i] = &globals[i];
+	composeSoA(r, t, s, num_bones, models);
+
+	//order dependant
+	for (int i = 1; i < num_bones; ++i)
+	{
+		Matrix44 local = globals[i];
+		multiplyBoneMatrix(local.m, globals[ (int)skeleton->bones[i].parent ].m, globals[i].m);
+	}
+}
+
+void Pose::computeFinalBoneMatrices(Matrix44* result, GFX::Mesh* mesh)
+{
+	assert(mesh);
+	computePalette(globals, skeleton->getBoneRemap(mesh).data(), mesh->bones_offset.data(), (int)mesh->bones_info.size(), result);
+}
+
+void blendPoses(const Pose& a, const Pose& b, float w, Pose& result, uint8 layers)
+{
+	assert(a.skeleton == b.skeleton || a.skeleton->layout_id == b.skeleton->layout_id);
+	assert(a.stride == b.stride && a.stride == result.stride);
+
+	//weight of every bone according to the layers
+	float weights[128];
+	for (int i = 0; i < a.stride; ++i)
+		weights[i] = (i < a.num_bones && (layers == 0xFF || (a.skeleton->bones[i].layer & layers))) ? w : 0.0f;
+
+	int done = 0;
+#ifdef SKELETON_SSE
+	const __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps(), sign_mask = _mm_set1_ps(-0.0f);
+	for (; Animation::use_simd && done < a.stride; done += 4)
+	{
+		int i = done;
+		__m128 f = _mm_loadu_ps(weights + i);
+		__m128 fa = _mm_sub_ps(one, f);
+		for (int j = 0; j < 3; ++j)
+		{
+			_mm_storeu_ps(result.t[j] + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a.t[j] + i), fa), _mm_mul_ps(_mm_loadu_ps(b.t[j] + i), f)));
+			_mm_storeu_ps(result.s[j] + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a.s[j] + i), fa), _mm_mul_ps(_mm_loadu_ps(b.s[j] + i), f)));
+		}
+
+		__m128 qa[4], qb[4], q[4];
+		for (int j = 0; j < 4; ++j)
+		{
+			qa[j] = _mm_loadu_ps(a.r[j] + i);
+			qb[j] = _mm_loadu_ps(b.r[j] + i);
+		}
+		__m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qa[0], qb[0]), _mm_mul_ps(qa[1], qb[1])), _mm_add_ps(_mm_mul_ps(qa[2], qb[2]), _mm_mul_ps(qa[3], qb[3])));
+		__m128 fb = _mm_xor_ps(f, _mm_and_ps(_mm_cmplt_ps(dot, zero), sign_mask)); //shortest path
+		for (int j = 0; j < 4; ++j)
+			q[j] = _mm_add_ps(_mm_mul_ps(qa[j], fa), _mm_mul_ps(qb[j], fb));
+		__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(q[0], q[0]), _mm_mul_ps(q[1], q[1])), _mm_add_ps(_mm_mul_ps(q[2], q[2]), _mm_mul_ps(q[3], q[3])))));
+		for (int j = 0; j < 4; ++j)
+			_mm_storeu_ps(result.r[j] + i, _mm_mul_ps(q[j], inv));
+	}
+#endif
+	for (int i = done; i < a.num_bones; ++i)
+	{
+		float f = weights[i];
+		for (int j = 0; j < 3; ++j)
+		{
+			result.t[j][i] = lerp(a.t[j][i], b.t[j][i], f);
+			result.s[j][i] = lerp(a.s[j][i], b.s[j][i], f);
+		}
+		float qa[4] = { a.r[0][i], a.r[1][i], a.r[2][i], a.r[3][i] };
+		float qb[4] = { b.r[0][i], b.r[1][i], b.r[2][i], b.r[3][i] };
+		float q[4];
+		nlerpQuat(qa, qb, f, q);
+		for (int j = 0; j < 4; ++j)
+			result.r[j][i] = q[j];
+	}
+}
+
 void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 {
-	assert(keyframes && skeleton.num_bones);
+	if (tracks.size() && cursors.size() != tracks.size() * 3)
+		cursors.assign(tracks.size() * 3, 0);
+	sample(t, skeleton, loop, interpolate, layers, cursors.data());
+	skeleton.updateGlobalMatrices();
+}
+
+void Animation::sample(float t, Skeleton& out, bool loop, bool interpolate, uint8 layers, uint16* track_cursors)
+{
+	assert((keyframes || tracks.size()) && out.num_bones);
 
 	if (loop)
 	{
@@ -188,6 +1136,13 @@ void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 	else
 		t = clamp( t, 0.0f, duration - (1.0/samples_per_second) );
 	float v = samples_per_second * t;
+
+	if (tracks.size())
+	{
+		sampleFrame(interpolate ? v : floor(v), out, layers, track_cursors);
+		return;
+	}
+
 	int index = clamp(floor(v), 0, num_keyframes - 1);
 	int index2 = index + 1;
 	if (index2 >= num_keyframes)
@@ -198,24 +1153,30 @@ void Animation::assignTime(float t, bool loop, bool interpolate, uint8 layers)
 	Matrix44* k2 = keyframes + index2 * num_animated_bones;
 
 	//compute local bones
-	#pragma omp for  
 	for (int i = 0; i < num_animated_bones; ++i)
 	{
 		int bone_index = bones_map[i];
-		Skeleton::Bone& bone = skeleton.bones[bone_index];
+		Skeleton::Bone& bone = out.bones[bone_index];
 		if (layers != 0xFF && !(bone.layer & layers))
 			continue;
 		for (int j = 0; j < 16; ++j)
 			bone.model.m[j] = lerp(k[i].m[j], k2[i].m[j], f);
 	}
-
-	skeleton.updateGlobalMatrices();
+	out.globals_dirty = true;
 }
 
 
 void Animation::operator = (Animation* anim)
 {
-	memcpy(this, anim, sizeof(Animation));
+	skeleton = anim->skeleton;
+	duration = anim->duration;
+	samples_per_second = anim->samples_per_second;
+	num_animated_bones = anim->num_animated_bones;
+	num_keyframes = anim->num_keyframes;
+	memcpy(bones_map, anim->bones_map, sizeof(bones_map));
+	tracks = anim->tracks;
+	keys = anim->keys;
+	cursors.clear();
 	this->keyframes = NULL;
 }
 
@@ -239,8 +1200,9 @@ bool Animation::load(const char* filename)
 		std::string binfilename = name + ".abin";
 		if (!loadABIN(binfilename.c_str())) //not found
 		{
-			//try to load in ASCII
-			if (!loadSKANIM(filename))
+			//the first clip of the glTF, otherwise try to load in ASCII
+			bool loaded = (ext == "gltf" || ext == "glb") ? loadGLTFAnimation(this, filename) : loadSKANIM(filename);
+			if (!loaded)
 			{
 				std::cout << " [ERROR]: File not found" << std::endl;
 				return false;
@@ -264,11 +1226,15 @@ struct sAnimHeader {
 	int num_keyframes;
 	int num_bones;
 	int8 bones_map[128];
-	char extra[16];
+	int num_keys; //compressed keys, the tracks are num_animated_bones
+	char extra[12];
 };
 
 bool Animation::writeABIN(const char* filename)
 {
+	if (tracks.empty())
+		compress();
+
 	std::string s_filename = filename;
 	s_filename += ".abin";
 
@@ -291,6 +1257,8 @@ bool Animation::writeABIN(const char* filename)
 	header.num_keyframes = num_keyframes;
 	header.num_bones = skeleton.num_bones;
 	memcpy( header.bones_map, bones_map, sizeof(bones_map)  );
+	header.num_keys = (int)keys.size();
+	memset( header.extra, 0, sizeof(header.extra) );
 
 	//write header
 	fwrite((void*)&header, sizeof(sAnimHeader), 1, f);
@@ -298,8 +1266,9 @@ bool Animation::writeABIN(const char* filename)
 	//write skeleton
 	fwrite((void*)skeleton.bones, sizeof(skeleton.bones), 1, f);
 
-	//write keyframes
-	fwrite((void*)keyframes, sizeof(Matrix44) * num_keyframes * num_animated_bones, 1, f);
+	//write tracks and keys
+	fwrite((void*)tracks.data(), sizeof(sAnimTrack) * tracks.size(), 1, f);
+	fwrite((void*)keys.data(), sizeof(sAnimKey) * keys.size(), 1, f);
 
 	fclose(f);
 	return true;
@@ -326,6 +1295,7 @@ bool Animation::loadABIN(const char* filename)
 	if (memcmp(data, "ABIN", 4) != 0)
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		delete[] data;
 		return false;
 	}
 
@@ -334,9 +1304,10 @@ bool Animation::loadABIN(const char* filename)
 	memcpy(&header, pos, sizeof(sAnimHeader));
 	pos += sizeof(sAnimHeader);
 
-	if (header.version != ANIM_BIN_VERSION || header.header_bytes != sizeof(sAnimHeader))
+	if ((header.version != ANIM_BIN_VERSION && header.version != ANIM_BIN_RAW_VERSION) || header.header_bytes != sizeof(sAnimHeader))
 	{
 		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		delete[] data;
 		return false;
 	}
 
@@ -352,21 +1323,38 @@ bool Animation::loadABIN(const char* filename)
 	memcpy( skeleton.bones, pos, sizeof(skeleton.bones) );
 	pos += sizeof(skeleton.bones);
 
-	//extract keyframes
-	assert(keyframes == NULL);
-	keyframes = new Matrix44[num_keyframes * num_animated_bones];
-	memcpy( keyframes, pos, sizeof(Matrix44)*num_keyframes * num_animated_bones );
-	pos += sizeof(Matrix44) * num_keyframes * num_animated_bones;
-
 	//compute bone names map
 	for (int i = 0; i < skeleton.num_bones; ++i)
 		skeleton.bones_by_name[ skeleton.bones[i].name ] = i;
+	skeleton.computeLayoutId();
+	skeleton.assignDefaultLODs();
+	skeleton.globals_dirty = true;
+
+	if (header.version == ANIM_BIN_RAW_VERSION)
+	{
+		//extract raw keyframes and convert them
+		assert(keyframes == NULL);
+		keyframes = new Matrix44[num_keyframes * num_animated_bones];
+		memcpy( keyframes, pos, sizeof(Matrix44)*num_keyframes * num_animated_bones );
+		pos += sizeof(Matrix44) * num_keyframes * num_animated_bones;
+		compress();
+	}
+	else
+	{
+		//extract tracks and keys
+		tracks.resize(num_animated_bones);
+		memcpy( tracks.data(), pos, sizeof(sAnimTrack) * num_animated_bones );
+		pos += sizeof(sAnimTrack) * num_animated_bones;
+		keys.resize(header.num_keys);
+		memcpy( keys.data(), pos, sizeof(sAnimKey) * header.num_keys );
+		pos += sizeof(sAnimKey) * header.num_keys;
+	}
 
 	delete[] data;
 	return true;
 }
 
-bool Animation::loadSKANIM(const char* filename)
+bool Animation::loadSKANIM(const char* filename, bool compress_clip)
 {
 	struct stat stbuffer;
 
@@ -449,24 +1437,13 @@ bool Animation::loadSKANIM(const char* filename)
 	}
 
 	for (int i = 0; i < skeleton.num_bones; ++i)
-	{
-		Skeleton::Bone& bone = skeleton.bones[i];
-		bone.layer = BODY;
-		skeleton.bones_by_name[bone.name] = i;
-	}
+		skeleton.bones_by_name[skeleton.bones[i].name] = i;
+	skeleton.computeLayoutId();
+	skeleton.assignDefaultLayers();
+	skeleton.assignDefaultLODs();
 
-	//assign layers
-	Skeleton::Bone* hips = skeleton.getBone("mixamorig_Hips");
-	if (hips)
-	{
-		hips->layer |= HIPS;
-		skeleton.assignLayer(hips, BODY);//force every bone to have a bit
-		skeleton.assignLayer(skeleton.getBone("mixamorig_Spine"), UPPER_BODY);
-		skeleton.assignLayer(skeleton.getBone("mixamorig_RightUpLeg"), LOWER_BODY | RIGHT_LEG);
-		skeleton.assignLayer(skeleton.getBone("mixamorig_LeftUpLeg"), LOWER_BODY | LEFT_LEG);
-		skeleton.assignLayer(skeleton.getBone("mixamorig_RightShoulder"), RIGHT_ARM);
-		skeleton.assignLayer(skeleton.getBone("mixamorig_LeftShoulder"), LEFT_ARM);
-	}
+	if (compress_clip)
+		compress();
 
 	assignTime(0); //reset pose
 
@@ -496,3 +1473,382 @@ Animation* Animation::Get(const char* filename)
 	sAnimationsLoaded[filename] = anim;
 	return anim;
 }
+
+bool Animation::benchmark(const char* filename, int iterations)
+{
+	Animation raw;
+	if (!raw.loadSKANIM(filename, false))
+	{
+		std::cout << "[ERROR] cannot load SKANIM: " << filename << std::endl;
+		return false;
+	}
+
+	Animation compressed;
+	compressed.loadSKANIM(filename, true);
+	std::cout << std::endl;
+
+	std::cout << " Bones: " << raw.num_animated_bones << " Keyframes: " << raw.num_keyframes << " Memory: " << raw.getMemoryUsage() / 1024 << "KB -> " << compressed.getMemoryUsage() / 1024 << "KB" << std::endl;
+
+	//a crowd plays many different clips, so the keyframes are rarely in the cache
+	const int num_clips = 64;
+	std::vector<Animation*> crowd[2];
+	for (int i = 0; i < num_clips; ++i)
+	{
+		Animation* anim = new Animation();
+		*anim = &raw;
+		anim->keyframes = new Matrix44[raw.num_keyframes * raw.num_animated_bones];
+		memcpy(anim->keyframes, raw.keyframes, sizeof(Matrix44) * raw.num_keyframes * raw.num_animated_bones);
+		crowd[0].push_back(anim);
+		anim = new Animation();
+		*anim = &compressed;
+		crowd[1].push_back(anim);
+	}
+
+	const char* names[] = { " Raw matrix lerp: ", " Compressed scalar: ", " Compressed SIMD: " };
+	for (int mode = 0; mode < 3; ++mode)
+	{
+		Animation& anim = mode == 0 ? raw : compressed;
+		std::vector<Animation*>& clips = crowd[mode == 0 ? 0 : 1];
+		use_simd = mode == 2;
+		double time = 0, crowd_time = 0;
+		for (int i = 0; i < iterations; ++i)
+		{
+			float t = i * 0.0173f;
+			auto start = std::chrono::high_resolution_clock::now();
+			anim.assignTime(t);
+			time += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+		for (int i = 0; i < iterations / 10; ++i)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int j = 0; j < num_clips; ++j)
+				clips[j]->assignTime(i * 0.0173f + j * 0.37f);
+			crowd_time += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+		std::cout << names[mode] << TermColor::GREEN << time / iterations << "us" << TermColor::DEFAULT << " per clip, " << num_clips << " clips: " << TermColor::GREEN << crowd_time / (iterations / 10) << "us" << TermColor::DEFAULT << std::endl;
+	}
+	use_simd = true;
+	for (int i = 0; i < num_clips; ++i)
+	{
+		delete crowd[0][i];
+		delete crowd[1][i];
+	}
+	#ifndef SKELETON_SSE
+		std::cout << " (SSE not available in this build, both use the scalar path)" << std::endl;
+	#endif
+	return true;
+}
+
+// ANIMATED INSTANCES *********************************
+
+bool AnimationManager::use_jobs = true;
+int AnimationManager::batch_size = 8;
+std::vector<Matrix44> AnimationManager::palette;
+std::vector<Matrix44> AnimationManager::last_palette;
+double AnimationManager::last_update_time = 0;
+bool AnimationManager::use_lods = true;
+sAnimLOD AnimationManager::lods[ANIM_NUM_LODS] = { { 20.0f, 1 }, { 10.0f, 2 }, { 5.0f, 4 }, { 0.0f, 8 } };
+int AnimationManager::lod_counters[ANIM_NUM_LODS + 1];
+int AnimationManager::num_sampled = 0;
+int AnimationManager::num_interpolated = 0;
+uint32 AnimationManager::num_updates = 0;
+
+AnimatedInstance::AnimatedInstance()
+{
+	animation = NULL;
+	time = 0.0f;
+	loop = true;
+	blend_animation = NULL;
+	blend_time = 0.0f;
+	blend = 0.0f;
+	blend_layers = 0xFF;
+	mesh = NULL;
+	pose = NULL;
+	blend_pose = NULL;
+	palette_start = -1;
+	last_palette_start = -1;
+	lod = 0;
+	lod_phase = 0;
+	frames_to_update = 0;
+	update_frames = 1;
+	time_step = blend_time_step = 0.0f;
+	last_time = last_blend_time = 0.0f;
+	next_time = next_blend_time = 0.0f;
+	has_history = false;
+	history[0].skeleton = history[1].skeleton = NULL;
+	num_samples = 0;
+}
+
+bool AnimatedInstance::prepare()
+{
+	if (!animation)
+		return false;
+	Skeleton* skeleton = &animation->skeleton;
+
+	//poses kept between updates, the poses only point to the bones of the animation
+	if (history[0].skeleton != skeleton)
+	{
+		size_t size = Pose::getSize(skeleton);
+		history_data.resize(size * 2);
+		for (int i = 0; i < 2; ++i)
+		{
+			history[i].init(skeleton, &history_data[size * i]);
+			history[i].setRest();
+		}
+		has_history = false;
+		last_time = time;
+		last_blend_time = blend_time;
+	}
+
+	//how much the time advances every frame, to sample ahead in the far LODs
+	time_step = time - last_time;
+	blend_time_step = blend_time - last_blend_time;
+	last_time = time;
+	last_blend_time = blend_time;
+	if (fabs(time_step) > 0.5f || fabs(blend_time_step) > 0.5f) //jumped
+	{
+		time_step = blend_time_step = 0.0f;
+		has_history = false;
+	}
+	if (lod == ANIM_NUM_LODS)
+		has_history = false;
+
+	bool interpolated = lod < ANIM_NUM_LODS && AnimationManager::lods[lod].update_interval > 1;
+	pose = interpolated ? PosePool::frame.alloc(skeleton) : &history[1];
+	blend_pose = NULL;
+	cursors[0].resize(animation->tracks.size() * 3);
+
+	if (blend_animation)
+	{
+		assert(blend_animation->skeleton.layout_id == animation->skeleton.layout_id && "blended animations must share skeleton");
+		if (blend > 0.0f && lod < ANIM_NUM_LODS)
+			blend_pose = PosePool::frame.alloc(skeleton);
+		cursors[1].resize(blend_animation->tracks.size() * 3);
+	}
+
+	//builds the remap and the offsets now, in the workers they are only read
+	if (mesh && mesh->bones_info.size())
+		skeleton->getBoneRemap(mesh);
+	return true;
+}
+
+void AnimatedInstance::samplePose(float t, float bt, Pose& out)
+{
+	uint16* cursors_a = cursors[0].size() ? cursors[0].data() : NULL;
+	uint16* cursors_b = cursors[1].size() ? cursors[1].data() : NULL;
+	uint8 lods = 1 << lod;
+
+	if (blend_pose && blend >= 1.0f && blend_layers == 0xFF)
+		blend_animation->samplePose(bt, out, loop, cursors_b, lods);
+	else
+	{
+		animation->samplePose(t, out, loop, cursors_a, lods);
+		if (blend_pose)
+		{
+			blend_pose->copy(out); //for the bones skipped by the LOD
+			blend_animation->samplePose(bt, *blend_pose, loop, cursors_b, lods);
+			blendPoses(out, *blend_pose, blend, out, blend_layers);
+		}
+	}
+	num_samples++;
+}
+
+void AnimatedInstance::evaluate()
+{
+	num_samples = 0;
+
+	//out of the camera, keeps the bones of the last update
+	if (lod == ANIM_NUM_LODS)
+	{
+		if (palette_start != -1)
+			memcpy(getPalette(), &AnimationManager::last_palette[last_palette_start], sizeof(Matrix44) * mesh->bones_info.size());
+		return;
+	}
+
+	int interval = AnimationManager::lods[lod].update_interval;
+	if (interval <= 1)
+	{
+		samplePose(time, blend_time, *pose);
+		has_history = false;
+	}
+	else
+	{
+		if (!has_history || frames_to_update <= 0)
+		{
+			//the pose sampled ahead is reused if the time advanced as expected
+			float tolerance = 0.5f * std::max(fabs(time_step), fabs(blend_time_step)) + 0.0001f;
+			if (has_history && fabs(next_time - time) < tolerance && fabs(next_blend_time - blend_time) < tolerance)
+				std::swap(history[0], history[1]);
+			else
+				samplePose(time, blend_time, history[0]);
+			if (!has_history && time_step == 0.0f && blend_time_step == 0.0f) //speed not known yet
+				frames_to_update = 1;
+			else //so not all the instances update in the same frame
+				frames_to_update = interval - (AnimationManager::num_updates + lod_phase) % interval;
+
+			//interpolating across the end of a loop (from the last keyframe) would blend the last and the first pose, update again in the next frame
+			auto wraps = [&](Animation* anim, float t, float step) {
+				return loop && anim && floor(t / anim->duration) != floor((t + step * frames_to_update + 1.0f / anim->samples_per_second) / anim->duration);
+			};
+			if (frames_to_update > 1 && (wraps(animation, time, time_step) || (blend_pose && wraps(blend_animation, blend_time, blend_time_step))))
+				frames_to_update = 1;
+
+			//sampled ahead assuming the time keeps advancing at the same speed
+			next_time = time + time_step * frames_to_update;
+			next_blend_time = blend_time + blend_time_step * frames_to_update;
+			samplePose(next_time, next_blend_time, history[1]);
+			update_frames = frames_to_update;
+			has_history = true;
+		}
+		blendPoses(history[0], history[1], 1.0f - frames_to_update / (float)update_frames, *pose);
+		frames_to_update--;
+	}
+	pose->computeGlobals();
+
+	if (palette_start != -1)
+		pose->computeFinalBoneMatrices(getPalette(), mesh);
+}
+
+Matrix44* AnimatedInstance::getPalette()
+{
+	if (palette_start == -1)
+		return NULL;
+	return &AnimationManager::palette[palette_start];
+}
+
+void AnimationManager::update(std::vector<AnimatedInstance*>& instances, Camera* camera)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	//serial part: LODs, poses, caches and room in the palette
+	PosePool::frame.reset();
+	std::swap(palette, last_palette);
+	memset(lod_counters, 0, sizeof(lod_counters));
+	std::vector<AnimatedInstance*> active;
+	active.reserve(instances.size());
+	size_t num_bones = 0;
+	for (AnimatedInstance* instance : instances)
+	{
+		instance->lod = 0;
+		instance->last_palette_start = instance->palette_start;
+		if (camera && use_lods && instance->mesh)
+		{
+			GFX::Mesh* mesh = instance->mesh;
+			Vector3f center = instance->model * mesh->box.center;
+			float radius = mesh->radius * instance->model.rotateVector(Vector3f(1, 0, 0)).length();
+			if (camera->testSphereInFrustum(center, radius) == CLIP_OUTSIDE)
+				instance->lod = ANIM_NUM_LODS;
+			else
+			{
+				float scale = camera->getProjectedScale(center, radius);
+				while (instance->lod < ANIM_NUM_LODS - 1 && scale < lods[instance->lod].min_scale)
+					instance->lod++;
+			}
+			if (instance->lod == ANIM_NUM_LODS && instance->last_palette_start == -1) //nothing to freeze yet
+				instance->lod = ANIM_NUM_LODS - 1;
+		}
+		instance->lod_phase = (int)active.size();
+
+		if (!instance->prepare())
+			continue;
+		instance->palette_start = -1;
+		if (instance->mesh && instance->mesh->bones_info.size())
+		{
+			instance->palette_start = (int)num_bones;
+			num_bones += instance->mesh->bones_info.size();
+		}
+		lod_counters[instance->lod]++;
+		active.push_back(instance);
+	}
+	palette.resize(num_bones);
+
+	//parallel part, every instance only writes to itself and its range of the palette
+	auto func = [&](int start, int end) {
+		for (int i = start; i < end; ++i)
+			active[i]->evaluate();
+	};
+	if (use_jobs)
+		JobSystem::parallelFor((int)active.size(), batch_size, func);
+	else
+		func(0, (int)active.size());
+
+	num_sampled = num_interpolated = 0;
+	for (AnimatedInstance* instance : active)
+	{
+		num_sampled += instance->num_samples;
+		if (instance->lod < ANIM_NUM_LODS && !instance->num_samples)
+			num_interpolated++;
+	}
+
+	num_updates++;
+	last_update_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+bool AnimationManager::benchmark(const char* filename, int num_characters, int frames)
+{
+	Animation* anim = new Animation();
+	if (!anim->loadSKANIM(filename))
+	{
+		std::cout << "[ERROR] cannot load SKANIM: " << filename << std::endl;
+		delete anim;
+		return false;
+	}
+	std::cout << std::endl;
+
+	//skinned mesh using every bone of the skeleton
+	GFX::Mesh mesh;
+	mesh.bones_info.resize(anim->skeleton.num_bones);
+	for (int i = 0; i < anim->skeleton.num_bones; ++i)
+		memcpy(mesh.bones_info[i].name, anim->skeleton.bones[i].name, sizeof(mesh.bones_info[i].name));
+
+	std::vector<AnimatedInstance*> instances;
+	for (int i = 0; i < num_characters; ++i)
+	{
+		AnimatedInstance* instance = new AnimatedInstance();
+		instance->animation = anim;
+		instance->blend_animation = anim; //same clip with an offset, to include the cost of blending
+		instance->blend = (i % 4) * 0.25f;
+		instance->mesh = &mesh;
+		instance->model.setTranslation((i % 20 - 10) * 150.0f, 0.0f, (i / 20) * 400.0f - 2000.0f); //rows in front and behind the camera
+		instances.push_back(instance);
+	}
+
+	//camera for the LODs, the skeleton is around 100 units tall
+	Camera camera;
+	camera.setPerspective(60.0f, 16.0f / 9.0f, 1.0f, 100000.0f);
+	camera.lookAt(Vector3f(0.0f, 100.0f, 0.0f), Vector3f(0.0f, 100.0f, 1.0f), Vector3f(0.0f, 1.0f, 0.0f));
+	mesh.box.center.set(0.0f, 90.0f, 0.0f);
+	mesh.radius = 100.0f;
+
+	double times[3];
+	for (int mode = 0; mode < 3; ++mode)
+	{
+		use_jobs = mode >= 1;
+		double total = 0;
+		for (int f = 0; f < frames; ++f)
+		{
+			for (int i = 0; i < num_characters; ++i)
+			{
+				instances[i]->time = f * 0.016f + i * 0.1f;
+				instances[i]->blend_time = instances[i]->time + 0.5f;
+			}
+			update(instances, mode == 2 ? &camera : NULL);
+			total += last_update_time;
+		}
+		times[mode] = total / frames;
+	}
+	use_jobs = true;
+
+	std::cout << " Characters: " << num_characters << " Bones: " << anim->skeleton.num_bones << " Palette: " << palette.size() * sizeof(Matrix44) / 1024 << "KB Poses: " << PosePool::frame.used_bytes / 1024 << "KB" << std::endl;
+	std::cout << " Main thread: " << TermColor::GREEN << times[0] << "ms" << TermColor::DEFAULT << std::endl;
+	std::cout << " " << JobSystem::getNumThreads() << " threads: " << TermColor::GREEN << times[1] << "ms" << TermColor::DEFAULT << " (" << times[0] / times[1] << "x)" << std::endl;
+	std::cout << " With LODs: " << TermColor::GREEN << times[2] << "ms" << TermColor::DEFAULT << " (" << times[1] / times[2] << "x) Instances per LOD:";
+	for (int i = 0; i < ANIM_NUM_LODS; ++i)
+		std::cout << " " << lod_counters[i];
+	std::cout << " frozen: " << lod_counters[ANIM_NUM_LODS] << " Sampled: " << num_sampled << " Interpolated: " << num_interpolated << std::endl;
+
+	for (AnimatedInstance* instance : instances)
+		delete instance;
+	delete anim;
+	return true;
+}
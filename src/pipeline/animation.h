@@ -9,7 +9,8 @@
 
 class Camera;
 
-#define ANIM_BIN_VERSION 3
+#define ANIM_BIN_VERSION 4
+#define ANIM_BIN_RAW_VERSION 3 //old files with one Matrix44 per bone and keyframe, converted when loaded
 
 //defined layers for every body
 enum BODY_LAYERS {
@@ -23,6 +24,17 @@ enum BODY_LAYERS {
 	HIPS = 128,
 };
 
+#define ANIM_NUM_LODS 4
+
+//LODs where a bone is animated, in the far LODs the small bones (like fingers) keep their last pose
+enum ANIM_LODS {
+	ANIM_LOD0 = 1,
+	ANIM_LOD1 = 2,
+	ANIM_LOD2 = 4,
+	ANIM_LOD3 = 8,
+	ANIM_LOD_ALL = 0xFF
+};
+
 //used to compare bone names in the map
 struct cmp_str { bool operator()(char const *a, char const *b) const { return std::strcmp(a, b) < 0; } };
 
@@ -44,6 +56,9 @@ public:
 
 	Matrix44 global_bone_matrices[128]; //transform of every bone in global coordinates (according to the 0,0,0 and not the parent)
 	std::map<const char*, int, cmp_str> bones_by_name;	//map to get the bone index from its name, required to extract the final bones array
+	uint32 layout_id;	//hash of the bone names and parents, skeletons with the same bones share the remap tables stored in the mesh
+	bool globals_dirty;	//set when the local matrices change, set it to true if you modify bones[].model by hand
+	uint8 bone_lods[128];	//ANIM_LODS where every bone is animated, not stored in the files
 
 	Skeleton();
 
@@ -54,12 +69,82 @@ public:
 
 	void renderSkeleton(Camera* camera, Matrix44 model, Vector4f color = Vector4f(0.5, 0, 0.5, 1), bool render_points = false); //renders the skeleton with lines
 	void computeFinalBoneMatrices(std::vector<Matrix44>& bones, GFX::Mesh* mesh); //fills the std::vector with the bones ready for the shader
+	void computeFinalBoneMatrices(Matrix44* bones, GFX::Mesh* mesh); //same but to a buffer with room for mesh->bones_info.size() matrices
+	const std::vector<int>& getBoneRemap(GFX::Mesh* mesh); //index in this skeleton of every bone in mesh->bones_info (-1 if not found), cached in the mesh
+	void computeLayoutId(); //call after changing the bone names
 	void assignLayer(Bone* bone, uint8 layer); //assigns a layer to a node and all its children
+	void assignDefaultLayers(); //BODY to every bone and the rest of BODY_LAYERS from the mixamo bone names
+	void assignLODs(Bone* bone, uint8 lods); //sets the ANIM_LODS of a node and all its children
+	void assignDefaultLODs(); //fingers are only animated in the first two LODs
 };
 
 //this function takes skeleton A and blends it with skeleton B and stores the result in result
 void blendSkeleton(Skeleton* a, Skeleton* b, float w, Skeleton* result, uint8 layer = 0xFF);
 
+//mutable state of a skeleton: local translation, rotation and scale of every bone in SoA plus the global matrices
+//the bone structure (names, parents, layers) is read from the shared skeleton, never copied
+//arrays are padded to a multiple of 4 bones so they can be processed with SIMD
+struct Pose {
+	Skeleton* skeleton;
+	int num_bones;
+	int stride;		//num_bones rounded up to 4
+	float* t[3];	//translation x,y,z
+	float* r[4];	//rotation quaternion x,y,z,w
+	float* s[3];	//scale x,y,z
+	Matrix44* globals;
+
+	void setRest(int bone); //copies the bone from the skeleton
+	void setRest();
+	void setLocal(int bone, const Matrix44& m); //splits the matrix in TRS
+	void copy(const Pose& pose);
+	void init(Skeleton* skeleton, char* data); //data must have getSize bytes
+	static size_t getSize(Skeleton* skeleton);
+	void computeGlobals(); //updates globals from the local TRS
+	void computeFinalBoneMatrices(Matrix44* bones, GFX::Mesh* mesh); //from globals, with room for mesh->bones_info.size() matrices
+};
+
+//blends the local TRS of two poses of the same skeleton, result can be a or b
+//bones not in layers keep the pose of a
+void blendPoses(const Pose& a, const Pose& b, float w, Pose& result, uint8 layers = 0xFF);
+
+//linear allocator for the poses of a frame, reset frees everything at once keeping the memory
+//not thread safe, allocate the poses before starting the jobs
+class PosePool {
+public:
+	std::vector<char*> blocks;
+	size_t block_size;
+	int current_block;
+	size_t offset;
+	size_t used_bytes;
+
+	static PosePool frame; //poses of the current frame, reset by AnimationManager::update
+
+	PosePool(size_t block_size = 1 << 20);
+	~PosePool();
+
+	Pose* alloc(Skeleton* skeleton); //bones not initialized, sample it or call setRest
+	void reset();
+};
+
+//one quantized key of a track, v is a smallest-three quaternion or a vector quantized in the range of the track
+struct sAnimKey {
+	uint16 frame;
+	uint16 v[3];
+};
+
+//keys of the rotation, translation and scale of one animated bone, stored in Animation::keys
+struct sAnimTrack {
+	uint32 rot_start;
+	uint32 pos_start;
+	uint32 scale_start;
+	uint16 rot_count;
+	uint16 pos_count;
+	uint16 scale_count;
+	uint16 padding;
+	Vector3f pos_min, pos_extent;	//range used to quantize the translations
+	Vector3f scale_min, scale_extent;
+};
+
 //This class contains one animation loaded from a file (it also uses a skeleton to store the current snapshot)
 class Animation {
 public:
@@ -72,20 +157,41 @@ public:
 	int num_keyframes;
 	int8 bones_map[128]; //maps from keyframe data index to bone
 
-	Matrix44* keyframes;
+	Matrix44* keyframes; //raw keyframes, only kept until the clip is compressed
+
+	//compressed clip, one track per animated bone
+	std::vector<sAnimTrack> tracks;
+	std::vector<sAnimKey> keys;
+	std::vector<uint16> cursors; //last key used by every track, speeds up the search when playing
+
+	static float compression_error; //max error allowed when removing keys, relative to the size of the skeleton
+	static bool use_simd;
 
 	Animation();
 	~Animation();	//we need the dtor to remove the keyframes memory
 
 	//change the skeleton to the given pose according to time
 	void assignTime(float time, bool loop = true, bool interpolate = true, uint8 layers = 0xFF);
+	//same but only the local matrices of another skeleton with the same bones, does not modify the animation so it can run in several threads
+	//track_cursors is 3 per track (speeds up the key search of compressed clips), can be NULL
+	void sample(float time, Skeleton& out, bool loop = true, bool interpolate = true, uint8 layers = 0xFF, uint16* track_cursors = NULL);
+	void sampleFrame(float frame, Skeleton& out, uint8 layers = 0xFF, uint16* track_cursors = NULL); //from the compressed tracks at a fractional keyframe
+	//only the local TRS, the pose must use this skeleton, bones not in lods keep their value
+	void samplePose(float time, Pose& out, bool loop = true, uint16* track_cursors = NULL, uint8 lods = ANIM_LOD_ALL);
+
+	//converts the raw keyframes to quantized TRS tracks, removing the keys that can be interpolated
+	void compress(float error = compression_error, bool free_raw = true);
+	size_t getMemoryUsage(); //bytes used by the keyframes
 
 	//storage
 	bool load(const char* filename);
-	bool loadSKANIM(const char* filename);
+	bool loadSKANIM(const char* filename, bool compress_clip = true);
 	bool loadABIN(const char* filename);
 	bool writeABIN(const char* filename);
 
+	//compares the raw matrix lerp against the compressed sampler, no window needed
+	static bool benchmark(const char* filename, int iterations = 1000);
+
 	static std::map<std::string, Animation*> sAnimationsLoaded;
 	static Animation* Get(const char* filename);
 
@@ -93,3 +199,72 @@ public:
 	void operator = (Animation* anim);
 };
 
+//a character playing an animation (optionally blended with a second one), evaluated by AnimationManager::update
+class AnimatedInstance {
+public:
+	Animation* animation;
+	float time;
+	bool loop;
+
+	Animation* blend_animation; //can be NULL, must use the same skeleton
+	float blend_time;
+	float blend; //weight of the blend_animation
+	uint8 blend_layers;
+
+	GFX::Mesh* mesh; //if set the bones palette is computed
+	Matrix44 model; //world transform, used to choose the LOD
+
+	Pose* pose; //resulting pose, only valid until the next update
+	Pose* blend_pose; //from PosePool::frame
+	std::vector<uint16> cursors[2]; //key search state of every animation
+	int palette_start; //first bone of this instance in AnimationManager::palette, -1 if no mesh
+	int last_palette_start; //in AnimationManager::last_palette, used when frozen
+
+	//LOD, chosen by AnimationManager::update
+	int lod; //ANIM_NUM_LODS when out of the camera
+	int lod_phase; //spreads the updates of the instances among the frames
+	int frames_to_update; //until the next full update
+	int update_frames; //frames between the two sampled poses
+	float time_step, blend_time_step; //time advanced in the last update, used to sample ahead
+	float last_time, last_blend_time;
+	float next_time, next_blend_time; //of the pose sampled ahead
+	bool has_history;
+	Pose history[2]; //last two full updates, the frames between are interpolated
+	std::vector<char> history_data;
+	int num_samples; //poses sampled in the last update
+
+	AnimatedInstance();
+
+	bool prepare(); //called before the parallel part, allocates the poses and prepares the caches of the mesh
+	void evaluate(); //samples, blends and computes the palette, only touches this instance
+	void samplePose(float time, float blend_time, Pose& out); //both animations blended, skipping the bones not in the current lod
+	Matrix44* getPalette(); //bones ready for the shader, NULL if no mesh
+};
+
+//settings of every animation LOD
+struct sAnimLOD {
+	float min_scale; //Camera::getProjectedScale of the mesh radius to use this LOD
+	int update_interval; //frames between full updates, the frames between are interpolated
+};
+
+//evaluates all the animated instances of a frame split among the job system workers
+class AnimationManager {
+public:
+	static bool use_jobs;
+	static int batch_size; //instances per job
+	static std::vector<Matrix44> palette; //bones of all the instances of the last update in a single buffer
+	static std::vector<Matrix44> last_palette; //the previous one, frozen instances copy their bones from here
+	static double last_update_time; //in ms
+	static uint32 num_updates;
+
+	//LODs
+	static bool use_lods;
+	static sAnimLOD lods[ANIM_NUM_LODS];
+	static int lod_counters[ANIM_NUM_LODS + 1]; //instances in every LOD in the last update, the last one are the frozen
+	static int num_sampled; //poses sampled in the last update
+	static int num_interpolated; //instances interpolated between two previous updates
+
+	//camera is used to choose the LODs, if NULL all use the first one
+	static void update(std::vector<AnimatedInstance*>& instances, Camera* camera = NULL);
+	static bool benchmark(const char* filename, int num_characters = 500, int frames = 100);
+};
@@ -4,6 +4,7 @@
 #include "../utils/utils.h"
 #include "../core/includes.h"
 #include "../gfx/gfx.h"
+#include "../gfx/shader.h"
 
 Camera* Camera::current = NULL;
 
@@ -20,6 +21,17 @@ void Camera::enable()
 	updateProjectionMatrix();
 
 	extractFrustum(); //not necessary as it is updated when matrices are updated
+	uploadBlock();
+}
+
+void Camera::uploadBlock()
+{
+	//every shader that includes "blocks" reads the camera from here
+	GFX::sCameraBlock block;
+	block.viewprojection = viewprojection_matrix;
+	block.camera_pos = eye;
+	block.padding = 0;
+	GFX::Shader::UpdateUniformBlock(GFX::CAMERA_BLOCK, &block, sizeof(block));
 }
 
 void Camera::updateViewMatrix()
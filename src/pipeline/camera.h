@@ -47,6 +47,7 @@ public:
 
 	//set as current
 	void enable();
+	void uploadBlock(); //to u_camera_block, enable does it
 
 	//translate and rotate the camera
 	void move(Vector3f delta);
@@ -0,0 +1,356 @@
+#include "irradiance.h"
+
+#include "raytracer.h"
+#include "../gfx/gfx.h"
+#include "../gfx/mesh.h"
+#include "../gfx/texture.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+#include "../utils/gltf_loader.h"
+#include "../extra/hdre.h"
+
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+
+using namespace SCN;
+
+static float halfToFloat(unsigned short h)
+{
+	uint32 sign = uint32(h & 0x8000) << 16;
+	uint32 exponent = (h >> 10) & 0x1F;
+	uint32 mantissa = h & 0x3FF;
+	if (!exponent) //zero or denormal
+	{
+		float value = mantissa * (1.0f / 16777216.0f);
+		return sign ? -value : value;
+	}
+	uint32 bits = sign | (exponent == 0x1F ? 0x7F800000 : (exponent + 112) << 23) | (mantissa << 13);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+IrradianceVolumeEntity::IrradianceVolumeEntity()
+{
+	size.set(10, 4, 10);
+	dims[0] = 8; dims[1] = 4; dims[2] = 8;
+	num_samples = 256;
+	probes_dims[0] = probes_dims[1] = probes_dims[2] = 0;
+	texture = nullptr;
+	bake_time = 0;
+	num_invalid_probes = 0;
+}
+
+void IrradianceVolumeEntity::configure(cJSON* json)
+{
+	size = readJSONVector3(json, "size", size);
+	Vector3f d = readJSONVector3(json, "dims", Vector3f((float)dims[0], (float)dims[1], (float)dims[2]));
+	for (int i = 0; i < 3; ++i)
+		dims[i] = std::max((int)d.v[i], 1);
+	num_samples = std::max((int)readJSONNumber(json, "samples", (float)num_samples), 1);
+	filename = readJSONString(json, "filename", filename.c_str());
+
+	//the baked data is optional, without it the renderer uses the ambient light
+	if (filename.size() && fileExists(getFullPath()))
+		load(getFullPath().c_str());
+}
+
+void IrradianceVolumeEntity::serialize(cJSON* json)
+{
+	writeJSONVector3(json, "size", size);
+	writeJSONVector3(json, "dims", Vector3f((float)dims[0], (float)dims[1], (float)dims[2]));
+	writeJSONNumber(json, "samples", (float)num_samples);
+	writeJSONString(json, "filename", filename.c_str());
+}
+
+std::string IrradianceVolumeEntity::getFullPath() const
+{
+	return scene ? scene->base_folder + "/" + filename : filename;
+}
+
+Vector3f IrradianceVolumeEntity::getProbePosition(int x, int y, int z) const
+{
+	Vector3f pos = start;
+	int coords[3] = { x, y, z };
+	for (int i = 0; i < 3; ++i)
+		if (probes_dims[i] > 1)
+			pos.v[i] += (end.v[i] - start.v[i]) * coords[i] / float(probes_dims[i] - 1);
+	return pos;
+}
+
+bool IrradianceVolumeEntity::bake(const RayTracer& tracer)
+{
+	auto start_time = std::chrono::high_resolution_clock::now();
+
+	//a probe in the center of every cell of the box
+	Vector3f center = root.model.getTranslation();
+	for (int i = 0; i < 3; ++i)
+	{
+		probes_dims[i] = std::max(dims[i], 1);
+		float cell = size.v[i] / probes_dims[i];
+		start.v[i] = center.v[i] - size.v[i] * 0.5f + cell * 0.5f;
+		end.v[i] = center.v[i] + size.v[i] * 0.5f - cell * 0.5f;
+	}
+	int num_probes = getNumProbes();
+	probes.assign(num_probes, SphericalHarmonics());
+	texture = nullptr; //uploaded again on the next use
+
+	//same directions for every probe, spread with the golden angle
+	int num_dirs = std::max(num_samples, 1);
+	std::vector<Vector3f> dirs(num_dirs);
+	std::vector<float> basis(size_t(num_dirs) * 9);
+	for (int i = 0; i < num_dirs; ++i)
+	{
+		float z = 1.0f - (2.0f * i + 1.0f) / num_dirs;
+		float r = sqrt(std::max(0.0f, 1.0f - z * z));
+		float phi = i * float(PI * (3.0 - sqrt(5.0)));
+		dirs[i].set(r * cos(phi), r * sin(phi), z);
+		SHProjection::evalBasis(dirs[i], 2, &basis[size_t(i) * 9]);
+	}
+	float weight = float(4.0 * PI / num_dirs);
+
+	//the probes that see too many backfaces are inside the geometry
+	std::vector<uint8> valid(num_probes, 0);
+	JobSystem::parallelFor(num_probes, 1, [&](int first, int last) {
+		for (int i = first; i < last; ++i)
+		{
+			Vector3f pos = getProbePosition(i % probes_dims[0], (i / probes_dims[0]) % probes_dims[1], i / (probes_dims[0] * probes_dims[1]));
+			double acc[9][3] = {};
+			int backfaces = 0;
+			for (int k = 0; k < num_dirs; ++k)
+			{
+				sRayHit hit;
+				Vector3f radiance = tracer.getRadiance(pos, dirs[k], &hit);
+				if (hit.t >= 0.0f && hit.backface)
+					backfaces++;
+				const float* b = &basis[size_t(k) * 9];
+				for (int c = 0; c < 9; ++c)
+				{
+					acc[c][0] += radiance.x * b[c];
+					acc[c][1] += radiance.y * b[c];
+					acc[c][2] += radiance.z * b[c];
+				}
+			}
+			SHProjection projection(2);
+			for (int c = 0; c < 9; ++c)
+				projection.coeffs[c].set(float(acc[c][0] * weight), float(acc[c][1] * weight), float(acc[c][2] * weight));
+			probes[i] = projection.toIrradiance();
+			valid[i] = backfaces * 4 < num_dirs;
+		}
+	});
+
+	//invalid probes take the average of their valid neighbours, growing from the valid ones
+	num_invalid_probes = 0;
+	for (int i = 0; i < num_probes; ++i)
+		num_invalid_probes += !valid[i];
+	bool changed = num_invalid_probes > 0;
+	while (changed)
+	{
+		changed = false;
+		std::vector<SphericalHarmonics> next = probes;
+		std::vector<uint8> next_valid = valid;
+		for (int i = 0; i < num_probes; ++i)
+		{
+			if (valid[i])
+				continue;
+			int p[3] = { i % probes_dims[0], (i / probes_dims[0]) % probes_dims[1], i / (probes_dims[0] * probes_dims[1]) };
+			int stride[3] = { 1, probes_dims[0], probes_dims[0] * probes_dims[1] };
+			SphericalHarmonics sum;
+			int count = 0;
+			for (int axis = 0; axis < 3; ++axis)
+				for (int side = -1; side <= 1; side += 2)
+				{
+					int n = p[axis] + side;
+					if (n < 0 || n >= probes_dims[axis] || !valid[i + side * stride[axis]])
+						continue;
+					for (int c = 0; c < 9; ++c)
+						sum.coeffs[c] += probes[i + side * stride[axis]].coeffs[c];
+					count++;
+				}
+			if (!count)
+				continue;
+			for (int c = 0; c < 9; ++c)
+				next[i].coeffs[c] = sum.coeffs[c] * (1.0f / count);
+			next_valid[i] = 1;
+			changed = true;
+		}
+		probes.swap(next);
+		valid.swap(next_valid);
+	}
+
+	bake_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	return true;
+}
+
+bool IrradianceVolumeEntity::save(const char* filename)
+{
+	int num_probes = getNumProbes();
+	if (!num_probes || (int)probes.size() != num_probes)
+		return false;
+
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write IRRV: " << filename << std::endl;
+		return false;
+	}
+
+	sIrradianceHeader header;
+	memcpy(header.magic, "IRRV", 4);
+	header.version = IRRADIANCE_VOLUME_VERSION;
+	memcpy(header.dims, probes_dims, sizeof(header.dims));
+	header.num_samples = num_samples;
+	header.start = start;
+	header.end = end;
+
+	//27 half floats per probe
+	std::vector<unsigned short> halfs(size_t(num_probes) * 27);
+	HDRE::floatToHalf(&probes[0].coeffs[0].x, &halfs[0], halfs.size());
+
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(&halfs[0], sizeof(unsigned short), halfs.size(), f);
+	fclose(f);
+	return true;
+}
+
+bool IrradianceVolumeEntity::load(const char* filename)
+{
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer) || buffer.size() < sizeof(sIrradianceHeader))
+	{
+		std::cout << "[ERROR] cannot read IRRV: " << filename << std::endl;
+		return false;
+	}
+
+	sIrradianceHeader header;
+	memcpy(&header, &buffer[0], sizeof(header));
+	if (memcmp(header.magic, "IRRV", 4) != 0 || header.version != IRRADIANCE_VOLUME_VERSION)
+	{
+		std::cout << "[ERROR] IRRV of another version, bake it again: " << filename << std::endl;
+		return false;
+	}
+	size_t num_probes = 1;
+	for (int i = 0; i < 3; ++i)
+		num_probes *= header.dims[i] > 0 ? header.dims[i] : 0;
+	if (!num_probes || buffer.size() != sizeof(header) + num_probes * 27 * sizeof(unsigned short))
+	{
+		std::cout << "[ERROR] wrong IRRV size: " << filename << std::endl;
+		return false;
+	}
+
+	memcpy(probes_dims, header.dims, sizeof(probes_dims));
+	start = header.start;
+	end = header.end;
+	probes.resize(num_probes);
+	const unsigned short* halfs = (const unsigned short*)&buffer[sizeof(header)];
+	float* dst = &probes[0].coeffs[0].x;
+	for (size_t i = 0; i < num_probes * 27; ++i)
+		dst[i] = halfToFloat(halfs[i]);
+	texture = nullptr;
+	return true;
+}
+
+void IrradianceVolumeEntity::upload()
+{
+	int num_probes = getNumProbes();
+	if (!num_probes || (int)probes.size() != num_probes)
+		return;
+
+	//the coefficient k of the probe (x,y,z) goes to the texel (x, y, k * dims.z + z)
+	std::vector<float> texels(size_t(num_probes) * 27);
+	for (int i = 0; i < num_probes; ++i)
+		for (int k = 0; k < 9; ++k)
+			memcpy(&texels[(size_t(k) * num_probes + i) * 3], probes[i].coeffs[k].v, sizeof(float) * 3);
+	std::vector<unsigned short> halfs(texels.size());
+	HDRE::floatToHalf(&texels[0], &halfs[0], halfs.size());
+
+	std::string texture_name = filename.size() ? getFullPath() : "@irradiance_" + name;
+	texture = GFX::Texture::Find(texture_name.c_str());
+	if (!texture)
+	{
+		texture = new GFX::Texture();
+		texture->setName(texture_name.c_str());
+	}
+	texture->create3D(probes_dims[0], probes_dims[1], probes_dims[2] * 9, GL_RGB, GL_HALF_FLOAT, false, (const Uint8*)&halfs[0], GL_RGB16F);
+}
+
+bool IrradianceVolumeEntity::bakeScene(const char* scene_filename, bool verify)
+{
+	//only the geometry and the material colors are needed
+	GFX::Mesh::auto_upload_to_vram = false;
+	load_textures = false;
+
+	Scene* scene = new Scene(); //not deleted, the process ends after baking
+	if (!scene->load(scene_filename))
+		return false;
+
+	RayTracer tracer;
+	if (!tracer.build(scene))
+	{
+		std::cout << "[ERROR] no geometry to bake in " << scene_filename << std::endl;
+		return false;
+	}
+
+	bool ok = true;
+	int num_volumes = 0;
+	for (BaseEntity* ent : scene->entities)
+	{
+		if (ent->getType() != eEntityType::IRRADIANCE_VOLUME)
+			continue;
+		IrradianceVolumeEntity* volume = (IrradianceVolumeEntity*)ent;
+		num_volumes++;
+
+		volume->bake(tracer);
+		int num_probes = volume->getNumProbes();
+		double rays = double(num_probes) * volume->num_samples;
+		std::cout << " + Irradiance volume " << TermColor::GREEN << volume->name << TermColor::DEFAULT << ": " << volume->probes_dims[0] << "x" << volume->probes_dims[1] << "x" << volume->probes_dims[2]
+			<< " probes, " << volume->num_samples << " rays each, " << volume->num_invalid_probes << " inside geometry, "
+			<< volume->bake_time << "ms (" << rays / (volume->bake_time * 1000.0) << " Mrays/s, " << JobSystem::getNumThreads() << " threads)" << std::endl;
+
+		if (verify)
+		{
+			//the probes are summed in the same order in any thread, a serial bake must give the same bits
+			std::vector<SphericalHarmonics> parallel = volume->probes;
+			bool enabled = JobSystem::enabled;
+			JobSystem::enabled = false;
+			volume->bake(tracer);
+			JobSystem::enabled = enabled;
+			bool same = memcmp(&parallel[0], &volume->probes[0], sizeof(SphericalHarmonics) * num_probes) == 0;
+			ok = ok && same;
+			std::cout << "   serial " << volume->bake_time << "ms" << (same ? " same result" : " [ERROR] different from the parallel bake") << std::endl;
+		}
+
+		if (volume->filename.empty())
+		{
+			std::cout << "[WARN] no filename to save " << volume->name << std::endl;
+			continue;
+		}
+		std::string path = volume->getFullPath();
+		if (!volume->save(path.c_str()))
+		{
+			ok = false;
+			continue;
+		}
+
+		//the file stores half floats
+		IrradianceVolumeEntity loaded;
+		bool same = loaded.load(path.c_str()) && loaded.getNumProbes() == num_probes;
+		float max_error = 0;
+		for (int i = 0; same && i < num_probes; ++i)
+			for (int c = 0; c < 9; ++c)
+				for (int j = 0; j < 3; ++j)
+				{
+					float value = volume->probes[i].coeffs[c].v[j];
+					max_error = std::max(max_error, (float)fabs(loaded.probes[i].coeffs[c].v[j] - value) / std::max((float)fabs(value), 1e-3f));
+				}
+		same = same && max_error < 1e-3f;
+		ok = ok && same;
+		std::cout << "   saved " << path << " (" << sizeof(sIrradianceHeader) + num_probes * 27 * sizeof(unsigned short) << " bytes)" << (same ? "" : " [ERROR] reading it back") << std::endl;
+	}
+
+	if (!num_volumes)
+		std::cout << "[WARN] no IRRADIANCE_VOLUME entities in " << scene_filename << std::endl;
+	return ok && num_volumes > 0;
+}
@@ -0,0 +1,72 @@
+/*  Irradiance volume: a grid of probes inside the box of the entity (centered at its position, rotation and scale are ignored).
+	Every probe traces the same set of directions (a fibonacci sphere) against the scene BVH, projects the radiance
+	that arrives to SH and keeps the irradiance (9 RGB coefficients). Probes are independent and each one is summed
+	in a fixed order, so the bake gives the same result with any number of workers.
+	The result is saved as a .irrv (header and half floats) and uploaded as a 3D texture with the 9 coefficients
+	stacked along Z (depth is dims.z * 9), so the shader interpolates every coefficient trilinearly.
+*/
+
+#pragma once
+
+#include "scene.h"
+#include "../gfx/sphericalharmonics.h"
+
+namespace GFX {
+	class Texture;
+}
+
+namespace SCN {
+
+	class RayTracer;
+
+	#define IRRADIANCE_VOLUME_VERSION 1 //change it if the format of the .irrv changes
+
+	struct sIrradianceHeader {
+		char magic[4]; //IRRV
+		uint32 version;
+		int dims[3];
+		int num_samples;
+		Vector3f start; //position of the first probe
+		Vector3f end; //position of the last probe
+	};
+
+	class IrradianceVolumeEntity : public BaseEntity
+	{
+	public:
+		Vector3f size; //of the box
+		int dims[3]; //probes per axis
+		int num_samples; //rays per probe
+		std::string filename; //.irrv, relative to the scene folder
+
+		//baked data, also filled when loading the file
+		std::vector<SphericalHarmonics> probes;
+		int probes_dims[3];
+		Vector3f start;
+		Vector3f end;
+		GFX::Texture* texture; //registered with the name of the file, uploaded on the first use
+
+		//stats
+		double bake_time; //ms
+		int num_invalid_probes; //inside the geometry, filled from their neighbours
+
+		IrradianceVolumeEntity();
+
+		ENTITY_METHODS(IrradianceVolumeEntity, IRRADIANCE_VOLUME, 9, 4);
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		int getNumProbes() const { return probes_dims[0] * probes_dims[1] * probes_dims[2]; }
+		Vector3f getProbePosition(int x, int y, int z) const;
+		std::string getFullPath() const;
+
+		bool bake(const RayTracer& tracer);
+		bool save(const char* filename);
+		bool load(const char* filename);
+		void upload();
+
+		//headless: loads the scene, bakes every volume and saves them, checks that a serial bake gives the same bits
+		static bool bakeScene(const char* scene_filename, bool verify = true);
+	};
+
+};
@@ -12,6 +12,7 @@ uint32 Material::s_last_index = 0;
 Material Material::default_material;
 
 const char* SCN::texture_channel_str[] = { "ALBEDO","EMISSIVE","OPACITY","METALLIC_ROUGHNESS","OCCLUSION","NORMALMAP" };
+const char* SCN::material_macro_str[] = { "HAS_ALBEDO","HAS_NORMALMAP","HAS_EMISSIVE","ALPHA_MASK","LIGHTS_FEW","LIGHTS_MANY","HAS_IRRADIANCE","HAS_PROBE" };
 
 
 Material* Material::Get(const char* name)
@@ -37,6 +38,20 @@ Material::~Material()
 		if (it != sMaterials.end())
 			sMaterials.erase(it);
 	}
+
+	//textures still waiting to be decoded that no other material uses are not needed anymore
+	for (int i = 0; i < eTextureChannel::ALL; ++i)
+	{
+		GFX::Texture* texture = textures[i].texture;
+		if (!texture || !texture->loading)
+			continue;
+		bool shared = false;
+		for (auto& it : sMaterials)
+			for (int j = 0; j < eTextureChannel::ALL && !shared; ++j)
+				shared = it.second->textures[j].texture == texture;
+		if (!shared)
+			texture->cancelLoading();
+	}
 }
 
 void Material::Release()
@@ -90,7 +105,7 @@ void Material::bind(GFX::Shader* shader) {
 		//	texture = occlusion_texture;
 		// ==========================
 
-		// We always force a default albedo texture
+		// We always force a default albedo texture (the permutations without HAS_ALBEDO dont read it)
 		if (texture == NULL)
 			texture = GFX::Texture::getWhiteTexture(); //a 1x1 white texture
 
@@ -98,8 +113,52 @@ void Material::bind(GFX::Shader* shader) {
 
 		if (texture)
 			shader->setUniform("u_texture", texture, 0);
+		if (textures[SCN::eTextureChannel::NORMALMAP].texture)
+			shader->setUniform("u_normal_texture", textures[SCN::eTextureChannel::NORMALMAP].texture, 1);
+		if (textures[SCN::eTextureChannel::EMISSIVE].texture)
+		{
+			shader->setUniform("u_emissive_texture", textures[SCN::eTextureChannel::EMISSIVE].texture, 2);
+			shader->setUniform("u_emissive_factor", emissive_factor);
+		}
 
 		// This is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
 		shader->setUniform("u_alpha_cutoff", alpha_mode == SCN::eAlphaMode::MASK ? alpha_cutoff : 0.001f);
+
+		// Programs without u_material_block (the osx atlas) read the rest from plain uniforms
+		if (!shader->has_block[GFX::MATERIAL_BLOCK])
+		{
+			shader->setUniform("u_material_shine", shininess);
+			shader->setUniform("u_roughness", roughness_factor);
+			shader->setUniform("u_metalness", metallic_factor);
+		}
 	}
 }
+
+void Material::fillBlock(GFX::sMaterialBlock& block) const
+{
+	block.color = color;
+	block.emissive_factor = emissive_factor;
+	block.alpha_cutoff = alpha_mode == SCN::eAlphaMode::MASK ? alpha_cutoff : 0.001f;
+	block.shininess = shininess;
+	block.roughness = roughness_factor;
+	block.metalness = metallic_factor;
+	block.padding = 0;
+}
+
+uint64 Material::getShaderMacros(int num_lights) const
+{
+	uint64 macros = 0;
+	if (textures[SCN::eTextureChannel::ALBEDO].texture)
+		macros |= uint64(1) << HAS_ALBEDO;
+	if (textures[SCN::eTextureChannel::NORMALMAP].texture)
+		macros |= uint64(1) << HAS_NORMALMAP;
+	if (textures[SCN::eTextureChannel::EMISSIVE].texture)
+		macros |= uint64(1) << HAS_EMISSIVE;
+	if (alpha_mode != SCN::eAlphaMode::NO_ALPHA) //blended pixels without alpha are discarded too, so they dont write depth
+		macros |= uint64(1) << ALPHA_MASK;
+	if (num_lights > 4)
+		macros |= uint64(1) << LIGHTS_MANY;
+	else if (num_lights > 0)
+		macros |= uint64(1) << LIGHTS_FEW;
+	return macros;
+}
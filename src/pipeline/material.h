@@ -11,6 +11,7 @@ namespace GFX
 	class Mesh;
 	class Texture;
 	class Shader;
+	struct sMaterialBlock;
 }
 
 namespace SCN {
@@ -40,6 +41,21 @@ namespace SCN {
 
 	extern const char* texture_channel_str[];
 
+	//macros of the @material ubershader, in the same order as in the atlas
+	enum eMaterialMacro {
+		HAS_ALBEDO,
+		HAS_NORMALMAP,
+		HAS_EMISSIVE,
+		ALPHA_MASK,
+		LIGHTS_FEW,		//up to 4
+		LIGHTS_MANY,	//up to 10
+		HAS_IRRADIANCE,
+		HAS_PROBE,
+		NUM_MATERIAL_MACROS
+	};
+
+	extern const char* material_macro_str[];
+
 	//this class contains all info relevant of how something must be rendered
 	class Material {
 	public:
@@ -70,13 +86,15 @@ namespace SCN {
 		Sampler textures[eTextureChannel::ALL];
 
 		//ctors
-		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), two_sided(false), roughness_factor(1), metallic_factor(0) {
+		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), two_sided(false), roughness_factor(1), metallic_factor(0), emissive_factor(0, 0, 0) {
 			//color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
 			index = s_last_index++;
 		}
 		virtual ~Material();
 
 		void bind(GFX::Shader *shader);
+		void fillBlock(GFX::sMaterialBlock& block) const; //its entry of u_material_block
+		uint64 getShaderMacros(int num_lights) const; //the features of the material as eMaterialMacro bits, the scene adds its own
 
 		static void Release();
 	};
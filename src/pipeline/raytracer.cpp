@@ -0,0 +1,537 @@
+#include "raytracer.h"
+
+#include "scene.h"
+#include "light.h"
+#include "material.h"
+#include "../gfx/mesh.h"
+#include "../gfx/cubemapfilter.h"
+#include "../utils/utils.h"
+#include "../extra/hdre.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <iostream>
+
+using namespace SCN;
+
+#define BVH_LEAF_SIZE 4
+#define BVH_BINS 12
+#define BVH_STACK_SIZE 128
+
+struct sBounds {
+	Vector3f min, max;
+	sBounds() : min(FLT_MAX), max(-FLT_MAX) {}
+	void add(const Vector3f& p) { min.setMin(p); max.setMax(p); }
+	void add(const sBounds& b) { min.setMin(b.min); max.setMax(b.max); }
+	float area() const {
+		if (min.x > max.x)
+			return 0.0f;
+		Vector3f d = max - min;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+};
+
+//slab test, returns the entry distance in tnear
+static inline bool rayBox(const RayTracer::sNode& node, const Vector3f& origin, const Vector3f& inv, float max_dist, float& tnear)
+{
+	float tmin = 0.0f, tmax = max_dist;
+	for (int i = 0; i < 3; ++i)
+	{
+		float t0 = (node.min.v[i] - origin.v[i]) * inv.v[i];
+		float t1 = (node.max.v[i] - origin.v[i]) * inv.v[i];
+		if (t0 > t1)
+			std::swap(t0, t1);
+		tmin = t0 > tmin ? t0 : tmin;
+		tmax = t1 < tmax ? t1 : tmax;
+		if (tmin > tmax)
+			return false;
+	}
+	tnear = tmin;
+	return true;
+}
+
+//moller-trumbore, both sides
+static inline bool rayTriangle(const RayTracer::sTriangle& tri, const Vector3f& origin, const Vector3f& dir, float max_dist, float& t)
+{
+	Vector3f p = cross(dir, tri.e2);
+	float det = dot(tri.e1, p);
+	if (fabs(det) < 1e-12f)
+		return false;
+	float inv_det = 1.0f / det;
+	Vector3f s = origin - tri.v0;
+	float u = dot(s, p) * inv_det;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+	Vector3f q = cross(s, tri.e1);
+	float v = dot(dir, q) * inv_det;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+	t = dot(tri.e2, q) * inv_det;
+	return t > 0.0f && t < max_dist;
+}
+
+static inline Vector3f inverseDir(const Vector3f& dir)
+{
+	Vector3f inv;
+	for (int i = 0; i < 3; ++i)
+		inv.v[i] = 1.0f / (fabs(dir.v[i]) > 1e-12f ? dir.v[i] : (dir.v[i] < 0.0f ? -1e-12f : 1e-12f));
+	return inv;
+}
+
+RayTracer::RayTracer()
+{
+	has_sky = false;
+	sky_size = sky_channels = 0;
+	bias = 0.001f;
+	build_time = 0;
+}
+
+void RayTracer::clear()
+{
+	triangles.clear();
+	surfaces.clear();
+	nodes.clear();
+	lights.clear();
+	has_sky = false;
+	sky_filename.clear();
+	sky_faces.clear();
+	sky_size = sky_channels = 0;
+}
+
+bool RayTracer::build(Scene* scene, bool keep_sky)
+{
+	auto start_time = std::chrono::high_resolution_clock::now();
+	clear();
+	ambient = scene->ambient_light;
+	background = scene->background_color;
+
+	if (scene->skybox_filename.size() && toLowerCase(getExtension(scene->skybox_filename)) == "hdre")
+	{
+		HDRE* hdre = HDRE::Get((scene->base_folder + "/" + scene->skybox_filename).c_str());
+		has_sky = hdre && projectSH(hdre, 0, 2, sky);
+		float** faces = has_sky && keep_sky ? hdre->getFacesf(0) : nullptr;
+		if (faces)
+		{
+			sky_size = hdre->getLevelWidth(0);
+			sky_channels = hdre->header.numChannels;
+			size_t face_size = size_t(sky_size) * sky_size * sky_channels;
+			sky_faces.resize(face_size * 6);
+			for (int i = 0; i < 6; ++i)
+				memcpy(&sky_faces[face_size * i], faces[i], face_size * sizeof(float));
+		}
+		if (hdre)
+			hdre->releaseLevels();
+		if (has_sky)
+			sky_filename = scene->skybox_filename;
+	}
+
+	for (BaseEntity* ent : scene->entities)
+	{
+		if (!ent->visible)
+			continue;
+		if (ent->getType() == eEntityType::PREFAB)
+			addNode(&ent->root);
+		else if (ent->getType() == eEntityType::LIGHT)
+		{
+			LightEntity* light = (LightEntity*)ent;
+			sLight l;
+			l.type = (int)light->light_type;
+			l.position = light->root.getGlobalMatrix().getTranslation();
+			l.direction = normalize(light->root.model.frontVector());
+			l.color = light->color * light->intensity;
+			l.cone_min = (float)cos(light->cone_info.x * PI / 180.0);
+			l.cone_max = (float)cos(light->cone_info.y * PI / 180.0);
+			l.cast_shadows = light->cast_shadows;
+			lights.push_back(l);
+		}
+	}
+
+	buildTree();
+	if (nodes.size())
+		bias = std::max((nodes[0].max - nodes[0].min).length() * 1e-5f, 1e-5f);
+
+	build_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start_time).count();
+	std::cout << " + Scene BVH: " << triangles.size() << " triangles, " << nodes.size() << " nodes, " << lights.size() << " lights in " << build_time << " ms" << std::endl;
+	return triangles.size() > 0;
+}
+
+void RayTracer::addNode(Node* node)
+{
+	if (!node->visible)
+		return;
+
+	GFX::Mesh* mesh = node->mesh;
+	Material* material = node->material;
+	if (mesh && material && material->alpha_mode != eAlphaMode::BLEND)
+	{
+		if (mesh->evicted && !mesh->vertices.size() && !mesh->interleaved.size())
+			mesh->makeResident(true); //only when baking from the editor, the tools never evict
+		Matrix44 model = node->getGlobalMatrix();
+		std::vector<Vector3f> world;
+		if (mesh->vertices.size())
+		{
+			world.resize(mesh->vertices.size());
+			for (size_t i = 0; i < world.size(); ++i)
+				world[i] = model * mesh->vertices[i];
+		}
+		else //interleaved
+		{
+			world.resize(mesh->interleaved.size());
+			for (size_t i = 0; i < world.size(); ++i)
+				world[i] = model * mesh->interleaved[i].vertex;
+		}
+
+		//a mirrored transform flips the winding
+		Vector3f ax(model.m[0], model.m[1], model.m[2]), ay(model.m[4], model.m[5], model.m[6]), az(model.m[8], model.m[9], model.m[10]);
+		float orientation = dot(cross(ax, ay), az) < 0.0f ? -1.0f : 1.0f;
+
+		sSurface surface;
+		surface.albedo.set(material->color.x, material->color.y, material->color.z);
+		surface.two_sided = material->two_sided;
+
+		size_t num_indices = mesh->m_indices.size() ? mesh->m_indices.size() : world.size();
+		for (size_t i = 0; i + 2 < num_indices; i += 3)
+		{
+			const Vector3f& a = world[mesh->m_indices.size() ? mesh->m_indices[i] : i];
+			const Vector3f& b = world[mesh->m_indices.size() ? mesh->m_indices[i + 1] : i + 1];
+			const Vector3f& c = world[mesh->m_indices.size() ? mesh->m_indices[i + 2] : i + 2];
+			sTriangle tri;
+			tri.v0 = a;
+			tri.e1 = b - a;
+			tri.e2 = c - a;
+			Vector3f n = cross(tri.e1, tri.e2);
+			float len = n.length();
+			if (len < 1e-20f) //degenerated
+				continue;
+			surface.normal = n * (orientation / len);
+			triangles.push_back(tri);
+			surfaces.push_back(surface);
+		}
+	}
+
+	for (Node* child : node->children)
+		addNode(child);
+}
+
+void RayTracer::buildTree()
+{
+	nodes.clear();
+	uint32 num_triangles = (uint32)triangles.size();
+	if (!num_triangles)
+		return;
+
+	std::vector<sBounds> bounds(num_triangles);
+	std::vector<Vector3f> centroids(num_triangles);
+	std::vector<uint32> indices(num_triangles);
+	for (uint32 i = 0; i < num_triangles; ++i)
+	{
+		const sTriangle& tri = triangles[i];
+		bounds[i].add(tri.v0);
+		bounds[i].add(tri.v0 + tri.e1);
+		bounds[i].add(tri.v0 + tri.e2);
+		centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+		indices[i] = i;
+	}
+
+	//nodes are split in order so the build is deterministic
+	nodes.reserve(num_triangles * 2);
+	nodes.push_back({ Vector3f(), 0, Vector3f(), num_triangles });
+	std::vector<uint32> pending;
+	pending.push_back(0);
+	while (pending.size())
+	{
+		uint32 index = pending.back();
+		pending.pop_back();
+		uint32 start = nodes[index].start;
+		uint32 count = nodes[index].count;
+
+		sBounds box, centers;
+		for (uint32 i = start; i < start + count; ++i)
+		{
+			box.add(bounds[indices[i]]);
+			centers.add(centroids[indices[i]]);
+		}
+		nodes[index].min = box.min;
+		nodes[index].max = box.max;
+		if (count <= BVH_LEAF_SIZE)
+			continue;
+
+		//split along the longest axis of the centroids
+		Vector3f extent = centers.max - centers.min;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		float axis_min = centers.min.v[axis];
+		float axis_size = extent.v[axis];
+		uint32 mid = start + count / 2;
+		if (axis_size > 1e-12f)
+		{
+			sBounds bins[BVH_BINS];
+			uint32 bin_count[BVH_BINS] = {};
+			float scale = BVH_BINS / axis_size;
+			for (uint32 i = start; i < start + count; ++i)
+			{
+				int b = std::min(BVH_BINS - 1, (int)((centroids[indices[i]].v[axis] - axis_min) * scale));
+				bins[b].add(bounds[indices[i]]);
+				bin_count[b]++;
+			}
+
+			//surface area heuristic for every plane between bins
+			float right_area[BVH_BINS];
+			uint32 right_count[BVH_BINS];
+			sBounds acc;
+			uint32 acc_count = 0;
+			for (int b = BVH_BINS - 1; b > 0; --b)
+			{
+				acc.add(bins[b]);
+				acc_count += bin_count[b];
+				right_area[b] = acc.area();
+				right_count[b] = acc_count;
+			}
+			float best_cost = FLT_MAX;
+			int best_split = -1;
+			acc = sBounds();
+			acc_count = 0;
+			for (int b = 1; b < BVH_BINS; ++b)
+			{
+				acc.add(bins[b - 1]);
+				acc_count += bin_count[b - 1];
+				if (!acc_count || !right_count[b])
+					continue;
+				float cost = acc.area() * acc_count + right_area[b] * right_count[b];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_split = b;
+				}
+			}
+			if (best_split == -1)
+				continue; //all in one bin, keep it as a leaf
+			if (best_cost >= box.area() * count && count <= BVH_LEAF_SIZE * 4)
+				continue; //splitting does not pay off
+
+			uint32* first = &indices[start];
+			uint32* last = first + count;
+			uint32* it = std::partition(first, last, [&](uint32 i) {
+				return std::min(BVH_BINS - 1, (int)((centroids[i].v[axis] - axis_min) * scale)) < best_split;
+			});
+			mid = start + (uint32)(it - first);
+		}
+
+		uint32 left = (uint32)nodes.size();
+		nodes.push_back({ Vector3f(), start, Vector3f(), mid - start });
+		nodes.push_back({ Vector3f(), mid, Vector3f(), start + count - mid });
+		nodes[index].start = left;
+		nodes[index].count = 0;
+		pending.push_back(left + 1);
+		pending.push_back(left);
+	}
+
+	//triangles sorted as the leaves
+	std::vector<sTriangle> sorted_triangles(num_triangles);
+	std::vector<sSurface> sorted_surfaces(num_triangles);
+	for (uint32 i = 0; i < num_triangles; ++i)
+	{
+		sorted_triangles[i] = triangles[indices[i]];
+		sorted_surfaces[i] = surfaces[indices[i]];
+	}
+	triangles.swap(sorted_triangles);
+	surfaces.swap(sorted_surfaces);
+}
+
+bool RayTracer::intersect(const Vector3f& origin, const Vector3f& dir, float max_dist, sRayHit& hit) const
+{
+	if (nodes.empty())
+		return false;
+
+	Vector3f inv = inverseDir(dir);
+	float best = max_dist;
+	int best_triangle = -1;
+	float tnear;
+	if (!rayBox(nodes[0], origin, inv, best, tnear))
+		return false;
+
+	uint32 stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top)
+	{
+		const sNode& node = nodes[stack[--top]];
+		if (node.count)
+		{
+			for (uint32 i = node.start; i < node.start + node.count; ++i)
+			{
+				float t;
+				if (rayTriangle(triangles[i], origin, dir, best, t))
+				{
+					best = t;
+					best_triangle = i;
+				}
+			}
+			continue;
+		}
+
+		//nearest child is visited first
+		float t0, t1;
+		bool hit0 = rayBox(nodes[node.start], origin, inv, best, t0);
+		bool hit1 = rayBox(nodes[node.start + 1], origin, inv, best, t1);
+		assert(top + 2 <= BVH_STACK_SIZE);
+		if (hit0 && hit1)
+		{
+			stack[top++] = t0 <= t1 ? node.start + 1 : node.start;
+			stack[top++] = t0 <= t1 ? node.start : node.start + 1;
+		}
+		else if (hit0)
+			stack[top++] = node.start;
+		else if (hit1)
+			stack[top++] = node.start + 1;
+	}
+
+	if (best_triangle == -1)
+		return false;
+	hit.t = best;
+	hit.triangle = best_triangle;
+	const sSurface& surface = surfaces[best_triangle];
+	hit.backface = !surface.two_sided && dot(surface.normal, dir) > 0.0f;
+	return true;
+}
+
+bool RayTracer::occluded(const Vector3f& origin, const Vector3f& dir, float max_dist) const
+{
+	if (nodes.empty())
+		return false;
+
+	Vector3f inv = inverseDir(dir);
+	float tnear;
+	uint32 stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top)
+	{
+		const sNode& node = nodes[stack[--top]];
+		if (!rayBox(node, origin, inv, max_dist, tnear))
+			continue;
+		if (node.count)
+		{
+			float t;
+			for (uint32 i = node.start; i < node.start + node.count; ++i)
+				if (rayTriangle(triangles[i], origin, dir, max_dist, t))
+					return true;
+			continue;
+		}
+		assert(top + 2 <= BVH_STACK_SIZE);
+		stack[top++] = node.start + 1;
+		stack[top++] = node.start;
+	}
+	return false;
+}
+
+uint64 RayTracer::getHash() const
+{
+	//fnv-1a, field by field so the padding of the structs is not read
+	uint64 hash = 14695981039346656037ULL;
+	auto add = [&](const void* data, size_t size) {
+		const uint8* bytes = (const uint8*)data;
+		for (size_t i = 0; i < size; ++i)
+			hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	};
+	if (triangles.size())
+		add(&triangles[0], triangles.size() * sizeof(sTriangle));
+	for (const sSurface& surface : surfaces)
+	{
+		add(&surface.albedo, sizeof(Vector3f));
+		add(&surface.two_sided, sizeof(bool));
+	}
+	for (const sLight& light : lights)
+	{
+		add(&light.type, sizeof(int));
+		add(&light.position, sizeof(Vector3f));
+		add(&light.direction, sizeof(Vector3f));
+		add(&light.color, sizeof(Vector3f));
+		add(&light.cone_min, sizeof(float) * 2);
+		add(&light.cast_shadows, sizeof(bool));
+	}
+	add(&ambient, sizeof(Vector3f));
+	add(&background, sizeof(Vector3f));
+	add(sky_filename.c_str(), sky_filename.size());
+	if (has_sky)
+		add(&sky.coeffs[0], sizeof(Vector3f) * sky.getNumCoeffs());
+	return hash;
+}
+
+Vector3f RayTracer::getSkyRadiance(const Vector3f& dir, bool sharp) const
+{
+	if (!has_sky)
+		return background;
+	if (sharp && sky_faces.size())
+	{
+		int face;
+		float u, v;
+		GFX::CubemapFilter::getFaceUV(dir, face, u, v);
+		int x = std::min(int((u * 0.5f + 0.5f) * sky_size), sky_size - 1);
+		int y = std::min(int((v * 0.5f + 0.5f) * sky_size), sky_size - 1);
+		const float* p = &sky_faces[((size_t(face) * sky_size + std::max(y, 0)) * sky_size + std::max(x, 0)) * sky_channels];
+		return Vector3f(p[0], p[1], p[2]);
+	}
+	Vector3f radiance = sky.evaluate(dir);
+	radiance.setMax(Vector3f(0.0f));
+	return radiance;
+}
+
+Vector3f RayTracer::getDirectLight(const Vector3f& position, const Vector3f& normal) const
+{
+	Vector3f result;
+	for (const sLight& light : lights)
+	{
+		Vector3f L;
+		float dist = FLT_MAX;
+		float factor = 1.0f;
+		if (light.type == eLightType::DIRECTIONAL)
+			L = light.direction;
+		else if (light.type == eLightType::POINT || light.type == eLightType::SPOT)
+		{
+			L = light.position - position;
+			dist = L.length();
+			if (dist < 1e-6f)
+				continue;
+			L = L * (1.0f / dist);
+			factor = 1.0f / (dist * dist);
+			if (light.type == eLightType::SPOT)
+			{
+				float cos_angle = dot(L, light.direction);
+				if (cos_angle < light.cone_max)
+					continue;
+				factor *= (clamp(cos_angle, 0.0f, 1.0f) - light.cone_max) / std::max(light.cone_min - light.cone_max, 1e-6f);
+			}
+		}
+		else
+			continue;
+
+		float n_dot_l = dot(normal, L);
+		if (n_dot_l <= 0.0f)
+			continue;
+		if (light.cast_shadows && occluded(position, L, dist))
+			continue;
+		result += light.color * (factor * n_dot_l);
+	}
+	return result;
+}
+
+Vector3f RayTracer::getRadiance(const Vector3f& origin, const Vector3f& dir, sRayHit* out_hit, bool sharp_sky) const
+{
+	sRayHit hit;
+	if (!intersect(origin, dir, FLT_MAX, hit))
+	{
+		if (out_hit)
+			out_hit->t = -1.0f;
+		return getSkyRadiance(dir, sharp_sky);
+	}
+	if (out_hit)
+		*out_hit = hit;
+
+	const sSurface& surface = surfaces[hit.triangle];
+	Vector3f normal = dot(surface.normal, dir) > 0.0f ? surface.normal * -1.0f : surface.normal;
+	Vector3f position = origin + dir * hit.t + normal * bias;
+	return surface.albedo * (ambient + getDirectLight(position, normal));
+}
@@ -0,0 +1,72 @@
+/*  CPU ray tracing of the scene, used by the bakers so they can run without a GPU.
+	The triangles of the visible prefabs are copied in world space into a BVH (binned SAH, up to 4 triangles per leaf).
+	Queries only read the tree, so all the workers can trace at the same time once it is built.
+	Surfaces are lambertian with the color of their material (textures are not sampled) and are lit with the
+	diffuse terms of the forward shader: lights (with shadow rays if they cast shadows) and ambient.
+	Rays that escape see the sky (the skybox projected to SH) or the background color, the reflection probes
+	can keep the faces of the skybox to see it sharp.
+*/
+
+#pragma once
+
+#include "../core/math.h"
+#include "../gfx/sphericalharmonics.h"
+#include <vector>
+#include <string>
+
+namespace SCN {
+
+	class Scene;
+	class Node;
+
+	struct sRayHit {
+		float t;
+		uint32 triangle;
+		bool backface; //the ray reached the back of a single sided triangle
+	};
+
+	class RayTracer {
+	public:
+		struct sTriangle { Vector3f v0, e1, e2; };
+		struct sSurface { Vector3f normal; Vector3f albedo; bool two_sided; };
+		struct sNode { Vector3f min; uint32 start; Vector3f max; uint32 count; }; //count 0: inner node, children at start and start + 1
+		struct sLight { int type; Vector3f position; Vector3f direction; Vector3f color; float cone_min; float cone_max; bool cast_shadows; }; //color scaled by the intensity
+
+		std::vector<sTriangle> triangles;
+		std::vector<sSurface> surfaces; //one per triangle
+		std::vector<sNode> nodes;
+		std::vector<sLight> lights;
+
+		Vector3f ambient;
+		Vector3f background; //radiance of the rays that escape when there is no sky
+		SHProjection sky;
+		bool has_sky;
+		std::string sky_filename;
+		std::vector<float> sky_faces; //level 0 of the skybox, only when built with keep_sky
+		int sky_size;
+		int sky_channels;
+		float bias; //offset of the secondary rays, relative to the size of the scene
+
+		//stats
+		double build_time; //ms
+
+		RayTracer();
+
+		//reads the meshes from the RAM, load the scene with GFX::Mesh::auto_upload_to_vram false to build it headless
+		bool build(Scene* scene, bool keep_sky = false);
+		void clear();
+		uint64 getHash() const; //of everything that changes the radiance, to validate the baked caches
+
+		bool intersect(const Vector3f& origin, const Vector3f& dir, float max_dist, sRayHit& hit) const;
+		bool occluded(const Vector3f& origin, const Vector3f& dir, float max_dist) const;
+
+		Vector3f getSkyRadiance(const Vector3f& dir, bool sharp = false) const; //sharp reads the kept faces (nearest)
+		Vector3f getDirectLight(const Vector3f& position, const Vector3f& normal) const;
+		Vector3f getRadiance(const Vector3f& origin, const Vector3f& dir, sRayHit* hit = nullptr, bool sharp_sky = false) const; //arriving from dir, one bounce
+
+	private:
+		void addNode(Node* node);
+		void buildTree();
+	};
+
+};
@@ -0,0 +1,272 @@
+#include "reflection.h"
+
+#include "raytracer.h"
+#include "../gfx/gfx.h"
+#include "../gfx/mesh.h"
+#include "../gfx/texture.h"
+#include "../gfx/cubemapfilter.h"
+#include "../gfx/mipgenerator.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+#include "../utils/gltf_loader.h"
+#include "../extra/hdre.h"
+
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+
+using namespace SCN;
+
+ReflectionProbeEntity::ReflectionProbeEntity()
+{
+	size.set(10, 10, 10);
+	resolution = 128;
+	num_levels = 6;
+	header = sReflectionProbeHeader();
+	texture = nullptr;
+	capture_time = filter_time = 0;
+	from_cache = false;
+}
+
+void ReflectionProbeEntity::configure(cJSON* json)
+{
+	size = readJSONVector3(json, "size", size);
+	resolution = std::max((int)readJSONNumber(json, "resolution", (float)resolution), 4);
+	while (!isPowerOfTwo(resolution))
+		resolution &= resolution - 1; //the prefilter needs the full mip chain
+	num_levels = std::max((int)readJSONNumber(json, "levels", (float)num_levels), 1);
+	filename = readJSONString(json, "filename", filename.c_str());
+
+	//without the baked data the renderer does not use the probe
+	if (filename.size() && fileExists(getFullPath()))
+		load(getFullPath().c_str());
+}
+
+void ReflectionProbeEntity::serialize(cJSON* json)
+{
+	writeJSONVector3(json, "size", size);
+	writeJSONNumber(json, "resolution", (float)resolution);
+	writeJSONNumber(json, "levels", (float)num_levels);
+	writeJSONString(json, "filename", filename.c_str());
+}
+
+std::string ReflectionProbeEntity::getFullPath() const
+{
+	return scene ? scene->base_folder + "/" + filename : filename;
+}
+
+bool ReflectionProbeEntity::contains(const Vector3f& point) const
+{
+	Vector3f local = point - Vector3f(root.model.m[12], root.model.m[13], root.model.m[14]);
+	return fabs(local.x) <= size.x * 0.5f && fabs(local.y) <= size.y * 0.5f && fabs(local.z) <= size.z * 0.5f;
+}
+
+bool ReflectionProbeEntity::bake(const RayTracer& tracer, bool force)
+{
+	Vector3f position = root.model.getTranslation();
+	int levels = std::min(num_levels, GFX::MipGenerator::getNumMips(resolution, resolution));
+	uint64 scene_hash = tracer.getHash();
+	from_cache = false;
+
+	if (!force && filename.size() && fileExists(getFullPath()) && load(getFullPath().c_str()) &&
+		header.scene_hash == scene_hash && header.size == resolution && header.num_levels == levels &&
+		header.num_samples == GFX::CubemapFilter::num_samples && (header.position - position).length() < 1e-4f)
+	{
+		from_cache = true;
+		capture_time = filter_time = 0;
+		return true;
+	}
+
+	//level 0 is the radiance that arrives to the probe, one ray per texel
+	auto start_time = std::chrono::high_resolution_clock::now();
+	std::vector<GFX::sCubemapLevel> cubemap(1);
+	cubemap[0].resize(resolution);
+	JobSystem::parallelFor(6 * resolution, 4, [&](int first, int last) {
+		for (int row = first; row < last; ++row)
+		{
+			int face = row / resolution;
+			int y = row % resolution;
+			float* dst = cubemap[0].getFace(face) + size_t(y) * resolution * 4;
+			float v = 2.0f * (y + 0.5f) / resolution - 1.0f;
+			for (int x = 0; x < resolution; ++x, dst += 4)
+			{
+				Vector3f dir = normalize(GFX::CubemapFilter::getDirection(face, 2.0f * (x + 0.5f) / resolution - 1.0f, v));
+				Vector3f radiance = tracer.getRadiance(position, dir, nullptr, true);
+				dst[0] = radiance.x;
+				dst[1] = radiance.y;
+				dst[2] = radiance.z;
+				dst[3] = 1.0f;
+			}
+		}
+	});
+	auto filter_start = std::chrono::high_resolution_clock::now();
+	capture_time = std::chrono::duration<double, std::milli>(filter_start - start_time).count();
+
+	GFX::CubemapFilter::prefilter(cubemap, levels);
+	filter_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - filter_start).count();
+
+	//RGB half floats, the alpha is not uploaded
+	size_t num_texels = 0;
+	for (const GFX::sCubemapLevel& level : cubemap)
+		num_texels += level.pixels.size() / 4;
+	std::vector<float> rgb(num_texels * 3);
+	size_t offset = 0;
+	for (const GFX::sCubemapLevel& level : cubemap)
+		for (size_t i = 0; i < level.pixels.size(); i += 4, offset += 3)
+			memcpy(&rgb[offset], &level.pixels[i], sizeof(float) * 3);
+	texels.resize(rgb.size());
+	HDRE::floatToHalf(&rgb[0], &texels[0], rgb.size());
+
+	memcpy(header.magic, "RPRB", 4);
+	header.version = REFLECTION_PROBE_VERSION;
+	header.size = resolution;
+	header.num_levels = levels;
+	header.num_samples = GFX::CubemapFilter::num_samples;
+	header.position = position;
+	header.scene_hash = scene_hash;
+	texture = nullptr; //uploaded again on the next use
+
+	if (filename.size())
+		save(getFullPath().c_str());
+	return true;
+}
+
+bool ReflectionProbeEntity::save(const char* filename)
+{
+	if (!isBaked())
+		return false;
+
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write PROBE: " << filename << std::endl;
+		return false;
+	}
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(&texels[0], sizeof(unsigned short), texels.size(), f);
+	fclose(f);
+	return true;
+}
+
+bool ReflectionProbeEntity::load(const char* filename)
+{
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer) || buffer.size() < sizeof(sReflectionProbeHeader))
+	{
+		std::cout << "[ERROR] cannot read PROBE: " << filename << std::endl;
+		return false;
+	}
+
+	sReflectionProbeHeader file_header;
+	memcpy(&file_header, &buffer[0], sizeof(file_header));
+	if (memcmp(file_header.magic, "RPRB", 4) != 0 || file_header.version != REFLECTION_PROBE_VERSION)
+	{
+		std::cout << "[ERROR] PROBE of another version, bake it again: " << filename << std::endl;
+		return false;
+	}
+	size_t num_texels = 0;
+	if (file_header.size > 0 && isPowerOfTwo(file_header.size) && file_header.num_levels > 0 && file_header.num_levels <= GFX::MipGenerator::getNumMips(file_header.size, file_header.size))
+		for (int i = 0; i < file_header.num_levels; ++i)
+			num_texels += size_t(file_header.size >> i) * (file_header.size >> i) * 6;
+	if (!num_texels || buffer.size() != sizeof(file_header) + num_texels * 3 * sizeof(unsigned short))
+	{
+		std::cout << "[ERROR] wrong PROBE size: " << filename << std::endl;
+		return false;
+	}
+
+	header = file_header;
+	texels.resize(num_texels * 3);
+	memcpy(&texels[0], &buffer[sizeof(header)], texels.size() * sizeof(unsigned short));
+	texture = nullptr;
+	return true;
+}
+
+void ReflectionProbeEntity::upload()
+{
+	if (!isBaked())
+		return;
+
+	std::string texture_name = filename.size() ? getFullPath() : "@probe_" + name;
+	texture = GFX::Texture::Find(texture_name.c_str());
+	if (!texture)
+	{
+		texture = new GFX::Texture();
+		texture->setName(texture_name.c_str());
+	}
+
+	//every level comes from the file, the mipmaps of GL are replaced
+	size_t offset = 0;
+	for (int level = 0; level < header.num_levels; ++level)
+	{
+		int level_size = header.size >> level;
+		Uint8* faces[6];
+		for (int i = 0; i < 6; ++i)
+			faces[i] = (Uint8*)&texels[offset + size_t(i) * level_size * level_size * 3];
+		if (level == 0)
+			texture->createCubemap(level_size, level_size, faces, GL_RGB, GL_HALF_FLOAT, true, GL_RGB16F);
+		else
+			texture->uploadCubemap(GL_RGB, GL_HALF_FLOAT, false, faces, GL_RGB16F, level);
+		offset += size_t(level_size) * level_size * 3 * 6;
+	}
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, header.num_levels - 1);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
+
+bool ReflectionProbeEntity::bakeScene(const char* scene_filename, bool force)
+{
+	//only the geometry and the material colors are needed
+	GFX::Mesh::auto_upload_to_vram = false;
+	load_textures = false;
+
+	Scene* scene = new Scene(); //not deleted, the process ends after baking
+	if (!scene->load(scene_filename))
+		return false;
+
+	RayTracer tracer;
+	if (!tracer.build(scene, true))
+	{
+		std::cout << "[ERROR] no geometry to bake in " << scene_filename << std::endl;
+		return false;
+	}
+
+	bool ok = true;
+	int num_probes = 0;
+	for (BaseEntity* ent : scene->entities)
+	{
+		if (ent->getType() != eEntityType::REFLECTION_PROBE)
+			continue;
+		ReflectionProbeEntity* probe = (ReflectionProbeEntity*)ent;
+		num_probes++;
+
+		probe->bake(tracer, force);
+		std::cout << " + Reflection probe " << TermColor::GREEN << probe->name << TermColor::DEFAULT << ": " << probe->header.size << "x" << probe->header.size
+			<< ", " << probe->header.num_levels << " levels, ";
+		if (probe->from_cache)
+		{
+			std::cout << "up to date in " << probe->getFullPath() << std::endl;
+			continue;
+		}
+		double rays = 6.0 * probe->resolution * probe->resolution;
+		std::cout << "capture " << probe->capture_time << "ms (" << rays / (probe->capture_time * 1000.0) << " Mrays/s), prefilter " << probe->filter_time << "ms ("
+			<< GFX::CubemapFilter::num_samples << " samples, " << JobSystem::getNumThreads() << " threads)" << std::endl;
+
+		if (probe->filename.empty())
+		{
+			std::cout << "[WARN] no filename to cache " << probe->name << std::endl;
+			continue;
+		}
+
+		//nothing changed, the next bake must read the file
+		std::vector<unsigned short> baked = probe->texels;
+		bool same = probe->bake(tracer) && probe->from_cache && probe->texels == baked;
+		ok = ok && same;
+		std::cout << "   saved " << probe->getFullPath() << " (" << sizeof(sReflectionProbeHeader) + baked.size() * sizeof(unsigned short) << " bytes)"
+			<< (same ? "" : " [ERROR] the cache is not reused") << std::endl;
+	}
+
+	if (!num_probes)
+		std::cout << "[WARN] no REFLECTION_PROBE entities in " << scene_filename << std::endl;
+	return ok && num_probes > 0;
+}
@@ -0,0 +1,70 @@
+/*  Reflection probe: a cubemap captured from the position of the entity and prefiltered with GGX,
+	one mip per roughness (level l is roughness l / (num_levels - 1)), as the environment of the objects inside its box.
+	The capture traces the scene BVH from the CPU (one bounce, sharp skybox) and the prefilter runs in the CPU too,
+	so probes can be baked headless. The result is cached in a .probe (header and half floats) and is only baked
+	again when the scene, the position or the settings change.
+*/
+
+#pragma once
+
+#include "scene.h"
+
+namespace GFX {
+	class Texture;
+}
+
+namespace SCN {
+
+	class RayTracer;
+
+	#define REFLECTION_PROBE_VERSION 1 //change it if the format of the .probe changes
+
+	struct sReflectionProbeHeader {
+		char magic[4]; //RPRB
+		uint32 version;
+		int size; //of the faces of the level 0
+		int num_levels;
+		int num_samples; //of the prefilter
+		Vector3f position;
+		uint64 scene_hash; //RayTracer::getHash when it was baked
+	};
+
+	class ReflectionProbeEntity : public BaseEntity
+	{
+	public:
+		Vector3f size; //of the box of influence, centered at the position
+		int resolution; //of the faces, a power of two
+		int num_levels; //of roughness
+		std::string filename; //.probe, relative to the scene folder
+
+		//baked data: RGB half floats, level after level with the 6 faces each, also filled when loading the file
+		sReflectionProbeHeader header;
+		std::vector<unsigned short> texels;
+		GFX::Texture* texture; //registered with the name of the file, uploaded on the first use
+
+		//stats
+		double capture_time; //ms
+		double filter_time; //ms
+		bool from_cache;
+
+		ReflectionProbeEntity();
+
+		ENTITY_METHODS(ReflectionProbeEntity, REFLECTION_PROBE, 10, 4);
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		bool isBaked() const { return texels.size() > 0; }
+		bool contains(const Vector3f& point) const;
+		std::string getFullPath() const;
+
+		bool bake(const RayTracer& tracer, bool force = false); //reads the .probe instead if it was baked with the same scene and settings
+		bool save(const char* filename);
+		bool load(const char* filename);
+		void upload();
+
+		//headless: loads the scene and bakes every probe that is not cached, checks that the next bake reuses the file
+		static bool bakeScene(const char* scene_filename, bool force = false);
+	};
+
+};
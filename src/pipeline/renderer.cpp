@@ -1,6 +1,8 @@
 #include "renderer.h"
 
 #include <algorithm> //sort
+#include <cfloat>
+#include <chrono>
 
 #include "camera.h"
 #include "../gfx/gfx.h"
@@ -8,6 +10,7 @@
 #include "../gfx/mesh.h"
 #include "../gfx/texture.h"
 #include "../gfx/fbo.h"
+#include "../gfx/texturestreaming.h"
 #include "../pipeline/prefab.h"
 #include "../pipeline/material.h"
 #include "../pipeline/animation.h"
@@ -25,6 +28,13 @@ using namespace SCN;
 //some globals
 GFX::Mesh sphere;
 
+//the mip streaming needs to know how big every texture of the material is seen
+static void requestTextureMips(const Matrix44& model, GFX::Mesh* mesh, SCN::Material* material, Camera* camera)
+{
+	for (int i = 0; i < eTextureChannel::ALL; ++i)
+		GFX::TextureStreaming::addDemand(material->textures[i].texture, mesh, model, camera);
+}
+
 Renderer::Renderer(const char* shader_atlas_filename)
 {
 	render_wireframe = false;
@@ -33,6 +43,16 @@ Renderer::Renderer(const char* shader_atlas_filename)
 	skybox_cubemap = nullptr;
 
 	use_multipass = false;
+	use_irradiance_volume = true;
+	irradiance_volume = nullptr;
+	use_reflection_probes = true;
+	use_material_permutations = true;
+	profile_materials = false;
+	irradiance_enabled = false;
+	material_blocks.resize(BLOCK_MAX_MATERIALS);
+	material_overflow_warned = false;
+	overflow_material = nullptr;
+	draw_cpu_time = 0;
 	shadow_fbo = new GFX::FBO();
 	shadow_fbo->setDepthOnly(1024, 1024);
 
@@ -40,6 +60,18 @@ Renderer::Renderer(const char* shader_atlas_filename)
 		exit(1);
 	GFX::checkGLErrors();
 
+	//the bits of the material masks are the indices of the macros in the atlas
+	GFX::Shader::UberShader* ubershader = GFX::Shader::GetUberShader("@material");
+	for (int i = 0; ubershader && i < NUM_MATERIAL_MACROS; ++i)
+		if (ubershader->getMacroIndex(material_macro_str[i]) != i)
+		{
+			std::cout << "[WARN] the macros of @material dont follow eMaterialMacro, using the generic shader" << std::endl;
+			use_material_permutations = false;
+			break;
+		}
+	if (ubershader) //until a permutation is compiled its objects have all the lights and no textures
+		ubershader->fallback_macros = uint64(1) << LIGHTS_MANY;
+
 	sphere.createSphere(1.0f);
 	sphere.uploadToVRAM();
 }
@@ -74,6 +106,7 @@ void Renderer::parseNode(SCN::Node* node, Camera* cam) {
 		draw_com.mesh = node->mesh;
 		draw_com.material = node->material;
 		draw_com.model = node->getGlobalMatrix();
+		draw_com.probe = nullptr;
 
 		draw_command_list.push_back(draw_com);
 	}
@@ -93,6 +126,8 @@ void Renderer::parseSceneEntities(SCN::Scene* scene, Camera* cam) {
 
 
 	lights_list.clear();
+	irradiance_volume = nullptr;
+	probes_list.clear();
 
 	for (int i = 0; i < scene->entities.size(); i++) {
 		BaseEntity* entity = scene->entities[i];
@@ -112,6 +147,19 @@ void Renderer::parseSceneEntities(SCN::Scene* scene, Camera* cam) {
 
 			lights_list.push_back(light_entt);
 		}
+		else if (entity->getType() == eEntityType::IRRADIANCE_VOLUME) {
+			IrradianceVolumeEntity* volume = (IrradianceVolumeEntity*)entity;
+
+			//only one volume is used, the first one with baked probes
+			if (!irradiance_volume && volume->probes.size())
+				irradiance_volume = volume;
+		}
+		else if (entity->getType() == eEntityType::REFLECTION_PROBE) {
+			ReflectionProbeEntity* probe = (ReflectionProbeEntity*)entity;
+
+			if (probe->isBaked())
+				probes_list.push_back(probe);
+		}
 
 		// Store Prefab Entitys
 		// ...
@@ -121,10 +169,29 @@ void Renderer::parseSceneEntities(SCN::Scene* scene, Camera* cam) {
 		// ...
 	}
 
+	assignReflectionProbes();
 	orderDrawCommands(cam);
 	
 }
 
+void Renderer::assignReflectionProbes() {
+	if (probes_list.empty())
+		return;
+
+	//the center of the mesh in world space decides, the smallest box wins where they overlap
+	for (sDrawCommand& command : draw_command_list) {
+		Vector3f center = transformBoundingBox(command.model, command.mesh->box).center;
+		float best_volume = FLT_MAX;
+		for (ReflectionProbeEntity* probe : probes_list) {
+			float volume = probe->size.x * probe->size.y * probe->size.z;
+			if (volume < best_volume && probe->contains(center)) {
+				command.probe = probe;
+				best_volume = volume;
+			}
+		}
+	}
+}
+
 void Renderer::orderDrawCommands(Camera* cam) {
 
 	//Check every node in the draw_command_list. Check the material to see if it's transparent or not
@@ -159,12 +226,93 @@ void Renderer::orderDrawCommands(Camera* cam) {
 	draw_command_list.insert(draw_command_list.end(), transparent_command_list.begin(), transparent_command_list.end());
 }
 
+void Renderer::updateFrameBlocks()
+{
+	//lights, ambient, time and the irradiance grid are the same for every draw of the frame
+	GFX::sFrameBlock frame = GFX::sFrameBlock(); //zeroed
+	frame.light_ambient = scene->ambient_light;
+	frame.time = (float)getTime();
+	frame.light_count = (int)min(lights_list.size(), BLOCK_MAX_LIGHTS);
+	for (int i = 0; i < frame.light_count; ++i)
+	{
+		LightEntity* light = lights_list[i];
+		frame.light_pos[i].set(light->root.getGlobalMatrix().getTranslation(), 0);
+		frame.light_color[i].set(light->color, 0);
+		frame.light_dir[i].set(light->root.model.frontVector(), 0);
+		frame.light_int[i].x = light->intensity;
+		frame.light_type[i][0] = (int)light->light_type;
+		frame.light_min[i].x = light->near_distance;
+		frame.light_max[i].x = light->max_distance;
+		frame.light_cone_max[i].x = (float)cos((light->cone_info.y * PI) / 180.0);
+		frame.light_cone_min[i].x = (float)cos((light->cone_info.x * PI) / 180.0);
+	}
+
+	irradiance_enabled = use_irradiance_volume && irradiance_volume;
+	if (irradiance_enabled && !irradiance_volume->texture)
+		irradiance_volume->upload();
+	irradiance_enabled = irradiance_enabled && irradiance_volume->texture;
+	frame.irr_enabled = (int)irradiance_enabled;
+	if (irradiance_enabled)
+	{
+		//probes go from start to end, a flat axis of the grid is not interpolated
+		Vector3f delta = irradiance_volume->end - irradiance_volume->start;
+		for (int i = 0; i < 3; ++i)
+		{
+			frame.irr_start.v[i] = irradiance_volume->start.v[i];
+			frame.irr_inv_delta.v[i] = fabs(delta.v[i]) > 1e-6f ? 1.0f / delta.v[i] : 0.0f;
+			frame.irr_dims.v[i] = (float)irradiance_volume->probes_dims[i];
+		}
+	}
+	GFX::Shader::UpdateUniformBlock(GFX::FRAME_BLOCK, &frame, sizeof(frame));
+
+	//every material drawn gets a slot, the last one is left for the ones that dont fit
+	material_slots.clear();
+	overflow_material = nullptr;
+	for (sDrawCommand& command : draw_command_list)
+	{
+		if (material_slots.count(command.material))
+			continue;
+		if (material_slots.size() == BLOCK_MAX_MATERIALS - 1)
+		{
+			if (!material_overflow_warned)
+				std::cout << "[WARN] more than " << BLOCK_MAX_MATERIALS - 1 << " materials in the frame, the rest upload u_material_block per draw" << std::endl;
+			material_overflow_warned = true;
+			break;
+		}
+		int slot = (int)material_slots.size();
+		command.material->fillBlock(material_blocks[slot]);
+		material_slots[command.material] = slot;
+	}
+	//the whole array, the block of the shader has its full size
+	GFX::Shader::UpdateUniformBlock(GFX::MATERIAL_BLOCK, &material_blocks[0], (int)(material_blocks.size() * sizeof(GFX::sMaterialBlock)));
+}
+
+int Renderer::getMaterialSlot(SCN::Material* material)
+{
+	auto it = material_slots.find(material);
+	if (it != material_slots.end())
+		return it->second;
+
+	//slow path, the material did not fit in the table of the frame: only its entry is uploaded
+	int slot = BLOCK_MAX_MATERIALS - 1;
+	if (material == overflow_material)
+		return slot;
+	material->fillBlock(material_blocks[slot]);
+	GFX::Shader::UpdateUniformBlockRange(GFX::MATERIAL_BLOCK, &material_blocks[slot], slot * (int)sizeof(GFX::sMaterialBlock), sizeof(GFX::sMaterialBlock));
+	overflow_material = material;
+	return slot;
+}
+
 void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 {
 	this->scene = scene;
 	setupScene();
+	if (profile_materials)
+		material_timer.beginFrame();
 
 	parseSceneEntities(scene, camera);
+	auto draw_start = std::chrono::high_resolution_clock::now();
+	updateFrameBlocks();
 
 	// ================= SHADOW PASS START =================
 	renderShadowMap();
@@ -184,6 +332,7 @@ void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 	// ================= RENDER PREFAB ENTITIES =================
 	renderRenderable();
 	// ==========================================================
+	draw_cpu_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - draw_start).count();
 	
 
 }
@@ -222,9 +371,12 @@ void Renderer::renderShadowMap() {
 	mat4 light_viewproj_matrix = light_camera.viewprojection_matrix;
 
 	// Render all opaque geometry to depth
+	light_camera.uploadBlock();
 	for(sDrawCommand command : opaque_command_list) {
 		renderPlain(light_camera, command.model, command.mesh, command.material);
 	}
+	if (Camera::current)
+		Camera::current->uploadBlock(); //the view camera again for the rest of the frame
 
 
 	glColorMask(true, true, true, true);
@@ -239,9 +391,8 @@ void Renderer::renderPlain(Camera light_cam, Matrix44 model, GFX::Mesh* mesh, SC
 	if (!plain_shader) return;
 	plain_shader->enable();
 
-	plain_shader->setUniform("u_model", model);
-	plain_shader->setUniform("u_viewprojection", light_cam.viewprojection_matrix);
-	mesh->render(GL_TRIANGLES);
+	plain_shader->setUniform("u_model", model); //the light camera is in u_camera_block
+	mesh->renderMeshlets(GL_TRIANGLES, model, &light_cam, false);
 
 
 
@@ -252,19 +403,35 @@ void Renderer::renderRenderable() {
 
 	if (use_multipass) {
 		for (sDrawCommand command : opaque_command_list) {
-			renderMeshWithMaterialMultipass(command.model, command.mesh, command.material);
+			if (profile_materials) material_timer.start(command.material);
+			renderMeshWithMaterialMultipass(command.model, command.mesh, command.material, command.probe);
+			if (profile_materials) material_timer.finish();
 		}
 		for (sDrawCommand command : transparent_command_list) {
-			renderMeshWithMaterialSinglepass(command.model, command.mesh, command.material);
+			if (profile_materials) material_timer.start(command.material);
+			renderMeshWithMaterialSinglepass(command.model, command.mesh, command.material, command.probe);
+			if (profile_materials) material_timer.finish();
 		}
 	}
 	else {
 		for (sDrawCommand command : draw_command_list) {
-			renderMeshWithMaterialSinglepass(command.model, command.mesh, command.material);
+			if (profile_materials) material_timer.start(command.material);
+			renderMeshWithMaterialSinglepass(command.model, command.mesh, command.material, command.probe);
+			if (profile_materials) material_timer.finish();
 		}
 	}
 }
 
+uint64 Renderer::getMaterialMacros(SCN::Material* material, SCN::ReflectionProbeEntity* probe)
+{
+	uint64 macros = material->getShaderMacros((int)min(lights_list.size(), BLOCK_MAX_LIGHTS));
+	if (irradiance_enabled)
+		macros |= uint64(1) << HAS_IRRADIANCE;
+	if (use_reflection_probes && probe && probe->isBaked())
+		macros |= uint64(1) << HAS_PROBE;
+	return macros;
+}
+
 void Renderer::renderSkybox(GFX::Texture* cubemap)
 {
 	Camera* camera = Camera::current;
@@ -290,10 +457,6 @@ void Renderer::renderSkybox(GFX::Texture* cubemap)
 	m.scale(10, 10, 10);
 	shader->setUniform("u_model", m);
 
-	// Upload camera uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-
 	shader->setUniform("u_texture", cubemap, 0);
 
 	sphere.render(GL_TRIANGLES);
@@ -306,7 +469,7 @@ void Renderer::renderSkybox(GFX::Texture* cubemap)
 }
 
 // Renders a mesh given its transform and material using a single pass shader
-void Renderer::renderMeshWithMaterialSinglepass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+void Renderer::renderMeshWithMaterialSinglepass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, SCN::ReflectionProbeEntity* probe)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material )
@@ -319,8 +482,12 @@ void Renderer::renderMeshWithMaterialSinglepass(const Matrix44 model, GFX::Mesh*
 
 	glEnable(GL_DEPTH_TEST);
 
-	//chose a shader
-	shader = GFX::Shader::Get("normalmap");
+	//chose a shader: the permutation with only what the material uses, the generic one otherwise
+	GFX::Shader::UberShader* ubershader = use_material_permutations ? GFX::Shader::GetUberShader("@material") : nullptr;
+	if (ubershader)
+		shader = ubershader->get(getMaterialMacros(material, probe));
+	if (!shader)
+		shader = GFX::Shader::Get("normalmap");
 
     assert(glGetError() == GL_NO_ERROR);
 
@@ -330,83 +497,20 @@ void Renderer::renderMeshWithMaterialSinglepass(const Matrix44 model, GFX::Mesh*
 	shader->enable();
 
 	material->bind(shader);
+	requestTextureMips(model, mesh, material, camera);
 
-	//Sending the lights
-	vec3* light_pos = new vec3[lights_list.size()];
-	vec3* light_color = new vec3[lights_list.size()];
-	float* light_int = new float[lights_list.size()];
-	vec3* light_dir = new vec3[lights_list.size()];
-	int* light_type = new int[lights_list.size()];
-	float* light_min = new float[lights_list.size()];
-	float* light_max = new float[lights_list.size()];
-	float* light_cone_max = new float[lights_list.size()]; //for spot lights
-	float* light_cone_min = new float[lights_list.size()]; //for spot lights
-
-	int i = 0;
-	for (LightEntity* light : lights_list) {
-		if (light->light_type != eLightType::POINT){
-			//continue;
-		}
-		light_pos[i] = light->root.getGlobalMatrix().getTranslation();
-		light_color[i] = light->color;
-		light_int[i] = light->intensity;
-		light_dir[i] = light->root.model.frontVector();
-		light_type[i] = (int) light->light_type;
-		light_min[i] = light->near_distance;
-		light_max[i] = light->max_distance;
-		light_cone_max[i] = cos((light->cone_info.y * PI)/180);
-		light_cone_min[i] = cos((light->cone_info.x * PI) / 180);
-		i++;
-	}
-
-	shader->setUniform3Array("u_light_pos", (float*) light_pos, min(lights_list.size(), 10));
-	shader->setUniform3Array("u_light_color", (float*) light_color, min(lights_list.size(), 10));
-	shader->setUniform1Array("u_light_int", (float*) light_int, min(lights_list.size(), 10));
-	shader->setUniform3Array("u_light_dir", (float*) light_dir, min(lights_list.size(), 10));
-	shader->setUniform1Array("u_light_type", (int*) light_type, min(lights_list.size(), 10));
-	shader->setUniform1Array("u_light_min", (float*) light_min, min(lights_list.size(), 10));
-	shader->setUniform1Array("u_light_max", (float*) light_max, min(lights_list.size(), 10));
-	shader->setUniform1Array("u_light_cone_max", (float*) light_cone_max, min(lights_list.size(), 10));
-	shader->setUniform1Array("u_light_cone_min", (float*) light_cone_min, min(lights_list.size(), 10));
-	shader->setUniform3("u_light_ambient", scene->ambient_light.x, scene->ambient_light.y, scene->ambient_light.z);
-	shader->setUniform1("u_light_count", (int) min(lights_list.size(), 10));
-
-	//For specular factor:
-	shader->setUniform1("u_material_shine", material->shininess);
-	shader->setUniform3("u_camera_pos", camera->eye);
-
-	delete[] light_pos;
-	delete[] light_color;
-	delete[] light_int;
-	delete[] light_dir;
-	delete[] light_type;
-	delete[] light_min;
-	delete[] light_max;
-	delete[] light_cone_max;
-	delete[] light_cone_min;
-
-
-
-	//upload uniforms
+	//the lights, the camera and the material values are in the uniform blocks
 	shader->setUniform("u_model", model);
-	if (material->textures[NORMALMAP].texture) {
-		shader->setUniform("u_normal_texture", material->textures[NORMALMAP].texture, 1);
-	}
-
-	// Upload camera uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-
-	// Upload time, for cool shader effects
-	float t = getTime();
-	shader->setUniform("u_time", t );
+	shader->setUniform1("u_material_index", getMaterialSlot(material));
+	setIrradianceUniforms(shader);
+	setReflectionUniforms(shader, probe);
 
 	// Render just the verticies as a wireframe
 	if (render_wireframe)
 		glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
 
-	//do the draw call that renders the mesh into the screen
-	mesh->render(GL_TRIANGLES);
+	//do the draw call that renders the mesh into the screen (only the visible meshlets)
+	mesh->renderMeshlets(GL_TRIANGLES, model, camera, !material->two_sided);
 
 	//disable shader
 	shader->disable();
@@ -416,7 +520,7 @@ void Renderer::renderMeshWithMaterialSinglepass(const Matrix44 model, GFX::Mesh*
 	glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
 }
 
-void Renderer::renderMeshWithMaterialMultipass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material) {
+void Renderer::renderMeshWithMaterialMultipass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, SCN::ReflectionProbeEntity* probe) {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
 		return;
@@ -442,10 +546,16 @@ void Renderer::renderMeshWithMaterialMultipass(const Matrix44 model, GFX::Mesh*
 	shader->enable();
 
 	material->bind(shader);
+	requestTextureMips(model, mesh, material, camera);
+
+	// Uniforms that don't change per light, the lights are in u_frame_block
+	shader->setUniform("u_model", model);
+	shader->setUniform1("u_material_index", getMaterialSlot(material));
+	setIrradianceUniforms(shader);
 
-	//Sending the lights
-	bool is_first_pass = true;
-	for (LightEntity* light : lights_list) {
+	int num_lights = (int)min(lights_list.size(), BLOCK_MAX_LIGHTS);
+	for (int i = 0; i < num_lights; ++i) {
+		bool is_first_pass = i == 0;
 		if (!is_first_pass) {		//If we aren't in the first light, we enable blending and disable depth writing
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_ONE, GL_ONE);
@@ -456,46 +566,21 @@ void Renderer::renderMeshWithMaterialMultipass(const Matrix44 model, GFX::Mesh*
 			glDepthMask(GL_TRUE);
 		}
 
-		//Send the info of ONE light to the shader:
-		shader->setUniform3("u_light_pos", light->root.getGlobalMatrix().getTranslation());
-		shader->setUniform3("u_light_color", light->color);
-		shader->setUniform1("u_light_int", light->intensity);
-		shader->setUniform3("u_light_dir", light->root.model.frontVector());
-		shader->setUniform1("u_light_type", (int)light->light_type);
-		shader->setUniform1("u_light_min", light->near_distance);
-		shader->setUniform1("u_light_max", light->max_distance);
-		shader->setUniform1("u_light_cone_max", (float) (cos((light->cone_info.y * PI) / 180.0)));
-		shader->setUniform1("u_light_cone_min", (float)(cos((light->cone_info.x * PI) / 180.0)));
-
-		// Only ambient in first pass
-		vec3 ambient = is_first_pass ? scene->ambient_light : vec3(0.0);
-		shader->setUniform3("u_light_ambient", ambient);
-
-		// Uniforms that dont change per light
-		shader->setUniform("u_model", model);
-		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader->setUniform3("u_camera_pos", camera->eye);
-		shader->setUniform1("u_material_shine", material->shininess);
-		// Upload time, for cool shader effects
-		float t = getTime();
-		shader->setUniform("u_time", t);
-
-		if (material->textures[NORMALMAP].texture)
-			shader->setUniform("u_normal_texture", material->textures[NORMALMAP].texture, 1);
+		// Only ambient and reflection in first pass
+		shader->setUniform1("u_light_index", i);
+		setReflectionUniforms(shader, is_first_pass ? probe : nullptr);
 
 		if (render_wireframe)
 			glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
 
 		// Draw the mesh
-		mesh->render(GL_TRIANGLES);
+		mesh->renderMeshlets(GL_TRIANGLES, model, camera, !material->two_sided);
 
 		if (!is_first_pass) {
 			glDisable(GL_BLEND);
 			glDepthMask(GL_TRUE);
 		}
-
-		is_first_pass = false;
 	}
 
 	shader->disable();
@@ -506,6 +591,102 @@ void Renderer::renderMeshWithMaterialMultipass(const Matrix44 model, GFX::Mesh*
 	
 }
 
+void Renderer::setIrradianceUniforms(GFX::Shader* shader)
+{
+	//the grid is in u_frame_block, only the texture is per shader
+	if (irradiance_enabled)
+		shader->setUniform("u_irr_texture", irradiance_volume->texture, 7);
+	else
+		shader->setUniform1("u_irr_texture", 7); //a sampler3D cannot share the unit 0 with the 2D textures
+}
+
+bool Renderer::benchmarkMaterials(SCN::Scene* scene, Camera* camera, int num_frames)
+{
+	bool previous_permutations = use_material_permutations;
+	bool previous_profile = profile_materials;
+	profile_materials = true;
+
+	std::map<const void*, double> times[2];
+	int frames[2];
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		use_material_permutations = pass == 1;
+		camera->enable();
+		renderScene(scene, camera); //requests the permutations
+		GFX::Shader::FinishPending(); //no fallbacks in the measure
+		material_timer.flush();
+		material_timer.reset();
+		for (int i = 0; i < num_frames; ++i)
+		{
+			camera->enable();
+			renderScene(scene, camera);
+		}
+		material_timer.flush();
+		times[pass] = material_timer.times;
+		frames[pass] = material_timer.num_frames;
+	}
+
+	std::cout << "GPU time per material, ms per frame with the generic shader -> its permutation (" << frames[0] << " and " << frames[1] << " frames):" << std::endl;
+	double totals[2] = { 0, 0 };
+	for (auto& it : times[0])
+	{
+		const Material* material = (const Material*)it.first;
+		double before = it.second / std::max(frames[0], 1);
+		double after = times[1][it.first] / std::max(frames[1], 1);
+		totals[0] += before;
+		totals[1] += after;
+		std::cout << "  " << (material->name.size() ? material->name : "unnamed") << ": " << before << " -> " << after << std::endl;
+	}
+	std::cout << "Materials: " << totals[0] << "ms -> " << TermColor::GREEN << totals[1] << "ms" << TermColor::DEFAULT << " x" << totals[0] / std::max(totals[1], 1e-6) << std::endl;
+
+	use_material_permutations = previous_permutations;
+	profile_materials = previous_profile;
+	material_timer.reset();
+	return frames[0] > 0 && frames[1] > 0;
+}
+
+bool Renderer::benchmarkDrawCPU(SCN::Scene* scene, Camera* camera, int num_frames)
+{
+	//the first frame requests the permutations, they are ready before measuring
+	camera->enable();
+	renderScene(scene, camera);
+	GFX::Shader::FinishPending();
+
+	double total = 0;
+	double worst = 0;
+	for (int i = 0; i < num_frames; ++i)
+	{
+		glFinish(); //a full command queue would block the draw calls
+		camera->enable();
+		renderScene(scene, camera);
+		total += draw_cpu_time;
+		worst = std::max(worst, draw_cpu_time);
+	}
+	glFinish();
+
+	int num_draws = (int)draw_command_list.size();
+	std::cout << "Draw calls CPU, " << num_draws << " draws with " << material_slots.size() << " materials in the blocks: "
+		<< TermColor::GREEN << total / std::max(num_frames, 1) << "ms" << TermColor::DEFAULT << " per frame, worst " << worst << "ms (" << num_frames << " frames)" << std::endl;
+	return num_frames > 0 && num_draws > 0;
+}
+
+void Renderer::setReflectionUniforms(GFX::Shader* shader, SCN::ReflectionProbeEntity* probe)
+{
+	bool enabled = use_reflection_probes && probe;
+	if (enabled && !probe->texture)
+		probe->upload();
+	enabled = enabled && probe->texture;
+	shader->setUniform1("u_probe_enabled", (int)enabled);
+	if (!enabled)
+	{
+		shader->setUniform1("u_probe_texture", 8); //a samplerCube cannot share the unit 0 with the 2D textures either
+		return;
+	}
+
+	shader->setUniform("u_probe_texture", probe->texture, 8);
+	shader->setUniform1("u_probe_levels", (float)probe->header.num_levels); //roughness and metalness are in u_material_block
+}
+
 #ifndef SKIP_IMGUI
 
 void Renderer::showUI()
@@ -518,6 +699,30 @@ void Renderer::showUI()
 	//...
 
 	ImGui::Checkbox("Multipass", &use_multipass);
+	ImGui::Checkbox("Meshlet culling", &GFX::Mesh::use_meshlets);
+	ImGui::Checkbox("Irradiance volume", &use_irradiance_volume);
+	ImGui::Checkbox("Reflection probes", &use_reflection_probes);
+	if (ImGui::Checkbox("Material permutations", &use_material_permutations))
+		material_timer.reset(); //the times of before dont mix with the new ones
+	ImGui::Text("Draw calls (CPU): %.3fms", draw_cpu_time);
+	ImGui::Checkbox("Profile materials (GPU)", &profile_materials);
+	if (profile_materials && material_timer.num_frames)
+	{
+		//the slowest first
+		std::vector<std::pair<double, const Material*>> sorted;
+		double total = 0;
+		for (auto& it : material_timer.times)
+		{
+			sorted.push_back(std::make_pair(it.second / material_timer.num_frames, (const Material*)it.first));
+			total += it.second / material_timer.num_frames;
+		}
+		std::sort(sorted.begin(), sorted.end(), [](const std::pair<double, const Material*>& a, const std::pair<double, const Material*>& b) { return a.first > b.first; });
+		ImGui::Text("Materials: %.3fms per frame (%d frames)", total, material_timer.num_frames);
+		for (auto& it : sorted)
+			ImGui::Text("  %.3fms %s", it.first, it.second->name.size() ? it.second->name.c_str() : "unnamed");
+		if (ImGui::Button("Reset"))
+			material_timer.reset();
+	}
 }
 
 #else
@@ -3,6 +3,12 @@
 #include "prefab.h"
 
 #include "light.h"
+#include "irradiance.h"
+#include "reflection.h"
+#include "../gfx/gfx.h" //GPUTimer
+#include "../gfx/shader.h" //sMaterialBlock
+
+#include <map>
 
 //forward declarations
 class Camera;
@@ -22,6 +28,7 @@ namespace SCN {
 		GFX::Mesh* mesh;
 		SCN::Material* material;
 		Matrix44 model;
+		SCN::ReflectionProbeEntity* probe; //the smallest one that contains the center of the mesh
 	};
 
 	// This class is in charge of rendering anything in our system.
@@ -39,6 +46,26 @@ namespace SCN {
 
 		std::vector<SCN::LightEntity*> lights_list;
 
+		//baked indirect light, replaces the ambient light where it has data
+		bool use_irradiance_volume;
+		SCN::IrradianceVolumeEntity* irradiance_volume;
+
+		//baked specular, each object uses the probe around it
+		bool use_reflection_probes;
+		std::vector<SCN::ReflectionProbeEntity*> probes_list;
+
+		//singlepass objects use the @material permutation of their material instead of the generic normalmap
+		bool use_material_permutations;
+		bool profile_materials; //GPU time of the draws of every material
+		GFX::GPUTimer material_timer;
+
+		//u_frame_block and u_material_block, uploaded once per frame instead of in every draw
+		bool irradiance_enabled; //the volume is in u_frame_block
+		std::map<const SCN::Material*, int> material_slots; //index in u_material_block of the materials drawn this frame
+		std::vector<GFX::sMaterialBlock> material_blocks;
+		bool material_overflow_warned;
+		SCN::Material* overflow_material; //in the last slot now, draws in a row with it do not upload it again
+		double draw_cpu_time; //ms of CPU of the last frame from the blocks to the last draw call
 
 		//For shadowmaps:
 		GFX::FBO* shadow_fbo;
@@ -60,7 +87,10 @@ namespace SCN {
 
 		void parseSceneEntities(SCN::Scene* scene, Camera* camera);
 
+		void assignReflectionProbes();
 		void orderDrawCommands(Camera* cam);
+		void updateFrameBlocks(); //after parsing the scene
+		int getMaterialSlot(SCN::Material* material);
 
 		//renders several elements of the scene
 		void renderScene(SCN::Scene* scene, Camera* camera);
@@ -73,8 +103,16 @@ namespace SCN {
 		void renderSkybox(GFX::Texture* cubemap);
 
 		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterialSinglepass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
-		void renderMeshWithMaterialMultipass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
+		void renderMeshWithMaterialSinglepass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, SCN::ReflectionProbeEntity* probe = nullptr);
+		void renderMeshWithMaterialMultipass(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, SCN::ReflectionProbeEntity* probe = nullptr);
+		void setIrradianceUniforms(GFX::Shader* shader);
+		void setReflectionUniforms(GFX::Shader* shader, SCN::ReflectionProbeEntity* probe);
+		uint64 getMaterialMacros(SCN::Material* material, SCN::ReflectionProbeEntity* probe);
+
+		//GPU time of every material with the generic shader and with its permutation, needs the GL context
+		bool benchmarkMaterials(SCN::Scene* scene, Camera* camera, int num_frames = 100);
+		//CPU time of the draw calls of a frame, the GPU is idle when every frame starts
+		bool benchmarkDrawCPU(SCN::Scene* scene, Camera* camera, int num_frames = 100);
 
 		void showUI();
 	};
@@ -9,6 +9,7 @@
 #include "../gfx/texture.h"
 #include "../pipeline/material.h"
 #include "../pipeline/prefab.h"
+#include "../pipeline/animation.h"
 #include "../utils/utils.h"
 
 #include <iostream>
@@ -235,6 +236,18 @@ void parseGLTFBufferVector2(std::vector<Vector2f>& container, cgltf_accessor* ac
 
 }
 
+void parseGLTFBufferVector4ub(std::vector<Vector4ub>& container, cgltf_accessor* acc)
+{
+	//joints can be 8u or 16u, we only support 256 bones per mesh
+	container.resize(acc->count);
+	for (size_t i = 0; i < acc->count; ++i)
+	{
+		cgltf_uint v[4] = { 0,0,0,0 };
+		cgltf_accessor_read_uint(acc, i, v, 4);
+		container[i].set(v[0], v[1], v[2], v[3]);
+	}
+}
+
 void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor* acc)
 {
 	container.resize(acc->count);
@@ -323,18 +336,23 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 			else
 			if (attr->type == cgltf_attribute_type_weights)
 			{
-				parseGLTFBufferVector4(mesh->weights, attr->data);
+				if (strcmp(attr->name, "WEIGHTS_0") == 0)
+					parseGLTFBufferVector4(mesh->weights, attr->data);
 			}
 			else
 			if (attr->type == cgltf_attribute_type_joints)
 			{
-				//parseGLTFBufferVector4(mesh->bones, attr->data);
+				if (strcmp(attr->name, "JOINTS_0") == 0) //we only support 4 bones per vertex
+					parseGLTFBufferVector4ub(mesh->bones, attr->data);
 			}
 
 			if (primitive->indices && primitive->indices->count)
 				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
 		}
-		mesh->uploadToVRAM();
+		if (GFX::Mesh::use_meshlets)
+			mesh->buildMeshlets();
+		if (GFX::Mesh::auto_upload_to_vram)
+			mesh->uploadToVRAM();
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
 		result.push_back(mesh);
@@ -480,6 +498,8 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	return material;
 }
 
+void parseGLTFSkin(cgltf_skin* skin, GFX::Mesh* mesh);
+
 void parseGLTFTransform(cgltf_node* node, Matrix44 &model)
 {
 	if (node->has_matrix)
@@ -526,6 +546,8 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 			{
 				SCN::Node* subnode = new SCN::Node();
 				subnode->mesh = meshes[i];
+				if (node->skin)
+					parseGLTFSkin(node->skin, meshes[i]);
 				if (node->mesh->primitives[i].material)
 					subnode->material = parseGLTFMaterial(node->mesh->primitives[i].material, basename );
 				scenenode->addChild(subnode);
@@ -545,6 +567,8 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 				if(meshes.size())
 					scenenode->mesh = meshes[0];
 			}
+			if (node->skin && scenenode->mesh)
+				parseGLTFSkin(node->skin, scenenode->mesh);
 
 			if (node->mesh->primitives->material)
 				scenenode->material = parseGLTFMaterial(node->mesh->primitives->material, basename );
@@ -697,3 +721,284 @@ SCN::Prefab* loadGLTF(const char* filename)
 	return loadGLTF(filename, data, options);
 }
 
+
+// SKINS AND ANIMATIONS *****************************
+
+//same name in the mesh bones and the skeleton, ':' from mixamo exports is replaced to match the names of our skanim files
+void getGLTFJointName(cgltf_skin* skin, int index, char* out)
+{
+	cgltf_node* node = skin->joints[index];
+	if (node->name)
+		strncpy(out, node->name, 31);
+	else
+		snprintf(out, 32, "joint%d", index);
+	out[31] = 0;
+	for (char* c = out; *c; ++c)
+		if (*c == ':')
+			*c = '_';
+}
+
+void parseGLTFSkin(cgltf_skin* skin, GFX::Mesh* mesh)
+{
+	if (mesh->bones_info.size()) //already parsed
+		return;
+
+	mesh->bones_info.resize(skin->joints_count);
+	for (size_t i = 0; i < skin->joints_count; ++i)
+	{
+		BoneInfo& info = mesh->bones_info[i];
+		getGLTFJointName(skin, (int)i, info.name);
+		//the inverse bind matrices are column major, the same layout we use
+		if (!skin->inverse_bind_matrices || !cgltf_accessor_read_float(skin->inverse_bind_matrices, i, info.bind_pose.m, 16))
+			info.bind_pose.setIdentity();
+	}
+	mesh->bind_matrix.setIdentity();
+	mesh->bones_offset.clear();
+	mesh->bones_remap.clear();
+}
+
+//fills the skeleton with the joints of the skin, parents before children
+bool parseGLTFSkeleton(cgltf_skin* skin, Skeleton& skeleton, std::vector<cgltf_node*>& nodes, std::vector<Matrix44>& parent_models)
+{
+	std::map<cgltf_node*, int> joints;
+	for (size_t i = 0; i < skin->joints_count; ++i)
+		joints[skin->joints[i]] = (int)i;
+
+	//closest ancestor that is also a joint
+	auto getParentJoint = [&](cgltf_node* node) -> cgltf_node* {
+		for (cgltf_node* parent = node->parent; parent; parent = parent->parent)
+			if (joints.count(parent))
+				return parent;
+		return NULL;
+	};
+
+	std::vector<cgltf_node*> roots;
+	for (size_t i = 0; i < skin->joints_count; ++i)
+		if (!getParentJoint(skin->joints[i]))
+			roots.push_back(skin->joints[i]);
+
+	int num_bones = (int)skin->joints_count + (roots.size() > 1 ? 1 : 0); //several roots hang from an extra one
+	if (num_bones > 128)
+	{
+		std::cout << "[ERROR] too many joints in skin: " << num_bones << std::endl;
+		return false;
+	}
+
+	memset(&skeleton.bones, 0, sizeof(skeleton.bones)); //clear
+	skeleton.bones_by_name.clear();
+	skeleton.num_bones = 0;
+	nodes.clear();
+	parent_models.clear();
+
+	std::vector<std::pair<cgltf_node*, int>> stack; //node and parent bone
+	if (roots.size() > 1)
+	{
+		Skeleton::Bone& root = skeleton.bones[skeleton.num_bones++];
+		strcpy(root.name, "root");
+		root.parent = -1;
+		root.model.setIdentity();
+		nodes.push_back(NULL);
+		parent_models.push_back(Matrix44());
+	}
+	for (int i = (int)roots.size() - 1; i >= 0; --i)
+		stack.push_back(std::make_pair(roots[i], roots.size() > 1 ? 0 : -1));
+
+	while (stack.size())
+	{
+		cgltf_node* node = stack.back().first;
+		int parent = stack.back().second;
+		stack.pop_back();
+
+		int index = skeleton.num_bones++;
+		Skeleton::Bone& bone = skeleton.bones[index];
+		getGLTFJointName(skin, joints[node], bone.name);
+		bone.parent = parent;
+		cgltf_node_transform_local(node, bone.model.m);
+
+		//the transform of the nodes between the joints (or above the root) is baked in the bone
+		Matrix44 parent_model;
+		cgltf_node* parent_joint = getParentJoint(node);
+		for (cgltf_node* n = node->parent; n && n != parent_joint; n = n->parent)
+		{
+			Matrix44 local;
+			cgltf_node_transform_local(n, local.m);
+			parent_model = parent_model * local;
+		}
+		bone.model = bone.model * parent_model;
+		nodes.push_back(node);
+		parent_models.push_back(parent_model);
+
+		if (parent != -1)
+		{
+			Skeleton::Bone& parent_bone = skeleton.bones[parent];
+			if (parent_bone.num_children == 16)
+			{
+				std::cout << "[ERROR] joint with more than 16 children: " << parent_bone.name << std::endl;
+				return false;
+			}
+			parent_bone.children[parent_bone.num_children++] = index;
+		}
+
+		for (int i = (int)node->children_count - 1; i >= 0; --i)
+			if (joints.count(node->children[i]))
+				stack.push_back(std::make_pair(node->children[i], index));
+	}
+
+	//joints under nodes that are not joints but hang from a joint
+	if (skeleton.num_bones != num_bones)
+	{
+		std::cout << "[ERROR] joints not connected in skin" << std::endl;
+		return false;
+	}
+
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		skeleton.bones_by_name[skeleton.bones[i].name] = i;
+	skeleton.computeLayoutId();
+	skeleton.assignDefaultLayers();
+	skeleton.assignDefaultLODs();
+	skeleton.globals_dirty = true;
+	return true;
+}
+
+//one channel of a clip, keys read once and searched with a cursor as the resampling goes forward in time
+struct sGLTFChannel {
+	cgltf_animation_path_type path;
+	cgltf_interpolation_type interpolation;
+	std::vector<float> times;
+	std::vector<float> values; //3 per key for cubic splines (in tangent, value, out tangent)
+	int components;
+	size_t cursor;
+
+	void sample(float t, float* out)
+	{
+		size_t num = times.size();
+		while (cursor + 1 < num && times[cursor + 1] <= t)
+			cursor++;
+		bool cubic = interpolation == cgltf_interpolation_type_cubic_spline;
+		int stride = components * (cubic ? 3 : 1);
+		const float* a = &values[cursor * stride + (cubic ? components : 0)];
+		if (t <= times[0] || cursor + 1 >= num || interpolation == cgltf_interpolation_type_step)
+		{
+			memcpy(out, a, sizeof(float) * components);
+			return;
+		}
+
+		float dt = times[cursor + 1] - times[cursor];
+		float f = (t - times[cursor]) / dt;
+		const float* b = &values[(cursor + 1) * stride + (cubic ? components : 0)];
+		if (cubic)
+		{
+			//hermite with the out tangent of a and the in tangent of b
+			const float* out_tangent = a + components;
+			const float* in_tangent = b - components;
+			float f2 = f * f, f3 = f2 * f;
+			for (int i = 0; i < components; ++i)
+				out[i] = (2 * f3 - 3 * f2 + 1) * a[i] + (f3 - 2 * f2 + f) * dt * out_tangent[i] + (-2 * f3 + 3 * f2) * b[i] + (f3 - f2) * dt * in_tangent[i];
+		}
+		else if (path == cgltf_animation_path_type_rotation)
+		{
+			Quaternion q;
+			Quaternion qa(a[0], a[1], a[2], a[3]), qb(b[0], b[1], b[2], b[3]);
+			qa.slerp(qb, f, q);
+			out[0] = q.x; out[1] = q.y; out[2] = q.z; out[3] = q.w;
+			return;
+		}
+		else
+			for (int i = 0; i < components; ++i)
+				out[i] = a[i] + (b[i] - a[i]) * f;
+
+		if (path == cgltf_animation_path_type_rotation)
+		{
+			float len = sqrtf(out[0] * out[0] + out[1] * out[1] + out[2] * out[2] + out[3] * out[3]);
+			for (int i = 0; i < 4; ++i)
+				out[i] /= len;
+		}
+	}
+};
+
+bool loadGLTFAnimation(Animation* anim, const char* filename, int index, bool compress_clip)
+{
+	cgltf_options options;
+	memset(&options, 0, sizeof(cgltf_options));
+	options.file.read = internalOpenFile;
+	cgltf_data* data = NULL;
+	if (cgltf_parse_file(&options, filename, &data) != cgltf_result_success)
+		return false;
+	if (cgltf_load_buffers(&options, data, filename) != cgltf_result_success || !data->skins_count || index >= (int)data->animations_count)
+	{
+		std::cout << "[ERROR] no skin or animation " << index << " in " << filename << std::endl;
+		cgltf_free(data);
+		return false;
+	}
+
+	std::vector<cgltf_node*> nodes;
+	std::vector<Matrix44> parent_models;
+	Skeleton& skeleton = anim->skeleton;
+	if (!parseGLTFSkeleton(&data->skins[0], skeleton, nodes, parent_models))
+	{
+		cgltf_free(data);
+		return false;
+	}
+
+	//channels of every bone
+	cgltf_animation* animation = &data->animations[index];
+	std::vector<sGLTFChannel> channels(animation->channels_count);
+	std::vector<std::vector<sGLTFChannel*>> bone_channels(skeleton.num_bones);
+	float duration = 0.0f;
+	for (size_t i = 0; i < animation->channels_count; ++i)
+	{
+		cgltf_animation_channel& channel = animation->channels[i];
+		auto it = std::find(nodes.begin(), nodes.end(), channel.target_node);
+		if (it == nodes.end() || channel.target_path == cgltf_animation_path_type_weights || channel.target_path == cgltf_animation_path_type_invalid)
+			continue; //not a joint
+		sGLTFChannel& c = channels[i];
+		c.path = channel.target_path;
+		c.interpolation = channel.sampler->interpolation;
+		c.components = c.path == cgltf_animation_path_type_rotation ? 4 : 3;
+		c.cursor = 0;
+		c.times.resize(channel.sampler->input->count);
+		cgltf_accessor_unpack_floats(channel.sampler->input, c.times.data(), c.times.size());
+		c.values.resize(channel.sampler->output->count * c.components);
+		cgltf_accessor_unpack_floats(channel.sampler->output, c.values.data(), c.values.size()); //also unpacks the quantized rotations
+		if (c.times.empty() || c.values.size() < c.times.size() * c.components)
+			continue;
+		duration = std::max(duration, c.times.back());
+		bone_channels[it - nodes.begin()].push_back(&c);
+	}
+
+	anim->num_animated_bones = 0;
+	for (int i = 0; i < skeleton.num_bones; ++i)
+		if (bone_channels[i].size())
+			anim->bones_map[anim->num_animated_bones++] = i;
+
+	//resampled once at a fixed rate, the compression removes the keys that can be interpolated
+	anim->samples_per_second = 30.0f;
+	anim->num_keyframes = std::max(1, (int)round(duration * anim->samples_per_second));
+	anim->duration = anim->num_keyframes / anim->samples_per_second;
+	delete[] anim->keyframes;
+	anim->keyframes = new Matrix44[std::max(1, anim->num_animated_bones * anim->num_keyframes)];
+	anim->tracks.clear();
+	anim->keys.clear();
+
+	for (int i = 0; i < anim->num_animated_bones; ++i)
+	{
+		int bone = anim->bones_map[i];
+		cgltf_node node = *nodes[bone]; //rest pose, the channels overwrite it
+		node.has_matrix = false;
+		for (int k = 0; k < anim->num_keyframes; ++k)
+		{
+			float t = k / anim->samples_per_second;
+			for (sGLTFChannel* c : bone_channels[bone])
+				c->sample(t, c->path == cgltf_animation_path_type_translation ? node.translation : c->path == cgltf_animation_path_type_rotation ? node.rotation : node.scale);
+			Matrix44& m = anim->keyframes[k * anim->num_animated_bones + i];
+			cgltf_node_transform_local(&node, m.m);
+			m = m * parent_models[bone];
+		}
+	}
+	cgltf_free(data);
+
+	if (compress_clip)
+		anim->compress();
+	anim->assignTime(0); //reset pose
+	return true;
+}
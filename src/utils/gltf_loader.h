@@ -2,6 +2,13 @@
 
 #include "../pipeline/prefab.h"
 
+class Animation;
+
+extern bool load_textures; //false to load only the geometry and the material factors (headless tools)
+
 SCN::Prefab* loadGLTF(const char* filename);
 //GTR::Prefab* loadGLTF(const char* filename, cgltf_data* data, cgltf_options& options);
 SCN::Prefab* loadGLTF(const std::vector<unsigned char>& data, const std::string& path);
+
+//skeleton of the first skin and one clip resampled to keyframes (compressed if compress_clip), use Animation::Get to keep an .abin cache
+bool loadGLTFAnimation(Animation* anim, const char* filename, int index = 0, bool compress_clip = true);
@@ -7,6 +7,8 @@
 #include "../core/includes.h"
 #include "../core/core.h"
 
+#include <sys/stat.h>
+
 #ifndef WIN32
 	#include <sys/time.h>
 #endif
@@ -119,6 +121,12 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+bool fileExists(const std::string& filename)
+{
+	struct stat stbuffer;
+	return stat(filename.c_str(), &stbuffer) == 0;
+}
+
 bool writeFile(const std::string& filename, std::string& content)
 {
 	FILE* f = fopen(filename.c_str(), "w");